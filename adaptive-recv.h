@@ -0,0 +1,227 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Receive buffer for a feed connection, with reads sized from what is
+// waiting on the socket and capacity sized from the messages seen so far.
+//
+// A recv through a TLS stream returns at most one TLS record (up to 16KB of
+// plaintext) however large the buffer is, and every record is decrypted on
+// its own. What can be saved is reads that return part of a record because
+// the buffer had no room left, and trips back to the event loop between
+// records that had all arrived. So the buffer always keeps room for a whole
+// record, and after a read it looks at the socket: if another complete
+// record is already queued in the kernel (FIONREAD, and a peek at the
+// 5-byte record header for its length) it is read at once. On plain TCP
+// FIONREAD is the exact size of the next read.
+//
+// Capacity follows a decaying log2 histogram of message sizes: it grows as
+// soon as a frame does not fit and shrinks once the largest recent message
+// would fit in a quarter of it. Data is consumed by moving an offset and
+// compacted only when room is needed, never erased from the front per frame.
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <photon/common/alog.h>
+#include <photon/net/socket.h>
+
+#include "ws-frame.h"
+
+// Largest TLS record plaintext.
+const size_t TLS_RECORD_MAX = 16384;
+const size_t TLS_RECORD_HEADER = 5;
+
+class AdaptiveRecvBuffer {
+public:
+    // `fd` is the socket under the stream, -1 if there is none to look at
+    // (no read-ahead then); `tls` whether the stream decrypts TLS records.
+    explicit AdaptiveRecvBuffer(int fd = -1, bool tls = true, size_t max_capacity = 8 << 20)
+        : m_fd(fd), m_tls(tls), m_max(max_capacity) {
+        m_min = tls ? 2 * TLS_RECORD_MAX : 16384;
+        resize(m_min);
+    }
+    AdaptiveRecvBuffer(const AdaptiveRecvBuffer&) = delete;
+    AdaptiveRecvBuffer& operator=(const AdaptiveRecvBuffer&) = delete;
+    ~AdaptiveRecvBuffer() { free(m_buf); }
+
+    // A new connection: drops buffered data, keeps what was learnt.
+    void reset(int fd, bool tls) {
+        m_fd = fd;
+        m_tls = tls;
+        m_head = m_tail = 0;
+    }
+
+    const char* data() const { return m_buf + m_head; }
+    size_t size() const { return m_tail - m_head; }
+    size_t capacity() const { return m_cap; }
+
+    void consume(size_t n) {
+        m_head += n;
+        if (m_head == m_tail) m_head = m_tail = 0;
+    }
+
+    char* write_ptr() { return m_buf + m_tail; }
+    size_t room() const { return m_cap - m_tail; }
+    void commit(size_t n) { m_tail += n; }
+
+    // Makes room for `n` more bytes, compacting or growing. False if that
+    // would exceed the maximum capacity.
+    bool reserve(size_t n) {
+        if (room() >= n) return true;
+        if (size() + n > m_max) return false;
+        if (m_head) {
+            memmove(m_buf, m_buf + m_head, size());
+            m_tail -= m_head;
+            m_head = 0;
+            if (room() >= n) return true;
+        }
+        size_t cap = m_cap;
+        while (cap - m_tail < n) cap *= 2;
+        resize(cap < m_max ? cap : m_max);
+        m_stats.grows++;
+        return true;
+    }
+
+    // One recv, into room for a whole TLS record or, on plain TCP, for
+    // everything the kernel holds. Returns what the stream's recv returns.
+    ssize_t recv_from(photon::net::ISocketStream* s) {
+        size_t want = m_tls ? TLS_RECORD_MAX : 4096;
+        if (!m_tls) {
+            size_t avail = available();
+            if (avail > want) want = avail < m_max / 2 ? avail : m_max / 2;
+        }
+        if (!reserve(want) && room() == 0) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        ssize_t n = s->recv(write_ptr(), room());
+        if (n > 0) {
+            commit(n);
+            m_stats.recvs++;
+            m_stats.bytes += n;
+        }
+        return n;
+    }
+
+    // Whether another recv would return without waiting.
+    bool more_ready() const {
+        if (m_fd < 0) return false;
+        size_t avail = available();
+        if (!m_tls) return avail > 0;
+        if (avail < TLS_RECORD_HEADER) return false;
+        uint8_t h[TLS_RECORD_HEADER];
+        if (::recv(m_fd, h, sizeof(h), MSG_PEEK | MSG_DONTWAIT) != (ssize_t)sizeof(h)) return false;
+        return avail >= TLS_RECORD_HEADER + ((size_t)h[3] << 8 | h[4]);
+    }
+
+    // Feeds the size estimate; call once per message.
+    void note_message(size_t n) {
+        int b = n ? 63 - __builtin_clzll(n) : 0;
+        m_sizes[b < 31 ? b : 31]++;
+        if (++m_noted % ADAPT_EVERY == 0) adapt();
+    }
+
+    struct Stats {
+        uint64_t recvs = 0;
+        uint64_t bytes = 0;
+        uint64_t grows = 0;
+        uint64_t shrinks = 0;
+    };
+    const Stats& stats() const { return m_stats; }
+
+private:
+    static const uint64_t ADAPT_EVERY = 1024;
+
+    size_t available() const {
+        int n = 0;
+        if (m_fd < 0 || ioctl(m_fd, FIONREAD, &n) < 0) return 0;
+        return n;
+    }
+
+    void resize(size_t cap) {
+        auto p = (char*)realloc(m_buf, cap);
+        if (!p) abort();
+        m_buf = p;
+        m_cap = cap;
+    }
+
+    // Shrinks to what the recent messages need, then halves the counts so
+    // that old sizes fade out. Sized for the largest recent message, not a
+    // percentile: a rare large one would otherwise regrow the buffer every
+    // time.
+    void adapt() {
+        int largest = 0;
+        for (int i = 0; i < 32; i++)
+            if (m_sizes[i]) largest = i;
+        size_t need = m_min;
+        while (need < (2ULL << largest) + TLS_RECORD_MAX) need *= 2;
+        if (need * 4 <= m_cap && size() <= need / 2) {
+            memmove(m_buf, m_buf + m_head, size());
+            m_tail -= m_head;
+            m_head = 0;
+            resize(need);
+            m_stats.shrinks++;
+        }
+        for (auto& c : m_sizes) c /= 2;
+    }
+
+    char* m_buf = nullptr;
+    size_t m_cap = 0;
+    size_t m_head = 0;
+    size_t m_tail = 0;
+    int m_fd;
+    bool m_tls;
+    size_t m_min;
+    size_t m_max;
+    uint64_t m_sizes[32] = {};
+    uint64_t m_noted = 0;
+    Stats m_stats;
+};
+
+// Reads from `s` and hands every complete frame to
+// `on_frame(const WsFrameHeader&, const char* payload)`, which returns false
+// to stop. All frames of one read are decoded before the next read, and
+// reading goes on while more_ready(), up to `max_batch` reads. Returns the
+// number of reads, 0 on EOF, -1 on error or a frame that cannot fit.
+template <typename OnFrame>
+ssize_t ws_recv_frames(photon::net::ISocketStream* s, AdaptiveRecvBuffer& rx, OnFrame&& on_frame,
+                       int max_batch = 16) {
+    for (int i = 1;; i++) {
+        ssize_t n = rx.recv_from(s);
+        if (n <= 0) return n;
+        while (true) {
+            WsFrameHeader h;
+            int hl = ws_parse_header(rx.data(), rx.size(), &h);
+            if (hl < 0) LOG_ERROR_RETURN(EPROTO, -1, "malformed websocket frame");
+            if (hl == 0) break;
+            size_t total = hl + h.payload_len;
+            if (rx.size() < total) {
+                if (!rx.reserve(total - rx.size()))
+                    LOG_ERROR_RETURN(EMSGSIZE, -1, "websocket frame of ` bytes does not fit", h.payload_len);
+                break;
+            }
+            rx.note_message(h.payload_len);
+            bool go_on = on_frame(h, rx.data() + hl);
+            rx.consume(total);
+            if (!go_on) return i;
+        }
+        if (i == max_batch || !rx.more_ready()) return i;
+    }
+}
@@ -0,0 +1,387 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Loopback throughput benchmark for the TCP / TLS / kTLS stacks.
+//
+// Server and client run in the same process, each on its own set of vCPUs,
+// so nothing leaves the host. Every (buffer size, connection count) case in
+// the matrix streams data for --duration seconds; the bytes counted by the
+// server are reported as one JSON object per line (to stdout, or appended to
+// --output) for regression tracking.
+//
+//   bench_tls --engine=iouring --mode=tls --sizes=64,4096,1048576
+//             --conns=1,100,10000 --vcpus=2 --duration=10 --output=bench.jsonl
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/thread/thread11.h>
+#include <photon/net/socket.h>
+#include <photon/net/security-context/tls-stream.h>
+
+#include "cert-key.cpp"
+#include "ktls-stream.h"
+
+using namespace photon;
+
+enum class Mode { TCP, TLS, KTLS };
+
+struct Options {
+    uint64_t engine = INIT_EVENT_IOURING;
+    Mode mode = Mode::TLS;
+    std::vector<size_t> sizes = {64, 4096, 65536, 1048576};
+    std::vector<size_t> conns = {1, 100};
+    int vcpus = 1;
+    int duration = 5;
+    std::string output;
+};
+
+static Options opts;
+
+static const char* engine_name() {
+    return opts.engine == INIT_EVENT_EPOLL ? "epoll" : "iouring";
+}
+
+static const char* mode_name() {
+    return opts.mode == Mode::TCP ? "tcp" : opts.mode == Mode::TLS ? "tls" : "ktls";
+}
+
+static std::vector<size_t> parse_list(const char* s) {
+    std::vector<size_t> v;
+    for (char* end; *s; s = end + (*end == ',')) {
+        v.push_back(strtoull(s, &end, 10));
+        if (end == s) break;
+    }
+    return v;
+}
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"engine", required_argument, 0, 'e'},
+        {"mode", required_argument, 0, 'm'},
+        {"sizes", required_argument, 0, 's'},
+        {"conns", required_argument, 0, 'c'},
+        {"vcpus", required_argument, 0, 'v'},
+        {"duration", required_argument, 0, 'd'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "e:m:s:c:v:d:o:", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'e': opts.engine = strcmp(optarg, "epoll") == 0 ? INIT_EVENT_EPOLL : INIT_EVENT_IOURING; break;
+            case 'm': opts.mode = strcmp(optarg, "tcp") == 0 ? Mode::TCP :
+                                  strcmp(optarg, "ktls") == 0 ? Mode::KTLS : Mode::TLS; break;
+            case 's': opts.sizes = parse_list(optarg); break;
+            case 'c': opts.conns = parse_list(optarg); break;
+            case 'v': opts.vcpus = std::max(1, atoi(optarg)); break;
+            case 'd': opts.duration = std::max(1, atoi(optarg)); break;
+            case 'o': opts.output = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [--engine=epoll|iouring] [--mode=tcp|tls|ktls] "
+                        "[--sizes=64,4096,...] [--conns=1,100,...] [--vcpus=N] "
+                        "[--duration=sec] [--output=file]\n", argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// OS-thread barrier; every vCPU blocks here between cases only.
+class Barrier {
+public:
+    explicit Barrier(int n) : m_n(n) {}
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto gen = m_gen;
+        if (++m_count == m_n) {
+            m_count = 0;
+            m_gen++;
+            m_cond.notify_all();
+            return;
+        }
+        m_cond.wait(lock, [&] { return gen != m_gen; });
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    int m_n, m_count = 0;
+    uint64_t m_gen = 0;
+};
+
+struct Shared {
+    std::atomic<uint16_t> port{0};
+    std::atomic<size_t> size{0};            // buffer size of the current case
+    std::atomic<uint64_t> bytes{0};         // received by the server
+    std::atomic<uint64_t> handshakes_us{0}; // connect + handshake time
+    std::atomic<uint64_t> connected{0};
+    std::atomic<uint64_t> served{0};        // connections the server finished
+    std::atomic<uint64_t> first_send_ns{UINT64_MAX};
+    std::atomic<uint64_t> last_recv_ns{0};
+    std::atomic<bool> ktls_active{false};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> stop{false};
+};
+
+static Shared shared;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Atomic min / max, for timestamps taken on several vCPUs.
+static void store_min(std::atomic<uint64_t>& a, uint64_t v) {
+    uint64_t cur = a.load(std::memory_order_relaxed);
+    while (v < cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+}
+
+static void store_max(std::atomic<uint64_t>& a, uint64_t v) {
+    uint64_t cur = a.load(std::memory_order_relaxed);
+    while (v > cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+}
+
+static net::ISocketServer* new_base_server() {
+    return opts.engine == INIT_EVENT_EPOLL ? net::new_tcp_socket_server()
+                                           : net::new_iouring_tcp_server();
+}
+
+static net::ISocketClient* new_base_client() {
+    return opts.engine == INIT_EVENT_EPOLL ? net::new_tcp_socket_client()
+                                           : net::new_iouring_tcp_client();
+}
+
+static int serve(int index, Barrier* ready);
+
+// One server vCPU: a SO_REUSEPORT listener on the shared port.
+static void server_vcpu(int index, Barrier* ready) {
+    if (photon::init(opts.engine, INIT_IO_NONE)) {
+        LOG_ERROR("server vCPU ` failed to init", index);
+        shared.failed = true;
+        ready->wait();
+        return;
+    }
+    DEFER(photon::fini());
+    if (serve(index, ready) < 0) {
+        shared.failed = true;
+        ready->wait();
+    }
+}
+
+static int serve(int index, Barrier* ready) {
+    net::TLSContext* ctx = nullptr;
+    SSL_CTX* kctx = nullptr;
+    if (opts.mode == Mode::TLS) ctx = net::new_tls_context(cert_str, key_str, passphrase_str);
+    if (opts.mode == Mode::KTLS) kctx = new_ktls_context(cert_str, key_str);
+    DEFER(delete ctx);
+    DEFER(if (kctx) SSL_CTX_free(kctx));
+
+    auto base = new_base_server();
+    base->setsockopt<int>(SOL_SOCKET, SO_REUSEPORT, 1);
+    net::ISocketServer* server = ctx ? net::new_tls_server(ctx, base, true) : base;
+    DEFER(delete server);
+
+    auto handler = [&](net::ISocketStream* stream) -> int {
+        DEFER(shared.served++);
+        net::ISocketStream* s = stream;
+        KtlsSocketStream* ks = nullptr;
+        if (kctx) {
+            ks = new_ktls_stream(kctx, stream, true, false);
+            if (!ks) return -1;
+            if (ks->ktls_recv()) shared.ktls_active = true;
+            s = ks;
+        }
+        DEFER(delete ks);
+        // bounded, so that 10k connections with large messages do not
+        // each hold a message-sized buffer; recv() takes it piecewise
+        std::vector<char> buf(std::min<size_t>(std::max<size_t>(shared.size, 4096), 64 * 1024));
+        uint64_t total = 0, last = 0;
+        ssize_t n;
+        while ((n = s->recv(buf.data(), buf.size())) > 0) {
+            total += n;
+            last = now_ns();
+        }
+        shared.bytes += total;
+        if (total) store_max(shared.last_recv_ns, last);
+        return 0;
+    };
+    server->set_handler(handler);
+    if (server->bind_v4localhost(shared.port) < 0)
+        LOG_ERRNO_RETURN(0, -1, "server vCPU ` failed to bind port `", index, shared.port);
+    if (index == 0) {
+        net::EndPoint ep;
+        server->getsockname(ep);
+        shared.port = ep.port;
+    }
+    if (server->listen(65535) < 0 || server->start_loop(false) < 0)
+        LOG_ERRNO_RETURN(0, -1, "server vCPU ` failed to listen", index);
+    ready->wait();
+    while (!shared.stop) photon::thread_usleep(100 * 1000);
+    server->terminate();
+    return 0;
+}
+
+// One client vCPU: runs its share of the connections of every case.
+static void client_vcpu(int index, Barrier* start, Barrier* done) {
+    if (photon::init(opts.engine, INIT_IO_NONE)) {
+        LOG_ERROR("client vCPU ` failed to init", index);
+        // the other vCPUs and main() see this after the first case starts,
+        // and everybody stops at its end
+        shared.failed = true;
+        start->wait();
+        done->wait();
+        return;
+    }
+    DEFER(photon::fini());
+
+    net::TLSContext* ctx = nullptr;
+    SSL_CTX* kctx = nullptr;
+    if (opts.mode == Mode::TLS) ctx = net::new_tls_context(nullptr, nullptr, nullptr);
+    if (opts.mode == Mode::KTLS) kctx = new_ktls_context();
+    DEFER(delete ctx);
+    DEFER(if (kctx) SSL_CTX_free(kctx));
+    net::ISocketClient* cli = ctx ? net::new_tls_client(ctx, new_base_client(), true)
+                                  : new_base_client();
+    DEFER(delete cli);
+    net::EndPoint ep(net::IPAddr("127.0.0.1"), shared.port);
+
+    for (auto size : opts.sizes) {
+        for (auto conns : opts.conns) {
+            start->wait();
+            if (shared.failed) {
+                done->wait();
+                return;
+            }
+            size_t mine = conns / opts.vcpus + ((size_t)index < conns % opts.vcpus);
+            uint64_t deadline = photon::now + opts.duration * 1000UL * 1000;
+            std::vector<char> payload(size, 't');
+            std::vector<photon::join_handle*> jhs;
+            for (size_t i = 0; i < mine; i++) {
+                auto th = photon::thread_create11((uint64_t)256 * 1024, [&] {
+                    auto t0 = photon::now;
+                    net::ISocketStream* s = cli->connect(ep);
+                    if (s && kctx) s = new_ktls_stream(kctx, s, false);
+                    if (!s) {
+                        LOG_ERROR("failed to connect");
+                        return;
+                    }
+                    DEFER(delete s);
+                    shared.handshakes_us += photon::now - t0;
+                    shared.connected++;
+                    store_min(shared.first_send_ns, now_ns());
+                    while (photon::now < deadline) {
+                        if (s->write(payload.data(), size) != (ssize_t)size) break;
+                    }
+                });
+                jhs.push_back(photon::thread_enable_join(th));
+            }
+            for (auto jh : jhs) photon::thread_join(jh);
+            done->wait();
+        }
+    }
+}
+
+// Throughput is computed from the first send to the last receive, so the
+// connects and handshakes before it are left out; `wall` covers them too.
+static void report(size_t size, size_t conns, double wall) {
+    uint64_t first = shared.first_send_ns.exchange(UINT64_MAX);
+    uint64_t last = shared.last_recv_ns.exchange(0);
+    double seconds = last > first ? (last - first) / 1e9 : opts.duration;
+    uint64_t bytes = shared.bytes.exchange(0);
+    uint64_t connected = shared.connected.exchange(0);
+    shared.served = 0;
+    uint64_t hs = shared.handshakes_us.exchange(0);
+    char line[512];
+    snprintf(line, sizeof(line),
+             "{\"engine\":\"%s\",\"mode\":\"%s\",\"ktls\":%s,\"vcpus\":%d,\"size\":%zu,"
+             "\"conns\":%zu,\"connected\":%lu,\"seconds\":%.3f,\"wall\":%.3f,\"bytes\":%lu,"
+             "\"MBps\":%.2f,\"msgs_per_sec\":%.0f,\"avg_connect_us\":%lu}\n",
+             engine_name(), mode_name(), shared.ktls_active ? "true" : "false", opts.vcpus,
+             size, conns, connected, seconds, wall, bytes, bytes / seconds / 1024 / 1024,
+             bytes / (double)size / seconds, connected ? hs / connected : 0);
+    LOG_INFO("` ` size=` conns=`: ` MB/s", engine_name(), mode_name(), size, conns,
+             (uint64_t)(bytes / seconds / 1024 / 1024));
+    FILE* f = opts.output.empty() ? stdout : fopen(opts.output.c_str(), "a");
+    if (!f) {
+        LOG_ERROR("failed to open `", opts.output.c_str());
+        return;
+    }
+    fputs(line, f);
+    if (f != stdout) fclose(f);
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    set_log_output_level(ALOG_INFO);
+
+    // up to 10k connections on each side
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    Barrier ready(opts.vcpus + 1);
+    std::vector<std::thread> servers;
+    servers.emplace_back(server_vcpu, 0, &ready);
+    // the first server picks the port, the others share it
+    while (shared.port == 0 && !shared.failed)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    for (int i = 1; i < opts.vcpus; i++) servers.emplace_back(server_vcpu, i, &ready);
+    ready.wait();
+    if (shared.failed) {
+        shared.stop = true;
+        for (auto& t : servers) t.join();
+        LOG_ERROR_RETURN(0, -1, "failed to start servers");
+    }
+
+    Barrier start(opts.vcpus + 1), done(opts.vcpus + 1);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < opts.vcpus; i++) clients.emplace_back(client_vcpu, i, &start, &done);
+
+    for (auto size : opts.sizes) {
+        for (auto conns : opts.conns) {
+            shared.size = size;
+            shared.ktls_active = false;
+            auto t0 = std::chrono::steady_clock::now();
+            start.wait();
+            done.wait();
+            if (shared.failed) break;
+            // the server counts a connection's bytes once it sees EOF
+            for (int i = 0; i < 5000 && shared.served < shared.connected; i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+            report(size, conns, elapsed.count());
+        }
+        if (shared.failed) break;
+    }
+
+    for (auto& t : clients) t.join();
+    shared.stop = true;
+    for (auto& t : servers) t.join();
+    if (shared.failed) LOG_ERROR_RETURN(0, -1, "a client vCPU failed to start");
+    return 0;
+}
@@ -0,0 +1,599 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Binary logging for the hot path: per-message logs that would cost too much
+// through alog or std::cout.
+//
+// A BLOG() site formats nothing. It copies its arguments, tagged with their
+// type, into a fixed-format record in a lock-free single-producer ring owned
+// by the calling vCPU (OS thread); the format string, file and line are
+// registered once per site and referred to by a 16-bit id. A background
+// thread moves the records of all rings to a file with io_uring writes,
+// double buffered, and binlog_decode turns the file back into text. A full
+// ring drops records (and counts them) rather than block the caller.
+//
+// Sites below BINLOG_MIN_LEVEL are compiled out; sites below the runtime
+// level cost one relaxed load and do not evaluate their arguments. Logging
+// is off until binlog_start().
+//
+// File layout: BinlogFileHeader, then chunks (BinlogChunk + payload). A
+// BINLOG_SITES chunk defines sites, a BINLOG_RECORDS chunk carries records
+// of one vCPU, a BINLOG_DROPS chunk the number of records a vCPU dropped so
+// far. Records are BinlogRecord + `nargs` args, each a tag byte and then an
+// int64 ('i'), uint64 ('u'), double ('d'), pointer ('p') or a uint16 length
+// and the bytes ('s'), padded to 8 bytes.
+#pragma once
+
+#include <fcntl.h>
+#include <liburing.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <photon/common/alog.h>
+
+#ifndef BINLOG_MIN_LEVEL
+#define BINLOG_MIN_LEVEL ALOG_DEBUG
+#endif
+
+const char BINLOG_MAGIC[8] = {'P', 'H', 'B', 'L', 'O', 'G', '0', '1'};
+const int BINLOG_OFF = 100;
+const size_t BINLOG_MAX_STR = 4096;         // longer strings are truncated
+const size_t BINLOG_MAX_RECORD = 65528;
+const uint32_t BINLOG_MAX_SITES = 0xFFFF;
+
+enum BinlogChunkType : uint32_t {
+    BINLOG_SITES = 1,
+    BINLOG_RECORDS = 2,
+    BINLOG_DROPS = 3,
+};
+
+struct BinlogFileHeader {
+    char magic[8];
+    uint64_t realtime_ns;   // CLOCK_REALTIME and CLOCK_MONOTONIC read together
+    uint64_t monotonic_ns;  // at start, to put record timestamps on the wall clock
+};
+
+struct BinlogChunk {
+    uint32_t type;
+    uint32_t vcpu;
+    uint32_t bytes;         // of the payload that follows
+    uint32_t reserved;
+};
+
+// Payload of a BINLOG_SITES chunk: one per site, followed by the file name
+// and the format string.
+struct BinlogSiteDef {
+    uint16_t id;
+    uint16_t level;
+    uint32_t line;
+    uint16_t file_len;
+    uint16_t fmt_len;
+};
+
+struct BinlogRecord {
+    uint16_t size;          // of the whole record, a multiple of 8
+    uint16_t site;          // 0 in a ring: the rest of the ring is padding
+    uint16_t nargs;
+    uint16_t reserved;
+    uint64_t ts_ns;         // CLOCK_MONOTONIC
+};
+
+inline uint64_t binlog_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Constant-initialized, so a site costs no guard when it is first reached.
+struct BinlogSite {
+    constexpr BinlogSite(const char* file, int line, int level, const char* fmt)
+        : file(file), line(line), level(level), fmt(fmt) {}
+    const char* file;
+    int line;
+    int level;
+    const char* fmt;
+    std::atomic<uint32_t> id{0};
+};
+
+// A string argument that is not NUL-terminated, e.g. a payload in a receive
+// buffer: BLOG_INFO("< `", blog_str(data, len)).
+struct BlogStr {
+    const char* p;
+    size_t n;
+};
+inline BlogStr blog_str(const char* p, size_t n) { return {p, n}; }
+
+struct BlogArg {
+    template <typename T, typename std::enable_if<std::is_integral<T>::value &&
+                                                  std::is_signed<T>::value, int>::type = 0>
+    BlogArg(T x) : tag('i') { v.i = x; }
+    template <typename T, typename std::enable_if<std::is_integral<T>::value &&
+                                                  !std::is_signed<T>::value, int>::type = 0>
+    BlogArg(T x) : tag('u') { v.u = x; }
+    template <typename T, typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0>
+    BlogArg(T x) : tag('d') { v.d = x; }
+    template <typename T>
+    BlogArg(T* x) : tag('p') { v.p = x; }
+    BlogArg(const char* x) : tag('s') { str(x ? x : "(null)", x ? strlen(x) : 6); }
+    BlogArg(char* x) : BlogArg((const char*)x) {}
+    BlogArg(const std::string& x) : tag('s') { str(x.data(), x.size()); }
+    BlogArg(BlogStr x) : tag('s') { str(x.p, x.n); }
+
+    size_t encoded_size() const { return tag == 's' ? 3 + v.s.n : 9; }
+
+    char* encode(char* out) const {
+        *out++ = tag;
+        if (tag == 's') {
+            uint16_t n = v.s.n;
+            memcpy(out, &n, 2);
+            memcpy(out + 2, v.s.p, n);
+            return out + 2 + n;
+        }
+        memcpy(out, &v, 8);
+        return out + 8;
+    }
+
+    char tag;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void* p;
+        struct { const char* p; size_t n; } s;
+    } v;
+
+private:
+    void str(const char* p, size_t n) {
+        v.s.p = p;
+        v.s.n = n < BINLOG_MAX_STR ? n : BINLOG_MAX_STR;
+    }
+};
+
+// Records of one vCPU, on their way to the drain thread.
+class BinlogBuffer {
+public:
+    BinlogBuffer(size_t size, uint32_t vcpu) : m_vcpu(vcpu) {
+        m_size = 4096;
+        while (m_size < size) m_size *= 2;
+        m_mask = m_size - 1;
+        // touch every page now rather than on the hot path
+        m_data = new char[m_size]();
+    }
+    ~BinlogBuffer() { delete[] m_data; }
+
+    // Room for a record of `n` bytes (a multiple of 8), or null if the ring
+    // is full. Writer side.
+    char* reserve(size_t n) {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t pos = tail & m_mask;
+        size_t pad = pos + n > m_size ? m_size - pos : 0;
+        if (tail + pad + n - m_head_cache > m_size) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail + pad + n - m_head_cache > m_size) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+        }
+        if (pad) {
+            auto marker = (BinlogRecord*)(m_data + pos);
+            marker->size = 0;
+            marker->site = 0;
+            pos = 0;
+        }
+        m_reserved = pad + n;
+        return m_data + pos;
+    }
+
+    void commit() {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + m_reserved, std::memory_order_release);
+    }
+
+    // Copies whole records to `out`, at most `max` bytes. Drain side.
+    size_t read(char* out, size_t max) {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        uint64_t tail = m_tail.load(std::memory_order_acquire);
+        size_t copied = 0;
+        while (head < tail) {
+            size_t pos = head & m_mask;
+            auto rec = (const BinlogRecord*)(m_data + pos);
+            if (rec->site == 0) {
+                head += m_size - pos;
+                continue;
+            }
+            if (copied + rec->size > max) break;
+            memcpy(out + copied, rec, rec->size);
+            copied += rec->size;
+            head += rec->size;
+        }
+        m_head.store(head, std::memory_order_release);
+        return copied;
+    }
+
+    bool empty() const {
+        return m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_acquire);
+    }
+
+    uint32_t vcpu() const { return m_vcpu; }
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    uint64_t reported_drops = 0;                // drain side
+    std::atomic<bool> orphaned{false};          // the owning thread has exited
+
+private:
+    std::atomic<uint64_t> m_tail{0};
+    uint64_t m_head_cache = 0;
+    size_t m_reserved = 0;
+    std::atomic<uint64_t> m_dropped{0};
+    char m_pad[64];     // the writer's and the drain's words on separate cache lines
+    std::atomic<uint64_t> m_head{0};
+    char* m_data;
+    size_t m_size;
+    size_t m_mask;
+    uint32_t m_vcpu;
+};
+
+// Moves the records of every vCPU to the log file: two buffers, one being
+// filled while io_uring writes the other.
+class BinlogWriter {
+public:
+    static const size_t WRITE_BUF = 1 << 20;
+
+    ~BinlogWriter() {
+        close();
+        for (auto b : m_bufs) delete[] b;
+    }
+
+    int open(const char* path) {
+        m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0) LOG_ERRNO_RETURN(0, -1, "failed to open binary log `", path);
+        m_uring = io_uring_queue_init(4, &m_ring, 0) == 0;
+        if (!m_uring) LOG_WARN("io_uring unavailable, binary log falls back to pwrite");
+        for (auto& b : m_bufs)
+            if (!b) b = new char[WRITE_BUF];
+        m_len[0] = m_len[1] = 0;
+        m_offset = 0;
+        BinlogFileHeader h;
+        memcpy(h.magic, BINLOG_MAGIC, sizeof(h.magic));
+        struct timespec rt;
+        clock_gettime(CLOCK_REALTIME, &rt);
+        h.monotonic_ns = binlog_now_ns();
+        h.realtime_ns = rt.tv_sec * 1000000000ULL + rt.tv_nsec;
+        memcpy(m_bufs[m_cur], &h, sizeof(h));
+        m_len[m_cur] = sizeof(h);
+        return 0;
+    }
+
+    void close() {
+        if (m_fd < 0) return;
+        flush();
+        wait();
+        if (m_uring) io_uring_queue_exit(&m_ring);
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    // Payload bytes a chunk may still take in the current buffer.
+    size_t room() const {
+        size_t used = m_len[m_cur] + sizeof(BinlogChunk);
+        return used < WRITE_BUF ? WRITE_BUF - used : 0;
+    }
+
+    // Appends a chunk whose payload is written in place by `fill(out)`,
+    // which returns its size, at most `max` (<= WRITE_BUF / 2). Empty
+    // chunks are dropped.
+    template <typename Fill>
+    size_t chunk(uint32_t type, uint32_t vcpu, size_t max, Fill&& fill) {
+        if (room() < max) flush();
+        char* at = m_bufs[m_cur] + m_len[m_cur];
+        size_t n = fill(at + sizeof(BinlogChunk));
+        if (n == 0) return 0;
+        BinlogChunk c = {type, vcpu, (uint32_t)n, 0};
+        memcpy(at, &c, sizeof(c));
+        m_len[m_cur] += sizeof(c) + n;
+        return n;
+    }
+
+    // Starts writing the current buffer and switches to the other one.
+    void flush() {
+        size_t len = m_len[m_cur];
+        if (len == 0) return;
+        wait();
+        if (m_uring) {
+            auto sqe = io_uring_get_sqe(&m_ring);
+            io_uring_prep_write(sqe, m_fd, m_bufs[m_cur], len, m_offset);
+            io_uring_submit(&m_ring);
+            m_inflight = m_cur;
+            m_inflight_offset = m_offset;
+        } else {
+            write_at(m_bufs[m_cur], len, m_offset);
+            m_len[m_cur] = 0;
+        }
+        m_offset += len;
+        m_cur ^= 1;
+    }
+
+private:
+    void wait() {
+        if (m_inflight < 0) return;
+        struct io_uring_cqe* cqe;
+        int ret = io_uring_wait_cqe(&m_ring, &cqe);
+        ssize_t res = ret < 0 ? ret : cqe->res;
+        if (ret == 0) io_uring_cqe_seen(&m_ring, cqe);
+        // short or failed write: finish it synchronously
+        size_t len = m_len[m_inflight];
+        size_t done = res > 0 ? res : 0;
+        if (done < len) write_at(m_bufs[m_inflight] + done, len - done, m_inflight_offset + done);
+        m_len[m_inflight] = 0;
+        m_inflight = -1;
+    }
+
+    void write_at(const char* p, size_t n, uint64_t off) {
+        while (n) {
+            ssize_t r = pwrite(m_fd, p, n, off);
+            if (r <= 0) {
+                if (r < 0 && errno == EINTR) continue;
+                LOG_ERROR("binary log write failed, ` bytes lost", n);
+                return;
+            }
+            p += r;
+            n -= r;
+            off += r;
+        }
+    }
+
+    int m_fd = -1;
+    bool m_uring = false;
+    struct io_uring m_ring;
+    char* m_bufs[2] = {};
+    size_t m_len[2] = {};
+    int m_cur = 0;
+    int m_inflight = -1;
+    uint64_t m_inflight_offset = 0;
+    uint64_t m_offset = 0;
+};
+
+class Binlog {
+public:
+    static Binlog& instance() {
+        static Binlog log;
+        return log;
+    }
+
+    static std::atomic<int>& level() {
+        static std::atomic<int> level{BINLOG_OFF};
+        return level;
+    }
+
+    int start(const char* path, int min_level, size_t buffer_size, uint64_t flush_interval_us) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_running) LOG_ERROR_RETURN(EALREADY, -1, "binary log already started");
+        if (m_writer.open(path) < 0) return -1;
+        m_buffer_size = buffer_size;
+        m_flush_interval_us = flush_interval_us;
+        m_sites_written = 0;
+        m_running = true;
+        m_drainer = std::thread(&Binlog::drain_loop, this);
+        level().store(min_level, std::memory_order_relaxed);
+        return 0;
+    }
+
+    void stop() {
+        level().store(BINLOG_OFF, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_running) return;
+            m_running = false;
+        }
+        m_drainer.join();
+        m_writer.close();
+    }
+
+    // Assigns the site its id; 0x10000 if there are too many sites.
+    uint32_t register_site(BinlogSite& site) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint32_t id = site.id.load(std::memory_order_relaxed);
+        if (id) return id;
+        id = m_sites.size() < BINLOG_MAX_SITES ? m_sites.size() + 1 : BINLOG_MAX_SITES + 1;
+        if (id <= BINLOG_MAX_SITES) m_sites.push_back(&site);
+        site.id.store(id, std::memory_order_release);
+        return id;
+    }
+
+    // The ring of the calling thread, created on first use.
+    BinlogBuffer* local_buffer() {
+        struct Local {
+            BinlogBuffer* buf = nullptr;
+            ~Local() {
+                if (buf) buf->orphaned.store(true, std::memory_order_release);
+            }
+        };
+        thread_local Local local;
+        if (!local.buf) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            local.buf = new BinlogBuffer(m_buffer_size, m_next_vcpu++);
+            m_buffers.push_back(local.buf);
+        }
+        return local.buf;
+    }
+
+private:
+    void drain_loop() {
+        while (true) {
+            bool running;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                running = m_running;
+            }
+            size_t n = drain();
+            if (!running) {
+                while (drain()) {}
+                break;
+            }
+            // keep going while there is a backlog, else batch up for a while
+            if (n < BinlogWriter::WRITE_BUF / 2) {
+                m_writer.flush();
+                usleep(m_flush_interval_us);
+            }
+        }
+        m_writer.flush();
+    }
+
+    // One pass over the new sites and every ring; returns the record bytes.
+    size_t drain() {
+        std::vector<BinlogSite*> sites;
+        std::vector<BinlogBuffer*> buffers;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            sites.assign(m_sites.begin() + m_sites_written, m_sites.end());
+            m_sites_written = m_sites.size();
+            buffers = m_buffers;
+        }
+        if (!sites.empty()) write_sites(sites);
+
+        // one chunk per ring and pass, so that a busy vCPU cannot starve
+        // the others
+        size_t total = 0;
+        for (auto b : buffers) {
+            bool orphaned = b->orphaned.load(std::memory_order_acquire);
+            if (!b->empty()) {
+                size_t max = m_writer.room() < BINLOG_MAX_RECORD ? BinlogWriter::WRITE_BUF / 2
+                                                                 : m_writer.room();
+                total += m_writer.chunk(BINLOG_RECORDS, b->vcpu(), max,
+                                        [&](char* out) { return b->read(out, max); });
+            }
+            uint64_t dropped = b->dropped();
+            if (dropped != b->reported_drops) {
+                b->reported_drops = dropped;
+                m_writer.chunk(BINLOG_DROPS, b->vcpu(), 8, [&](char* out) {
+                    memcpy(out, &dropped, 8);
+                    return (size_t)8;
+                });
+                LOG_WARN("binary log: vCPU ` dropped ` records so far", b->vcpu(), dropped);
+            }
+            if (orphaned && b->empty()) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (auto it = m_buffers.begin(); it != m_buffers.end(); ++it) {
+                    if (*it == b) {
+                        m_buffers.erase(it);
+                        break;
+                    }
+                }
+                delete b;
+            }
+        }
+        return total;
+    }
+
+    void write_sites(const std::vector<BinlogSite*>& sites) {
+        for (auto s : sites) {
+            size_t flen = strlen(s->file), fmtlen = strlen(s->fmt);
+            if (flen > 0xFFFF) flen = 0xFFFF;
+            if (fmtlen > 0xFFFF) fmtlen = 0xFFFF;
+            BinlogSiteDef d = {(uint16_t)s->id.load(std::memory_order_relaxed), (uint16_t)s->level,
+                               (uint32_t)s->line, (uint16_t)flen, (uint16_t)fmtlen};
+            // chunks stay 8-byte aligned, like the records in them
+            size_t len = sizeof(d) + flen + fmtlen, n = (len + 7) & ~(size_t)7;
+            m_writer.chunk(BINLOG_SITES, 0, n, [&](char* out) {
+                memcpy(out, &d, sizeof(d));
+                memcpy(out + sizeof(d), s->file, flen);
+                memcpy(out + sizeof(d) + flen, s->fmt, fmtlen);
+                memset(out + len, 0, n - len);
+                return n;
+            });
+        }
+    }
+
+    std::mutex m_mutex;
+    bool m_running = false;
+    std::thread m_drainer;
+    BinlogWriter m_writer;
+    size_t m_buffer_size = 4 << 20;
+    uint64_t m_flush_interval_us = 1000;
+    uint32_t m_next_vcpu = 0;
+    std::vector<BinlogBuffer*> m_buffers;
+    std::vector<BinlogSite*> m_sites;
+    size_t m_sites_written = 0;
+};
+
+// Starts logging sites at `level` and above to `path`. Each thread that logs
+// gets a ring of `buffer_size` bytes; the drain thread polls the rings every
+// `flush_interval_us` when they are idle.
+inline int binlog_start(const char* path, int level = ALOG_INFO, size_t buffer_size = 4 << 20,
+                        uint64_t flush_interval_us = 1000) {
+    return Binlog::instance().start(path, level, buffer_size, flush_interval_us);
+}
+
+// Turns logging off and writes out everything logged so far.
+inline void binlog_stop() { Binlog::instance().stop(); }
+
+// binlog_start() with the file and level from BINLOG_FILE and BINLOG_LEVEL
+// (0 debug ... 4 fatal, default 1), if BINLOG_FILE is set.
+inline int binlog_start_from_env() {
+    const char* path = getenv("BINLOG_FILE");
+    if (!path || !*path) return 0;
+    const char* level = getenv("BINLOG_LEVEL");
+    return binlog_start(path, level ? atoi(level) : ALOG_INFO);
+}
+
+inline int binlog_level() { return Binlog::level().load(std::memory_order_relaxed); }
+
+inline void binlog_write(BinlogSite& site, std::initializer_list<BlogArg> args) {
+    uint32_t id = site.id.load(std::memory_order_acquire);
+    if (!id) id = Binlog::instance().register_site(site);
+    if (id > BINLOG_MAX_SITES) return;
+    size_t n = sizeof(BinlogRecord);
+    for (auto& a : args) n += a.encoded_size();
+    n = (n + 7) & ~(size_t)7;
+    if (n > BINLOG_MAX_RECORD) return;
+    auto buf = Binlog::instance().local_buffer();
+    char* p = buf->reserve(n);
+    if (!p) return;
+    auto rec = (BinlogRecord*)p;
+    rec->size = n;
+    rec->site = id;
+    rec->nargs = args.size();
+    rec->reserved = 0;
+    rec->ts_ns = binlog_now_ns();
+    char* q = p + sizeof(BinlogRecord);
+    for (auto& a : args) q = a.encode(q);
+    memset(q, 0, p + n - q);
+    buf->commit();
+}
+
+// BLOG(ALOG_INFO, "[`] < `", symbol, blog_str(data, len)), with alog's
+// backtick placeholders.
+#define BLOG(level, fmt, ...)                                                    \
+    do {                                                                         \
+        if ((level) >= BINLOG_MIN_LEVEL && (level) >= binlog_level()) {          \
+            static BinlogSite __blog_site(__FILE__, __LINE__, (level), fmt);     \
+            binlog_write(__blog_site, {__VA_ARGS__});                            \
+        }                                                                        \
+    } while (0)
+
+#define BLOG_DEBUG(...) BLOG(ALOG_DEBUG, __VA_ARGS__)
+#define BLOG_INFO(...) BLOG(ALOG_INFO, __VA_ARGS__)
+#define BLOG_WARN(...) BLOG(ALOG_WARN, __VA_ARGS__)
+#define BLOG_ERROR(...) BLOG(ALOG_ERROR, __VA_ARGS__)
@@ -0,0 +1,246 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Turns a binary log written by binlog.h back into text, one line per
+// record in alog's layout:
+//
+//   2024/01/01 12:00:00.123456789|INFO |vcpu=0|client_tls.cpp:205|received ...
+//
+// Records of all vCPUs are merged by timestamp unless --unsorted is given.
+//
+//   binlog_decode [--level=N] [--unsorted] hot.blog
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "binlog.h"
+
+struct Options {
+    int level = ALOG_DEBUG;
+    bool sorted = true;
+    const char* path = nullptr;
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"level", required_argument, 0, 'l'},
+        {"unsorted", no_argument, 0, 'u'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "l:u", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'l': opts.level = atoi(optarg); break;
+            case 'u': opts.sorted = false; break;
+            default: goto usage;
+        }
+    }
+    if (optind == argc - 1) {
+        opts.path = argv[optind];
+        return 0;
+    }
+usage:
+    fprintf(stderr, "usage: %s [--level=N] [--unsorted] file\n", argv[0]);
+    return -1;
+}
+
+struct Site {
+    int level = 0;
+    uint32_t line = 0;
+    std::string file;
+    std::string fmt;
+};
+
+struct Entry {
+    uint64_t ts_ns;
+    uint32_t vcpu;
+    const BinlogRecord* rec;
+};
+
+static const char* level_name(int level) {
+    static const char* names[] = {"DEBUG", "INFO ", "WARN ", "ERROR", "FATAL", "TEMP ", "AUDIT"};
+    return level >= 0 && level < 7 ? names[level] : "?    ";
+}
+
+static void append_escaped(std::string& out, const char* p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = p[i];
+        if (c >= 0x20 && c < 0x7f) {
+            out += (char)c;
+        } else {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\x%02x", c);
+            out += hex;
+        }
+    }
+}
+
+// Appends the next argument; false if the record ends early.
+static bool append_arg(std::string& out, const char*& p, const char* end) {
+    if (p >= end) return false;
+    char tag = *p++;
+    char buf[32];
+    if (tag == 's') {
+        uint16_t n;
+        if (end - p < 2) return false;
+        memcpy(&n, p, 2);
+        if (end - p - 2 < n) return false;
+        append_escaped(out, p + 2, n);
+        p += 2 + n;
+        return true;
+    }
+    if (end - p < 8) return false;
+    union { int64_t i; uint64_t u; double d; const void* ptr; } v;
+    memcpy(&v, p, 8);
+    p += 8;
+    switch (tag) {
+        case 'i': snprintf(buf, sizeof(buf), "%lld", (long long)v.i); break;
+        case 'u': snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v.u); break;
+        case 'd': snprintf(buf, sizeof(buf), "%g", v.d); break;
+        case 'p': snprintf(buf, sizeof(buf), "%p", v.ptr); break;
+        default: return false;
+    }
+    out += buf;
+    return true;
+}
+
+// Fills the backtick placeholders of the format in order; arguments left
+// over are appended, separated by spaces, as alog does.
+static std::string format(const Site& site, const BinlogRecord* rec) {
+    std::string out;
+    const char* p = (const char*)(rec + 1);
+    const char* end = (const char*)rec + rec->size;
+    int args = rec->nargs;
+    for (char c : site.fmt) {
+        if (c == '`' && args > 0) {
+            if (!append_arg(out, p, end)) return out + " <truncated record>";
+            args--;
+        } else {
+            out += c;
+        }
+    }
+    for (; args > 0; args--) {
+        out += ' ';
+        if (!append_arg(out, p, end)) return out + " <truncated record>";
+    }
+    return out;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return 1;
+    int fd = open(opts.path, O_RDONLY);
+    if (fd < 0) {
+        perror(opts.path);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_t size = st.st_size;
+    if (size < sizeof(BinlogFileHeader)) {
+        fprintf(stderr, "%s: not a binary log\n", opts.path);
+        return 1;
+    }
+    auto data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    BinlogFileHeader hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    if (memcmp(hdr.magic, BINLOG_MAGIC, sizeof(hdr.magic)) != 0) {
+        fprintf(stderr, "%s: not a binary log\n", opts.path);
+        return 1;
+    }
+
+    // Sites may be defined after their first records (they are written
+    // once per drain pass), so collect everything before printing.
+    std::unordered_map<uint16_t, Site> sites;
+    std::unordered_map<uint32_t, uint64_t> drops;
+    std::vector<Entry> entries;
+    size_t off = sizeof(hdr);
+    while (off + sizeof(BinlogChunk) <= size) {
+        BinlogChunk c;
+        memcpy(&c, data + off, sizeof(c));
+        off += sizeof(c);
+        if (c.bytes > size - off) {
+            fprintf(stderr, "%s: truncated at offset %zu\n", opts.path, off);
+            break;
+        }
+        const char* p = data + off;
+        off += c.bytes;
+        if (c.type == BINLOG_SITES) {
+            BinlogSiteDef d;
+            if (c.bytes < sizeof(d)) continue;
+            memcpy(&d, p, sizeof(d));
+            if (sizeof(d) + d.file_len + d.fmt_len > c.bytes) continue;
+            auto& s = sites[d.id];
+            s.level = d.level;
+            s.line = d.line;
+            s.file.assign(p + sizeof(d), d.file_len);
+            s.fmt.assign(p + sizeof(d) + d.file_len, d.fmt_len);
+        } else if (c.type == BINLOG_DROPS && c.bytes >= 8) {
+            memcpy(&drops[c.vcpu], p, 8);
+        } else if (c.type == BINLOG_RECORDS) {
+            // records are 8-byte aligned within the chunk
+            for (const char* r = p; r + sizeof(BinlogRecord) <= p + c.bytes;) {
+                auto rec = (const BinlogRecord*)r;
+                if (rec->size < sizeof(BinlogRecord) || r + rec->size > p + c.bytes) break;
+                entries.push_back({rec->ts_ns, c.vcpu, rec});
+                r += rec->size;
+            }
+        }
+    }
+    if (opts.sorted) {
+        std::stable_sort(entries.begin(), entries.end(),
+                         [](const Entry& a, const Entry& b) { return a.ts_ns < b.ts_ns; });
+    }
+
+    Site unknown;
+    unknown.file = "?";
+    for (auto& e : entries) {
+        auto it = sites.find(e.rec->site);
+        const Site& site = it == sites.end() ? unknown : it->second;
+        if (site.level < opts.level) continue;
+        uint64_t real = hdr.realtime_ns + (e.ts_ns - hdr.monotonic_ns);
+        time_t sec = real / 1000000000ULL;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        char when[32];
+        strftime(when, sizeof(when), "%Y/%m/%d %H:%M:%S", &tm);
+        const char* file = strrchr(site.file.c_str(), '/');
+        file = file ? file + 1 : site.file.c_str();
+        printf("%s.%09llu|%s|vcpu=%u|%s:%u|%s\n", when, (unsigned long long)(real % 1000000000ULL),
+               level_name(site.level), e.vcpu, file, site.line, format(site, e.rec).c_str());
+    }
+    for (auto& d : drops)
+        fprintf(stderr, "vcpu %u dropped %llu records (ring full)\n", d.first, (unsigned long long)d.second);
+    munmap((void*)data, size);
+    return 0;
+}
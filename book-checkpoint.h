@@ -0,0 +1,311 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Order books saved to a memory-mapped file, so that a restarted feed
+// client starts from where it stopped instead of from empty books.
+//
+// The file has a fixed layout: a header, then one entry per symbol (by
+// lowercase name, as SymbolIds are not stable across runs and a restart may
+// intern another spelling first) with two slots. A save
+// goes to the slot not holding the last complete copy: its generation is
+// zeroed, the levels are copied, and the new generation and a checksum are
+// stored last. A crash in the middle of a save leaves the other slot as it
+// was, and a slot torn by a machine crash fails its checksum, so loading
+// takes the newest slot that checks out. Saving is memcpy into mapped (and
+// pre-faulted) page cache; nothing is synced to disk on the way. flush()
+// does that and blocks, so it is for shutdown or a background thread.
+//
+// BookCheckpointer saves the live books of a BookSynchronizer that changed
+// since their last save, every `interval`, a few books per turn so the
+// feed coroutine beside it keeps running. On startup restore_books() hands
+// the saved books to the synchronizer, which confirms them against the
+// first diffs instead of downloading snapshots (book-sync.h).
+#pragma once
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+
+#include "book-sync.h"
+#include "order-book.h"
+#include "symbol-table.h"
+
+const uint64_t BOOK_CHECKPOINT_MAGIC = 0x31504B43424BULL;    // "KBCKP1"
+const uint32_t BOOK_CHECKPOINT_VERSION = 1;
+
+struct BookCheckpointHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t levels;        // per side and slot
+    uint32_t books;         // entries
+    uint32_t pad;
+    uint64_t entry_size;
+};
+
+struct BookCheckpointSlot {
+    std::atomic<uint64_t> generation;   // 0 while being written
+    uint64_t checksum;                  // of the rest of the slot
+    uint64_t update_id;
+    uint32_t bids;
+    uint32_t asks;
+    // followed by `levels` bid and `levels` ask MdBookLevels
+};
+
+struct BookCheckpointEntry {
+    char name[SYMBOL_MAX_LEN + 1];
+    char pad[64 - (SYMBOL_MAX_LEN + 1) % 64];
+    // followed by two slots
+};
+
+class BookCheckpointFile {
+public:
+    ~BookCheckpointFile() { close(); }
+
+    // Opens or creates `path` for up to `books` symbols of up to `levels`
+    // levels a side (deeper levels are not saved). A file of another shape
+    // is started over.
+    int open(const char* path, uint32_t books = 1024, uint32_t levels = 1000) {
+        m_slot_size = (sizeof(BookCheckpointSlot) + 2 * levels * sizeof(MdBookLevel) + 63) / 64 * 64;
+        m_entry_size = sizeof(BookCheckpointEntry) + 2 * m_slot_size;
+        m_size = 4096 + books * m_entry_size;
+        int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) LOG_ERRNO_RETURN(0, -1, "failed to open checkpoint file `", path);
+        DEFER(::close(fd));
+        struct stat st;
+        if (fstat(fd, &st) < 0) LOG_ERRNO_RETURN(0, -1, "failed to stat `", path);
+        bool fresh = (size_t)st.st_size != m_size;
+        if (fresh && ftruncate(fd, m_size) < 0) LOG_ERRNO_RETURN(0, -1, "failed to size `", path);
+        void* p = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (p == MAP_FAILED) LOG_ERRNO_RETURN(0, -1, "failed to map `", path);
+        m_base = (char*)p;
+        m_hdr = (BookCheckpointHeader*)p;
+        if (fresh || m_hdr->magic != BOOK_CHECKPOINT_MAGIC || m_hdr->version != BOOK_CHECKPOINT_VERSION ||
+                m_hdr->levels != levels || m_hdr->books != books || m_hdr->entry_size != m_entry_size) {
+            if (!fresh) LOG_WARN("checkpoint file ` has another layout, starting it over", path);
+            memset(m_base, 0, m_size);
+            m_hdr->version = BOOK_CHECKPOINT_VERSION;
+            m_hdr->levels = levels;
+            m_hdr->books = books;
+            m_hdr->entry_size = m_entry_size;
+            m_hdr->magic = BOOK_CHECKPOINT_MAGIC;
+        }
+        m_levels = levels;
+        m_books = books;
+        for (uint32_t i = 0; i < books; i++) {
+            auto e = entry(i);
+            if (e->name[0]) m_index[e->name] = i;
+        }
+        LOG_INFO("checkpoint file `: ` of ` books saved", path, m_index.size(), books);
+        return 0;
+    }
+
+    void close() {
+        if (m_base) munmap(m_base, m_size);
+        m_base = nullptr;
+        m_index.clear();
+    }
+
+    // Saves `book` as the book of `name`. -1 if the file is full.
+    int save(const char* name, const OrderBook& book) {
+        int i = find_or_add(name);
+        if (i < 0) LOG_ERROR_RETURN(ENOSPC, -1, "no room for the ` book in the checkpoint file", name);
+        auto a = slot(i, 0), b = slot(i, 1);
+        uint64_t ga = a->generation.load(std::memory_order_relaxed);
+        uint64_t gb = b->generation.load(std::memory_order_relaxed);
+        auto s = ga <= gb ? a : b;
+        s->generation.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        auto levels = (MdBookLevel*)(s + 1);
+        uint32_t n = 0;
+        for (auto& l : book.bids()) {
+            if (n == m_levels) break;
+            levels[n++] = MdBookLevel{l.first, l.second};
+        }
+        s->bids = n;
+        n = 0;
+        for (auto& l : book.asks()) {
+            if (n == m_levels) break;
+            levels[m_levels + n++] = MdBookLevel{l.first, l.second};
+        }
+        s->asks = n;
+        s->update_id = book.update_id();
+        s->checksum = checksum(s);
+        s->generation.store((ga > gb ? ga : gb) + 1, std::memory_order_release);
+        return 0;
+    }
+
+    // Loads the saved book of `name` into `book`. False if there is none.
+    bool load(const char* name, OrderBook* book) const {
+        int i = find(name);
+        if (i < 0) return false;
+        const BookCheckpointSlot* best = nullptr;
+        for (int k = 0; k < 2; k++) {
+            auto s = slot(i, k);
+            uint64_t g = s->generation.load(std::memory_order_acquire);
+            if (!g || s->bids > m_levels || s->asks > m_levels || s->checksum != checksum(s)) continue;
+            if (!best || g > best->generation.load(std::memory_order_relaxed)) best = s;
+        }
+        if (!best) return false;
+        book->clear();
+        auto levels = (const MdBookLevel*)(best + 1);
+        for (uint32_t n = 0; n < best->bids; n++) book->set_level(0, levels[n].price, levels[n].qty);
+        for (uint32_t n = 0; n < best->asks; n++) book->set_level(1, levels[m_levels + n].price, levels[m_levels + n].qty);
+        book->set_update_id(best->update_id);
+        return true;
+    }
+
+    // Writes the file out to disk; blocks.
+    int flush() {
+        if (msync(m_base, m_size, MS_SYNC) < 0) LOG_ERRNO_RETURN(0, -1, "failed to sync checkpoint file");
+        return 0;
+    }
+
+private:
+    BookCheckpointEntry* entry(uint32_t i) const {
+        return (BookCheckpointEntry*)(m_base + 4096 + i * m_entry_size);
+    }
+
+    BookCheckpointSlot* slot(uint32_t i, int k) const {
+        return (BookCheckpointSlot*)((char*)(entry(i) + 1) + k * m_slot_size);
+    }
+
+    int find(const char* name) const {
+        auto it = m_index.find(name);
+        return it == m_index.end() ? -1 : (int)it->second;
+    }
+
+    int find_or_add(const char* name) {
+        int i = find(name);
+        if (i >= 0 || m_index.size() == m_books) return i;
+        i = m_index.size();
+        strncpy(entry(i)->name, name, SYMBOL_MAX_LEN);
+        m_index[name] = i;
+        return i;
+    }
+
+    // Over the counts, the update id and the levels in use.
+    uint64_t checksum(const BookCheckpointSlot* s) const {
+        uint64_t h = s->update_id * 0x9E3779B97F4A7C15ULL ^ ((uint64_t)s->bids << 32 | s->asks);
+        auto levels = (const MdBookLevel*)(s + 1);
+        auto mix = [&](const MdBookLevel& l) {
+            h = (h ^ (uint64_t)l.price) * 0xC2B2AE3D27D4EB4FULL;
+            h = (h ^ (uint64_t)l.qty) * 0x165667B19E3779F9ULL;
+        };
+        for (uint32_t n = 0; n < s->bids && n < m_levels; n++) mix(levels[n]);
+        for (uint32_t n = 0; n < s->asks && n < m_levels; n++) mix(levels[m_levels + n]);
+        return h ^ (h >> 31);
+    }
+
+    char* m_base = nullptr;
+    BookCheckpointHeader* m_hdr = nullptr;
+    size_t m_size = 0;
+    size_t m_slot_size = 0;
+    size_t m_entry_size = 0;
+    uint32_t m_levels = 0;
+    uint32_t m_books = 0;
+    std::unordered_map<std::string, uint32_t> m_index;
+};
+
+class BookCheckpointer {
+public:
+    BookCheckpointer(BookSynchronizer* sync, BookCheckpointFile* file) : m_sync(sync), m_file(file) {}
+
+    ~BookCheckpointer() { stop(); }
+
+    // Saves every `interval_us`, yielding after every `per_turn` books.
+    void start(uint64_t interval_us = 1000 * 1000, int per_turn = 8) {
+        m_interval = interval_us;
+        m_per_turn = per_turn;
+        m_th = photon::thread_create11(&BookCheckpointer::loop, this);
+        m_loop = photon::thread_enable_join(m_th);
+    }
+
+    // Stops the loop after a last save.
+    void stop() {
+        if (!m_loop) return;
+        m_stopping = true;
+        photon::thread_interrupt(m_th);
+        photon::thread_join(m_loop);
+        m_loop = nullptr;
+        save_changed();
+    }
+
+    // Saves the live books that changed since they were last saved.
+    // Returns how many were saved.
+    size_t save_changed() {
+        size_t saved = 0;
+        for (SymbolId id = 0; id < m_sync->size(); id++) {
+            // looked up again after every yield: the book may be gone
+            auto book = m_sync->book(id);
+            if (!book) continue;
+            if (id >= m_saved.size()) m_saved.resize(id + 1, 0);
+            if (book->update_id() == m_saved[id]) continue;
+            if (m_file->save(symbol_table().lower(id), *book) < 0) continue;
+            m_saved[id] = book->update_id();
+            if (++saved % m_per_turn == 0) photon::thread_yield();
+        }
+        m_stats.saves++;
+        m_stats.books += saved;
+        return saved;
+    }
+
+    struct Stats {
+        uint64_t saves = 0;
+        uint64_t books = 0;
+    };
+    const Stats& stats() const { return m_stats; }
+
+private:
+    void loop() {
+        while (!m_stopping) {
+            photon::thread_usleep(m_interval);
+            if (!m_stopping) save_changed();
+        }
+    }
+
+    BookSynchronizer* m_sync;
+    BookCheckpointFile* m_file;
+    uint64_t m_interval = 0;
+    int m_per_turn = 8;
+    bool m_stopping = false;
+    photon::thread* m_th = nullptr;
+    photon::join_handle* m_loop = nullptr;
+    std::vector<uint64_t> m_saved;      // update id last saved, by SymbolId
+    Stats m_stats;
+};
+
+// Hands the saved books of `ids` to `sync`. Returns how many there were.
+inline size_t restore_books(const BookCheckpointFile& file, BookSynchronizer* sync,
+                            const std::vector<SymbolId>& ids) {
+    size_t n = 0;
+    for (SymbolId id : ids) {
+        OrderBook book;
+        if (!file.load(symbol_table().lower(id), &book)) continue;
+        sync->restore(id, std::move(book));
+        n++;
+    }
+    LOG_INFO("restored ` of ` books from the checkpoint", n, ids.size());
+    return n;
+}
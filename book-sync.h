@@ -0,0 +1,277 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Keeps the order books of many symbols in sync with the exchange: REST
+// depth snapshots plus the diff stream.
+//
+// A book that is not in sync buffers its diffs (up to max_buffered events,
+// oldest diffs dropped first) while its snapshot is fetched. Once the
+// snapshot arrives, the buffered diffs it already covers are skipped and
+// the rest are applied; if the first of them does not follow on from the
+// snapshot, the snapshot is older than the buffer and is fetched again.
+// From then on every diff must follow the previous one (order-book.h); a
+// gap puts the book back to buffering and fetches it again.
+//
+// Snapshots are fetched by up to max_fetches coroutines at a time, over the
+// keep-alive connections of an HttpClient, so after a reconnect resync()
+// of a few hundred books costs a few round trips per connection rather
+// than one per book in sequence. Give the client at least max_fetches idle
+// connections per host (HttpClientOptions) or some are reopened per fetch.
+//
+// A book restored from a checkpoint (book-checkpoint.h) goes live without a
+// snapshot if the first diffs that arrive follow on from it; otherwise it
+// is fetched like any other.
+//
+// A synchronizer belongs to one vCPU, like its HttpClient: on_update() is
+// called from the feed's coroutine and fetches run as coroutines beside it.
+#pragma once
+
+#include <ctype.h>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+#include <photon/net/socket.h>
+
+#include "http-client.h"
+#include "order-book.h"
+#include "symbol-table.h"
+
+struct BookSyncOptions {
+    photon::net::EndPoint endpoint;             // of the REST API
+    std::string host = "api.binance.com";       // Host header
+    std::string path = "/api/v3/depth";
+    int depth = 1000;                           // levels per side in a snapshot
+    size_t max_buffered = 4096;                 // diff events per book while syncing
+    int max_fetches = 16;                       // concurrent snapshot fetches
+    int max_attempts = 5;                       // then stale until its next diff
+    uint64_t retry_delay_us = 200 * 1000;       // times the attempt number
+};
+
+enum BookState {
+    BOOK_STALE,         // not in sync, nothing fetched
+    BOOK_SYNCING,       // snapshot queued or being fetched
+    BOOK_LIVE,          // in sync, diffs applied as they come
+    BOOK_RESTORED,      // from a checkpoint, until a diff confirms it
+};
+
+class BookSynchronizer {
+public:
+    // `http` is not owned.
+    BookSynchronizer(HttpClient* http, const BookSyncOptions& opts) : m_http(http), m_opts(opts) {}
+
+    ~BookSynchronizer() {
+        m_stopping = true;
+        while (m_fetchers) m_cond.wait_no_lock();
+    }
+
+    // A diff from the stream. A stale book starts syncing on its first diff.
+    void on_update(const MdBookUpdate& u) {
+        SymbolId id = u.hdr.symbol_id;
+        Book& b = book_of(id);
+        if (b.state == BOOK_RESTORED) {
+            int r = b.book.apply(u);
+            if (r > 0) {
+                m_stats.restored++;
+                set_state(b, BOOK_LIVE);
+            }
+            if (r >= 0) return;
+            LOG_INFO("` book: checkpoint at ` is behind update `, fetching it", symbol_table().name(id),
+                     b.book.update_id(), u.first_update_id);
+            set_state(b, BOOK_STALE);
+        } else if (b.state == BOOK_LIVE) {
+            if (b.book.apply(u) >= 0) return;
+            LOG_WARN("` book: updates ` to ` do not follow `, fetching it again", symbol_table().name(id),
+                     u.first_update_id, u.last_update_id, b.book.update_id());
+            m_stats.gaps++;
+            set_state(b, BOOK_STALE);
+        }
+        if (b.pending.size() >= m_opts.max_buffered) {
+            // drop the oldest diff as a whole, not some of its events
+            uint64_t oldest = b.pending.front().last_update_id;
+            while (!b.pending.empty() && b.pending.front().last_update_id == oldest) b.pending.pop_front();
+            m_stats.overflows++;
+        }
+        b.pending.push_back(u);
+        if (b.state == BOOK_STALE) fetch(id);
+    }
+
+    // Drops what the books of `ids` hold and syncs them again, e.g. after
+    // the feed reconnected and diffs may have been missed.
+    void resync(const std::vector<SymbolId>& ids) {
+        for (SymbolId id : ids) resync(id);
+    }
+
+    void resync(SymbolId id) {
+        Book& b = book_of(id);
+        b.pending.clear();
+        // a fetch on its way is kept: the diffs that follow will tell
+        // whether its snapshot is recent enough
+        if (b.state == BOOK_SYNCING) return;
+        set_state(b, BOOK_STALE);
+        fetch(id);
+    }
+
+    // Takes a saved book for `id`, unless the book is syncing already.
+    void restore(SymbolId id, OrderBook&& book) {
+        Book& b = book_of(id);
+        if (b.state == BOOK_SYNCING) return;
+        b.book = std::move(book);
+        b.pending.clear();
+        set_state(b, BOOK_RESTORED);
+    }
+
+    // The book of `id` if it is live, nullptr otherwise.
+    const OrderBook* book(SymbolId id) const {
+        return id < m_books.size() && m_books[id] && m_books[id]->state == BOOK_LIVE ? &m_books[id]->book
+                                                                                   : nullptr;
+    }
+
+    BookState state(SymbolId id) const {
+        return id < m_books.size() && m_books[id] ? m_books[id]->state : BOOK_STALE;
+    }
+
+    // Books waiting for a snapshot or for a restored book to be confirmed.
+    size_t syncing() const { return m_syncing; }
+
+    // Ids are below this.
+    size_t size() const { return m_books.size(); }
+
+    // Waits until no book is syncing. -1 on timeout.
+    int wait_synced(photon::Timeout tmo = {}) {
+        while (m_syncing) {
+            if (m_cond.wait_no_lock(tmo) < 0 && m_syncing)
+                LOG_ERROR_RETURN(ETIMEDOUT, -1, "` books still syncing", m_syncing);
+        }
+        return 0;
+    }
+
+    struct Stats {
+        uint64_t snapshots = 0;         // fetched and loaded
+        uint64_t fetch_errors = 0;
+        uint64_t stale_snapshots = 0;   // older than the buffered diffs
+        uint64_t replayed = 0;          // buffered diff events applied
+        uint64_t gaps = 0;              // live books that lost updates
+        uint64_t overflows = 0;         // diffs dropped from full buffers
+        uint64_t restored = 0;          // checkpoints confirmed by a diff
+    };
+    const Stats& stats() const { return m_stats; }
+
+private:
+    struct Book {
+        OrderBook book;
+        BookState state = BOOK_STALE;
+        std::deque<MdBookUpdate> pending;
+        int attempts = 0;
+    };
+
+    Book& book_of(SymbolId id) {
+        if (id >= m_books.size()) m_books.resize(id + 1);
+        if (!m_books[id]) m_books[id].reset(new Book);
+        return *m_books[id];
+    }
+
+    static bool is_syncing(BookState s) { return s == BOOK_SYNCING || s == BOOK_RESTORED; }
+
+    void set_state(Book& b, BookState s) {
+        m_syncing += is_syncing(s) - is_syncing(b.state);
+        b.state = s;
+        if (!is_syncing(s)) m_cond.notify_all();
+    }
+
+    // Queues the snapshot of a stale book, with a new fetcher if there are
+    // fewer than max_fetches.
+    void fetch(SymbolId id) {
+        set_state(*m_books[id], BOOK_SYNCING);
+        m_queue.push_back(id);
+        if (m_fetchers < m_opts.max_fetches) {
+            m_fetchers++;
+            photon::thread_create11(&BookSynchronizer::fetch_loop, this);
+        }
+    }
+
+    void fetch_loop() {
+        while (!m_queue.empty() && !m_stopping) {
+            SymbolId id = m_queue.front();
+            m_queue.pop_front();
+            sync(id);
+        }
+        m_fetchers--;
+        m_cond.notify_all();
+    }
+
+    void sync(SymbolId id) {
+        Book& b = *m_books[id];
+        if (b.state != BOOK_SYNCING) return;
+        const char* name = symbol_table().name(id);
+        std::string path = m_opts.path + "?symbol=";
+        for (const char* c = name; *c; c++) path += toupper((unsigned char)*c);
+        path += "&limit=" + std::to_string(m_opts.depth);
+
+        HttpResponse resp;
+        int ret = m_http->get(m_opts.endpoint, m_opts.host, path, &resp);
+        // diffs that arrived meanwhile are in b.pending
+        if (ret < 0 || resp.status != 200 || !b.book.load_snapshot(resp.body.data(), resp.body.size())) {
+            LOG_ERROR("failed to fetch ` book: HTTP `", name, resp.status);
+            m_stats.fetch_errors++;
+            return retry(id, b);
+        }
+        m_stats.snapshots++;
+
+        // fast-forward through the diffs that arrived meanwhile
+        while (!b.pending.empty()) {
+            int r = b.book.apply(b.pending.front());
+            if (r < 0) break;
+            m_stats.replayed += r;
+            b.pending.pop_front();
+        }
+        if (!b.pending.empty()) {
+            LOG_DEBUG("` snapshot at ` is older than the buffered updates from `", name,
+                      b.book.update_id(), b.pending.front().first_update_id);
+            m_stats.stale_snapshots++;
+            return retry(id, b);
+        }
+        b.attempts = 0;
+        set_state(b, BOOK_LIVE);
+        LOG_DEBUG("` book in sync at update `", name, b.book.update_id());
+    }
+
+    void retry(SymbolId id, Book& b) {
+        b.book.clear();
+        if (++b.attempts >= m_opts.max_attempts) {
+            LOG_ERROR("giving up on ` book after ` attempts", symbol_table().name(id), b.attempts);
+            b.attempts = 0;
+            b.pending.clear();
+            set_state(b, BOOK_STALE);
+            return;
+        }
+        photon::thread_usleep(m_opts.retry_delay_us * b.attempts);
+        if (b.state == BOOK_SYNCING) m_queue.push_back(id);
+    }
+
+    HttpClient* m_http;
+    BookSyncOptions m_opts;
+    std::vector<std::unique_ptr<Book>> m_books;     // by SymbolId
+    std::deque<SymbolId> m_queue;
+    int m_fetchers = 0;
+    size_t m_syncing = 0;
+    bool m_stopping = false;
+    photon::condition_variable m_cond;
+    Stats m_stats;
+};
@@ -0,0 +1,350 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Order book synchronization against a local stub exchange.
+//
+// The stub keeps the true books of --symbols symbols and changes them at
+// --rate diffs/s, delivering each diff as a depthUpdate message through the
+// DepthStream pipeline into a BookSynchronizer. Its REST endpoint
+// (/api/v3/depth on 127.0.0.1:--port) answers snapshots after --latency-us,
+// like a distant exchange. The run syncs all books from cold, then drops
+// the feed for --outage-ms as a disconnect would, resyncs every book and
+// checks each one against the stub's. With --checkpoint=file the books are
+// then saved, and a new synchronizer stands in for a restarted process: it
+// restores them from the file after --restart-ms without the feed and
+// catches up from the diffs, fetching only the books that moved on too far.
+// One JSON line is printed with the sync times; --fetches=1 gives the
+// one-book-at-a-time baseline.
+//
+//   book_sync_bench --symbols=200 --fetches=16 --latency-us=50000
+//                   --checkpoint=/dev/shm/books --restart-ms=100
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/thread/thread11.h>
+#include <photon/net/socket.h>
+
+#include "book-checkpoint.h"
+#include "book-sync.h"
+#include "http-client.h"
+#include "order-book.h"
+#include "symbol-table.h"
+#include "ws-pipeline.h"
+
+using namespace photon;
+
+struct Options {
+    int symbols = 200;
+    int fetches = 16;
+    uint64_t rate = 20000;              // diffs/s over all symbols
+    uint64_t latency_us = 50 * 1000;    // of a snapshot request
+    uint64_t outage_ms = 500;
+    uint16_t port = 18080;
+    const char* checkpoint = nullptr;
+    uint64_t restart_ms = 0;
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"symbols", required_argument, 0, 's'},
+        {"fetches", required_argument, 0, 'f'},
+        {"rate", required_argument, 0, 'r'},
+        {"latency-us", required_argument, 0, 'l'},
+        {"outage-ms", required_argument, 0, 'o'},
+        {"port", required_argument, 0, 'p'},
+        {"checkpoint", required_argument, 0, 'c'},
+        {"restart-ms", required_argument, 0, 'R'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "s:f:r:l:o:p:c:R:", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 's': opts.symbols = std::max(1, atoi(optarg)); break;
+            case 'f': opts.fetches = std::max(1, atoi(optarg)); break;
+            case 'r': opts.rate = strtoull(optarg, nullptr, 10); break;
+            case 'l': opts.latency_us = strtoull(optarg, nullptr, 10); break;
+            case 'o': opts.outage_ms = strtoull(optarg, nullptr, 10); break;
+            case 'p': opts.port = atoi(optarg); break;
+            case 'c': opts.checkpoint = optarg; break;
+            case 'R': opts.restart_ms = strtoull(optarg, nullptr, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [--symbols=N] [--fetches=N] [--rate=diffs_per_sec] "
+                        "[--latency-us=N] [--outage-ms=N] [--port=N] [--checkpoint=file] "
+                        "[--restart-ms=N]\n", argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static std::string fixed(int64_t v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld.%08ld", v / MD_PRICE_SCALE, v % MD_PRICE_SCALE);
+    return buf;
+}
+
+template <typename Side>
+static void append_levels(std::string* out, const Side& side, int limit) {
+    *out += '[';
+    for (auto& l : side) {
+        if (limit-- == 0) break;
+        if (out->back() != '[') *out += ',';
+        *out += "[\"" + fixed(l.first) + "\",\"" + fixed(l.second) + "\"]";
+    }
+    *out += ']';
+}
+
+// The exchange side: true books, the diff stream and the REST endpoint.
+class StubExchange {
+public:
+    explicit StubExchange(const std::vector<SymbolId>& ids) : m_ids(ids), m_books(ids.size()) {
+        for (size_t i = 0; i < ids.size(); i++) {
+            // a starting book, as the stream would have built it
+            for (int n = 0; n < 200; n++) diff(i);
+        }
+    }
+
+    // Changes a random book and returns the depthUpdate message for it.
+    std::string diff(size_t i) {
+        auto& b = m_books[i];
+        int64_t mid = (1000 + i) * MD_PRICE_SCALE, tick = MD_PRICE_SCALE / 100;
+        std::string bids, asks;
+        int levels = 1 + m_rng() % 4;
+        for (int n = 0; n < levels; n++) {
+            int side = m_rng() % 2;
+            int64_t price = mid + (side ? 1 : -1) * (int64_t)(1 + m_rng() % 50) * tick;
+            int64_t qty = m_rng() % 4 ? (int64_t)(1 + m_rng() % 1000) * MD_PRICE_SCALE / 10 : 0;
+            std::string& out = side ? asks : bids;
+            if (!out.empty()) out += ',';
+            out += "[\"" + fixed(price) + "\",\"" + fixed(qty) + "\"]";
+            // the stub's copy goes through the same parser as the client's
+            MdBookUpdate u = {};
+            u.side = side;
+            u.count = 1;
+            u.last = 1;
+            u.first_update_id = u.last_update_id = b.update_id() + 1;
+            u.levels[0].price = price;
+            u.levels[0].qty = qty;
+            b.apply(u);
+        }
+        uint64_t last = b.update_id();
+        uint64_t first = last - levels + 1;
+        return "{\"e\":\"depthUpdate\",\"E\":" + std::to_string(photon::now / 1000) + ",\"s\":\"" +
+               symbol_table().name(m_ids[i]) + "\",\"U\":" + std::to_string(first) + ",\"u\":" +
+               std::to_string(last) + ",\"b\":[" + bids + "],\"a\":[" + asks + "]}";
+    }
+
+    std::string snapshot(size_t i, int limit) {
+        auto& b = m_books[i];
+        std::string body = "{\"lastUpdateId\":" + std::to_string(b.update_id()) + ",\"bids\":";
+        append_levels(&body, b.bids(), limit);
+        body += ",\"asks\":";
+        append_levels(&body, b.asks(), limit);
+        return body + "}";
+    }
+
+    // GET /api/v3/depth?symbol=SYM&limit=N, keep-alive.
+    int serve(net::ISocketStream* s) {
+        char req[4096];
+        size_t n = 0;
+        while (true) {
+            char* end;
+            while (!(end = (char*)memmem(req, n, "\r\n\r\n", 4))) {
+                ssize_t r = n < sizeof(req) ? s->recv(req + n, sizeof(req) - n) : -1;
+                if (r <= 0) return 0;
+                n += r;
+            }
+            size_t used = end + 4 - req;
+            *end = '\0';
+            std::string body;
+            const char* sym = strstr(req, "symbol=");
+            const char* limit = strstr(req, "limit=");
+            SymbolId id = sym ? symbol_table().find(sym + 7, strcspn(sym + 7, "& ")) : SYMBOL_NONE;
+            photon::thread_usleep(opts.latency_us);
+            m_requests++;
+            for (size_t i = 0; i < m_ids.size(); i++) {
+                if (m_ids[i] == id) body = snapshot(i, limit ? atoi(limit + 6) : 100);
+            }
+            std::string resp = body.empty() ? "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n"
+                                            : "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                                              "Content-Length: " + std::to_string(body.size()) +
+                                              "\r\n\r\n" + body;
+            if (s->write(resp.data(), resp.size()) != (ssize_t)resp.size()) return -1;
+            memmove(req, req + used, n - used);
+            n -= used;
+        }
+    }
+
+    const OrderBook& book(size_t i) const { return m_books[i]; }
+    size_t size() const { return m_ids.size(); }
+    uint64_t requests() const { return m_requests; }
+
+private:
+    std::vector<SymbolId> m_ids;
+    std::vector<OrderBook> m_books;
+    std::mt19937_64 m_rng{42};
+    uint64_t m_requests = 0;
+};
+
+// Feed handler: every diff goes to the synchronizer.
+struct DepthSink {
+    BookSynchronizer* sync;
+    void on_message(const char*, size_t) {}
+    void on_event(MdBookUpdate& u) { sync->on_update(u); }
+    void on_other(const char* p, size_t n) { LOG_WARN("unexpected message `", std::string(p, n).c_str()); }
+    int send_pong(const char*, size_t) { return 0; }
+    void on_close() {}
+};
+
+static double ms_since(uint64_t t0) { return (photon::now - t0) / 1000.0; }
+
+// Books of `sync` that are not live (*stale) or differ from the stub's.
+static int count_mismatched(const BookSynchronizer& sync, const StubExchange& exchange,
+                            const std::vector<SymbolId>& ids, int* stale) {
+    int mismatched = 0;
+    *stale = 0;
+    for (size_t i = 0; i < ids.size(); i++) {
+        auto b = sync.book(ids[i]);
+        if (!b) {
+            (*stale)++;
+            continue;
+        }
+        auto& truth = exchange.book(i);
+        if (b->update_id() != truth.update_id() || b->bids() != truth.bids() || b->asks() != truth.asks())
+            mismatched++;
+    }
+    return mismatched;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    if (photon::init(INIT_EVENT_DEFAULT, INIT_IO_NONE))
+        LOG_ERROR_RETURN(0, -1, "Photon init failed");
+    DEFER(photon::fini());
+    set_log_output_level(ALOG_INFO);
+
+    std::vector<std::string> names;
+    for (int i = 0; i < opts.symbols; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "SYM%04dUSDT", i);
+        names.push_back(name);
+    }
+    auto ids = symbol_table().intern(names);
+    StubExchange exchange(ids);
+
+    auto server = net::new_tcp_socket_server();
+    DEFER(delete server);
+    if (server->bind_v4localhost(opts.port) < 0 || server->listen(1024) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to listen on port `", opts.port);
+    server->set_handler([&](net::ISocketStream* s) { return exchange.serve(s); });
+    server->start_loop(false);
+
+    HttpClientOptions http_opts;
+    http_opts.max_idle_per_host = opts.fetches;
+    HttpClient http(net::new_tcp_socket_client(), http_opts);
+    BookSyncOptions sync_opts;
+    sync_opts.endpoint = net::EndPoint(net::IPAddr("127.0.0.1"), opts.port);
+    sync_opts.host = "127.0.0.1:" + std::to_string(opts.port);
+    sync_opts.max_fetches = opts.fetches;
+    BookSynchronizer sync(&http, sync_opts);
+
+    // The feed: diffs every millisecond, delivered unless `connected` is off.
+    DepthSink sink{&sync};
+    WsPipeline<DepthStream, DepthSink, IgnorePings> feed(sink, SYMBOL_NONE);
+    bool connected = true, running = true;
+    uint64_t delivered = 0;
+    auto gen = photon::thread_create11([&] {
+        std::mt19937 rng(7);
+        uint64_t per_ms = std::max<uint64_t>(1, opts.rate / 1000);
+        while (running) {
+            for (uint64_t k = 0; k < per_ms; k++) {
+                std::string msg = exchange.diff(rng() % exchange.size());
+                if (!connected) continue;
+                feed.message(msg.data(), msg.size());
+                delivered++;
+            }
+            photon::thread_usleep(1000);
+        }
+    });
+    auto gen_jh = photon::thread_enable_join(gen);
+
+    Timeout limit(60UL * 1000 * 1000);
+    uint64_t t0 = photon::now;
+    sync.resync(ids);
+    if (sync.wait_synced(limit) < 0) return -1;
+    double initial_ms = ms_since(t0);
+
+    connected = false;
+    photon::thread_usleep(opts.outage_ms * 1000);
+    connected = true;
+    t0 = photon::now;
+    sync.resync(ids);
+    if (sync.wait_synced(limit) < 0) return -1;
+    double resync_ms = ms_since(t0);
+
+    // run live for a moment, then compare every book with the stub's
+    photon::thread_usleep(200 * 1000);
+    int stale;
+    int mismatched = count_mismatched(sync, exchange, ids, &stale);
+    auto st = sync.stats();
+
+    // save, "restart" and catch up from the checkpoint
+    double restart_ms = 0;
+    uint64_t restart_snapshots = 0, restored = 0;
+    std::unique_ptr<BookSynchronizer> sync2;
+    if (opts.checkpoint) {
+        BookCheckpointFile file;
+        if (file.open(opts.checkpoint, opts.symbols) < 0) return -1;
+        BookCheckpointer(&sync, &file).save_changed();
+        connected = false;
+        photon::thread_usleep(opts.restart_ms * 1000);
+        t0 = photon::now;
+        sync2.reset(new BookSynchronizer(&http, sync_opts));
+        sink.sync = sync2.get();
+        restore_books(file, sync2.get(), ids);
+        connected = true;
+        if (sync2->wait_synced(limit) < 0) return -1;
+        restart_ms = ms_since(t0);
+        photon::thread_usleep(200 * 1000);
+        int stale2;
+        mismatched += count_mismatched(*sync2, exchange, ids, &stale2);
+        stale += stale2;
+        restart_snapshots = sync2->stats().snapshots;
+        restored = sync2->stats().restored;
+    }
+    running = false;
+    photon::thread_join(gen_jh);
+
+    printf("{\"symbols\":%d,\"fetches\":%d,\"latency_us\":%lu,\"initial_ms\":%.1f,\"resync_ms\":%.1f,"
+           "\"snapshots\":%lu,\"requests\":%lu,\"connects\":%lu,\"stale_snapshots\":%lu,"
+           "\"replayed\":%lu,\"gaps\":%lu,\"restart_ms\":%.1f,\"restored\":%lu,"
+           "\"restart_snapshots\":%lu,\"diffs\":%lu,\"stale\":%d,\"mismatched\":%d}\n",
+           opts.symbols, opts.fetches, opts.latency_us, initial_ms, resync_ms, st.snapshots,
+           exchange.requests(), http.connects(), st.stale_snapshots, st.replayed, st.gaps, restart_ms,
+           restored, restart_snapshots, delivered, stale, mismatched);
+    return mismatched || stale ? 1 : 0;
+}
@@ -1,15 +1,124 @@
 #include <photon/photon.h>
 #include <photon/thread/std-compat.h>
-#include <photon/io/iouring-wrapper.h>
 #include <photon/common/alog.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
+#include <photon/net/socket.h>
 #include <iostream>
 #include <cstdint>
 
-int main() {
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "http-client.h"
+
+struct ParserCase {
+    const char* name;
+    std::string wire;
+    int status;             // 0: the parser must reject the response
+    const char* body;
+    size_t rest = 0;        // bytes of the next (pipelined) response
+    bool head = false;      // answer to a HEAD request
+    bool eof = false;       // the server closes after `wire`
+};
+
+static std::vector<ParserCase> parser_cases() {
+    std::vector<ParserCase> cases = {
+        {"content-length", "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 11\r\n\r\nhello world",
+         200, "hello world"},
+        {"padded content-length", "HTTP/1.1 200 OK\r\nContent-Length: \t 5  \r\n\r\nabcde", 200, "abcde"},
+        {"repeated content-length", "HTTP/1.1 200 OK\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc",
+         200, "abc"},
+        {"chunked", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                    "5;ext=1\r\nhello\r\n6\r\n world\r\n0\r\nX-Trailer: 1\r\n\r\n", 200, "hello world"},
+        {"chunked, bare LF", "HTTP/1.1 200 OK\nTransfer-Encoding: chunked\n\nA\n0123456789\n0\n\n",
+         200, "0123456789"},
+        {"chunked over content-length", "HTTP/1.1 200 OK\r\nContent-Length: 99\r\n"
+                                        "Transfer-Encoding: chunked\r\n\r\n2\r\nok\r\n0\r\n\r\n", 200, "ok"},
+        {"empty body, pipelined", "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\nHTTP/1.1 204 No Content\r\n\r\n",
+         200, "", 27},
+        {"204, pipelined", "HTTP/1.1 204 No Content\r\n\r\nHTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n",
+         204, "", 38},
+        {"304 with length", "HTTP/1.1 304 Not Modified\r\nContent-Length: 10\r\n\r\n", 304, ""},
+        {"HEAD", "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n", 200, "", 0, true},
+        {"100 Continue", "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 201 Created\r\nContent-Length: 2\r\n\r\nok",
+         201, "ok"},
+        {"until close", "HTTP/1.0 200 OK\r\nServer: x\r\n\r\nuntil eof", 200, "until eof", 0, false, true},
+        {"truncated body", "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", 0, "", 0, false, true},
+        {"truncated chunk", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel", 0, "", 0, false,
+         true},
+        {"non-numeric content-length", "HTTP/1.1 200 OK\r\nContent-Length: abc\r\n\r\n", 0, ""},
+        {"negative content-length", "HTTP/1.1 200 OK\r\nContent-Length: -1\r\n\r\n", 0, ""},
+        {"huge content-length", "HTTP/1.1 200 OK\r\nContent-Length: 99999999999999999999\r\n\r\n", 0, ""},
+        {"conflicting content-length", "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n",
+         0, ""},
+        {"bad chunk size", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 0, ""},
+        {"chunk without CRLF", "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhelloX\r\n", 0, ""},
+        {"bad status line", "HTTX/1.1 200 OK\r\n\r\n", 0, ""},
+        {"header without colon", "HTTP/1.1 200 OK\r\nbogus\r\n\r\n", 0, ""},
+    };
+    return cases;
+}
+
+// Feeds `c.wire` in the pieces that end at `cuts` (the last one at the
+// end). Returns what went wrong, or an empty string.
+static std::string run_parser_case(const ParserCase& c, const std::vector<size_t>& cuts) {
+    HttpResponseParser parser;
+    HttpResponse resp;
+    parser.reset(&resp, c.head);
+    size_t pos = 0, used = 0;
+    bool failed = false;
+    for (size_t cut : cuts) {
+        ssize_t n = parser.feed(c.wire.data() + pos, cut - pos);
+        if (n < 0) {
+            failed = true;
+            break;
+        }
+        used += n;
+        pos = cut;
+        if (parser.done()) break;
+    }
+    if (!failed && !parser.done() && c.eof) failed = parser.eof() < 0;
+    if (!c.status) return failed || !parser.done() ? "" : "accepted";
+    if (failed) return "rejected";
+    if (!parser.done()) return "not done";
+    if (resp.status != c.status) return "status " + std::to_string(resp.status);
+    if (resp.body != c.body) return "body '" + resp.body + "'";
+    if (used != c.wire.size() - c.rest) return "used " + std::to_string(used);
+    return "";
+}
+
+// Runs every canned response split at every byte boundary, and one byte
+// at a time. Prints one JSON line; returns the number of failed feeds.
+static int check_parser() {
+    set_log_output_level(ALOG_FATAL);   // the rejects are expected
+    uint64_t feeds = 0, failures = 0;
+    auto cases = parser_cases();
+    for (auto& c : cases) {
+        size_t n = c.wire.size();
+        std::vector<std::vector<size_t>> splits;
+        for (size_t i = 0; i < n; i++) splits.push_back(i ? std::vector<size_t>{i, n} : std::vector<size_t>{n});
+        splits.emplace_back();
+        for (size_t i = 1; i <= n; i++) splits.back().push_back(i);
+        for (auto& cuts : splits) {
+            feeds++;
+            auto err = run_parser_case(c, cuts);
+            if (err.empty()) continue;
+            failures++;
+            fprintf(stderr, "%s, %s: %s\n", c.name,
+                    cuts.size() == 2 ? ("split at " + std::to_string(cuts[0])).c_str() :
+                    cuts.size() == 1 ? "whole" : "byte by byte", err.c_str());
+        }
+    }
+    printf("{\"cases\":%zu,\"feeds\":%lu,\"failures\":%lu}\n", cases.size(), feeds, failures);
+    return failures;
+}
+
+// Talks to python_server.py (HTTP/1.1 keep-alive on 127.0.0.1:8080): all
+// requests below share one pooled connection.
+// Usage: client [--parser-check]; the check runs offline.
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--parser-check") == 0) return check_parser() ? 1 : 0;
+
     // Initialize Photon environment
     int ret = photon::init(photon::INIT_EVENT_IOURING, photon::INIT_IO_NONE);
     if (ret != 0) {
@@ -17,106 +126,52 @@ int main() {
         return -1;
     }
     DEFER(photon::fini());
+    DEFER(release_vcpu_buffer_pool());
 
     // Launch client in a Photon thread
     photon_std::thread client_thread([] {
-        // Create TCP socket
-        int fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd < 0) {
-            LOG_ERRNO_RETURN(0, , "failed to create socket");
-        }
-        DEFER({ photon::iouring_close(fd); });
-        std::cout << "Created TCP Socket\n\n\n";
-        std::cout.flush();
-        // Configure server address
-        struct sockaddr_in server_addr;
-        memset(&server_addr, 0, sizeof(server_addr));
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(8080);
-        inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-        std::cout << "Configured server address\n\n\n";
-        // Debug io_uring state
-        std::cout << "Master event engine: " << (void*)photon::get_vcpu()->master_event_engine << std::endl;
-        std::cout << "Attempting io_uring connect (fd: " << fd << ")" << std::endl;
+        // Sockets come from this vCPU's registered io_uring client, with
+        // responses received by multishot recv
+        HttpClient client;
+        photon::net::EndPoint server(photon::net::IPAddr("127.0.0.1"), 8080);
+        const std::string host = "127.0.0.1:8080";
 
-        // Connect using io_uring with 1-second timeout
-        uint64_t timeout = 100ULL; // 1 second in nanoseconds
-        char ip_str[INET_ADDRSTRLEN];
-        const char* result = inet_ntop(AF_INET, &(server_addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-        // std::cout << fd <<" "<< ip_str  << "\n";
-        int conn_ret = photon::iouring_connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr), timeout);
-        // std::cout << "1\n";
-        if (conn_ret < 0) {
-            LOG_ERRNO_RETURN(0, , "failed to connect to server");
+        HttpResponse resp;
+        if (client.get(server, host, "/", &resp) < 0) {
+            LOG_ERROR_RETURN(0, , "GET failed");
         }
-        std::cout << "Connected using io_uring with 1-second timeout";
-        // Send HTTP GET request
-        std::string get_request = "GET / HTTP/1.1\r\nHost: 127.0.0.1:8080\r\n\r\n";
-        ssize_t sent = photon::iouring_send(fd, get_request.c_str(), get_request.size(), 0, timeout);
-        if (sent < 0) {
-            LOG_ERROR("Failed to send GET request");
-        } else if (sent != (ssize_t)get_request.size()) {
-            LOG_ERROR("Incomplete GET send");
-        } else {
-            std::cout << "GET request sent successfully" << std::endl;
-        }
-        // Receive GET response
-        char buf[1024];
-        std::string full_get_response;
-        while (true) {
-            std::cout <<"0\n";
-            ssize_t received = photon::iouring_recv(fd, buf, sizeof(buf), 0, timeout);
-            std::cout <<"1\n";
-            if (received > 0) {
-                full_get_response += std::string(buf, received);
-                std::cout << full_get_response<< "\n";
-            } else if (received == 0) {
-                // EOF
-                break;
-            } else {
-                LOG_ERROR("Failed to receive GET response");
-                break;
-            }
-        }
-        std::cout << "GET response: '" << full_get_response << "'" << std::endl;
-        std::cout << "End of GET request\n";
+        std::cout << "GET " << resp.status << ": '" << resp.body << "'" << std::endl;
 
+        HttpRequest post;
+        post.method = "POST";
+        post.body = "Hello World";
+        if (client.request(server, host, post, &resp) < 0) {
+            LOG_ERROR_RETURN(0, , "POST failed");
+        }
+        std::cout << "POST " << resp.status << ": '" << resp.body << "'" << std::endl;
 
-        // Send HTTP POST request
-        std::string post_data = "Hello World";
-        std::string post_request =
-            "POST / HTTP/1.1\r\n"
-            "Host: 127.0.0.1:8080\r\n"
-            "Content-Length: " + std::to_string(post_data.size()) + "\r\n"
-            "\r\n" + post_data;
-        sent = photon::iouring_send(fd, post_request.c_str(), post_request.size(), 0, timeout);
-        if (sent < 0) {
-            LOG_ERROR("Failed to send POST request");
-        } else if (sent != (ssize_t)post_request.size()) {
-            LOG_ERROR("Incomplete POST send");
-        } else {
-            std::cout << "POST request sent successfully" << std::endl;
+        if (client.get(server, host, "/chunked", &resp) < 0) {
+            LOG_ERROR_RETURN(0, , "chunked GET failed");
         }
+        std::cout << "GET /chunked " << resp.status << ": '" << resp.body << "'" << std::endl;
 
-        // Receive POST response
-        std::string full_post_response;
-        while (true) {
-            ssize_t received = photon::iouring_recv(fd, buf, sizeof(buf), 0, timeout);
-            if (received > 0) {
-                full_post_response += std::string(buf, received);
-            } else if (received == 0) {
-                // EOF
-                break;
-            } else {
-                LOG_ERROR("Failed to receive POST response");
-                break;
-            }
+        // Pipelined: written back to back, responses read in order
+        std::vector<HttpRequest> reqs(4);
+        reqs[1].path = "/chunked";
+        reqs[2].method = "POST";
+        reqs[2].body = "pipelined";
+        std::vector<HttpResponse> resps;
+        if (client.pipeline(server, host, reqs, &resps) < 0) {
+            LOG_ERROR_RETURN(0, , "pipelined requests failed");
+        }
+        for (size_t i = 0; i < resps.size(); i++) {
+            std::cout << "pipelined " << reqs[i].method << " " << reqs[i].path << " "
+                      << resps[i].status << ": '" << resps[i].body << "'" << std::endl;
         }
-        std::cout << "POST response: '" << full_post_response << "'" << std::endl;
-        std::cout << "End of POST request\n";
+        std::cout << "TCP connections opened: " << client.connects() << std::endl;
     });
 
     // Wait for client thread to finish
     client_thread.join();
     return 0;
-}
\ No newline at end of file
+}
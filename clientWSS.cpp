@@ -19,23 +19,34 @@ limitations under the License.
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <photon/photon.h>
-#include <photon/io/signal.h>
 #include <photon/thread/thread11.h>
 #include <photon/common/alog.h>
 #include <photon/net/socket.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "adaptive-recv.h"
+#include "ktls-stream.h"
+#include "metrics.h"
+#include "shutdown.h"
+#include "ws-correlation.h"
+
 static const char* SERVER_IP = "18.177.127.58"; // stream.binance.com
 static const uint16_t SERVER_PORT = 9443;
 static const char* SERVER_HOST = "stream.binance.com";
 static const size_t CONNECTION_NUM = 8;
 static const size_t BUF_SIZE = 512;
 static const uint64_t STATS_INTERVAL = 1; // Seconds
+static const uint16_t METRICS_PORT = 9464;
+// On shutdown, how long the server has to answer our close frames, and how
+// long everything together may take
+static const uint64_t CLOSE_WAIT_US = 2ULL * 1000 * 1000;
+static const uint64_t DRAIN_US = 5ULL * 1000 * 1000;
 
-static bool stop_test = false;
-static uint64_t qps = 0;
-static uint64_t time_cost = 0;
+// Shared by all connections; each vCPU updates its own shard
+static MetricHistogram* message_us =
+    metrics().histogram("wss_message_us", "Read to processed, per message, microseconds");
+static MetricCounter* received_bytes = metrics().counter("wss_received_bytes_total", "Bytes read");
 
 // Custom TLS stream wrapper for io_uring
 class TLSSocketStream : public photon::net::ISocketStream {
@@ -108,7 +119,7 @@ public:
 
     ssize_t write(const void* buf, size_t cnt) override {
         size_t written = 0;
-        while (written < cnt && !stop_test) {
+        while (written < cnt) {
             ssize_t ret = send((char*)buf + written, cnt - written);
             if (ret > 0) {
                 written += ret;
@@ -123,7 +134,7 @@ public:
 
     ssize_t read(void* buf, size_t cnt) override {
         size_t read = 0;
-        while (read < cnt && !stop_test) {
+        while (read < cnt && !shutdown_requested()) {
             ssize_t ret = recv((char*)buf + read, cnt - read);
             if (ret > 0) {
                 read += ret;
@@ -205,23 +216,21 @@ public:
         return write(iov[0].iov_base, iov[0].iov_len);
     }
 
+    // Encrypted straight from the mapped file
     ssize_t sendfile(int fd, off_t offset, size_t count) override {
-        return -1; // Not supported
+        return write_mapped_file(this, fd, offset, count);
     }
 };
 
-static void handle_signal(int sig) {
-    LOG_INFO("Gracefully stopping WSS client...");
-    stop_test = true;
-}
-
-static void run_latency_loop() {
-    while (!stop_test) {
-        photon::thread_sleep(STATS_INTERVAL);
-        uint64_t lat = (qps != 0) ? (time_cost / qps) : 0;
-        LOG_INFO("Average latency: ` us", lat);
-        qps = time_cost = 0;
-    }
+// Average over the last interval, from the deltas of the histogram totals
+static void report_latency() {
+    static uint64_t last_count = 0, last_total = 0;
+    uint64_t count, total;
+    metrics().totals(message_us, &count, &total);
+    uint64_t lat = count != last_count ? (total - last_total) / (count - last_count) : 0;
+    LOG_INFO("Average latency: ` us", lat);
+    last_count = count;
+    last_total = total;
 }
 
 // Send WebSocket text frame (opcode 0x1)
@@ -242,29 +251,6 @@ static int send_ws_text(TLSSocketStream* stream, const char* data, size_t len) {
     return 0;
 }
 
-// Parse WebSocket frame, return 0 for text, 1 for ping, -1 for error
-static int parse_ws_frame(const char* buf, size_t len, char* payload, size_t* payload_len) {
-    if (len < 2) return -1;
-    uint8_t opcode = buf[0] & 0x0F;
-    uint8_t fin = buf[0] & 0x80;
-    uint8_t payload_len_byte = buf[1] & 0x7F;
-    if (!fin || payload_len_byte > len - 2) {
-        LOG_ERROR("Unsupported WebSocket frame");
-        return -1;
-    }
-    if (opcode == 0x1) { // Text
-        memcpy(payload, buf + 2, payload_len_byte);
-        payload[payload_len_byte] = '\0';
-        *payload_len = payload_len_byte;
-        return 0;
-    } else if (opcode == 0x9) { // Ping
-        memcpy(payload, buf + 2, payload_len_byte);
-        *payload_len = payload_len_byte;
-        return 1;
-    }
-    return -1;
-}
-
 // Extract price from aggTrade JSON (e.g., {"e":"aggTrade","p":"123.45",...})
 static const char* extract_price(const char* json) {
     const char* price_key = "\"p\":\"";
@@ -309,8 +295,6 @@ static int wss_client() {
 
     auto run_wss_connection = [&]() -> int {
         char buf[BUF_SIZE];
-        char payload[BUF_SIZE];
-        size_t payload_len;
 
         // Connect
         auto conn = cli->connect(ep);
@@ -344,7 +328,7 @@ static int wss_client() {
         DEFER(delete tls_stream);
 
         // Perform TLS handshake with non-blocking handling
-        while (!stop_test) {
+        while (!shutdown_requested()) {
             int ret = SSL_connect(ssl);
             if (ret == 1) {
                 break; // Handshake successful
@@ -386,65 +370,136 @@ static int wss_client() {
             return -1;
         }
 
-        // Subscribe to btcusdt@aggTrade
-        const char* subscribe = "{\"method\":\"SUBSCRIBE\",\"params\":[\"btcusdt@aggTrade\"],\"id\":1}";
-        if (send_ws_text(tls_stream, subscribe, strlen(subscribe)) != 0) {
+        // Subscribe to btcusdt@aggTrade; the acknowledgement is matched by id
+        WsCorrelator requests(16);
+        uint64_t subscribe_id = requests.next_id();
+        std::string subscribe = "{\"method\":\"SUBSCRIBE\",\"params\":[\"btcusdt@aggTrade\"],\"id\":" +
+                                std::to_string(subscribe_id) + "}";
+        requests.expect(subscribe_id, requests.method("SUBSCRIBE"), 10 * 1000 * 1000,
+                        [](int err, const char* resp, size_t len) {
+            if (!err) {
+                LOG_INFO("Subscribed successfully");
+            } else {
+                LOG_ERROR("Subscription failed: `", resp ? std::string(resp, len).c_str() : strerror(err));
+            }
+        });
+        if (send_ws_text(tls_stream, subscribe.data(), subscribe.size()) != 0) {
             LOG_ERROR("Failed to send subscription");
             return -1;
         }
 
-        // Main loop: Handle market data and ping/pong
-        while (!stop_test) {
+        // Main loop: Handle market data and ping/pong. Every complete frame
+        // of a read is handled before the next one, and records OpenSSL has
+        // already decrypted (SSL_pending) are read without yielding.
+        AdaptiveRecvBuffer rx(-1, true);
+        std::string text;
+        uint64_t close_sent = 0;    // photon::now
+        while (true) {
+            // on shutdown, a close frame and CLOSE_WAIT_US for the echo
+            if (shutdown_requested() && !close_sent) {
+                char frame[WS_MAX_HEADER + 2];
+                uint8_t mask[4];
+                ws_new_mask(mask);
+                size_t n = ws_encode_close(frame, WS_CLOSE_GOING_AWAY, mask);
+                if (tls_stream->write(frame, n) != (ssize_t)n) {
+                    LOG_ERROR("Failed to send close frame");
+                    return -1;
+                }
+                close_sent = photon::update_now();
+            } else if (close_sent && photon::update_now() - close_sent > CLOSE_WAIT_US) {
+                LOG_WARN("No close frame back from the server");
+                return -1;
+            }
             auto start = std::chrono::system_clock::now();
-            ret = tls_stream->read(buf, BUF_SIZE);
+            ret = rx.recv_from(tls_stream);
+            if (ret < 0 && errno == EAGAIN) {
+                photon::thread_yield();
+                continue;
+            }
             if (ret <= 0) {
                 LOG_ERROR("Receive failed");
                 return -1;
             }
+            received_bytes->add(ret);
+            while (SSL_pending(ssl) > 0 && (ret = rx.recv_from(tls_stream)) > 0) {
+                received_bytes->add(ret);
+            }
 
-            int frame_type = parse_ws_frame(buf, ret, payload, &payload_len);
-            if (frame_type == 1) { // Ping
-                char pong_header[2] = { (char)0x8A, (char)payload_len };
-                char pong_frame[BUF_SIZE];
-                memcpy(pong_frame, pong_header, 2);
-                memcpy(pong_frame + 2, payload, payload_len);
-                ret = tls_stream->write(pong_frame, 2 + payload_len);
-                if (ret != (ssize_t)(2 + payload_len)) {
-                    LOG_ERROR("Failed to send pong");
-                    return -1;
-                }
-            } else if (frame_type == 0) { // Text
-                if (strstr(payload, "\"result\":null") && strstr(payload, "\"id\":1")) {
-                    LOG_INFO("Subscribed successfully");
-                } else if (strstr(payload, "\"e\":\"aggTrade\"")) {
-                    const char* price = extract_price(payload);
-                    if (price) {
-                        LOG_INFO("Price: `", price);
+            WsFrameHeader h;
+            int hl;
+            while ((hl = ws_parse_header(rx.data(), rx.size(), &h)) > 0 &&
+                    rx.size() >= hl + h.payload_len) {
+                const char* payload = rx.data() + hl;
+                size_t payload_len = h.payload_len;
+                if (h.opcode == WS_PING && payload_len <= 125) {
+                    char pong_frame[WS_MAX_HEADER + 125];
+                    size_t n = ws_encode_header(pong_frame, WS_PONG, payload_len);
+                    memcpy(pong_frame + n, payload, payload_len);
+                    if (tls_stream->write(pong_frame, n + payload_len) != (ssize_t)(n + payload_len)) {
+                        LOG_ERROR("Failed to send pong");
+                        return -1;
+                    }
+                } else if (h.opcode == WS_CLOSE) {
+                    LOG_INFO("Connection closed by the server");
+                    return 0;
+                } else if (h.opcode == WS_TEXT && h.fin) {
+                    text.assign(payload, payload_len);
+                    if (requests.on_message(text.data(), text.size())) {
+                        // a response, completed by its callback
+                    } else if (strstr(text.c_str(), "\"e\":\"aggTrade\"")) {
+                        const char* price = extract_price(text.c_str());
+                        if (price) {
+                            LOG_INFO("Price: `", price);
+                        }
                     }
                 }
+                rx.note_message(payload_len);
+                rx.consume(hl + payload_len);
+            }
+            if (hl < 0) {
+                LOG_ERROR("Malformed WebSocket frame");
+                return -1;
+            }
+            if (hl > 0 && !rx.reserve(hl + h.payload_len - rx.size())) {
+                LOG_ERROR("WebSocket frame of ` bytes is too large", h.payload_len);
+                return -1;
             }
 
             auto end = std::chrono::system_clock::now();
-            time_cost += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
-            qps++;
+            message_us->observe(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
         }
 
         return 0;
     };
 
-    // Start latency monitoring
-    photon::thread_create11(run_latency_loop);
+    // Latency report and request timeouts fire from this vCPU's wheel
+    timer_wheel().start();
+    DEFER(timer_wheel().stop());
+    WheelTimer stats_timer(&report_latency);
+    stats_timer.start_periodic(STATS_INTERVAL * 1000 * 1000);
 
-    // Create coroutines for each connection
+    // Live numbers for scrapers at 127.0.0.1:9464/metrics
+    MetricsServer metrics_server;
+    if (metrics_server.start(METRICS_PORT) < 0) return -1;
+
+    // Create coroutines for each connection; on Ctrl+C they close, then the
+    // metrics endpoint goes
+    auto& coordinator = shutdown_coordinator();
     for (size_t i = 0; i < CONNECTION_NUM; i++) {
-        photon::thread_create11(run_wss_connection);
-    }
+        auto th = photon::thread_create11(run_wss_connection);
+        auto jh = photon::thread_enable_join(th);
+        coordinator.add(SHUTDOWN_SESSIONS, "wss connection", [th, jh](photon::Timeout tmo) {
+            return shutdown_join(th, jh, tmo);
+        });
+    }
+    coordinator.add(SHUTDOWN_STOP_INPUT, "metrics server", [&metrics_server](photon::Timeout) {
+        metrics_server.stop();
+        return 0;
+    });
 
-    // Sleep until Ctrl+C
-    while (!stop_test) {
-        photon::thread_sleep(1'000'000); // 1 second
-    }
-    return 0;
+    coordinator.wait();
+    LOG_INFO("Gracefully stopping WSS client...");
+    return coordinator.drain(DRAIN_US) ? -1 : 0;
 }
 
 int main() {
@@ -456,8 +511,7 @@ int main() {
     }
     DEFER(photon::fini());
 
-    photon::sync_signal(SIGTERM, &handle_signal);
-    photon::sync_signal(SIGINT, &handle_signal);
+    shutdown_coordinator().install_signals();
 
     return wss_client();
 }
\ No newline at end of file
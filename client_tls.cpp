@@ -24,6 +24,10 @@ limitations under the License.
 #include <photon/net/socket.h>
 #include <photon/net/security-context/tls-stream.h>
 
+#include "binlog.h"
+#include "endpoint-selector.h"
+#include "socket-profile.h"
+
 
 using namespace photon;
 
@@ -119,46 +123,33 @@ ssize_t send_websocket_frame(net::ISocketStream* tls, const char* data, size_t l
     return tls->send(frame, frame_len);
 }
 
-// Convert IPAddr to string (IPv4 only for simplicity, as Binance uses IPv4)
-std::string ipaddr_to_string(const net::IPAddr& addr) {
-    if (addr.is_ipv4()) {
-        uint32_t nl = addr.to_nl(); // Network byte order
-        struct in_addr in;
-        in.s_addr = nl;
-        return inet_ntoa(in);
-    }
-    return "unknown"; // Fallback for IPv6 or undefined
-}
-
 int main(int argc, char** argv) {
     if (photon::init(INIT_EVENT_IOURING, INIT_IO_NONE)) {
         LOG_ERROR_RETURN(0, -1, "Photon init failed");
     }
     DEFER(photon::fini());
 
+    // Everything received goes to the binary log named by BINLOG_FILE, if any
+    if (binlog_start_from_env() < 0) return -1;
+    DEFER(binlog_stop());
+
     auto ctx = net::new_tls_context(nullptr, nullptr, nullptr);
     if (!ctx) {
         LOG_ERROR_RETURN(0, -1, "TLS context creation failed");
     }
     DEFER(delete ctx);
 
-    auto cli = net::new_tls_client(ctx, net::new_iouring_tcp_client(), true);
+    auto cli = net::new_tls_client(ctx, new_profiled_client(net::new_iouring_tcp_client(), feed_socket_profile()), true);
     DEFER(delete cli);
 
+    // Every address of the host, fastest first once they have been tried
+    EndpointSelector endpoints("stream.binance.com");
     net::ISocketStream* tls = nullptr; 
+    int endpoint = -1;
     for (int attempt = 0; attempt < 3; ++attempt) {
-        net::IPAddr addr("52.194.53.108");
-        std::string ip_str = ipaddr_to_string(addr);
-        LOG_INFO("Attempt `, Resolved IP: `", attempt + 1, ip_str.c_str());
-        if (addr.undefined() || ip_str == "0.0.0.0") {
-            LOG_WARN("DNS resolution failed");
-            photon::thread_sleep(1);
-            continue;
-        }
-
-        tls = cli->connect(net::EndPoint{addr, 9443});
+        tls = endpoints.connect(cli, &endpoint);
         if (tls) break;
-        LOG_ERROR("Failed to connect to `:9443, retrying, errno=`", ip_str.c_str(), errno);
+        LOG_ERROR("Failed to connect, retrying, errno=`", errno);
         photon::thread_sleep(1);
     }
     if (!tls) {
@@ -201,9 +192,7 @@ int main(int argc, char** argv) {
             LOG_ERROR("Connection closed or error");
             break;
         }
-        buf[n] = '\0';
-        LOG_INFO("Received: ", buf);
-        // std::cout << buf << "\n";
+        BLOG_INFO("received `", blog_str(buf, n));
     }
 
     return 0;
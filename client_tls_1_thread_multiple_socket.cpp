@@ -2,13 +2,13 @@
 Copyright 2022 The Photon Authors
 Licensed under the Apache License, Version 2.0
 */
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include <memory>
-#include <arpa/inet.h>
-#include <netdb.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <photon/common/alog.h>
@@ -18,32 +18,110 @@ Licensed under the Apache License, Version 2.0
 #include <photon/net/security-context/tls-stream.h>
 //#include <photon/net/base_socket.h>  // For ISocketBase
 
+#include "adaptive-recv.h"
+#include "binlog.h"
+#include "endpoint-selector.h"
+#include "md-bus.h"
+#include "metrics.h"
+#include "rate-limiter.h"
+#include "shutdown.h"
+#include "socket-profile.h"
+#include "symbol-table.h"
+#include "timer-wheel.h"
+#include "topology.h"
+#include "ws-correlation.h"
+#include "ws-pipeline.h"
+
 using namespace photon;
 
+// A connection that delivers nothing for this long is dropped.
+static const uint64_t STALE_FEED_US = 60ULL * 1000 * 1000;
+static const uint64_t PING_INTERVAL_US = 30ULL * 1000 * 1000;
+static const uint64_t GAUGE_INTERVAL_US = 1000 * 1000;
+static const uint16_t DEFAULT_METRICS_PORT = 9464;
+// On shutdown, how long the exchange has to answer our close frames, and
+// how long everything together may take
+static const uint64_t CLOSE_WAIT_US = 2ULL * 1000 * 1000;
+static const uint64_t DRAIN_US = 5ULL * 1000 * 1000;
+
 // WebSocket connection state
 struct WebSocketConnection {
-    std::string symbol;
+    SymbolId symbol_id;
+    const char* symbol;         // stream name, owned by the symbol table
+    WsConnectionMetrics stats{symbol};
     net::ISocketStream* tls = nullptr;
     int sockfd = -1;
+    EndpointSelector* endpoints = nullptr;  // that `endpoint` came from
+    int endpoint = -1;
     
-    // Frame processing state
-    std::vector<char> recv_buffer;
-    std::string fragmented_message;
-    bool in_fragmented_message = false;
-    uint8_t fragmented_opcode = 0;
+    // Frame processing state: @trade messages are decoded straight into
+    // bus events
+    AdaptiveRecvBuffer rx;
+    WsPipeline<TradeStream, WebSocketConnection> pipeline{*this, symbol_id};
+    MdBusWriter* bus = nullptr;
     
-    // Connection health
-    time_t last_activity = 0;
+    // Connection health: restarted on every read
+    WheelTimer stale;
     bool connected = false;
+    bool established = false;   // handshake done, counted in stats.connects
+    bool closing = false;       // our close frame is sent, nothing may follow it
+
+    // Outstanding requests (SUBSCRIBE) on this connection
+    WsCorrelator requests{64};
+
+    // Everything sent, kept under the stream limit of 5 messages/s:
+    // pongs and pings go before subscriptions, which wait their turn
+    OutboundLimiter outbound{OutboundLimits(), [this](const char* frame, size_t n) {
+        return tls->send(frame, n) < 0 ? -1 : 0;
+    }};
     
-    WebSocketConnection(const std::string& sym) : symbol(sym) {
-        recv_buffer.reserve(8192);
-        last_activity = time(nullptr);
-    }
+    explicit WebSocketConnection(SymbolId id) : symbol_id(id), symbol(symbol_table().lower(id)) {}
     
     ~WebSocketConnection() {
+        if (established) stats.disconnects->add();
+        requests.log_stats(symbol);
+        if (endpoints) endpoints->on_close(endpoint);
         if (tls) delete tls;
     }
+
+    // Handler of the pipeline
+    void on_message(const char* data, size_t len) {
+        BLOG_DEBUG("[`] < `", symbol, blog_str(data, len));
+        stats.messages->add();
+    }
+
+    // Decoded trades go to the shared-memory bus for local consumers; their
+    // age ranks the address the connection went to.
+    void on_event(MdTrade& trade) {
+        if (endpoints) endpoints->on_message(endpoint, trade.hdr.exchange_ts_ns);
+        if (bus) bus->publish(trade);
+    }
+
+    void on_other(const char* data, size_t len) { requests.on_message(data, len); }
+
+    int send_pong(const char* data, size_t len) {
+        char frame[WS_MAX_HEADER + 125];
+        size_t frame_len = ws_encode_header(frame, WS_PONG, len);
+        memcpy(frame + frame_len, data, len);
+        return outbound.send(OUT_CONTROL, frame, frame_len + len);
+    }
+
+    // Starts the closing handshake: subscriptions still queued are dropped
+    // and the connection goes once the exchange echoes the close frame.
+    int send_close(uint16_t code) {
+        if (closing || !connected) return 0;
+        closing = true;
+        outbound.clear();
+        char frame[WS_MAX_HEADER + 2];
+        uint8_t mask[4];
+        ws_new_mask(mask);
+        return outbound.send(OUT_CONTROL, frame, ws_encode_close(frame, code, mask));
+    }
+
+    void on_close() {
+        LOG_INFO("Connection closed for `", symbol);
+        connected = false;
+    }
 };
 
 class MultiWebSocketManager {
@@ -52,13 +130,18 @@ private:
     int evfd = -1;
     struct epoll_event events[32]; // Increased for multiple connections
     std::unordered_map<int, std::unique_ptr<WebSocketConnection>> connections;
-    std::vector<std::string> symbols;
+    std::vector<SymbolId> symbols;
+    std::vector<int> stale_fds;     // dropped after the timers have run
     
     net::TLSContext* ctx = nullptr;
     net::ISocketClient* cli = nullptr;
+    MdBusWriter* bus = nullptr;
+    EndpointSelector endpoints{"stream.binance.com"};
+    uint64_t draining_until = 0;    // photon::now; 0 until shutdown
     
 public:
-    MultiWebSocketManager(const std::vector<std::string>& syms) : symbols(syms) {}
+    MultiWebSocketManager(const std::vector<std::string>& syms, MdBusWriter* bus = nullptr)
+        : symbols(symbol_table().intern(syms)), bus(bus) {}
     
     ~MultiWebSocketManager() {
         cleanup();
@@ -83,6 +166,11 @@ public:
         if (epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev) < 0) {
             LOG_ERRNO_RETURN(0, -1, "failed to add eventfd to epoll");
         }
+        // SIGINT and SIGTERM reach a vCPU blocked in epoll_wait this way
+        ev.data.fd = shutdown_coordinator().fd();
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) < 0) {
+            LOG_ERRNO_RETURN(0, -1, "failed to add shutdown eventfd to epoll");
+        }
         
         // Initialize TLS context
         ctx = net::new_tls_context(nullptr, nullptr, nullptr);
@@ -90,7 +178,7 @@ public:
             LOG_ERROR_RETURN(0, -1, "TLS context creation failed");
         }
         
-        cli = net::new_tls_client(ctx, net::new_iouring_tcp_client(), true);
+        cli = net::new_tls_client(ctx, new_profiled_client(net::new_iouring_tcp_client(), feed_socket_profile()), true);
         if (!cli) {
             LOG_ERROR_RETURN(0, -1, "TLS client creation failed");
         }
@@ -102,33 +190,8 @@ public:
         connections.clear();
         if (cli) { delete cli; cli = nullptr; }
         if (ctx) { delete ctx; ctx = nullptr; }
-        if (epfd >= 0) { epfd = -1; }
-        if (evfd >= 0) { evfd = -1; }
-    }
-    
-    net::IPAddr resolve_domain(const char* hostname) {
-        struct addrinfo hints = {};
-        struct addrinfo* result = nullptr;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = AI_ALL | AI_V4MAPPED;
-        hints.ai_family = AF_UNSPEC;
-
-        int ret = getaddrinfo(hostname, nullptr, &hints, &result);
-        if (ret != 0) {
-            LOG_ERROR("Failed to resolve `, error: `", hostname, gai_strerror(ret));
-            return net::IPAddr();
-        }
-
-        net::IPAddr addr;
-        for (auto* cur = result; cur != nullptr; cur = cur->ai_next) {
-            if (cur->ai_family == AF_INET) {
-                auto sock_addr = (struct sockaddr_in*)cur->ai_addr;
-                addr = net::IPAddr(sock_addr->sin_addr);
-                break;
-            }
-        }
-        freeaddrinfo(result);
-        return addr;
+        if (epfd >= 0) { ::close(epfd); epfd = -1; }
+        if (evfd >= 0) { ::close(evfd); evfd = -1; }
     }
     
     // Extract socket FD from TLS stream using ISocketBase interface
@@ -152,89 +215,88 @@ public:
         return fd;
     }
     
-    bool connect_websocket(const std::string& symbol) {
-        auto conn = std::make_unique<WebSocketConnection>(symbol);
+    bool connect_websocket(SymbolId id) {
+        auto conn = std::make_unique<WebSocketConnection>(id);
+        conn->bus = bus;
+        const char* symbol = conn->symbol;
         
-        // DNS resolution with retry
-        net::IPAddr addr;
-        for (int attempt = 0; attempt < 3; ++attempt) {
-            addr = resolve_domain("stream.binance.com");
-            if (!addr.undefined()) break;
-            LOG_WARN("DNS resolution failed for `, retry `", symbol.c_str(), attempt);
-            photon::thread_sleep(1);
-        }
-        
-        if (addr.undefined()) {
-            LOG_ERROR("Failed to resolve domain for `", symbol.c_str());
-            return false;
-        }
-        
-        // Connect
-        conn->tls = cli->connect(net::EndPoint{addr, 9443});
+        // Connect to the fastest address of the host
+        uint64_t connect_start = photon::update_now();
+        conn->tls = endpoints.connect(cli, &conn->endpoint);
         if (!conn->tls) {
-            LOG_ERROR("Failed to connect for `", symbol.c_str());
+            LOG_ERROR("Failed to connect for `", symbol);
             return false;
         }
+        conn->endpoints = &endpoints;
         
         // Get socket FD and add to epoll
         conn->sockfd = get_socket_fd(conn->tls);
         if (conn->sockfd < 0) {
-            LOG_ERROR("Failed to get socket fd for `", symbol.c_str());
+            LOG_ERROR("Failed to get socket fd for `", symbol);
             return false;
         }
         
-        LOG_INFO("Got socket fd ` for ` connection", conn->sockfd, symbol.c_str());
+        LOG_INFO("Got socket fd ` for ` connection", conn->sockfd, symbol);
         
         struct epoll_event ev;
         ev.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
         ev.data.fd = conn->sockfd;
         if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->sockfd, &ev) < 0) {
-            LOG_ERRNO_RETURN(0, false, "failed to add socket to epoll for `", symbol.c_str());
+            LOG_ERRNO_RETURN(0, false, "failed to add socket to epoll for `", symbol);
         }
         
-        // WebSocket handshake
-        const char* handshake = "GET /ws HTTP/1.1\r\n"
-                                "Host: stream.binance.com\r\n"
-                                "Upgrade: websocket\r\n"
-                                "Connection: Upgrade\r\n"
-                                "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
-                                "Sec-WebSocket-Version: 13\r\n"
-                                "\r\n";
-        
-        if (conn->tls->send(handshake, strlen(handshake)) < 0) {
-            LOG_ERROR("Failed to send handshake for `", symbol.c_str());
+        // WebSocket handshake; frames that arrive with the response stay
+        // in the receive buffer
+        conn->rx.reset(conn->sockfd, true);
+        size_t early = 0;
+        if (ws_client_handshake(conn->tls, "stream.binance.com", "/ws",
+                                conn->rx.write_ptr(), conn->rx.room(), &early) < 0) {
+            LOG_ERROR("WebSocket handshake failed for `", symbol);
             return false;
         }
+        conn->rx.commit(early);
+        uint64_t handshake_us = photon::update_now() - connect_start;
+        conn->stats.handshake_us->observe(handshake_us);
+        endpoints.on_handshake(conn->endpoint, handshake_us);
+        LOG_INFO("Handshake done for `", symbol);
+        // warns if the NIC hands this stream's packets to another node
+        check_feed_socket(dynamic_cast<net::ISocketBase*>(conn->tls));
         
-        // Receive handshake response
-        char buf[1024];
-        ssize_t n = conn->tls->recv(buf, sizeof(buf));
-        if (n <= 0) {
-            LOG_ERROR("Failed to receive handshake response for `", symbol.c_str());
-            return false;
-        }
-        buf[n] = '\0';
-        LOG_INFO("Handshake response for `: `", symbol.c_str(), buf);
-        
-        // Send subscription
-        std::string subscribe_msg = "{\"method\":\"SUBSCRIBE\",\"params\":[\"" + symbol + "@trade\"],\"id\":" + std::to_string(connections.size() + 1) + "}";
-        if (send_websocket_frame(conn->tls, subscribe_msg.c_str(), subscribe_msg.size()) < 0) {
-            LOG_ERROR("Failed to send subscription for `", symbol.c_str());
+        // Send subscription; the acknowledgement is matched by id
+        uint64_t req_id = conn->requests.next_id();
+        std::string subscribe_msg = "{\"method\":\"SUBSCRIBE\",\"params\":[\"" + std::string(symbol) + "@trade\"],\"id\":" + std::to_string(req_id) + "}";
+        conn->requests.expect(req_id, conn->requests.method("SUBSCRIBE"), 10 * 1000 * 1000,
+                              [symbol](int err, const char* resp, size_t len) {
+            if (!err) {
+                LOG_INFO("Subscribed to `", symbol);
+            } else {
+                LOG_ERROR("Subscription to ` failed: `", symbol,
+                          resp ? std::string(resp, len).c_str() : strerror(err));
+            }
+        });
+        if (send_websocket_frame(conn.get(), OUT_SUBSCRIPTION, subscribe_msg.c_str(), subscribe_msg.size()) < 0) {
+            LOG_ERROR("Failed to send subscription for `", symbol);
             return false;
         }
         
         conn->connected = true;
-        conn->last_activity = time(nullptr);
+        conn->established = true;
+        conn->stats.connects->add();
         
         // Store connection
         int sockfd = conn->sockfd;
+        conn->stale.set_callback([this, sockfd] {
+            LOG_WARN("No data on fd ` for ` s, dropping it", sockfd, STALE_FEED_US / 1000000);
+            stale_fds.push_back(sockfd);
+        });
+        conn->stale.start(STALE_FEED_US);
         connections[sockfd] = std::move(conn);
         
-        LOG_INFO("Successfully connected WebSocket for ` on fd `", symbol.c_str(), sockfd);
+        LOG_INFO("Successfully connected WebSocket for ` on fd `", symbol, sockfd);
         return true;
     }
     
-    ssize_t send_websocket_frame(net::ISocketStream* tls, const char* data, size_t len) {
+    int send_websocket_frame(WebSocketConnection* conn, OutboundClass cls, const char* data, size_t len) {
         char frame[4096];
         size_t frame_len = 0;
         frame[frame_len++] = 0x81; // Text frame, FIN bit set
@@ -252,201 +314,115 @@ public:
         }
         memcpy(frame + frame_len, data, len);
         frame_len += len;
-        return tls->send(frame, frame_len);
-    }
-    
-    ssize_t send_pong_frame(net::ISocketStream* tls, const char* data, size_t len) {
-        char frame[128];
-        size_t frame_len = 0;
-        frame[frame_len++] = 0x8A; // Pong opcode, FIN bit set
-        frame[frame_len++] = (char)len;
-        memcpy(frame + frame_len, data, len);
-        frame_len += len;
-        return tls->send(frame, frame_len);
-    }
-    
-    void process_websocket_frame(WebSocketConnection* conn, const std::string& payload, uint8_t opcode, bool fin) {
-        if (opcode == 0x1 || opcode == 0x2) { // Text or Binary frame
-            if (fin) {
-                if (opcode == 0x1) {
-                    std::cout << "[" << conn->symbol << "] < " << payload << std::endl;
-                }
-            } else {
-                conn->in_fragmented_message = true;
-                conn->fragmented_opcode = opcode;
-                conn->fragmented_message = payload;
-            }
-        } else if (opcode == 0x0) { // Continuation frame
-            if (conn->in_fragmented_message) {
-                conn->fragmented_message += payload;
-                if (fin) {
-                    if (conn->fragmented_opcode == 0x1) {
-                        std::cout << "[" << conn->symbol << "] < " << conn->fragmented_message << std::endl;
-                    }
-                    conn->in_fragmented_message = false;
-                    conn->fragmented_message.clear();
-                    conn->fragmented_opcode = 0;
-                }
-            }
-        } else if (opcode == 0x9) { // Ping frame
-            if (send_pong_frame(conn->tls, payload.c_str(), payload.size()) < 0) {
-                LOG_ERROR("Failed to send pong for `", conn->symbol.c_str());
-            } else {
-                LOG_DEBUG("Sent pong for `", conn->symbol.c_str());
-            }
-        } else if (opcode == 0xA) { // Pong frame
-            LOG_DEBUG("Received pong for `", conn->symbol.c_str());
-        } else if (opcode == 0x8) { // Close frame
-            LOG_INFO("Received close frame for `", conn->symbol.c_str());
-            conn->connected = false;
-        } else {
-            LOG_WARN("Unknown opcode ` for `", opcode, conn->symbol.c_str());
-        }
+        return conn->outbound.send(cls, frame, frame_len);
     }
     
+    // Reads whatever TLS records are ready and handles every complete frame
+    // in them before going back to epoll.
     void handle_socket_data(int sockfd) {
         auto it = connections.find(sockfd);
         if (it == connections.end()) return;
         
         auto& conn = it->second;
-        char temp_buf[4096];
-        ssize_t n = conn->tls->recv(temp_buf, sizeof(temp_buf));
+        auto before = conn->rx.stats();
+        ssize_t reads = ws_recv_frames(conn->tls, conn->rx, [&](const WsFrameHeader& h, const char* payload) {
+            conn->stats.frames[h.opcode]->add();
+            return conn->pipeline(h, payload);
+        });
         
-        if (n <= 0) {
-            LOG_ERROR("Connection error for `, removing", conn->symbol.c_str());
+        if (reads <= 0 || !conn->connected) {
+            if (reads <= 0) LOG_ERROR("Connection error for `, removing", conn->symbol);
             epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, nullptr);
             connections.erase(it);
             return;
         }
         
-        conn->last_activity = time(nullptr);
-        conn->recv_buffer.insert(conn->recv_buffer.end(), temp_buf, temp_buf + n);
-        
-        // Process complete frames
-        size_t processed = 0;
-        while (processed < conn->recv_buffer.size()) {
-            if (conn->recv_buffer.size() - processed < 2) break;
-
-            uint8_t first_byte = static_cast<uint8_t>(conn->recv_buffer[processed]);
-            uint8_t second_byte = static_cast<uint8_t>(conn->recv_buffer[processed + 1]);
-            
-            uint8_t fin = (first_byte & 0x80) >> 7;
-            uint8_t opcode = first_byte & 0x0F;
-            uint8_t mask = (second_byte & 0x80) >> 7;
-            uint64_t payload_len = second_byte & 0x7F;
-            size_t header_len = 2;
-
-            if (mask != 0) {
-                LOG_ERROR("Received masked frame from server for `", conn->symbol.c_str());
-                processed += header_len;
-                continue;
-            }
-
-            if (payload_len == 126) {
-                if (conn->recv_buffer.size() - processed < 4) break;
-                payload_len = (static_cast<uint64_t>(conn->recv_buffer[processed + 2]) << 8) | 
-                             static_cast<uint8_t>(conn->recv_buffer[processed + 3]);
-                header_len = 4;
-            } else if (payload_len == 127) {
-                if (conn->recv_buffer.size() - processed < 10) break;
-                payload_len = 0;
-                for (int i = 2; i < 10; ++i) {
-                    payload_len = (payload_len << 8) | static_cast<uint8_t>(conn->recv_buffer[processed + i]);
-                }
-                header_len = 10;
-            }
-
-            if (conn->recv_buffer.size() - processed < header_len + payload_len) {
-                break; // Wait for more data
-            }
-
-            std::string payload(conn->recv_buffer.begin() + processed + header_len, 
-                              conn->recv_buffer.begin() + processed + header_len + payload_len);
-
-            process_websocket_frame(conn.get(), payload, opcode, fin);
-            
-            if (!conn->connected) {
-                // Connection was closed
-                epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, nullptr);
-                connections.erase(it);
-                return;
-            }
-
-            processed += header_len + payload_len;
-        }
-
-        // Remove processed data
-        if (processed > 0) {
-            conn->recv_buffer.erase(conn->recv_buffer.begin(), conn->recv_buffer.begin() + processed);
-        }
-
-        // Prevent buffer overflow
-        if (conn->recv_buffer.size() > 16384) {
-            LOG_WARN("Buffer too large for `, clearing", conn->symbol.c_str());
-            conn->recv_buffer.clear();
-            conn->fragmented_message.clear();
-            conn->in_fragmented_message = false;
-            conn->fragmented_opcode = 0;
-        }
+        conn->stale.start(STALE_FEED_US);
+        auto& after = conn->rx.stats();
+        conn->stats.recvs->add(after.recvs - before.recvs);
+        conn->stats.bytes->add(after.bytes - before.bytes);
+        conn->stats.recv_buffer_hwm->set_max(conn->rx.size());
     }
     
+    // Gauges that change outside of the receive path
+    void sample_gauges() {
+        for (auto& it : connections) {
+            it.second->stats.outbound_queued->set(it.second->outbound.queued());
+            it.second->stats.recv_buffer_capacity->set(it.second->rx.capacity());
+        }
+    }
+
     void send_ping_to_all() {
         unsigned char ping_frame[] = {0x89, 0x00}; // Ping frame with no payload
         for (auto& [sockfd, conn] : connections) {
-            if (conn->connected) {
-                if (conn->tls->send((char*)ping_frame, sizeof(ping_frame)) < 0) {
-                    LOG_ERROR("Failed to send ping to `", conn->symbol.c_str());
+            if (conn->connected && !conn->closing) {
+                if (conn->outbound.send(OUT_CONTROL, (char*)ping_frame, sizeof(ping_frame)) < 0) {
+                    LOG_ERROR("Failed to send ping to `", conn->symbol);
                 }
             }
         }
     }
     
+    // Closes every connection with a close frame and keeps serving them
+    // until they are gone or CLOSE_WAIT_US has passed.
+    void start_drain() {
+        if (draining_until) return;
+        LOG_INFO("Shutting down, closing ` WebSocket streams", connections.size());
+        // both stay readable
+        epoll_ctl(epfd, EPOLL_CTL_DEL, evfd, nullptr);
+        epoll_ctl(epfd, EPOLL_CTL_DEL, shutdown_coordinator().fd(), nullptr);
+        for (auto& it : connections) {
+            if (it.second->send_close(WS_CLOSE_GOING_AWAY) < 0) {
+                LOG_ERROR("Failed to send close frame to `", it.second->symbol);
+            }
+        }
+        draining_until = photon::update_now() + CLOSE_WAIT_US;
+    }
+    
     void run() {
         // Connect to all symbols
-        for (const auto& symbol : symbols) {
-            if (!connect_websocket(symbol)) {
-                LOG_ERROR("Failed to connect to `", symbol.c_str());
+        for (SymbolId id : symbols) {
+            if (!connect_websocket(id)) {
+                LOG_ERROR("Failed to connect to `", symbol_table().name(id));
             }
             photon::thread_sleep(1); // Small delay between connections
         }
         
         LOG_INFO("Connected to ` WebSocket streams", connections.size());
         
-        time_t last_ping = time(nullptr);
+        // Pings, stale-feed checks and request timeouts all run on this
+        // vCPU's timer wheel, advanced below since epoll_wait blocks it
+        WheelTimer ping_timer([this] { send_ping_to_all(); });
+        ping_timer.start_periodic(PING_INTERVAL_US);
+        WheelTimer gauge_timer([this] { sample_gauges(); });
+        gauge_timer.start_periodic(GAUGE_INTERVAL_US);
         
         // Main event loop
         while (!connections.empty()) {
-            int nfds = epoll_wait(epfd, events, 32, 30000); // 30 second timeout
+            uint64_t tmo_us = timer_wheel().next_timeout_us();
+            int tmo_ms = tmo_us == -1UL ? -1 : (int)std::min<uint64_t>((tmo_us + 999) / 1000, 1000);
+            int nfds = epoll_wait(epfd, events, 32, tmo_ms);
             
             if (nfds < 0) {
                 if (errno == EINTR) continue;
                 LOG_ERRNO_RETURN(0, , "epoll_wait failed");
             }
             
-            if (nfds == 0) {
-                // Timeout - send ping to keep connections alive
-                LOG_DEBUG("Timeout, sending ping to all connections");
-                send_ping_to_all();
-                last_ping = time(nullptr);
-                continue;
-            }
-            
             // Process events
             for (int i = 0; i < nfds; i++) {
                 int fd = events[i].data.fd;
                 uint32_t ev = events[i].events;
                 
-                if (fd == evfd) {
-                    // Shutdown signal
-                    LOG_INFO("Shutdown signal received");
-                    return;
+                if (fd == evfd || fd == shutdown_coordinator().fd()) {
+                    start_drain();
+                    continue;
                 }
                 
                 if (ev & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
                     LOG_WARN("Connection error on fd `, removing", fd);
                     auto it = connections.find(fd);
                     if (it != connections.end()) {
-                        LOG_INFO("Removing connection for `", it->second->symbol.c_str());
+                        LOG_INFO("Removing connection for `", it->second->symbol);
                         connections.erase(it);
                     }
                     epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
@@ -458,17 +434,23 @@ public:
                 }
             }
             
-            // Send periodic pings
-            time_t now = time(nullptr);
-            if (now - last_ping > 120) { // Every 2 minutes
-                send_ping_to_all();
-                last_ping = now;
+            timer_wheel().advance(photon::update_now());
+            for (int fd : stale_fds) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                connections.erase(fd);
+            }
+            stale_fds.clear();
+            
+            if (draining_until && photon::now >= draining_until) {
+                LOG_WARN("` WebSocket streams did not close in time", connections.size());
+                return;
             }
         }
         
         LOG_INFO("All connections closed, exiting");
     }
     
+    // Thread-safe: the streams are closed from run().
     void shutdown() {
         eventfd_write(evfd, 1);
     }
@@ -480,7 +462,18 @@ void* multi_websocket_thread(void* arg) {
         "bnbusdt", "ltcusdt", "xrpusdt", "solusdt", "avaxusdt"
     };
     
-    MultiWebSocketManager manager(symbols);
+    // symbol_id on the bus is the SymbolId: interned in this order first,
+    // so it is also the index in this list
+    MdBusWriter bus;
+    if (bus.open((const char*)arg) < 0) {
+        LOG_ERROR("Failed to open market data bus");
+        return nullptr;
+    }
+
+    // however the feed ends, the process ends with it
+    DEFER(shutdown_coordinator().request("market data feed stopped"));
+
+    MultiWebSocketManager manager(symbols, &bus);
     if (manager.init() < 0) {
         LOG_ERROR("Failed to initialize WebSocket manager");
         return nullptr;
@@ -490,16 +483,72 @@ void* multi_websocket_thread(void* arg) {
     return nullptr;
 }
 
+// Registers metrics the way a bug would (one name with two types) and
+// updates them next to a real counter, which must keep its own count.
+// Prints one JSON line; returns the number of failed checks.
+static int check_metrics() {
+    set_log_output_level(ALOG_FATAL);   // the type clash is logged
+    auto& r = metrics();
+    auto real = r.counter("check_real_total", "Counted once per update");
+    auto orphan = r.histogram("check_real_total", "Same name, another type");
+    auto later = r.counter("check_later_total", "Registered after the orphan");
+    int failures = 0;
+    for (int i = 0; i < 1000; i++) {
+        real->add();
+        orphan->observe(1ULL << (i % 40));
+    }
+    later->add(7);
+    if (r.value(real) != 1000) failures++;
+    if (r.value(later) != 7) failures++;
+    if (r.render().find("check_real_total 1000\n") == std::string::npos) failures++;
+    printf("{\"real\":%lu,\"later\":%lu,\"failures\":%d}\n", r.value(real), r.value(later), failures);
+    return failures;
+}
+
 int main(int argc, char** argv) {
+    // Usage: client_tls_1_thread_multiple_socket --metrics-check, offline
+    if (argc > 1 && strcmp(argv[1], "--metrics-check") == 0) return check_metrics() ? 1 : 0;
+
+    // Usage: client_tls_1_thread_multiple_socket [bus_name [metrics_port [iface]]]
+    // metrics_port 0 turns the scrape endpoint off; with iface, the feed
+    // vCPU (this thread) is placed on a CPU of that NIC's node
+    const char* bus_name = argc > 1 ? argv[1] : "/md-bus";
+    uint16_t metrics_port = argc > 2 ? atoi(argv[2]) : DEFAULT_METRICS_PORT;
+    // started first, so that its thread is not pinned along with this one
+    MetricsServer metrics_server;
+    if (metrics_port && metrics_server.start(metrics_port) < 0) return -1;
+    if (argc > 3) {
+        auto cpus = CpuTopology::instance().pick(1, nic_numa_node(argv[3]));
+        if (cpus.empty() || place_vcpu(cpus[0]) < 0) return -1;
+    }
+
     if (photon::init(INIT_EVENT_IOURING, INIT_IO_NONE)) {
         LOG_ERROR_RETURN(0, -1, "Photon init failed");
     }
     DEFER(photon::fini());
 
-    photon::thread_create(&multi_websocket_thread, nullptr);
+    // Received messages go to the binary log named by BINLOG_FILE, if any
+    if (binlog_start_from_env() < 0) return -1;
+    DEFER(binlog_stop());
 
-    while (true) {
-        photon::thread_usleep(1000 * 1000);
-    }
-    return 0;
+    // SIGINT or SIGTERM: the feed closes its streams, then the metrics
+    // endpoint goes and the binary log is written out
+    auto& coordinator = shutdown_coordinator();
+    coordinator.install_signals();
+    auto feed = photon::thread_create(&multi_websocket_thread, (void*)bus_name);
+    auto feed_jh = photon::thread_enable_join(feed);
+    coordinator.add(SHUTDOWN_SESSIONS, "market data feed", [feed, feed_jh](photon::Timeout tmo) {
+        return shutdown_join(feed, feed_jh, tmo);
+    });
+    coordinator.add(SHUTDOWN_STOP_INPUT, "metrics server", [&metrics_server](photon::Timeout) {
+        metrics_server.stop();
+        return 0;
+    });
+    coordinator.add(SHUTDOWN_FLUSH, "binary log", [](photon::Timeout) {
+        binlog_stop();
+        return 0;
+    });
+
+    coordinator.wait();
+    return coordinator.drain(DRAIN_US) ? 1 : 0;
 }
\ No newline at end of file
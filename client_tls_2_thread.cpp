@@ -15,8 +15,21 @@ Licensed under the Apache License, Version 2.0
 #include <photon/net/socket.h>
 #include <photon/net/security-context/tls-stream.h>
 
+#include "adaptive-recv.h"
+#include "binlog.h"
+#include "registered-io.h"
+#include "shutdown.h"
+#include "socket-profile.h"
+#include "symbol-table.h"
+#include "ws-correlation.h"
+
 using namespace photon;
 
+// On shutdown, how long the exchange has to answer our close frame, and how
+// long everything together may take
+static const uint64_t CLOSE_WAIT_US = 2ULL * 1000 * 1000;
+static const uint64_t DRAIN_US = 5ULL * 1000 * 1000;
+
 // Convert IPAddr to string for logging
 std::string ipaddr_to_string(const net::IPAddr& addr) {
     if (addr.is_ipv4()) {
@@ -92,8 +105,13 @@ ssize_t send_websocket_frame(net::ISocketStream* tls, const char* data, size_t l
 }
 
 void* websocket_handler(void* arg) {
-    std::string symbol = static_cast<const char*>(arg);
-    std::string subscribe_msg = "{\"method\":\"SUBSCRIBE\",\"params\":[\"" + symbol + "@trade\"],\"id\":" + (symbol == "btcusdt" ? "1" : "2") + "}";
+    SymbolId symbol_id = (SymbolId)(uintptr_t)arg;
+    const char* symbol = symbol_table().lower(symbol_id);
+
+    // Requests on this connection, matched to their responses by id
+    WsCorrelator requests(16);
+    uint64_t subscribe_id = requests.next_id();
+    std::string subscribe_msg = "{\"method\":\"SUBSCRIBE\",\"params\":[\"" + std::string(symbol) + "@trade\"],\"id\":" + std::to_string(subscribe_id) + "}";
 
     auto ctx = net::new_tls_context(nullptr, nullptr, nullptr);
     if (!ctx) {
@@ -101,7 +119,9 @@ void* websocket_handler(void* arg) {
     }
     DEFER(delete ctx);
 
-    auto cli = net::new_tls_client(ctx, net::new_iouring_tcp_client(), true);
+    // TLS reads are fed by multishot recv on this vCPU's provided buffer ring,
+    // and the long-lived socket is put in the ring's registered file table
+    auto cli = net::new_tls_client(ctx, new_profiled_client(new_registered_tcp_client(), feed_socket_profile()), true);
     DEFER(delete cli);
 
     net::ISocketStream* tls = nullptr;
@@ -109,171 +129,133 @@ void* websocket_handler(void* arg) {
     for (int attempt = 0; attempt < 3; ++attempt) {
         addr = resolve_domain("stream.binance.com"); // Use getaddrinfo instead of Photon
         if (addr.undefined()) {
-            LOG_WARN("DNS resolution failed for `", symbol.c_str());
+            LOG_WARN("DNS resolution failed for `", symbol);
             photon::thread_sleep(1);
             continue;
         }
-        LOG_INFO("Resolved stream.binance.com to ` for `", ipaddr_to_string(addr).c_str(), symbol.c_str());
+        LOG_INFO("Resolved stream.binance.com to ` for `", ipaddr_to_string(addr).c_str(), symbol);
         tls = cli->connect(net::EndPoint{addr, 9443});
         if (tls) break;
-        LOG_ERROR("Failed to connect for `, retrying, errno=`", symbol.c_str(), errno);
+        LOG_ERROR("Failed to connect for `, retrying, errno=`", symbol, errno);
         photon::thread_sleep(1);
     }
     if (!tls) {
-        LOG_ERROR("Failed to connect for ` after retries, errno=`", symbol.c_str(), errno);
+        LOG_ERROR("Failed to connect for ` after retries, errno=`", symbol, errno);
         return nullptr;
     }
     DEFER(delete tls);
 
-    const char* handshake = "GET /ws HTTP/1.1\r\n"
-                            "Host: stream.binance.com\r\n"
-                            "Upgrade: websocket\r\n"
-                            "Connection: Upgrade\r\n"
-                            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
-                            "Sec-WebSocket-Version: 13\r\n"
-                            "\r\n";
-    if (tls->send(handshake, strlen(handshake)) < 0) {
-        LOG_ERROR_RETURN(0, nullptr, "Failed to send WebSocket handshake for `", symbol.c_str());
-    }
-
-    char buf[1024]; // Increased buffer size
-    ssize_t n = tls->recv(buf, sizeof(buf));
-    if (n <= 0) {
-        LOG_ERROR_RETURN(0, nullptr, "Failed to receive handshake response for `", symbol.c_str());
+    // The socket lives in the ring's registered file table, so there is no
+    // fd to look at for read-ahead: reads are still sized for whole records
+    // and every frame of a read is handled before the next one.
+    AdaptiveRecvBuffer rx(-1, true);
+    size_t early = 0;
+    if (ws_client_handshake(tls, "stream.binance.com", "/ws", rx.write_ptr(), rx.room(), &early) < 0) {
+        LOG_ERROR_RETURN(0, nullptr, "WebSocket handshake failed for `", symbol);
     }
-    buf[n] = '\0';
-    LOG_INFO("Handshake response for `: `", symbol.c_str(), buf);
-
+    rx.commit(early);
+    LOG_INFO("Handshake done for `", symbol);
+
+    requests.expect(subscribe_id, requests.method("SUBSCRIBE"), 10 * 1000 * 1000,
+                    [&](int err, const char* resp, size_t len) {
+        if (!err) {
+            LOG_INFO("Subscribed to `", symbol);
+        } else {
+            LOG_ERROR("Subscription to ` failed: `", symbol,
+                      resp ? std::string(resp, len).c_str() : strerror(err));
+        }
+    });
     if (send_websocket_frame(tls, subscribe_msg.c_str(), subscribe_msg.size()) < 0) {
-        LOG_ERROR_RETURN(0, nullptr, "Failed to send subscription for `", symbol.c_str());
+        LOG_ERROR_RETURN(0, nullptr, "Failed to send subscription for `", symbol);
     }
 
-    // Buffer for accumulating data
-    std::vector<char> recv_buffer;
-    recv_buffer.reserve(8192);
-    
     // Fragment reassembly state
     std::string fragmented_message;
     bool in_fragmented_message = false;
     uint8_t fragmented_opcode = 0;
 
-    while (true) {
-        char temp_buf[4096];
-        n = tls->recv(temp_buf, sizeof(temp_buf));
-        if (n <= 0) {
-            LOG_ERROR("Connection closed or error for `, errno=`", symbol.c_str(), errno);
-            break;
+    bool open = true;
+    auto on_frame = [&](const WsFrameHeader& h, const char* payload) {
+        uint8_t opcode = h.opcode;
+        size_t len = h.payload_len;
+        if (h.masked) {
+            LOG_ERROR("Received masked frame from server for `, which is invalid", symbol);
+            return open = false;
         }
-        
-        // Append new data to buffer
-        recv_buffer.insert(recv_buffer.end(), temp_buf, temp_buf + n);
-
-        // Process complete frames
-        size_t processed = 0;
-        while (processed < recv_buffer.size()) {
-            // Need at least 2 bytes for the header
-            if (recv_buffer.size() - processed < 2) break;
-
-            // Decode WebSocket frame header
-            uint8_t first_byte = static_cast<uint8_t>(recv_buffer[processed]);
-            uint8_t second_byte = static_cast<uint8_t>(recv_buffer[processed + 1]);
-            
-            uint8_t fin = (first_byte & 0x80) >> 7;
-            uint8_t opcode = first_byte & 0x0F;
-            uint8_t mask = (second_byte & 0x80) >> 7;
-            uint64_t payload_len = second_byte & 0x7F;
-            size_t header_len = 2;
-
-            // Validate mask bit (should be 0 for server-to-client messages)
-            if (mask != 0) {
-                LOG_ERROR("Received masked frame from server for `, which is invalid", symbol.c_str());
-                processed += header_len;
-                continue;
-            }
-
-            // Calculate payload length and header length
-            if (payload_len == 126) {
-                if (recv_buffer.size() - processed < 4) break;
-                payload_len = (static_cast<uint64_t>(recv_buffer[processed + 2]) << 8) | 
-                             static_cast<uint8_t>(recv_buffer[processed + 3]);
-                header_len = 4;
-            } else if (payload_len == 127) {
-                if (recv_buffer.size() - processed < 10) break;
-                payload_len = 0;
-                for (int i = 2; i < 10; ++i) {
-                    payload_len = (payload_len << 8) | static_cast<uint8_t>(recv_buffer[processed + i]);
+        LOG_DEBUG("Frame: opcode=`, fin=`, payload_len=`", opcode, h.fin, len);
+
+        // Process the frame based on opcode and fragmentation
+        if (opcode == 0x1 || opcode == 0x2) { // Text or Binary frame (start of message)
+            if (h.fin) {
+                // Complete message in single frame
+                if (opcode == 0x1 && !requests.on_message(payload, len)) { // Text frame
+                    BLOG_INFO("[`] < `", symbol, blog_str(payload, len));
                 }
-                header_len = 10;
-            }
-
-            // Check if we have the full frame
-            if (recv_buffer.size() - processed < header_len + payload_len) {
-                break; // Wait for more data
+            } else {
+                // Start of fragmented message
+                in_fragmented_message = true;
+                fragmented_opcode = opcode;
+                fragmented_message.assign(payload, len);
             }
-
-            // Extract the payload
-            std::string payload(recv_buffer.begin() + processed + header_len, 
-                              recv_buffer.begin() + processed + header_len + payload_len);
-
-            LOG_DEBUG("Frame: opcode=`, fin=`, payload_len=`", opcode, fin, payload_len);
-
-            // Process the frame based on opcode and fragmentation
-            if (opcode == 0x1 || opcode == 0x2) { // Text or Binary frame (start of message)
-                if (fin) {
-                    // Complete message in single frame
-                    if (opcode == 0x1) { // Text frame
-                        std::cout << "< " << payload << std::endl;
+        } else if (opcode == 0x0) { // Continuation frame
+            if (in_fragmented_message) {
+                fragmented_message.append(payload, len);
+                if (h.fin) {
+                    // End of fragmented message
+                    if (fragmented_opcode == 0x1 && // Text message
+                            !requests.on_message(fragmented_message.data(), fragmented_message.size())) {
+                        BLOG_INFO("[`] < `", symbol, fragmented_message);
                     }
-                } else {
-                    // Start of fragmented message
-                    in_fragmented_message = true;
-                    fragmented_opcode = opcode;
-                    fragmented_message = payload;
-                }
-            } else if (opcode == 0x0) { // Continuation frame
-                if (in_fragmented_message) {
-                    fragmented_message += payload;
-                    if (fin) {
-                        // End of fragmented message
-                        if (fragmented_opcode == 0x1) { // Text message
-                            std::cout << "< " << fragmented_message << std::endl;
-                        }
-                        in_fragmented_message = false;
-                        fragmented_message.clear();
-                        fragmented_opcode = 0;
-                    }
-                }
-            } else if (opcode == 0x9) { // Ping frame
-                if (send_pong_frame(tls, payload.c_str(), payload.size()) < 0) {
-                    LOG_ERROR("Failed to send pong for `", symbol.c_str());
-                    break;
+                    in_fragmented_message = false;
+                    fragmented_message.clear();
+                    fragmented_opcode = 0;
                 }
-                LOG_INFO("Sent pong for `", symbol.c_str());
-            } else if (opcode == 0xA) { // Pong frame
-                LOG_INFO("Received pong for `", symbol.c_str());
-            } else if (opcode == 0x8) { // Close frame
-                LOG_INFO("Received close frame for `", symbol.c_str());
-                break;
-            } else {
-                LOG_WARN("Unknown opcode ` for `, payload_len=`", opcode, symbol.c_str(), payload_len);
             }
-
-            // Move to the next frame
-            processed += header_len + payload_len;
+        } else if (opcode == 0x9) { // Ping frame
+            if (send_pong_frame(tls, payload, len) < 0) {
+                LOG_ERROR("Failed to send pong for `", symbol);
+                return open = false;
+            }
+            LOG_INFO("Sent pong for `", symbol);
+        } else if (opcode == 0xA) { // Pong frame
+            LOG_INFO("Received pong for `", symbol);
+        } else if (opcode == 0x8) { // Close frame
+            LOG_INFO("Received close frame for `", symbol);
+            return open = false;
+        } else {
+            LOG_WARN("Unknown opcode ` for `, payload_len=`", opcode, symbol, len);
         }
-
-        // Remove processed data from buffer
-        if (processed > 0) {
-            recv_buffer.erase(recv_buffer.begin(), recv_buffer.begin() + processed);
+        return true;
+    };
+
+    // On shutdown a close frame goes out; the loop below ends when the
+    // exchange echoes it, or when the socket is shut down after CLOSE_WAIT_US
+    bool closer_done = false;
+    auto closer = photon::thread_create11([&] {
+        DEFER(closer_done = true);
+        if (shutdown_coordinator().wait() < 0) return;    // the connection ended first
+        char frame[WS_MAX_HEADER + 2];
+        uint8_t mask[4];
+        ws_new_mask(mask);
+        if (tls->send(frame, ws_encode_close(frame, WS_CLOSE_GOING_AWAY, mask)) < 0) {
+            LOG_ERROR("Failed to send close frame for `", symbol);
+        } else if (photon::thread_usleep(CLOSE_WAIT_US) < 0) {
+            return;
+        } else {
+            LOG_WARN("No close frame back for `", symbol);
         }
-
-        // Prevent buffer from growing too large
-        if (recv_buffer.size() > 16384) {
-            LOG_WARN("Buffer too large, clearing for `", symbol.c_str());
-            recv_buffer.clear();
-            fragmented_message.clear();
-            in_fragmented_message = false;
-            fragmented_opcode = 0;
+        tls->shutdown(net::ShutdownHow::ReadWrite);
+    });
+    auto closer_jh = photon::thread_enable_join(closer);
+    DEFER({
+        if (!closer_done) photon::thread_interrupt(closer);
+        photon::thread_join(closer_jh);
+    });
+
+    while (open) {
+        if (ws_recv_frames(tls, rx, on_frame) <= 0) {
+            LOG_ERROR("Connection closed or error for `, errno=`", symbol, errno);
+            break;
         }
     }
 
@@ -285,13 +267,38 @@ int main(int argc, char** argv) {
         LOG_ERROR_RETURN(0, -1, "Photon init failed");
     }
     DEFER(photon::fini());
+    DEFER(release_vcpu_buffer_pool());
 
-    photon::thread_create(&websocket_handler, const_cast<char*>("ethusdt"));
-    photon::thread_create(&websocket_handler, const_cast<char*>("btcusdt"));
+    // This vCPU only runs feed connections: spin instead of sleeping.
+    // Usage: client_tls_2_thread [--low-latency [sqpoll_cpu]]
+    if (argc > 1 && strcmp(argv[1], "--low-latency") == 0) {
+        set_vcpu_low_latency(feed_low_latency_profile(argc > 2 ? atoi(argv[2]) : -1));
+    }
 
-    while (true) {
-        photon::thread_usleep(1000 * 1000);
+    // Received messages go to the binary log named by BINLOG_FILE, if any
+    if (binlog_start_from_env() < 0) return -1;
+    DEFER(binlog_stop());
+
+    // Request timeouts of both connections fire from this vCPU's wheel
+    timer_wheel().start();
+    DEFER(timer_wheel().stop());
+
+    // one connection per symbol, handed its SymbolId; on SIGINT or SIGTERM
+    // they close, then the binary log is written out
+    auto& coordinator = shutdown_coordinator();
+    coordinator.install_signals();
+    for (SymbolId id : symbol_table().intern(std::vector<std::string>{"ethusdt", "btcusdt"})) {
+        auto th = photon::thread_create(&websocket_handler, (void*)(uintptr_t)id);
+        auto jh = photon::thread_enable_join(th);
+        coordinator.add(SHUTDOWN_SESSIONS, symbol_table().lower(id), [th, jh](photon::Timeout tmo) {
+            return shutdown_join(th, jh, tmo);
+        });
     }
+    coordinator.add(SHUTDOWN_FLUSH, "binary log", [](photon::Timeout) {
+        binlog_stop();
+        return 0;
+    });
 
-    return 0;
+    coordinator.wait();
+    return coordinator.drain(DRAIN_US) ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,300 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Chooses among the addresses of an exchange host by measured latency.
+//
+// A cloud exchange resolves to several IPs whose paths can differ by
+// milliseconds. The selector keeps every address of the host (resolve(),
+// again every resolve_interval_us) and, per address, smoothed values of:
+//
+//   connect_us     what ISocketClient::connect() took: the TCP handshake,
+//                  plus the TLS one for a TLS client
+//   handshake_us   connect to the end of the application handshake (the
+//                  WebSocket upgrade), reported with on_handshake()
+//   latency_us     local wall clock minus the exchange's event time of
+//                  messages, reported with on_message(); the clock offset
+//                  is the same for every address, so only the differences
+//                  between addresses mean anything
+//
+// Addresses are ranked by latency_us once every one in rotation has it,
+// by handshake_us or connect_us until then. connect() takes an address that
+// has not been measured yet if there is one, so each gets sampled, and
+// otherwise the least loaded of those within `margin_us` of the fastest.
+// Every rebalance_interval_us the addresses slower than the fastest by
+// both demote_ratio and margin_us, or failing to connect max_failures
+// times in a row, are demoted: left out for demote_us, then measured
+// afresh in case their path got better.
+//
+// Addresses are referred to by index, which stays valid for the life of
+// the selector (addresses that stop resolving are only marked gone). A
+// selector belongs to one vCPU, like the connections it hands out.
+#pragma once
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+#include <photon/net/socket.h>
+
+struct EndpointSelectorOptions {
+    uint16_t port = 9443;
+    uint64_t resolve_interval_us = 300ULL * 1000 * 1000;
+    uint64_t rebalance_interval_us = 10ULL * 1000 * 1000;
+    uint64_t margin_us = 500;           // differences smaller than this are noise
+    double demote_ratio = 1.5;          // of the fastest address's value
+    uint64_t demote_us = 300ULL * 1000 * 1000;
+    int max_failures = 3;               // connects in a row, then demoted
+    int max_attempts = 3;               // addresses tried per connect()
+};
+
+class EndpointSelector {
+public:
+    struct Endpoint {
+        photon::net::EndPoint ep;
+        int64_t connect_us = 0;         // smoothed; 0 until measured
+        int64_t handshake_us = 0;
+        int64_t latency_us = 0;
+        uint64_t samples = 0;           // of latency_us
+        uint64_t connects = 0;
+        uint64_t failures = 0;
+        int failed_in_row = 0;
+        int active = 0;                 // connections open
+        bool measured = false;          // connected since added or demoted
+        uint64_t demoted_until = 0;     // photon::now
+        bool gone = false;              // no longer resolved
+    };
+
+    // `host` is resolved by resolve(); without one, add() the addresses.
+    explicit EndpointSelector(const char* host = "", const EndpointSelectorOptions& opts = {})
+        : m_host(host), m_opts(opts) {}
+
+    // Resolves the host, adding new IPv4 addresses and marking the ones no
+    // longer returned as gone. Blocks the vCPU in getaddrinfo().
+    int resolve() {
+        struct addrinfo hints = {};
+        struct addrinfo* res = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int ret = getaddrinfo(m_host.c_str(), nullptr, &hints, &res);
+        if (ret != 0) LOG_ERROR_RETURN(0, -1, "failed to resolve `: `", m_host.c_str(), gai_strerror(ret));
+        for (auto& e : m_endpoints) e.gone = true;
+        for (auto* ai = res; ai; ai = ai->ai_next) {
+            photon::net::IPAddr ip(((struct sockaddr_in*)ai->ai_addr)->sin_addr);
+            add(photon::net::EndPoint(ip, m_opts.port));
+        }
+        freeaddrinfo(res);
+        m_resolved = photon::now;
+        LOG_DEBUG("` resolved to ` of ` known addresses", m_host.c_str(), in_rotation(), m_endpoints.size());
+        return 0;
+    }
+
+    // Adds an address (or brings a gone one back). Returns its index.
+    int add(photon::net::EndPoint ep) {
+        for (size_t i = 0; i < m_endpoints.size(); i++) {
+            if (m_endpoints[i].ep == ep) {
+                m_endpoints[i].gone = false;
+                return i;
+            }
+        }
+        m_endpoints.emplace_back();
+        m_endpoints.back().ep = ep;
+        LOG_INFO("address ` added for `", ep, m_host.c_str());
+        return m_endpoints.size() - 1;
+    }
+
+    // The address a new connection should use, -1 if there is none.
+    int pick() { return pick({}); }
+
+    // Connects through `cli` to the best address, trying the next best on
+    // failure. The index of the address used goes to *index; report
+    // on_close() with it when the connection is gone.
+    photon::net::ISocketStream* connect(photon::net::ISocketClient* cli, int* index) {
+        std::vector<bool> tried;
+        for (int attempt = 0; attempt < m_opts.max_attempts; attempt++) {
+            int i = pick(tried);
+            if (i < 0) break;
+            auto& e = m_endpoints[i];
+            uint64_t t0 = photon::update_now();
+            auto s = cli->connect(e.ep);
+            if (!s) {
+                LOG_WARN("failed to connect to ` (`)", e.ep, m_host.c_str());
+                on_failure(i);
+                tried.resize(m_endpoints.size());
+                tried[i] = true;
+                continue;
+            }
+            smooth(e.connect_us, photon::update_now() - t0);
+            e.connects++;
+            e.measured = true;
+            e.failed_in_row = 0;
+            e.active++;
+            *index = i;
+            return s;
+        }
+        LOG_ERROR_RETURN(0, nullptr, "no address of ` could be connected", m_host.c_str());
+    }
+
+    // The application handshake on a connection from connect() finished,
+    // `us` after the connect started.
+    void on_handshake(int i, uint64_t us) { smooth(m_endpoints[i].handshake_us, us); }
+
+    // A message stamped `exchange_ts_ns` (wall clock) arrived over address i.
+    void on_message(int i, uint64_t exchange_ts_ns) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        int64_t us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 - (int64_t)(exchange_ts_ns / 1000);
+        auto& e = m_endpoints[i];
+        smooth(e.latency_us, us, e.samples++ == 0);
+    }
+
+    void on_failure(int i) {
+        auto& e = m_endpoints[i];
+        e.failures++;
+        // one that never connected is not given more tries
+        if (++e.failed_in_row >= m_opts.max_failures || !e.measured) demote(e, "failing");
+    }
+
+    void on_close(int i) { m_endpoints[i].active--; }
+
+    // Demotes the addresses that are far slower than the fastest one and
+    // brings back those demoted long enough.
+    void rebalance() {
+        m_rebalanced = photon::now;
+        bool by_latency = ranked_by_latency();
+        int64_t best_v = 0;
+        bool have_best = false;
+        for (auto& e : m_endpoints) {
+            if (e.demoted_until && photon::now >= e.demoted_until) {
+                // measured afresh from the next connect
+                LOG_INFO("` address ` back in rotation", m_host.c_str(), e.ep);
+                e.demoted_until = 0;
+                e.measured = false;
+                e.connect_us = e.handshake_us = e.latency_us = 0;
+                e.samples = 0;
+                e.failed_in_row = 0;
+            }
+            if (!usable(e) || !e.measured) continue;
+            int64_t v = value(e, by_latency);
+            if (!have_best || v < best_v) best_v = v;
+            have_best = true;
+        }
+        if (!have_best) return;
+        // latencies can be negative by the clock offset, then only the
+        // margin applies
+        int64_t slack = std::max<int64_t>(m_opts.margin_us, std::max<int64_t>(best_v, 0) * (m_opts.demote_ratio - 1));
+        for (auto& e : m_endpoints) {
+            if (usable(e) && e.measured && value(e, by_latency) - best_v > slack)
+                demote(e, by_latency ? "slow messages" : "slow connects");
+        }
+    }
+
+    const std::vector<Endpoint>& endpoints() const { return m_endpoints; }
+
+    // Addresses that are resolved and not demoted.
+    size_t in_rotation() const {
+        size_t n = 0;
+        for (auto& e : m_endpoints) n += usable(e);
+        return n;
+    }
+
+private:
+    // pick() without the addresses in `tried`.
+    int pick(const std::vector<bool>& tried) {
+        if (!m_host.empty() && (m_endpoints.empty() || photon::now - m_resolved > m_opts.resolve_interval_us))
+            resolve();
+        if (photon::now - m_rebalanced > m_opts.rebalance_interval_us) rebalance();
+        int best = -1;
+        int64_t best_v = 0;
+        bool by_latency = ranked_by_latency();
+        for (size_t i = 0; i < m_endpoints.size(); i++) {
+            auto& e = m_endpoints[i];
+            if (!usable(e) || (i < tried.size() && tried[i])) continue;
+            if (!e.measured) {
+                if (!e.failed_in_row) return i;
+                continue;
+            }
+            int64_t v = value(e, by_latency);
+            if (best < 0 || v < best_v) {
+                best = i;
+                best_v = v;
+            }
+        }
+        if (best < 0) return fallback(tried);
+        // spread connections over the addresses about as fast as the best
+        for (size_t i = 0; i < m_endpoints.size(); i++) {
+            auto& e = m_endpoints[i];
+            if (usable(e) && !(i < tried.size() && tried[i]) && value(e, by_latency) <= best_v + (int64_t)m_opts.margin_us &&
+                    e.active < m_endpoints[best].active)
+                best = i;
+        }
+        return best;
+    }
+
+    bool usable(const Endpoint& e) const { return !e.gone && !e.demoted_until; }
+
+    bool ranked_by_latency() const {
+        bool any = false;
+        for (auto& e : m_endpoints) {
+            if (!usable(e) || !e.measured) continue;
+            if (!e.samples) return false;
+            any = true;
+        }
+        return any;
+    }
+
+    static int64_t value(const Endpoint& e, bool by_latency) {
+        if (by_latency) return e.latency_us;
+        return e.handshake_us ? e.handshake_us : e.connect_us;
+    }
+
+    void demote(Endpoint& e, const char* why) {
+        e.demoted_until = photon::now + m_opts.demote_us;
+        LOG_WARN("demoting ` address ` (`): connect ` us, handshake ` us, latency ` us", m_host.c_str(), e.ep,
+                 why, e.connect_us, e.handshake_us, e.latency_us);
+    }
+
+    // With every address demoted or gone: the one due back first.
+    int fallback(const std::vector<bool>& tried) const {
+        int best = -1;
+        for (size_t i = 0; i < m_endpoints.size(); i++) {
+            auto& e = m_endpoints[i];
+            if (e.gone || (i < tried.size() && tried[i])) continue;
+            if (best < 0 || e.demoted_until < m_endpoints[best].demoted_until) best = i;
+        }
+        return best;
+    }
+
+    // Moving average over about the last 8 samples, as TCP's SRTT.
+    static void smooth(int64_t& avg, int64_t sample, bool first = false) {
+        if (first || !avg) {
+            avg = sample;
+        } else {
+            avg += (sample - avg) / 8;
+        }
+    }
+
+    std::string m_host;
+    EndpointSelectorOptions m_opts;
+    std::vector<Endpoint> m_endpoints;
+    uint64_t m_resolved = 0;
+    uint64_t m_rebalanced = 0;
+};
@@ -0,0 +1,200 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Endpoint selection against loopback servers with artificial delays.
+//
+// One server per entry of --delays-us listens on 127.0.0.1 from --port up,
+// standing in for the addresses of one exchange host. A server answers the
+// client's hello after twice its delay (a round trip) and then streams
+// --messages timestamps backdated by its delay (the one-way path), 1 ms
+// apart. --workers coroutines open --connections sessions in all through
+// an EndpointSelector and feed it what they measure; a JSON line reports
+// how the sessions spread and what the selector measured per server.
+//
+//   endpoint_bench --delays-us=300,2000,5000,800 --connections=400
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/thread/thread11.h>
+#include <photon/net/socket.h>
+
+#include "endpoint-selector.h"
+
+using namespace photon;
+
+struct Options {
+    std::vector<uint64_t> delays_us{300, 2000, 5000, 800};
+    int connections = 400;
+    int workers = 8;
+    int messages = 20;
+    uint16_t port = 18300;
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"delays-us", required_argument, 0, 'd'},
+        {"connections", required_argument, 0, 'c'},
+        {"workers", required_argument, 0, 'w'},
+        {"messages", required_argument, 0, 'm'},
+        {"port", required_argument, 0, 'p'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "d:c:w:m:p:", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'd':
+                opts.delays_us.clear();
+                for (char* p = optarg; *p;) {
+                    opts.delays_us.push_back(strtoull(p, &p, 10));
+                    if (*p == ',') p++;
+                    else if (*p) break;
+                }
+                break;
+            case 'c': opts.connections = std::max(1, atoi(optarg)); break;
+            case 'w': opts.workers = std::max(1, atoi(optarg)); break;
+            case 'm': opts.messages = std::max(1, atoi(optarg)); break;
+            case 'p': opts.port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [--delays-us=N,N,...] [--connections=N] [--workers=N] "
+                        "[--messages=N] [--port=N]\n", argv[0]);
+                return -1;
+        }
+    }
+    if (opts.delays_us.empty()) {
+        fprintf(stderr, "--delays-us needs at least one delay\n");
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t wall_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// One address of the stub exchange.
+static int serve(net::ISocketStream* s, uint64_t delay_us) {
+    char hello;
+    if (s->read(&hello, 1) != 1) return 0;
+    photon::thread_usleep(2 * delay_us);
+    if (s->write(&hello, 1) != 1) return 0;
+    for (int i = 0; i < opts.messages; i++) {
+        uint64_t ts = wall_ns() - delay_us * 1000;
+        if (s->write(&ts, sizeof(ts)) != sizeof(ts)) return 0;
+        photon::thread_usleep(1000);
+    }
+    // until the client hangs up
+    s->read(&hello, 1);
+    return 0;
+}
+
+// One session: connect, hello, the messages.
+static int session(EndpointSelector& sel, net::ISocketClient* cli) {
+    int i;
+    uint64_t t0 = photon::update_now();
+    auto s = sel.connect(cli, &i);
+    if (!s) return -1;
+    DEFER(delete s);
+    DEFER(sel.on_close(i));
+    char hello = 'h';
+    if (s->write(&hello, 1) != 1 || s->read(&hello, 1) != 1)
+        LOG_ERRNO_RETURN(0, -1, "hello failed on `", sel.endpoints()[i].ep);
+    sel.on_handshake(i, photon::update_now() - t0);
+    for (int n = 0; n < opts.messages; n++) {
+        uint64_t ts;
+        if (s->read(&ts, sizeof(ts)) != sizeof(ts)) LOG_ERRNO_RETURN(0, -1, "message lost");
+        sel.on_message(i, ts);
+    }
+    return i;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    if (photon::init(INIT_EVENT_DEFAULT, INIT_IO_NONE))
+        LOG_ERROR_RETURN(0, -1, "Photon init failed");
+    DEFER(photon::fini());
+    set_log_output_level(ALOG_WARN);
+
+    size_t n = opts.delays_us.size();
+    std::vector<net::ISocketServer*> servers;
+    DEFER(for (auto s : servers) delete s);
+    EndpointSelectorOptions sel_opts;
+    sel_opts.rebalance_interval_us = 50 * 1000;
+    sel_opts.demote_us = 1000 * 1000;
+    EndpointSelector sel("", sel_opts);
+    for (size_t i = 0; i < n; i++) {
+        auto server = net::new_tcp_socket_server();
+        servers.push_back(server);
+        uint16_t port = opts.port + i;
+        uint64_t delay = opts.delays_us[i];
+        if (server->bind_v4localhost(port) < 0 || server->listen(1024) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to listen on port `", port);
+        server->set_handler([delay](net::ISocketStream* s) { return serve(s, delay); });
+        server->start_loop(false);
+        sel.add(net::EndPoint(net::IPAddr("127.0.0.1"), port));
+    }
+
+    auto cli = net::new_tcp_socket_client();
+    DEFER(delete cli);
+    std::vector<int> sessions(n);
+    int failed = 0, next = 0;
+    uint64_t t0 = photon::now;
+    std::vector<photon::join_handle*> workers;
+    for (int w = 0; w < opts.workers; w++) {
+        auto th = photon::thread_create11([&] {
+            while (next < opts.connections) {
+                next++;
+                int i = session(sel, cli);
+                if (i < 0) {
+                    failed++;
+                } else {
+                    sessions[i]++;
+                }
+            }
+        });
+        workers.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : workers) photon::thread_join(jh);
+    double elapsed_ms = (photon::now - t0) / 1000.0;
+
+    // the fastest server by its delay, and the share of sessions it got
+    size_t fastest = 0;
+    for (size_t i = 1; i < n; i++) {
+        if (opts.delays_us[i] < opts.delays_us[fastest]) fastest = i;
+    }
+    printf("{\"connections\":%d,\"workers\":%d,\"elapsed_ms\":%.1f,\"failed\":%d,\"fastest_share\":%.3f,"
+           "\"endpoints\":[", opts.connections, opts.workers, elapsed_ms, failed,
+           (double)sessions[fastest] / opts.connections);
+    for (size_t i = 0; i < n; i++) {
+        auto& e = sel.endpoints()[i];
+        printf("%s{\"delay_us\":%lu,\"sessions\":%d,\"connect_us\":%ld,\"handshake_us\":%ld,"
+               "\"latency_us\":%ld,\"demoted\":%s}", i ? "," : "", opts.delays_us[i], sessions[i],
+               e.connect_us, e.handshake_us, e.latency_us, e.demoted_until ? "true" : "false");
+    }
+    printf("]}\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,289 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Fan-out of one message stream to many local subscribers.
+//
+// A published message is encoded once per wire format (raw lines or
+// WebSocket text frames) into a refcounted SharedFrame, and every subscriber
+// of that format queues a reference to the same frame. Each subscriber has
+// a bounded queue drained by its own coroutine, which sends everything
+// queued so far with one writev. A subscriber whose queue is full is a slow
+// consumer and is handled by SlowConsumerPolicy; it never holds back the
+// publisher or the other subscribers.
+//
+// The hub and its subscribers live on one vCPU: publish() and serve() must be
+// called from the same vCPU.
+#pragma once
+
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+#include <photon/net/socket.h>
+
+#include "ws-frame.h"
+
+class SharedFrame {
+public:
+    static SharedFrame* make(size_t size) {
+        auto f = (SharedFrame*)malloc(sizeof(SharedFrame) + size);
+        if (!f) return nullptr;
+        new (f) SharedFrame();
+        f->m_size = (uint32_t)size;
+        return f;
+    }
+
+    char* data() { return m_data; }
+    uint32_t size() const { return m_size; }
+
+    void ref() { m_refs.fetch_add(1, std::memory_order_relaxed); }
+    void unref() {
+        if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~SharedFrame();
+            free(this);
+        }
+    }
+
+private:
+    SharedFrame() = default;
+    std::atomic<uint32_t> m_refs{1};
+    uint32_t m_size = 0;
+    char m_data[0];
+};
+
+enum class FrameFormat { Raw, WebSocket };
+
+enum class SlowConsumerPolicy {
+    DropOldest,     // keep the freshest data
+    DropNewest,     // keep the queue, skip new messages
+    Disconnect,     // drop the subscriber
+};
+
+struct FanoutOptions {
+    uint32_t queue_capacity = 4096;     // frames per subscriber
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DropOldest;
+    uint32_t max_batch = 64;            // frames per writev
+};
+
+struct FanoutStats {
+    uint64_t published = 0;
+    uint64_t delivered = 0;     // frames handed to writev
+    uint64_t dropped = 0;
+    uint64_t disconnected = 0;
+};
+
+class FanoutSubscriber {
+public:
+    FanoutSubscriber(photon::net::ISocketStream* stream, FrameFormat format,
+                     const FanoutOptions& opts, FanoutStats* stats)
+        : m_stream(stream), m_format(format), m_opts(opts), m_stats(stats),
+          m_queue(opts.queue_capacity) {}
+
+    ~FanoutSubscriber() {
+        while (m_size) pop()->unref();
+    }
+
+    FrameFormat format() const { return m_format; }
+    bool closed() const { return m_closed; }
+
+    // Queues a reference to `f`. Never blocks.
+    void push(SharedFrame* f) {
+        if (m_closed || m_finishing) return;
+        if (m_size == m_queue.size()) {
+            m_stats->dropped++;
+            switch (m_opts.policy) {
+            case SlowConsumerPolicy::DropOldest:
+                pop()->unref();
+                break;
+            case SlowConsumerPolicy::DropNewest:
+                return;
+            case SlowConsumerPolicy::Disconnect:
+                LOG_WARN("disconnecting slow subscriber, ` frames queued", m_size);
+                m_stats->disconnected++;
+                close();
+                return;
+            }
+        }
+        f->ref();
+        m_queue[(m_head + m_size) % m_queue.size()] = f;
+        m_size++;
+        m_cond.notify_one();
+    }
+
+    // Sends queued frames until closed or the peer goes away.
+    void run() {
+        std::vector<SharedFrame*> batch;
+        std::vector<struct iovec> iov;
+        batch.reserve(m_opts.max_batch);
+        iov.reserve(m_opts.max_batch);
+        while (!m_closed) {
+            if (m_size == 0) {
+                if (m_finishing) {
+                    goodbye();
+                    break;
+                }
+                m_cond.wait_no_lock();
+                continue;
+            }
+            while (m_size && batch.size() < m_opts.max_batch) {
+                auto f = pop();
+                batch.push_back(f);
+                iov.push_back({f->data(), f->size()});
+            }
+            ssize_t total = 0;
+            for (auto& v : iov) total += v.iov_len;
+            ssize_t ret = m_stream->writev(iov.data(), (int)iov.size());
+            m_stats->delivered += batch.size();
+            for (auto f : batch) f->unref();
+            batch.clear();
+            iov.clear();
+            if (ret != total) {
+                if (!m_closed) LOG_DEBUG("subscriber gone: `", ERRNO());
+                m_closed = true;
+            }
+        }
+    }
+
+    // Takes no more frames; run() sends those queued and returns, after a
+    // close frame to a WebSocket subscriber.
+    void finish() {
+        m_finishing = true;
+        m_cond.notify_all();
+    }
+
+    // Wakes up the sender and unblocks a pending send.
+    void close() {
+        if (m_closed) return;
+        m_closed = true;
+        m_stream->shutdown(photon::net::ShutdownHow::ReadWrite);
+        m_cond.notify_all();
+    }
+
+private:
+    void goodbye() {
+        m_closed = true;
+        if (m_format != FrameFormat::WebSocket) return;
+        char frame[WS_MAX_HEADER + 2];
+        m_stream->write(frame, ws_encode_close(frame, WS_CLOSE_GOING_AWAY));
+    }
+
+    SharedFrame* pop() {
+        auto f = m_queue[m_head];
+        m_head = (m_head + 1) % m_queue.size();
+        m_size--;
+        return f;
+    }
+
+    photon::net::ISocketStream* m_stream;
+    FrameFormat m_format;
+    FanoutOptions m_opts;
+    FanoutStats* m_stats;
+    std::vector<SharedFrame*> m_queue;
+    size_t m_head = 0, m_size = 0;
+    bool m_closed = false;
+    bool m_finishing = false;
+    photon::condition_variable m_cond;
+};
+
+class FanoutHub {
+public:
+    explicit FanoutHub(const FanoutOptions& opts = {}) : m_opts(opts) {}
+
+    ~FanoutHub() {
+        for (auto s : m_subs) s->close();
+    }
+
+    // Turns a connected stream into a subscriber and feeds it until it goes
+    // away. Meant to be the body of a server handler; the caller keeps
+    // ownership of the stream. WebSocket subscribers must already be
+    // upgraded (see ws_server_handshake).
+    int serve(photon::net::ISocketStream* stream, FrameFormat format) {
+        FanoutSubscriber sub(stream, format, m_opts, &m_stats);
+        m_subs.push_back(&sub);
+        m_count[(int)format]++;
+        LOG_INFO("subscriber joined, ` total", m_subs.size());
+        if (m_draining) sub.finish();
+        sub.run();
+        for (size_t i = 0; i < m_subs.size(); i++) {
+            if (m_subs[i] == &sub) {
+                m_subs[i] = m_subs.back();
+                m_subs.pop_back();
+                break;
+            }
+        }
+        m_count[(int)format]--;
+        LOG_INFO("subscriber left, ` total", m_subs.size());
+        m_left.notify_all();
+        return 0;
+    }
+
+    // For shutdown: lets every subscriber send what it has queued and go,
+    // WebSocket ones with a close frame. Those still there at `tmo` are cut
+    // off; returns how many were.
+    int drain(photon::Timeout tmo) {
+        m_draining = true;
+        for (auto s : m_subs) s->finish();
+        while (!m_subs.empty() && m_left.wait_no_lock(tmo) == 0) {}
+        int n = m_subs.size();
+        if (n) LOG_WARN("` subscribers still sending at shutdown, closing them", n);
+        for (auto s : m_subs) s->close();
+        return n;
+    }
+
+    // Encodes the message once per format in use and queues it everywhere.
+    void publish(const char* data, size_t len) {
+        m_stats.published++;
+        SharedFrame* frames[2] = {nullptr, nullptr};
+        if (m_count[(int)FrameFormat::Raw]) {
+            frames[0] = SharedFrame::make(len + 1);
+            if (frames[0]) {
+                memcpy(frames[0]->data(), data, len);
+                frames[0]->data()[len] = '\n';
+            }
+        }
+        if (m_count[(int)FrameFormat::WebSocket]) {
+            char hdr[WS_MAX_HEADER];
+            size_t hl = ws_encode_header(hdr, WS_TEXT, len);
+            frames[1] = SharedFrame::make(hl + len);
+            if (frames[1]) {
+                memcpy(frames[1]->data(), hdr, hl);
+                memcpy(frames[1]->data() + hl, data, len);
+            }
+        }
+        for (auto s : m_subs) {
+            auto f = frames[(int)s->format()];
+            if (f) s->push(f);
+        }
+        for (auto f : frames) {
+            if (f) f->unref();
+        }
+    }
+
+    size_t subscribers() const { return m_subs.size(); }
+    const FanoutStats& stats() const { return m_stats; }
+
+private:
+    FanoutOptions m_opts;
+    FanoutStats m_stats;
+    std::vector<FanoutSubscriber*> m_subs;
+    size_t m_count[2] = {0, 0};
+    bool m_draining = false;
+    photon::condition_variable m_left;     // a subscriber went away
+};
@@ -0,0 +1,317 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Market-data fan-out: one upstream feed connection per host, rebroadcast to
+// the local strategy processes.
+//
+// Subscribers connect over plain TCP (one JSON message per line), WebSocket,
+// or WebSocket over TLS. Upstream is the exchange's combined trade stream for
+// --symbols, or a synthetic generator (--synthetic=msgs_per_sec) for testing.
+// On SIGINT or SIGTERM the listeners close and subscribers get up to
+// --drain-ms to receive what is queued for them.
+//
+//   fanout_server --symbols=btcusdt,ethusdt --tcp-port=9000 --ws-port=9001
+//                 --wss-port=9002 --queue=4096 --policy=drop-oldest --drain-ms=5000
+
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/thread/thread11.h>
+#include <photon/net/socket.h>
+#include <photon/net/security-context/tls-stream.h>
+
+#include "cert-key.cpp"
+#include "fanout.h"
+#include "ktls-stream.h"
+#include "registered-io.h"
+#include "shutdown.h"
+#include "socket-profile.h"
+
+using namespace photon;
+
+struct Options {
+    std::string symbols = "btcusdt,ethusdt";
+    uint64_t synthetic = 0;     // msgs/s, replaces the upstream when > 0
+    uint16_t tcp_port = 9000;
+    uint16_t ws_port = 9001;
+    uint16_t wss_port = 0;      // 0: disabled
+    uint64_t drain_ms = 5000;   // for subscribers to catch up on shutdown
+    FanoutOptions fanout;
+};
+
+static Options opts;
+static bool input_stopping = false;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"symbols", required_argument, 0, 's'},
+        {"synthetic", required_argument, 0, 'y'},
+        {"tcp-port", required_argument, 0, 't'},
+        {"ws-port", required_argument, 0, 'w'},
+        {"wss-port", required_argument, 0, 'x'},
+        {"queue", required_argument, 0, 'q'},
+        {"policy", required_argument, 0, 'p'},
+        {"drain-ms", required_argument, 0, 'd'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "s:y:t:w:x:q:p:d:", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 's': opts.symbols = optarg; break;
+            case 'y': opts.synthetic = strtoull(optarg, nullptr, 10); break;
+            case 't': opts.tcp_port = atoi(optarg); break;
+            case 'w': opts.ws_port = atoi(optarg); break;
+            case 'x': opts.wss_port = atoi(optarg); break;
+            case 'q': opts.fanout.queue_capacity = std::max(1, atoi(optarg)); break;
+            case 'p': opts.fanout.policy =
+                          strcmp(optarg, "drop-newest") == 0 ? SlowConsumerPolicy::DropNewest :
+                          strcmp(optarg, "disconnect") == 0 ? SlowConsumerPolicy::Disconnect :
+                          SlowConsumerPolicy::DropOldest; break;
+            case 'd': opts.drain_ms = strtoull(optarg, nullptr, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [--symbols=a,b,...] [--synthetic=msgs_per_sec] "
+                        "[--tcp-port=N] [--ws-port=N] [--wss-port=N] [--queue=frames] "
+                        "[--policy=drop-oldest|drop-newest|disconnect] [--drain-ms=N]\n", argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Pongs a ping, reassembles fragments and publishes complete text messages.
+class UpstreamDecoder {
+public:
+    UpstreamDecoder(FanoutHub* hub, net::ISocketStream* conn) : m_hub(hub), m_conn(conn) {}
+
+    // Returns the number of bytes consumed, -1 on close or protocol error.
+    ssize_t feed(const char* p, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            WsFrameHeader h;
+            int hl = ws_parse_header(p + done, n - done, &h);
+            if (hl < 0) LOG_ERROR_RETURN(EPROTO, -1, "malformed frame from upstream");
+            if (hl == 0 || n - done < hl + h.payload_len) break;
+            const char* payload = p + done + hl;
+            done += hl + h.payload_len;
+            switch (h.opcode) {
+            case WS_TEXT:
+            case WS_BINARY:
+                if (h.fin) {
+                    m_hub->publish(payload, h.payload_len);
+                } else {
+                    m_fragments.assign(payload, h.payload_len);
+                }
+                break;
+            case WS_CONTINUATION:
+                m_fragments.append(payload, h.payload_len);
+                if (h.fin) {
+                    m_hub->publish(m_fragments.data(), m_fragments.size());
+                    m_fragments.clear();
+                }
+                break;
+            case WS_PING: {
+                // an all-zero mask leaves the echoed payload as is
+                static const uint8_t zero_mask[4] = {0, 0, 0, 0};
+                char hdr[WS_MAX_HEADER];
+                size_t len = ws_encode_header(hdr, WS_PONG, h.payload_len, true, zero_mask);
+                struct iovec iov[2] = {{hdr, len}, {(void*)payload, h.payload_len}};
+                if (m_conn->writev(iov, 2) < 0) return -1;
+                break;
+            }
+            case WS_CLOSE:
+                LOG_INFO("upstream sent close");
+                return -1;
+            default:
+                break;
+            }
+        }
+        return done;
+    }
+
+private:
+    FanoutHub* m_hub;
+    net::ISocketStream* m_conn;
+    std::string m_fragments;
+};
+
+static net::IPAddr resolve_v4(const char* host) {
+    struct addrinfo hints = {};
+    struct addrinfo* res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, nullptr, &hints, &res) != 0 || !res) return net::IPAddr();
+    net::IPAddr addr(((struct sockaddr_in*)res->ai_addr)->sin_addr);
+    freeaddrinfo(res);
+    return addr;
+}
+
+static int run_upstream_once(FanoutHub* hub, net::ISocketClient* cli) {
+    std::string streams;
+    for (size_t i = 0, j; i < opts.symbols.size(); i = j + 1) {
+        j = opts.symbols.find(',', i);
+        if (j == std::string::npos) j = opts.symbols.size();
+        if (!streams.empty()) streams += '/';
+        streams += opts.symbols.substr(i, j - i) + "@trade";
+    }
+    auto addr = resolve_v4("stream.binance.com");
+    if (addr.undefined()) LOG_ERROR_RETURN(0, -1, "failed to resolve upstream");
+    auto conn = cli->connect(net::EndPoint{addr, 9443});
+    if (!conn) LOG_ERRNO_RETURN(0, -1, "failed to connect upstream");
+    DEFER(delete conn);
+
+    std::vector<char> buf(256 * 1024);
+    size_t len = 0;
+    std::string path = "/stream?streams=" + streams;
+    if (ws_client_handshake(conn, "stream.binance.com", path.c_str(), buf.data(), buf.size(), &len) < 0)
+        return -1;
+    LOG_INFO("upstream connected: `", streams.c_str());
+
+    UpstreamDecoder decoder(hub, conn);
+    while (true) {
+        // frames that came with the upgrade response are decoded first
+        ssize_t used = decoder.feed(buf.data(), len);
+        if (used < 0) return -1;
+        memmove(buf.data(), buf.data() + used, len - used);
+        len -= used;
+        if (len == buf.size()) LOG_ERROR_RETURN(EMSGSIZE, -1, "upstream frame too large");
+        ssize_t n = conn->recv(buf.data() + len, buf.size() - len);
+        if (n <= 0) LOG_ERRNO_RETURN(0, -1, "upstream connection closed");
+        len += n;
+    }
+}
+
+static void run_upstream(FanoutHub* hub) {
+    auto ctx = net::new_tls_context(nullptr, nullptr, nullptr);
+    if (!ctx) LOG_ERROR_RETURN(0, , "TLS context creation failed");
+    DEFER(delete ctx);
+    auto cli = net::new_tls_client(ctx, new_registered_tcp_client(), true);
+    DEFER(delete cli);
+    while (!input_stopping) {
+        run_upstream_once(hub, cli);
+        if (!input_stopping) photon::thread_sleep(1);
+    }
+}
+
+static void run_synthetic(FanoutHub* hub) {
+    uint64_t interval = std::max<uint64_t>(1, 1000000 / opts.synthetic);
+    char msg[256];
+    for (uint64_t seq = 0; !input_stopping; seq++) {
+        int n = snprintf(msg, sizeof(msg),
+                         "{\"e\":\"trade\",\"E\":%lu,\"s\":\"BTCUSDT\",\"t\":%lu,"
+                         "\"p\":\"%lu.%02lu\",\"q\":\"0.001\"}",
+                         photon::now / 1000, seq, 60000 + seq % 1000, seq % 100);
+        hub->publish(msg, n);
+        photon::thread_usleep(interval);
+    }
+}
+
+static net::ISocketServer* listen_on(uint16_t port, net::ISocketServer::Handler handler) {
+    auto base = net::new_iouring_tcp_server();
+    if (!base) base = net::new_tcp_socket_server();
+    auto server = new_profiled_server(base, feed_socket_profile());
+    if (!server) LOG_ERRNO_RETURN(0, nullptr, "failed to create server");
+    server->setsockopt<int>(SOL_SOCKET, SO_REUSEADDR, 1);
+    if (server->bind_v4any(port) < 0 || server->listen(1024) < 0) {
+        delete server;
+        LOG_ERRNO_RETURN(0, nullptr, "failed to listen on port `", port);
+    }
+    server->set_handler(handler);
+    server->start_loop(false);
+    LOG_INFO("listening on `", server->getsockname());
+    return server;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    if (photon::init(INIT_EVENT_IOURING, INIT_IO_NONE))
+        LOG_ERROR_RETURN(0, -1, "Photon init failed");
+    DEFER(photon::fini());
+    DEFER(release_vcpu_buffer_pool());
+    set_log_output_level(ALOG_INFO);
+
+    // thousands of subscribers
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    FanoutHub hub(opts.fanout);
+    std::vector<net::ISocketServer*> servers;
+    DEFER(for (auto s : servers) delete s);
+
+    servers.push_back(listen_on(opts.tcp_port, [&](net::ISocketStream* s) {
+        return hub.serve(s, FrameFormat::Raw);
+    }));
+    servers.push_back(listen_on(opts.ws_port, [&](net::ISocketStream* s) {
+        if (ws_server_handshake(s) < 0) return -1;
+        return hub.serve(s, FrameFormat::WebSocket);
+    }));
+    SSL_CTX* ssl_ctx = nullptr;
+    if (opts.wss_port) {
+        ssl_ctx = new_ktls_context(cert_str, key_str);
+        if (!ssl_ctx) return -1;
+        servers.push_back(listen_on(opts.wss_port, [&](net::ISocketStream* s) {
+            auto tls = new_ktls_stream(ssl_ctx, s, true, false);
+            if (!tls) return -1;
+            DEFER(delete tls);
+            if (ws_server_handshake(tls) < 0) return -1;
+            return hub.serve(tls, FrameFormat::WebSocket);
+        }));
+    }
+    DEFER(if (ssl_ctx) SSL_CTX_free(ssl_ctx));
+    for (auto s : servers) {
+        if (!s) return -1;
+    }
+
+    auto input = opts.synthetic ? photon::thread_create11(run_synthetic, &hub)
+                                : photon::thread_create11(run_upstream, &hub);
+    auto input_jh = photon::thread_enable_join(input);
+
+    // SIGINT or SIGTERM: no new subscribers, then the ones there get what
+    // is queued for them and a close frame
+    auto& coordinator = shutdown_coordinator();
+    coordinator.install_signals();
+    coordinator.add(SHUTDOWN_STOP_INPUT, "listeners", [&](photon::Timeout) {
+        for (auto s : servers) s->terminate();
+        return 0;
+    });
+    // its upstream stream lives on this vCPU's ring, released at exit
+    coordinator.add(SHUTDOWN_STOP_INPUT, "market data input", [&](photon::Timeout) {
+        input_stopping = true;
+        photon::thread_interrupt(input);
+        photon::thread_join(input_jh);
+        return 0;
+    });
+    coordinator.add(SHUTDOWN_SESSIONS, "subscribers", [&](photon::Timeout tmo) {
+        return hub.drain(tmo) ? -1 : 0;
+    });
+
+    uint64_t last_published = 0;
+    while (coordinator.wait(10 * 1000 * 1000) < 0) {
+        auto& st = hub.stats();
+        LOG_INFO("subscribers `, published ` (` msg/s), delivered `, dropped `, disconnected `",
+                 hub.subscribers(), st.published, (st.published - last_published) / 10,
+                 st.delivered, st.dropped, st.disconnected);
+        last_published = st.published;
+    }
+    return coordinator.drain(opts.drain_ms * 1000) ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Serving large static files (recorded feed segments, order book snapshots)
+// from the TCP and TLS servers without copying file data through user space
+// where the stream allows it.
+//
+// send_file() picks the path by stream:
+//   plain TCP    IORING_OP_SPLICE file -> pipe -> socket on the vCPU's ring
+//                (iouring-recv-ring.h); the socket's own sendfile without one
+//   kTLS         SSL_sendfile, the kernel encrypts from the page cache
+//                (KtlsSocketStream, which falls back to mapped writes when
+//                the kernel did not take the keys)
+//   TLS          writes straight from an mmap of the file, so encryption is
+//                the only pass over the data
+//
+// SnapshotFileServer answers HTTP/1.1 GET and HEAD for the regular files of
+// one directory, with keep-alive, so http-client.h can fetch from it.
+#pragma once
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+#include <photon/net/socket.h>
+
+#include "iouring-recv-ring.h"
+#include "ktls-stream.h"
+
+// Pipe capacity asked for by splice_file; the kernel may give less.
+const int SPLICE_PIPE_SIZE = 1 << 20;
+
+// Moves `count` bytes of the file from `offset` to the socket through a
+// pipe, on `ring`. The pages are never mapped or copied in user space.
+inline ssize_t splice_file(UringRecvRing* ring, int sockfd, int fd, off_t offset, size_t count,
+                           photon::Timeout tmo = {}) {
+    // one pipe per transfer: concurrent transfers on the vCPU must not mix
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) LOG_ERRNO_RETURN(0, -1, "failed to create splice pipe");
+    DEFER({ ::close(p[0]); ::close(p[1]); });
+    fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    int cap = fcntl(p[1], F_GETPIPE_SZ);
+    if (cap <= 0) cap = 65536;
+
+    size_t done = 0;
+    while (done < count) {
+        unsigned want = count - done < (size_t)cap ? count - done : cap;
+        ssize_t in = ring->call([&](struct io_uring_sqe* sqe) {
+            io_uring_prep_splice(sqe, fd, offset + done, p[1], -1, want, SPLICE_F_MOVE);
+        }, tmo);
+        if (in < 0) return done ? (ssize_t)done : -1;
+        if (in == 0) break;     // end of file
+        for (ssize_t left = in; left > 0;) {
+            ssize_t out = ring->call([&](struct io_uring_sqe* sqe) {
+                io_uring_prep_splice(sqe, p[0], -1, sockfd, -1, left, SPLICE_F_MOVE);
+            }, tmo);
+            // the server sockets are non-blocking: a full send buffer is
+            // EAGAIN, not an error
+            if (out < 0 && errno == EAGAIN) {
+                if (photon::wait_for_fd_writable(sockfd, tmo) < 0) return done ? (ssize_t)done : -1;
+                continue;
+            }
+            // what is still in the pipe is lost with it
+            if (out <= 0) return done ? (ssize_t)done : -1;
+            left -= out;
+            done += out;
+        }
+    }
+    return done;
+}
+
+// Sends `count` bytes of the file from `offset`; `tls` says whether `s`
+// encrypts. Returns the bytes sent, -1 if none could be.
+inline ssize_t send_file(photon::net::ISocketStream* s, int fd, off_t offset, size_t count, bool tls) {
+    if (tls) {
+        if (dynamic_cast<KtlsSocketStream*>(s)) return s->sendfile(fd, offset, count);
+        return write_mapped_file(s, fd, offset, count);
+    }
+    int sockfd = s->get_underlay_fd();
+    auto ring = get_vcpu_recv_ring();
+    if (sockfd < 0 || !ring) return s->sendfile(fd, offset, count);
+    return splice_file(ring, sockfd, fd, offset, count, photon::Timeout(s->timeout()));
+}
+
+class SnapshotFileServer {
+public:
+    // Serves the files under `root`; `tls` as for send_file.
+    SnapshotFileServer(const char* root, bool tls) : m_tls(tls) {
+        m_root = ::open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (m_root < 0) LOG_ERRNO_RETURN(0, , "failed to open snapshot directory `", root);
+        LOG_INFO("serving snapshot files from `", root);
+    }
+
+    ~SnapshotFileServer() {
+        if (m_root >= 0) ::close(m_root);
+    }
+
+    bool ok() const { return m_root >= 0; }
+
+    // Connection handler for ISocketServer / ShardedTlsServer: answers
+    // requests until the peer closes or asks to.
+    int handle(photon::net::ISocketStream* s) {
+        char req[4096];
+        size_t n = 0;
+        while (true) {
+            char* end;
+            while (!(end = (char*)memmem(req, n, "\r\n\r\n", 4))) {
+                if (n == sizeof(req)) return reply(s, "431 Request Header Fields Too Large", false);
+                ssize_t r = s->recv(req + n, sizeof(req) - n);
+                if (r <= 0) return 0;
+                n += r;
+            }
+            size_t used = end + 4 - req;
+            *end = '\0';
+            int ret = serve(s, req);
+            if (ret <= 0) return ret;
+            memmove(req, req + used, n - used);
+            n -= used;
+        }
+    }
+
+    struct Stats {
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> files{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> errors{0};
+    };
+    const Stats& stats() const { return m_stats; }
+
+private:
+    // Answers one request; 1 to keep the connection, 0 to close it, -1 on
+    // a failed send.
+    int serve(photon::net::ISocketStream* s, char* req) {
+        m_stats.requests.fetch_add(1, std::memory_order_relaxed);
+        // "GET /name HTTP/1.1"
+        char* eol = strstr(req, "\r\n");
+        if (eol) *eol = '\0';
+        char* target = strchr(req, ' ');
+        char* version = target ? strchr(target + 1, ' ') : nullptr;
+        if (!version) return reply(s, "400 Bad Request", false);
+        bool keep_alive = strcmp(version, " HTTP/1.1") == 0 &&
+                          !(eol && strcasestr(eol + 1, "\nConnection: close"));
+        bool head = target - req == 4 && strncmp(req, "HEAD", 4) == 0;
+        if (!head && !(target - req == 3 && strncmp(req, "GET", 3) == 0))
+            return reply(s, "405 Method Not Allowed", false);
+        if (target[1] != '/') return reply(s, "404 Not Found", keep_alive);
+        std::string name(target + 2, version);
+        if (!valid_name(name)) return reply(s, "404 Not Found", keep_alive);
+
+        int fd = ::openat(m_root, name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return reply(s, "404 Not Found", keep_alive);
+        DEFER(::close(fd));
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return reply(s, "404 Not Found", keep_alive);
+        std::string hdr = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                          std::to_string(st.st_size) +
+                          (keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+        if (s->write(hdr.data(), hdr.size()) != (ssize_t)hdr.size()) return error();
+        if (head) return keep_alive;
+        ssize_t sent = send_file(s, fd, 0, st.st_size, m_tls);
+        if (sent > 0) m_stats.bytes.fetch_add(sent, std::memory_order_relaxed);
+        // a short body cannot be recovered from: the peer has the length
+        if (sent != st.st_size) {
+            LOG_ERROR("sent ` of ` bytes of `", sent, st.st_size, name.c_str());
+            return error();
+        }
+        m_stats.files.fetch_add(1, std::memory_order_relaxed);
+        return keep_alive;
+    }
+
+    // Relative names of [A-Za-z0-9._-/], no "..", no empty components.
+    static bool valid_name(const std::string& name) {
+        if (name.empty() || name[0] == '/' || name.find("..") != std::string::npos ||
+                name.find("//") != std::string::npos)
+            return false;
+        for (char c : name)
+            if (!isalnum((unsigned char)c) && !strchr("._-/", c)) return false;
+        return name.back() != '/';
+    }
+
+    int reply(photon::net::ISocketStream* s, const char* status, bool keep_alive) {
+        m_stats.errors.fetch_add(1, std::memory_order_relaxed);
+        std::string resp = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: 0\r\n" +
+                           (keep_alive ? "\r\n" : "Connection: close\r\n\r\n");
+        if (s->write(resp.data(), resp.size()) != (ssize_t)resp.size()) return -1;
+        return keep_alive;
+    }
+
+    int error() {
+        m_stats.errors.fetch_add(1, std::memory_order_relaxed);
+        return -1;
+    }
+
+    int m_root = -1;
+    bool m_tls;
+    Stats m_stats;
+};
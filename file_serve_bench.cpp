@@ -0,0 +1,147 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Snapshot file serving over plain TCP, on one vCPU.
+//
+// Writes a --size-mb file to a temporary directory, serves it with
+// SnapshotFileServer (bodies spliced file -> pipe -> socket on the vCPU's
+// io_uring) and fetches it --fetches times with HttpClient on keep-alive
+// connections, checking every body byte. The file is many times the socket
+// buffer, which --sndbuf can shrink further, so the splice runs into a full
+// send buffer over and over. One JSON line is printed with the throughput
+// and the server's counters.
+//
+//   file_serve_bench --size-mb=64 --fetches=8 --sndbuf=65536
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/net/socket.h>
+
+#include "file-serve.h"
+#include "http-client.h"
+
+using namespace photon;
+
+struct Options {
+    size_t size_mb = 64;
+    int fetches = 8;
+    int sndbuf = 0;                 // server SO_SNDBUF, 0: the kernel's
+    uint16_t port = 18081;
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"size-mb", required_argument, 0, 's'},
+        {"fetches", required_argument, 0, 'f'},
+        {"sndbuf", required_argument, 0, 'b'},
+        {"port", required_argument, 0, 'p'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "s:f:b:p:", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 's': opts.size_mb = std::max(1, atoi(optarg)); break;
+            case 'f': opts.fetches = std::max(1, atoi(optarg)); break;
+            case 'b': opts.sndbuf = atoi(optarg); break;
+            case 'p': opts.port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [--size-mb=N] [--fetches=N] [--sndbuf=bytes] [--port=N]\n",
+                        argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Byte i of the file; not periodic in any power of two.
+static char pattern(size_t i) { return (char)(i * 2654435761UL >> 13); }
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    if (photon::init(INIT_EVENT_DEFAULT, INIT_IO_NONE))
+        LOG_ERROR_RETURN(0, -1, "Photon init failed");
+    DEFER(photon::fini());
+    DEFER(release_vcpu_recv_ring());
+    set_log_output_level(ALOG_WARN);
+
+    char dir[] = "/tmp/file_serve_bench.XXXXXX";
+    if (!mkdtemp(dir)) LOG_ERRNO_RETURN(0, -1, "failed to create temporary directory");
+    std::string path = std::string(dir) + "/snapshot.bin";
+    DEFER({ unlink(path.c_str()); rmdir(dir); });
+    size_t size = opts.size_mb << 20;
+    {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) LOG_ERRNO_RETURN(0, -1, "failed to create `", path.c_str());
+        std::vector<char> block(1 << 20);
+        for (size_t off = 0; off < size; off += block.size()) {
+            for (size_t i = 0; i < block.size(); i++) block[i] = pattern(off + i);
+            fwrite(block.data(), 1, block.size(), f);
+        }
+        fclose(f);
+    }
+
+    SnapshotFileServer files(dir, false);
+    if (!files.ok()) return -1;
+    auto server = net::new_tcp_socket_server();
+    DEFER(delete server);
+    if (server->bind_v4localhost(opts.port) < 0 || server->listen(1024) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to listen on port `", opts.port);
+    server->set_handler([&](net::ISocketStream* s) {
+        if (opts.sndbuf) s->setsockopt<int>(SOL_SOCKET, SO_SNDBUF, opts.sndbuf);
+        return files.handle(s);
+    });
+    server->start_loop(false);
+
+    HttpClient http(net::new_tcp_socket_client());
+    net::EndPoint ep(net::IPAddr("127.0.0.1"), opts.port);
+    std::string host = "127.0.0.1:" + std::to_string(opts.port);
+    int failed = 0, corrupt = 0;
+    uint64_t bytes = 0, t0 = photon::now;
+    for (int i = 0; i < opts.fetches; i++) {
+        HttpResponse resp;
+        if (http.get(ep, host, "/snapshot.bin", &resp) < 0 || resp.status != 200 ||
+                resp.body.size() != size) {
+            failed++;
+            continue;
+        }
+        bytes += resp.body.size();
+        for (size_t k = 0; k < size; k++) {
+            if (resp.body[k] != pattern(k)) {
+                corrupt++;
+                break;
+            }
+        }
+    }
+    double seconds = (photon::now - t0) / 1e6;
+    auto& st = files.stats();
+
+    printf("{\"size_mb\":%zu,\"fetches\":%d,\"sndbuf\":%d,\"seconds\":%.3f,\"mb_per_s\":%.1f,"
+           "\"failed\":%d,\"corrupt\":%d,\"served\":%lu,\"served_bytes\":%lu,\"server_errors\":%lu,"
+           "\"connects\":%lu}\n",
+           opts.size_mb, opts.fetches, opts.sndbuf, seconds, bytes / 1048576.0 / seconds, failed, corrupt,
+           st.files.load(), st.bytes.load(), st.errors.load(), http.connects());
+    return failed || corrupt ? 1 : 0;
+}
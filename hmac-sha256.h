@@ -0,0 +1,192 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// SHA-256 and HMAC-SHA256 for request signing on the order path.
+//
+// HMAC(K, m) = H((K ^ opad) || H((K ^ ipad) || m)). The two key blocks are
+// the same for every message, so HmacSha256Key hashes them once and keeps
+// the resulting midstates; signing a message then starts from a copy of the
+// inner midstate and costs only the message blocks plus one outer block.
+// Constant message prefixes can be absorbed the same way (see prefixed()).
+// Everything lives on the stack: no allocation per signature.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class Sha256 {
+public:
+    static const size_t BLOCK = 64;
+    static const size_t DIGEST = 32;
+
+    Sha256() { reset(); }
+
+    void reset() {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        memcpy(m_h, init, sizeof(m_h));
+        m_len = 0;
+        m_used = 0;
+    }
+
+    void update(const void* data, size_t n) {
+        auto p = (const uint8_t*)data;
+        m_len += n;
+        if (m_used) {
+            size_t k = BLOCK - m_used < n ? BLOCK - m_used : n;
+            memcpy(m_buf + m_used, p, k);
+            m_used += k;
+            p += k;
+            n -= k;
+            if (m_used < BLOCK) return;
+            compress(m_buf);
+            m_used = 0;
+        }
+        for (; n >= BLOCK; p += BLOCK, n -= BLOCK) compress(p);
+        memcpy(m_buf, p, n);
+        m_used = n;
+    }
+
+    void final(uint8_t out[DIGEST]) {
+        uint64_t bits = m_len * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        static const uint8_t zeros[BLOCK] = {};
+        update(zeros, (BLOCK + 56 - m_used) % BLOCK);
+        uint8_t len[8];
+        for (int i = 0; i < 8; i++) len[i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(len, 8);
+        for (int i = 0; i < 8; i++) {
+            out[4 * i] = (uint8_t)(m_h[i] >> 24);
+            out[4 * i + 1] = (uint8_t)(m_h[i] >> 16);
+            out[4 * i + 2] = (uint8_t)(m_h[i] >> 8);
+            out[4 * i + 3] = (uint8_t)m_h[i];
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* p) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+                   (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = m_h[0], b = m_h[1], c = m_h[2], d = m_h[3];
+        uint32_t e = m_h[4], f = m_h[5], g = m_h[6], h = m_h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        m_h[0] += a; m_h[1] += b; m_h[2] += c; m_h[3] += d;
+        m_h[4] += e; m_h[5] += f; m_h[6] += g; m_h[7] += h;
+    }
+
+    uint32_t m_h[8];
+    uint64_t m_len;
+    uint8_t m_buf[BLOCK];
+    size_t m_used;
+};
+
+class HmacSha256Key {
+public:
+    HmacSha256Key() = default;
+    HmacSha256Key(const void* key, size_t n) { set(key, n); }
+
+    void set(const void* key, size_t n) {
+        uint8_t k[Sha256::BLOCK] = {};
+        if (n > Sha256::BLOCK) {
+            Sha256 h;
+            h.update(key, n);
+            h.final(k);
+        } else {
+            memcpy(k, key, n);
+        }
+        uint8_t pad[Sha256::BLOCK];
+        for (size_t i = 0; i < Sha256::BLOCK; i++) pad[i] = k[i] ^ 0x36;
+        m_inner.reset();
+        m_inner.update(pad, Sha256::BLOCK);
+        for (size_t i = 0; i < Sha256::BLOCK; i++) pad[i] = k[i] ^ 0x5c;
+        m_outer.reset();
+        m_outer.update(pad, Sha256::BLOCK);
+    }
+
+    // A key whose inner state has also absorbed `prefix`: signing `m` with
+    // it yields HMAC(K, prefix || m).
+    HmacSha256Key prefixed(const void* prefix, size_t n) const {
+        HmacSha256Key k = *this;
+        k.m_inner.update(prefix, n);
+        return k;
+    }
+
+    // Incremental signing: sign = key.begin(); sign.update(...); sign.final().
+    class Signer {
+    public:
+        void update(const void* data, size_t n) { m_inner.update(data, n); }
+        void final(uint8_t out[Sha256::DIGEST]) {
+            uint8_t d[Sha256::DIGEST];
+            m_inner.final(d);
+            m_outer.update(d, sizeof(d));
+            m_outer.final(out);
+        }
+        // Lower-case hex, exactly 64 chars, not NUL-terminated.
+        void final_hex(char out[2 * Sha256::DIGEST]) {
+            static const char hex[] = "0123456789abcdef";
+            uint8_t d[Sha256::DIGEST];
+            final(d);
+            for (size_t i = 0; i < Sha256::DIGEST; i++) {
+                out[2 * i] = hex[d[i] >> 4];
+                out[2 * i + 1] = hex[d[i] & 15];
+            }
+        }
+
+    private:
+        friend class HmacSha256Key;
+        Signer(const Sha256& inner, const Sha256& outer) : m_inner(inner), m_outer(outer) {}
+        Sha256 m_inner, m_outer;
+    };
+
+    Signer begin() const { return Signer(m_inner, m_outer); }
+
+    void sign(const void* data, size_t n, uint8_t out[Sha256::DIGEST]) const {
+        auto s = begin();
+        s.update(data, n);
+        s.final(out);
+    }
+
+private:
+    Sha256 m_inner, m_outer;
+};
@@ -0,0 +1,464 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// HTTP/1.1 client for REST endpoints, for use from Photon coroutines.
+//
+// Responses are parsed incrementally as bytes arrive, with bodies framed by
+// Content-Length, chunked transfer encoding or (HTTP/1.0 style) connection
+// close. Connections are kept alive and pooled per host, so a snapshot fetch
+// or an order query does not pay a TCP (and TLS) handshake each time.
+// pipeline() writes a batch of requests back to back on one connection and
+// reads the responses in order.
+//
+// Connections come from an ISocketClient: by default the registered io_uring
+// client of the calling vCPU (registered-io.h) with the bulk socket profile
+// (socket-profile.h); wrap it with net::new_tls_client for HTTPS. A client
+// and its pool belong to one vCPU.
+#pragma once
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+#include <photon/net/socket.h>
+
+#include "registered-io.h"
+#include "socket-profile.h"
+
+struct HttpRequest {
+    std::string method = "GET";
+    std::string path = "/";
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+
+    // Safe to send again on a fresh connection if a reused one turns out to
+    // be dead.
+    bool idempotent() const {
+        return method == "GET" || method == "HEAD" || method == "PUT" ||
+               method == "DELETE" || method == "OPTIONS";
+    }
+};
+
+struct HttpResponse {
+    int status = 0;
+    int minor_version = 1;
+    bool keep_alive = true;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+
+    // Case-insensitive lookup; nullptr if absent.
+    const std::string* header(const char* name) const {
+        for (auto& h : headers) {
+            if (strcasecmp(h.first.c_str(), name) == 0) return &h.second;
+        }
+        return nullptr;
+    }
+};
+
+class HttpResponseParser {
+public:
+    // Starts a new response. The response to a HEAD request has no body,
+    // whatever its headers say.
+    void reset(HttpResponse* resp, bool head_request = false) {
+        *resp = HttpResponse();
+        m_resp = resp;
+        m_head = head_request;
+        m_state = STATUS;
+        m_line.clear();
+        m_remaining = 0;
+        m_chunked = false;
+        m_has_length = false;
+    }
+
+    bool done() const { return m_state == DONE; }
+    // Whether any byte of the response has been seen.
+    bool started() const { return m_state != STATUS || !m_line.empty(); }
+
+    // Consumes up to `n` bytes and returns how many were used; stops at the
+    // end of the response, so the rest may belong to the next (pipelined)
+    // response. Returns -1 on a malformed response.
+    ssize_t feed(const char* p, size_t n) {
+        size_t i = 0;
+        while (i < n && m_state != DONE) {
+            if (m_state == BODY || m_state == CHUNK_DATA) {
+                size_t k = std::min<uint64_t>(m_remaining, n - i);
+                m_resp->body.append(p + i, k);
+                i += k;
+                m_remaining -= k;
+                if (m_remaining == 0) m_state = m_state == BODY ? DONE : CHUNK_END;
+                continue;
+            }
+            if (m_state == UNTIL_EOF) {
+                m_resp->body.append(p + i, n - i);
+                return n;
+            }
+            auto nl = (const char*)memchr(p + i, '\n', n - i);
+            size_t end = nl ? nl - p : n;
+            if (m_line.size() + end - i > MAX_LINE)
+                LOG_ERROR_RETURN(EMSGSIZE, -1, "HTTP response line too long");
+            m_line.append(p + i, end - i);
+            i = end;
+            if (!nl) break;
+            i++;
+            if (!m_line.empty() && m_line.back() == '\r') m_line.pop_back();
+            if (on_line() < 0) return -1;
+            m_line.clear();
+        }
+        return i;
+    }
+
+    // The peer closed the connection. Completes a close-delimited body;
+    // returns -1 if the response was cut short.
+    int eof() {
+        if (m_state == UNTIL_EOF) {
+            m_state = DONE;
+            return 0;
+        }
+        if (m_state == DONE) return 0;
+        LOG_ERROR_RETURN(ECONNRESET, -1, "connection closed in the middle of a response");
+    }
+
+private:
+    enum State { STATUS, HEADERS, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILERS, UNTIL_EOF, DONE };
+    static const size_t MAX_LINE = 64 * 1024;
+    static const size_t MAX_RESERVE = 64 << 20;     // of a body, before it arrives
+
+    int on_line() {
+        switch (m_state) {
+        case STATUS: {
+            int minor, status;
+            if (sscanf(m_line.c_str(), "HTTP/1.%d %d", &minor, &status) != 2)
+                LOG_ERROR_RETURN(EPROTO, -1, "bad HTTP status line: `", m_line.c_str());
+            m_resp->minor_version = minor;
+            m_resp->status = status;
+            m_resp->keep_alive = minor >= 1;
+            m_state = HEADERS;
+            return 0;
+        }
+        case HEADERS:
+            if (m_line.empty()) return end_of_headers();
+            return add_header(&m_resp->headers);
+        case CHUNK_SIZE: {
+            char* end;
+            m_remaining = strtoull(m_line.c_str(), &end, 16);
+            if (end == m_line.c_str())
+                LOG_ERROR_RETURN(EPROTO, -1, "bad chunk size: `", m_line.c_str());
+            m_state = m_remaining ? CHUNK_DATA : TRAILERS;
+            return 0;
+        }
+        case CHUNK_END:
+            if (!m_line.empty()) LOG_ERROR_RETURN(EPROTO, -1, "missing CRLF after chunk");
+            m_state = CHUNK_SIZE;
+            return 0;
+        case TRAILERS:
+            if (m_line.empty()) m_state = DONE;
+            return 0;       // trailers are dropped
+        default:
+            return 0;
+        }
+    }
+
+    int add_header(std::vector<std::pair<std::string, std::string>>* headers) {
+        auto colon = m_line.find(':');
+        if (colon == std::string::npos)
+            LOG_ERROR_RETURN(EPROTO, -1, "bad HTTP header: `", m_line.c_str());
+        size_t v = colon + 1;
+        while (v < m_line.size() && (m_line[v] == ' ' || m_line[v] == '\t')) v++;
+        size_t e = m_line.size();
+        while (e > v && (m_line[e - 1] == ' ' || m_line[e - 1] == '\t')) e--;
+        headers->emplace_back(m_line.substr(0, colon), m_line.substr(v, e - v));
+        auto& name = headers->back().first;
+        auto& value = headers->back().second;
+        if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            // digits only; repeated only with the same value
+            char* end;
+            errno = 0;
+            uint64_t len = strtoull(value.c_str(), &end, 10);
+            if (!isdigit((unsigned char)value[0]) || *end || errno == ERANGE ||
+                    (m_has_length && len != m_remaining))
+                LOG_ERROR_RETURN(EPROTO, -1, "bad Content-Length: `", value.c_str());
+            m_has_length = true;
+            m_remaining = len;
+        } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            m_chunked = strcasestr(value.c_str(), "chunked") != nullptr;
+        } else if (strcasecmp(name.c_str(), "Connection") == 0) {
+            if (strcasestr(value.c_str(), "close")) m_resp->keep_alive = false;
+            else if (strcasestr(value.c_str(), "keep-alive")) m_resp->keep_alive = true;
+        }
+        return 0;
+    }
+
+    int end_of_headers() {
+        int status = m_resp->status;
+        if (status >= 100 && status < 200 && status != 101) {
+            // interim response (100 Continue): the real one follows
+            m_resp->headers.clear();
+            m_state = STATUS;
+            return 0;
+        }
+        if (m_head || status == 204 || status == 304 || status == 101) {
+            m_state = DONE;
+        } else if (m_chunked) {
+            m_state = CHUNK_SIZE;
+        } else if (m_has_length) {
+            m_state = m_remaining ? BODY : DONE;
+            m_resp->body.reserve(std::min<uint64_t>(m_remaining, (uint64_t)MAX_RESERVE));
+        } else {
+            m_state = UNTIL_EOF;
+            m_resp->keep_alive = false;
+        }
+        return 0;
+    }
+
+    HttpResponse* m_resp = nullptr;
+    bool m_head = false;
+    State m_state = STATUS;
+    std::string m_line;
+    uint64_t m_remaining = 0;
+    bool m_chunked = false;
+    bool m_has_length = false;
+};
+
+// One keep-alive connection. Requests written and responses read in order.
+class HttpConnection {
+public:
+    HttpConnection(photon::net::ISocketStream* stream, const std::string& host)
+        : m_stream(stream), m_host(host), m_buf(16 * 1024) {}
+    ~HttpConnection() { delete m_stream; }
+
+    bool reusable() const { return m_reusable && m_pending == 0; }
+    uint64_t idle_since() const { return m_idle_since; }
+    uint64_t requests() const { return m_requests; }
+
+    // Serializes all requests into one buffer and writes it with one call.
+    int send(const HttpRequest* reqs, size_t n) {
+        std::string out;
+        for (size_t i = 0; i < n; i++) serialize(reqs[i], &out);
+        if (m_stream->write(out.data(), out.size()) != (ssize_t)out.size()) {
+            m_reusable = false;
+            LOG_ERRNO_RETURN(0, -1, "failed to send HTTP request to `", m_host.c_str());
+        }
+        for (size_t i = 0; i < n; i++) m_head.push_back(reqs[i].method == "HEAD");
+        m_pending += n;
+        m_requests += n;
+        return 0;
+    }
+
+    // Reads the next response. Returns 0 on success, -1 on error; `*started`
+    // tells whether any of it arrived before the failure.
+    int receive(HttpResponse* resp, bool* started = nullptr) {
+        if (m_pending == 0) LOG_ERROR_RETURN(EINVAL, -1, "no request in flight");
+        HttpResponseParser parser;
+        parser.reset(resp, m_head.front());
+        if (started) *started = false;
+        while (true) {
+            if (m_begin < m_end) {
+                ssize_t used = parser.feed(m_buf.data() + m_begin, m_end - m_begin);
+                if (used < 0) return fail();
+                m_begin += used;
+                if (started && parser.started()) *started = true;
+                if (parser.done()) break;
+            }
+            if (m_begin == m_end) m_begin = m_end = 0;
+            if (m_end == m_buf.size()) {
+                // bodies are copied out as they arrive, so only the unparsed
+                // tail is kept here
+                memmove(m_buf.data(), m_buf.data() + m_begin, m_end - m_begin);
+                m_end -= m_begin;
+                m_begin = 0;
+            }
+            ssize_t n = m_stream->recv(m_buf.data() + m_end, m_buf.size() - m_end);
+            if (n < 0) {
+                fail();
+                LOG_ERRNO_RETURN(0, -1, "failed to receive HTTP response from `", m_host.c_str());
+            }
+            if (n == 0) {
+                if (parser.eof() < 0) return fail();
+                m_reusable = false;
+                break;
+            }
+            m_end += n;
+        }
+        m_head.erase(m_head.begin());
+        m_pending--;
+        if (!resp->keep_alive) m_reusable = false;
+        m_idle_since = photon::now;
+        return 0;
+    }
+
+private:
+    int fail() {
+        m_reusable = false;
+        return -1;
+    }
+
+    void serialize(const HttpRequest& r, std::string* out) {
+        *out += r.method;
+        *out += ' ';
+        *out += r.path;
+        *out += " HTTP/1.1\r\nHost: ";
+        *out += m_host;
+        *out += "\r\n";
+        bool has_length = false;
+        for (auto& h : r.headers) {
+            has_length |= strcasecmp(h.first.c_str(), "Content-Length") == 0;
+            *out += h.first;
+            *out += ": ";
+            *out += h.second;
+            *out += "\r\n";
+        }
+        if (!has_length && (!r.body.empty() || r.method == "POST" || r.method == "PUT")) {
+            *out += "Content-Length: ";
+            *out += std::to_string(r.body.size());
+            *out += "\r\n";
+        }
+        *out += "\r\n";
+        *out += r.body;
+    }
+
+    photon::net::ISocketStream* m_stream;
+    std::string m_host;
+    std::vector<char> m_buf;
+    size_t m_begin = 0, m_end = 0;
+    std::vector<bool> m_head;       // per request in flight: was it HEAD
+    size_t m_pending = 0;
+    bool m_reusable = true;
+    uint64_t m_idle_since = 0;
+    uint64_t m_requests = 0;
+};
+
+struct HttpClientOptions {
+    size_t max_idle_per_host = 8;
+    uint64_t idle_timeout_us = 30 * 1000 * 1000;    // server side is often 60s
+    uint64_t timeout_us = 5 * 1000 * 1000;          // per socket operation
+};
+
+class HttpClient {
+public:
+    // Takes ownership of `socket_client`; nullptr means this vCPU's
+    // registered io_uring client with the bulk socket profile.
+    explicit HttpClient(photon::net::ISocketClient* socket_client = nullptr,
+                        const HttpClientOptions& opts = {})
+        : m_client(socket_client ? socket_client
+                                 : new_profiled_client(new_registered_tcp_client(), bulk_socket_profile())),
+          m_opts(opts) {}
+
+    ~HttpClient() {
+        for (auto& p : m_idle) {
+            for (auto c : p.second) delete c;
+        }
+        delete m_client;
+    }
+
+    // `host` goes into the Host header ("api.example.com" or "127.0.0.1:8080")
+    // and, with the port, keys the connection pool.
+    int request(const photon::net::EndPoint& ep, const std::string& host,
+                const HttpRequest& req, HttpResponse* resp) {
+        std::vector<HttpResponse> resps;
+        if (pipeline(ep, host, &req, 1, &resps) < 0) return -1;
+        *resp = std::move(resps[0]);
+        return 0;
+    }
+
+    int get(const photon::net::EndPoint& ep, const std::string& host,
+            const std::string& path, HttpResponse* resp) {
+        HttpRequest req;
+        req.path = path;
+        return request(ep, host, req, resp);
+    }
+
+    // Sends `n` requests back to back on one connection and reads the n
+    // responses in order. If the connection dies before a response starts,
+    // the remaining idempotent requests are retried once on a new one.
+    int pipeline(const photon::net::EndPoint& ep, const std::string& host,
+                 const HttpRequest* reqs, size_t n, std::vector<HttpResponse>* resps) {
+        resps->clear();
+        resps->resize(n);
+        size_t done = 0;
+        for (int attempt = 0; attempt < 2 && done < n; attempt++) {
+            bool reused;
+            auto conn = acquire(ep, host, &reused);
+            if (!conn) return -1;
+            bool started = false;
+            if (conn->send(reqs + done, n - done) == 0) {
+                while (done < n && conn->receive(&(*resps)[done], &started) == 0) done++;
+            }
+            release(ep, host, conn);
+            if (done == n) break;
+            bool retry = !started;
+            for (size_t i = done; i < n; i++) retry &= reqs[i].idempotent();
+            // a fresh connection that fails is not a stale keep-alive one
+            if (!retry || (!reused && done == 0)) break;
+            LOG_DEBUG("retrying ` requests to ` on a new connection", n - done, host.c_str());
+        }
+        if (done < n) LOG_ERROR_RETURN(0, -1, "` of ` HTTP requests to ` failed", n - done, n, host.c_str());
+        return 0;
+    }
+
+    int pipeline(const photon::net::EndPoint& ep, const std::string& host,
+                 const std::vector<HttpRequest>& reqs, std::vector<HttpResponse>* resps) {
+        return pipeline(ep, host, reqs.data(), reqs.size(), resps);
+    }
+
+    uint64_t connects() const { return m_connects; }
+
+private:
+    static std::string key(const photon::net::EndPoint& ep, const std::string& host) {
+        return host + '#' + std::to_string(ep.port);
+    }
+
+    HttpConnection* acquire(const photon::net::EndPoint& ep, const std::string& host, bool* reused) {
+        auto& idle = m_idle[key(ep, host)];
+        while (!idle.empty()) {
+            auto c = idle.back();
+            idle.pop_back();
+            if (photon::now - c->idle_since() < m_opts.idle_timeout_us) {
+                *reused = true;
+                return c;
+            }
+            delete c;
+        }
+        *reused = false;
+        auto s = m_client->connect(ep);
+        if (!s) LOG_ERRNO_RETURN(0, nullptr, "failed to connect to ` (`)", host.c_str(), ep);
+        s->timeout(m_opts.timeout_us);
+        m_connects++;
+        return new HttpConnection(s, host);
+    }
+
+    void release(const photon::net::EndPoint& ep, const std::string& host, HttpConnection* c) {
+        auto& idle = m_idle[key(ep, host)];
+        if (c->reusable() && idle.size() < m_opts.max_idle_per_host) {
+            idle.push_back(c);
+        } else {
+            delete c;
+        }
+    }
+
+    photon::net::ISocketClient* m_client;
+    HttpClientOptions m_opts;
+    std::map<std::string, std::vector<HttpConnection*>> m_idle;
+    uint64_t m_connects = 0;
+};
@@ -0,0 +1,736 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Multishot recv with a provided buffer ring (kernel >= 6.0, liburing >= 2.3).
+//
+// One UringRecvRing lives on each vCPU. A socket is armed once with
+// IORING_OP_RECV | multishot; from then on the kernel picks a buffer from the
+// registered ring for every chunk of data and posts a completion, without any
+// further submission from us. Completions are reaped by a single coroutine
+// that wakes up on the ring's eventfd and hands (buffer, length) views to the
+// per-socket UringRecvChannel. Consumers either copy out of the view (recv) or
+// parse it in place (peek/consume) and the buffer goes back to the ring once
+// fully consumed.
+//
+// The ring follows the low-latency profile of the vCPU that creates it
+// (low-latency.h): SQPOLL for submissions, and spinning on the completion
+// queue before sleeping on the eventfd.
+//
+// Besides multishot recv the ring runs single-shot operations for coroutines
+// (call()), and owns the vCPU's registered file table and fixed buffers
+// (see registered-io.h).
+#pragma once
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+#include <photon/thread/thread.h>
+#include <photon/net/socket.h>
+
+#include "low-latency.h"
+#include "topology.h"
+
+class UringRecvRing;
+
+// Receive side of one socket armed on a UringRecvRing.
+class UringRecvChannel {
+public:
+    UringRecvChannel(UringRecvRing* ring, int fd);
+    ~UringRecvChannel();
+
+    int fd() const { return m_fd; }
+    // Whether a chunk (or EOF/error) can be consumed without waiting.
+    bool ready() const { return m_size > 0; }
+
+    // Arm multishot recv on the socket. Called once after connect.
+    int arm();
+    // Arm against this index of the ring's registered file table instead of
+    // the raw fd. Must be called before arm().
+    void use_fixed_file(int index) { m_file_index = index; }
+
+    // Returns the unread part of the current kernel buffer, waiting for data
+    // if there is none. 0 on EOF, -1 on error (errno set).
+    ssize_t peek(const char** data, photon::Timeout tmo = {});
+    // Drops `n` bytes of the current buffer, recycling it when exhausted.
+    void consume(size_t n);
+    // Copying recv on top of peek/consume, for callers that own the buffer
+    // (e.g. the TLS layer).
+    ssize_t recv(void* buf, size_t count, photon::Timeout tmo = {});
+
+private:
+    friend class UringRecvRing;
+    struct Chunk {
+        int32_t res;    // bytes, 0 for EOF, -errno on error
+        int32_t bid;    // provided buffer id, -1 if none
+    };
+
+    void on_completion(int32_t res, uint32_t flags);
+
+    UringRecvRing* m_ring;
+    int m_fd;
+    int m_file_index = -1;          // registered file slot, if any
+    uint64_t m_key = 0;             // user_data of our completions
+    bool m_armed = false;
+    bool m_closed = false;
+    std::vector<Chunk> m_queue;     // sized once, never grows
+    size_t m_head = 0, m_size = 0;
+    size_t m_offset = 0;            // consumed bytes of the front chunk
+    photon::condition_variable m_cond;
+};
+
+class UringRecvRing {
+public:
+    // `buf_count` must be a power of 2; `buf_count * buf_size` bytes are
+    // allocated and registered up front.
+    explicit UringRecvRing(uint32_t buf_count = 256, uint32_t buf_size = 16384,
+                           uint32_t entries = 256)
+        : m_buf_count(buf_count), m_buf_size(buf_size), m_entries(entries) {}
+
+    ~UringRecvRing() { fini(); }
+
+    int init() {
+        m_profile = get_vcpu_low_latency();
+        struct io_uring_params params = {};
+        if (m_profile.sqpoll) {
+            params.flags |= IORING_SETUP_SQPOLL;
+            params.sq_thread_idle = m_profile.sqpoll_idle_ms;
+            if (m_profile.sqpoll_cpu >= 0) {
+                params.flags |= IORING_SETUP_SQ_AFF;
+                params.sq_thread_cpu = m_profile.sqpoll_cpu;
+            }
+        }
+        int ret = io_uring_queue_init_params(m_entries, &m_ring, &params);
+        if (ret == -EPERM && m_profile.sqpoll) {
+            LOG_WARN("SQPOLL not permitted, falling back to regular submission");
+            m_profile.sqpoll = false;
+            params = {};
+            ret = io_uring_queue_init_params(m_entries, &m_ring, &params);
+        }
+        if (ret < 0) {
+            errno = -ret;
+            LOG_ERRNO_RETURN(0, -1, "failed to init io_uring for multishot recv");
+        }
+        m_ring_inited = true;
+        m_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_evfd < 0) {
+            LOG_ERRNO_RETURN(0, -1, "failed to create eventfd");
+        }
+        ret = io_uring_register_eventfd(&m_ring, m_evfd);
+        if (ret < 0) {
+            errno = -ret;
+            LOG_ERRNO_RETURN(0, -1, "failed to register eventfd");
+        }
+        if (setup_buf_ring() < 0) return -1;
+
+        auto th = photon::thread_create11(&UringRecvRing::reap_loop, this);
+        m_reaper = photon::thread_enable_join(th);
+        LOG_INFO("multishot recv ring ready: ` buffers of ` bytes", m_buf_count, m_buf_size);
+        return 0;
+    }
+
+    void fini() {
+        if (m_reaper) {
+            m_stopping = true;
+            eventfd_write(m_evfd, 1);
+            photon::thread_join(m_reaper);
+            m_reaper = nullptr;
+        }
+        if (m_br) {
+            io_uring_unregister_buf_ring(&m_ring, BGID);
+            munmap(m_br, br_bytes());
+            m_br = nullptr;
+        }
+        if (m_bufs) {
+            munmap(m_bufs, (size_t)m_buf_count * m_buf_size);
+            m_bufs = nullptr;
+        }
+        if (m_ring_inited) {
+            // also drops the registered files and buffers
+            io_uring_queue_exit(&m_ring);
+            m_ring_inited = false;
+        }
+        if (m_evfd >= 0) {
+            ::close(m_evfd);
+            m_evfd = -1;
+        }
+    }
+
+    uint32_t buf_count() const { return m_buf_count; }
+    uint32_t buf_size() const { return m_buf_size; }
+    char* buffer(int bid) { return m_bufs + (size_t)bid * m_buf_size; }
+
+    // Hands a buffer back to the kernel.
+    void recycle(int bid) {
+        io_uring_buf_ring_add(m_br, buffer(bid), m_buf_size, bid,
+                              io_uring_buf_ring_mask(m_buf_count), 0);
+        io_uring_buf_ring_advance(m_br, 1);
+        // a multishot recv that ran out of buffers has terminated and
+        // must be re-armed once buffers are available again
+        if (!m_starved.empty()) rearm_starved();
+    }
+
+    // Channels are addressed by (generation << 32 | slot) in user_data, so a
+    // completion that races with a channel going away is simply dropped.
+    uint64_t attach(UringRecvChannel* ch) {
+        uint32_t slot;
+        if (!m_free_slots.empty()) {
+            slot = m_free_slots.back();
+            m_free_slots.pop_back();
+        } else {
+            slot = m_slots.size();
+            m_slots.push_back(Slot());
+        }
+        m_slots[slot].ch = ch;
+        return ((uint64_t)++m_slots[slot].gen << 32) | slot;
+    }
+
+    void detach(uint64_t key) {
+        uint32_t slot = (uint32_t)key;
+        m_slots[slot].ch = nullptr;
+        m_free_slots.push_back(slot);
+        for (auto& x : m_starved)
+            if (x == key) x = 0;
+    }
+
+    // `fd` is an index into the registered file table if `fixed` is set.
+    int submit_recv(int fd, uint64_t key, bool fixed = false) {
+        auto sqe = get_sqe();
+        if (!sqe) LOG_ERROR_RETURN(EBUSY, -1, "io_uring submission queue full");
+        io_uring_prep_recv_multishot(sqe, fd, nullptr, 0, 0);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        if (fixed) sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->buf_group = BGID;
+        io_uring_sqe_set_data64(sqe, key);
+        int ret = io_uring_submit(&m_ring);
+        if (ret < 0) {
+            errno = -ret;
+            LOG_ERRNO_RETURN(0, -1, "failed to submit multishot recv on fd `", fd);
+        }
+        return 0;
+    }
+
+    int submit_cancel(uint64_t key) {
+        auto sqe = get_sqe();
+        if (!sqe) return -1;
+        io_uring_prep_cancel64(sqe, key, 0);
+        io_uring_sqe_set_data64(sqe, CANCEL_KEY);
+        return io_uring_submit(&m_ring);
+    }
+
+    void add_starved(uint64_t key) { m_starved.push_back(key); }
+
+    // Runs one operation prepared by `prep(sqe)` and waits for its result,
+    // cancelling it on timeout. Returns res, or -1 with errno set.
+    template <typename Prep>
+    ssize_t call(Prep&& prep, photon::Timeout tmo = {}) {
+        auto sqe = get_sqe();
+        if (!sqe) LOG_ERROR_RETURN(EBUSY, -1, "io_uring submission queue full");
+        Waiter w;
+        prep(sqe);
+        uint64_t key = (uint64_t)&w | WAITER_BIT;
+        io_uring_sqe_set_data64(sqe, key);
+        int ret = io_uring_submit(&m_ring);
+        if (ret < 0) {
+            errno = -ret;
+            return -1;
+        }
+        bool timedout = false;
+        while (!w.done) {
+            if (w.cond.wait_no_lock(timedout ? photon::Timeout() : tmo) < 0 &&
+                    errno == ETIMEDOUT && !timedout) {
+                // `w` lives on our stack: wait for the cancelled completion
+                timedout = true;
+                submit_cancel(key);
+            }
+        }
+        if (w.res < 0) {
+            errno = (timedout && w.res == -ECANCELED) ? ETIMEDOUT : -w.res;
+            return -1;
+        }
+        return w.res;
+    }
+
+    // Sparse registered file table with `capacity` slots (IORING_REGISTER_FILES).
+    int init_file_table(uint32_t capacity) {
+        if (!m_files.empty()) return 0;
+        std::vector<int> fds(capacity, -1);
+        int ret = io_uring_register_files(&m_ring, fds.data(), capacity);
+        if (ret < 0) {
+            errno = -ret;
+            LOG_ERRNO_RETURN(0, -1, "failed to register file table");
+        }
+        m_files.swap(fds);
+        return 0;
+    }
+
+    // Puts `fd` into the file table, returns its index.
+    int register_fd(int fd) {
+        if (m_files.empty() && init_file_table(DEFAULT_FILE_TABLE) < 0) return -1;
+        for (size_t i = 0; i < m_files.size(); i++) {
+            if (m_files[i] >= 0) continue;
+            int ret = io_uring_register_files_update(&m_ring, i, &fd, 1);
+            if (ret < 0) {
+                errno = -ret;
+                LOG_ERRNO_RETURN(0, -1, "failed to register fd `", fd);
+            }
+            m_files[i] = fd;
+            return i;
+        }
+        LOG_ERROR_RETURN(ENFILE, -1, "registered file table is full");
+    }
+
+    void unregister_fd(int index) {
+        int fd = -1;
+        io_uring_register_files_update(&m_ring, index, &fd, 1);
+        m_files[index] = -1;
+    }
+
+    // IORING_REGISTER_BUFFERS; a ring holds one set of fixed buffers.
+    int register_buffers(const struct iovec* iov, unsigned n) {
+        int ret = io_uring_register_buffers(&m_ring, iov, n);
+        if (ret < 0) {
+            errno = -ret;
+            LOG_ERRNO_RETURN(0, -1, "failed to register ` fixed buffers", n);
+        }
+        return 0;
+    }
+
+    void unregister_buffers() { io_uring_unregister_buffers(&m_ring); }
+
+private:
+    static const uint16_t BGID = 0;
+    static const uint64_t CANCEL_KEY = -1UL;
+    static const uint64_t WAITER_BIT = 1UL << 63;
+    static const uint32_t DEFAULT_FILE_TABLE = 1024;
+
+    struct Waiter {
+        int32_t res = 0;
+        bool done = false;
+        photon::condition_variable cond;
+    };
+
+    struct Slot {
+        UringRecvChannel* ch = nullptr;
+        uint32_t gen = 0;
+    };
+
+    struct io_uring_sqe* get_sqe() {
+        auto sqe = io_uring_get_sqe(&m_ring);
+        if (!sqe) {
+            io_uring_submit(&m_ring);
+            sqe = io_uring_get_sqe(&m_ring);
+        }
+        return sqe;
+    }
+
+    UringRecvChannel* lookup(uint64_t key) {
+        uint32_t slot = (uint32_t)key;
+        if ((key & WAITER_BIT) || slot >= m_slots.size()) return nullptr;
+        auto& s = m_slots[slot];
+        return (s.gen == (uint32_t)(key >> 32)) ? s.ch : nullptr;
+    }
+
+    size_t br_bytes() const {
+        return (size_t)m_buf_count * sizeof(struct io_uring_buf);
+    }
+
+    int setup_buf_ring() {
+        if (m_buf_count == 0 || (m_buf_count & (m_buf_count - 1)) != 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "buffer count ` is not a power of 2", m_buf_count);
+        // anonymous mappings are zero-filled, so the ring tail starts at 0;
+        // the ring and the buffers are on this vCPU's node
+        auto mem = mmap_local(br_bytes());
+        if (!mem)
+            LOG_ERRNO_RETURN(0, -1, "failed to map buffer ring");
+        m_br = (struct io_uring_buf_ring*)mem;
+
+        struct io_uring_buf_reg reg = {};
+        reg.ring_addr = (uint64_t)m_br;
+        reg.ring_entries = m_buf_count;
+        reg.bgid = BGID;
+        int ret = io_uring_register_buf_ring(&m_ring, &reg, 0);
+        if (ret < 0) {
+            munmap(m_br, br_bytes());
+            m_br = nullptr;
+            errno = -ret;
+            LOG_ERRNO_RETURN(0, -1, "failed to register buffer ring (kernel < 5.19?)");
+        }
+
+        mem = mmap_local((size_t)m_buf_count * m_buf_size);
+        if (!mem)
+            LOG_ERRNO_RETURN(0, -1, "failed to map receive buffers");
+        m_bufs = (char*)mem;
+
+        int mask = io_uring_buf_ring_mask(m_buf_count);
+        for (uint32_t i = 0; i < m_buf_count; i++)
+            io_uring_buf_ring_add(m_br, buffer(i), m_buf_size, i, mask, i);
+        io_uring_buf_ring_advance(m_br, m_buf_count);
+        return 0;
+    }
+
+    void rearm_starved() {
+        auto starved = std::move(m_starved);
+        m_starved.clear();
+        for (auto key : starved) {
+            auto ch = lookup(key);
+            if (ch && ch->arm() < 0)
+                LOG_ERROR("failed to re-arm multishot recv on fd `", ch->fd());
+        }
+    }
+
+    void drain() {
+        struct io_uring_cqe* cqe;
+        unsigned head, n = 0;
+        io_uring_for_each_cqe(&m_ring, head, cqe) {
+            auto key = io_uring_cqe_get_data64(cqe);
+            auto ch = lookup(key);
+            if (key != CANCEL_KEY && (key & WAITER_BIT)) {
+                auto w = (Waiter*)(key & ~WAITER_BIT);
+                w->res = cqe->res;
+                w->done = true;
+                w->cond.notify_one();
+            } else if (ch) {
+                ch->on_completion(cqe->res, cqe->flags);
+            } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+                // data for a channel that is already gone
+                recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            n++;
+        }
+        io_uring_cq_advance(&m_ring, n);
+    }
+
+    // Polls the completion queue for up to the spin budget, yielding to
+    // other coroutines in between. Returns true if completions showed up.
+    bool spin() {
+        auto deadline = photon::update_now() + m_profile.spin_budget_us;
+        do {
+            if (io_uring_cq_ready(&m_ring)) return true;
+            photon::thread_yield();
+        } while (!m_stopping && photon::update_now() < deadline);
+        return io_uring_cq_ready(&m_ring) > 0;
+    }
+
+    void reap_loop() {
+        while (!m_stopping) {
+            if (m_profile.spinning() && spin()) {
+                drain();
+                continue;
+            }
+            if (photon::wait_for_fd_readable(m_evfd) < 0) {
+                if (errno == EINTR) continue;
+                LOG_ERROR("wait on multishot ring eventfd failed, errno=`", errno);
+                break;
+            }
+            eventfd_t cnt;
+            eventfd_read(m_evfd, &cnt);
+            drain();
+        }
+    }
+
+    struct io_uring m_ring;
+    LowLatencyProfile m_profile;
+    bool m_ring_inited = false;
+    int m_evfd = -1;
+    struct io_uring_buf_ring* m_br = nullptr;
+    char* m_bufs = nullptr;
+    uint32_t m_buf_count, m_buf_size, m_entries;
+    std::vector<Slot> m_slots;
+    std::vector<uint32_t> m_free_slots;
+    std::vector<uint64_t> m_starved;
+    std::vector<int> m_files;       // registered file table, -1 for free
+    photon::join_handle* m_reaper = nullptr;
+    bool m_stopping = false;
+};
+
+inline UringRecvChannel::UringRecvChannel(UringRecvRing* ring, int fd)
+    : m_ring(ring), m_fd(fd), m_queue(ring->buf_count() + 2) {
+    m_key = m_ring->attach(this);
+}
+
+inline UringRecvChannel::~UringRecvChannel() {
+    m_closed = true;
+    if (m_armed) m_ring->submit_cancel(m_key);
+    m_ring->detach(m_key);
+    for (; m_size; m_size--, m_head = (m_head + 1) % m_queue.size()) {
+        if (m_queue[m_head].bid >= 0) m_ring->recycle(m_queue[m_head].bid);
+    }
+}
+
+inline int UringRecvChannel::arm() {
+    if (m_closed) return 0;
+    bool fixed = m_file_index >= 0;
+    if (m_ring->submit_recv(fixed ? m_file_index : m_fd, m_key, fixed) < 0) return -1;
+    m_armed = true;
+    return 0;
+}
+
+inline void UringRecvChannel::on_completion(int32_t res, uint32_t flags) {
+    int32_t bid = (flags & IORING_CQE_F_BUFFER) ? (int32_t)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        m_armed = false;
+        if (res == -ENOBUFS) {
+            // ran dry of provided buffers; re-armed on the next recycle
+            m_ring->add_starved(m_key);
+            return;
+        }
+        if (res > 0 && arm() < 0) {
+            if (bid >= 0) m_ring->recycle(bid);
+            res = -EIO;
+            bid = -1;
+        }
+    }
+    if (m_size == m_queue.size()) {
+        // cannot happen: there are never more chunks than provided buffers
+        LOG_ERROR("multishot queue overflow on fd `", m_fd);
+        if (bid >= 0) m_ring->recycle(bid);
+        return;
+    }
+    m_queue[(m_head + m_size) % m_queue.size()] = Chunk{res, bid};
+    m_size++;
+    m_cond.notify_all();
+}
+
+inline ssize_t UringRecvChannel::peek(const char** data, photon::Timeout tmo) {
+    while (m_size == 0) {
+        if (m_cond.wait_no_lock(tmo) < 0 && errno != EINTR) return -1;
+    }
+    auto& c = m_queue[m_head];
+    if (c.res <= 0) {
+        if (c.res == 0) return 0;
+        errno = -c.res;
+        return -1;
+    }
+    *data = m_ring->buffer(c.bid) + m_offset;
+    return c.res - m_offset;
+}
+
+inline void UringRecvChannel::consume(size_t n) {
+    if (m_size == 0) return;
+    auto& c = m_queue[m_head];
+    if (c.res <= 0) return;
+    m_offset += n;
+    if (m_offset < (size_t)c.res) return;
+    m_ring->recycle(c.bid);
+    m_offset = 0;
+    m_head = (m_head + 1) % m_queue.size();
+    m_size--;
+}
+
+inline ssize_t UringRecvChannel::recv(void* buf, size_t count, photon::Timeout tmo) {
+    const char* data;
+    ssize_t n = peek(&data, tmo);
+    if (n <= 0) return n;
+    if ((size_t)n > count) n = count;
+    memcpy(buf, data, n);
+    consume(n);
+    return n;
+}
+
+// A socket stream whose receive side is served by multishot recv.
+// Everything else is forwarded to the underlay stream.
+class MultishotSocketStream : public photon::net::ISocketStream {
+public:
+    MultishotSocketStream(UringRecvRing* ring, photon::net::ISocketStream* underlay, bool ownership)
+        : m_underlay(underlay), m_ownership(ownership),
+          m_channel(ring, underlay->get_underlay_fd()) {}
+
+    virtual ~MultishotSocketStream() {
+        if (m_ownership) delete m_underlay;
+    }
+
+    int arm() { return m_channel.arm(); }
+    UringRecvChannel* channel() { return &m_channel; }
+    // Keep the underlay alive when this wrapper is deleted.
+    void release_underlay() { m_ownership = false; }
+
+    ssize_t recv(void* buf, size_t count, int /*flags*/ = 0) override {
+        return m_channel.recv(buf, count, m_timeout);
+    }
+    ssize_t recv(const struct iovec* iov, int iovcnt, int /*flags*/ = 0) override {
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len == 0) continue;
+            // block only for the first chunk
+            if (total > 0 && !m_channel.ready()) break;
+            ssize_t n = m_channel.recv(iov[i].iov_base, iov[i].iov_len, m_timeout);
+            if (n <= 0) return total ? total : n;
+            total += n;
+            if ((size_t)n < iov[i].iov_len) break;
+        }
+        return total;
+    }
+    ssize_t read(void* buf, size_t count) override {
+        size_t done = 0;
+        while (done < count) {
+            ssize_t n = m_channel.recv((char*)buf + done, count - done, m_timeout);
+            if (n < 0) return done ? (ssize_t)done : -1;
+            if (n == 0) break;
+            done += n;
+        }
+        return done;
+    }
+    ssize_t readv(const struct iovec* iov, int iovcnt) override {
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t n = read(iov[i].iov_base, iov[i].iov_len);
+            if (n < 0) return total ? total : -1;
+            total += n;
+            if ((size_t)n < iov[i].iov_len) break;
+        }
+        return total;
+    }
+
+    ssize_t send(const void* buf, size_t count, int flags = 0) override {
+        return m_underlay->send(buf, count, flags);
+    }
+    ssize_t send(const struct iovec* iov, int iovcnt, int flags = 0) override {
+        return m_underlay->send(iov, iovcnt, flags);
+    }
+    ssize_t write(const void* buf, size_t count) override {
+        return m_underlay->write(buf, count);
+    }
+    ssize_t writev(const struct iovec* iov, int iovcnt) override {
+        return m_underlay->writev(iov, iovcnt);
+    }
+    ssize_t sendfile(int in_fd, off_t offset, size_t count) override {
+        return m_underlay->sendfile(in_fd, offset, count);
+    }
+    int close() override { return m_underlay->close(); }
+    int shutdown(photon::net::ShutdownHow how) override { return m_underlay->shutdown(how); }
+
+    photon::Object* get_underlay_object(uint64_t recursion = 0) override {
+        return m_underlay->get_underlay_object(recursion);
+    }
+    int setsockopt(int level, int option_name, const void* option_value, socklen_t option_len) override {
+        return m_underlay->setsockopt(level, option_name, option_value, option_len);
+    }
+    int getsockopt(int level, int option_name, void* option_value, socklen_t* option_len) override {
+        return m_underlay->getsockopt(level, option_name, option_value, option_len);
+    }
+    uint64_t timeout() const override { return m_timeout; }
+    void timeout(uint64_t tm) override {
+        m_timeout = tm;
+        m_underlay->timeout(tm);
+    }
+    int getsockname(photon::net::EndPoint& addr) override { return m_underlay->getsockname(addr); }
+    int getpeername(photon::net::EndPoint& addr) override { return m_underlay->getpeername(addr); }
+    int getsockname(char* path, size_t count) override { return m_underlay->getsockname(path, count); }
+    int getpeername(char* path, size_t count) override { return m_underlay->getpeername(path, count); }
+
+protected:
+    photon::net::ISocketStream* m_underlay;
+    bool m_ownership;
+    uint64_t m_timeout = -1UL;
+    UringRecvChannel m_channel;
+};
+
+// Socket client whose streams receive through multishot recv on `ring`.
+// Can be wrapped by net::new_tls_client like any other client.
+class MultishotSocketClient : public photon::net::ISocketClient {
+public:
+    MultishotSocketClient(UringRecvRing* ring, photon::net::ISocketClient* base, bool ownership)
+        : m_ring(ring), m_base(base), m_ownership(ownership) {}
+
+    virtual ~MultishotSocketClient() {
+        if (m_ownership) delete m_base;
+    }
+
+    photon::net::ISocketStream* connect(const photon::net::EndPoint& remote,
+                                        const photon::net::EndPoint* local = nullptr) override {
+        return wrap(m_base->connect(remote, local));
+    }
+    photon::net::ISocketStream* connect(const char* path, size_t count = 0) override {
+        return wrap(m_base->connect(path, count));
+    }
+
+    photon::Object* get_underlay_object(uint64_t recursion = 0) override {
+        return m_base->get_underlay_object(recursion);
+    }
+    int setsockopt(int level, int option_name, const void* option_value, socklen_t option_len) override {
+        return m_base->setsockopt(level, option_name, option_value, option_len);
+    }
+    int getsockopt(int level, int option_name, void* option_value, socklen_t* option_len) override {
+        return m_base->getsockopt(level, option_name, option_value, option_len);
+    }
+    uint64_t timeout() const override { return m_base->timeout(); }
+    void timeout(uint64_t tm) override { m_base->timeout(tm); }
+
+protected:
+    virtual MultishotSocketStream* new_stream(photon::net::ISocketStream* stream) {
+        return new MultishotSocketStream(m_ring, stream, true);
+    }
+
+    UringRecvRing* m_ring;
+
+private:
+    photon::net::ISocketStream* wrap(photon::net::ISocketStream* stream) {
+        if (!stream) return nullptr;
+        apply_busy_poll(stream);
+        auto ms = new_stream(stream);
+        if (!ms) {
+            delete stream;
+            return nullptr;
+        }
+        if (ms->arm() < 0) {
+            delete ms;
+            return nullptr;
+        }
+        return ms;
+    }
+
+    photon::net::ISocketClient* m_base;
+    bool m_ownership;
+};
+
+inline std::unique_ptr<UringRecvRing>& vcpu_recv_ring_slot() {
+    static thread_local std::unique_ptr<UringRecvRing> ring;
+    return ring;
+}
+
+// The multishot ring of the current vCPU, created on first use.
+inline UringRecvRing* get_vcpu_recv_ring() {
+    auto& ring = vcpu_recv_ring_slot();
+    if (!ring) {
+        std::unique_ptr<UringRecvRing> r(new UringRecvRing());
+        if (r->init() < 0) return nullptr;
+        ring = std::move(r);
+    }
+    return ring.get();
+}
+
+// Stops the current vCPU's ring, joining its reaper, and frees it. Call it
+// before photon::fini() on every vCPU that used the ring, once its streams
+// are closed: left to thread exit, the reaper would be joined after its
+// vCPU is gone. With registered-io.h, release_vcpu_buffer_pool() instead.
+inline void release_vcpu_recv_ring() {
+    vcpu_recv_ring_slot().reset();
+}
+
+// Drop-in for net::new_iouring_tcp_client() with multishot receive. Falls
+// back to the plain io_uring client if the ring cannot be set up.
+inline photon::net::ISocketClient* new_multishot_tcp_client(UringRecvRing* ring = nullptr) {
+    auto base = photon::net::new_iouring_tcp_client();
+    if (!ring) ring = get_vcpu_recv_ring();
+    if (!base || !ring) return base;
+    return new MultishotSocketClient(ring, base, true);
+}
@@ -0,0 +1,139 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Single-pass scanning of exchange JSON, without a DOM and without
+// allocating. Members and elements are handed to a callback as slices of the
+// input (strings without their quotes, escapes left as they are), nested
+// arrays and objects as their whole text, so that a parser for one message
+// type is a switch over keys that the compiler can inline into the callback.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+inline const char* json_skip_space(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+// End of the value starting at `p`, nullptr if it is cut short.
+inline const char* json_skip_value(const char* p, const char* end) {
+    if (p >= end) return nullptr;
+    if (*p == '"') {
+        for (p++; p < end; p++) {
+            if (*p == '\\') {
+                p++;
+            } else if (*p == '"') {
+                return p + 1;
+            }
+        }
+        return nullptr;
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            char c = *p;
+            if (c == '"') {
+                p = json_skip_value(p, end);
+                if (!p) return nullptr;
+                continue;
+            }
+            if (c == '{' || c == '[') {
+                depth++;
+            } else if ((c == '}' || c == ']') && --depth == 0) {
+                return p + 1;
+            }
+            p++;
+        }
+        return nullptr;
+    }
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\r' && *p != '\n') p++;
+    return p;
+}
+
+// Calls f(value, len) for the value at [p, end): strings lose their quotes.
+template <typename F>
+inline void json_emit(const char* p, const char* end, F& f) {
+    if (*p == '"') {
+        f(p + 1, (size_t)(end - p - 2));
+    } else {
+        f(p, (size_t)(end - p));
+    }
+}
+
+// Calls f(key, key_len, value, value_len) for each member of the object
+// in `p`. False if it is not a complete object.
+template <typename F>
+inline bool json_for_each_member(const char* p, size_t n, F&& f) {
+    const char* end = p + n;
+    p = json_skip_space(p, end);
+    if (p == end || *p != '{') return false;
+    p = json_skip_space(p + 1, end);
+    if (p < end && *p == '}') return true;
+    while (p < end && *p == '"') {
+        const char* key_end = json_skip_value(p, end);
+        if (!key_end) return false;
+        const char* key = p + 1;
+        size_t key_len = key_end - key - 1;
+        p = json_skip_space(key_end, end);
+        if (p == end || *p != ':') return false;
+        p = json_skip_space(p + 1, end);
+        const char* val_end = json_skip_value(p, end);
+        if (!val_end || val_end == p) return false;
+        auto member = [&](const char* v, size_t len) { f(key, key_len, v, len); };
+        json_emit(p, val_end, member);
+        p = json_skip_space(val_end, end);
+        if (p < end && *p == '}') return true;
+        if (p == end || *p != ',') return false;
+        p = json_skip_space(p + 1, end);
+    }
+    return false;
+}
+
+// Calls f(value, len) for each element of the array in `p`. False if it is
+// not a complete array.
+template <typename F>
+inline bool json_for_each_element(const char* p, size_t n, F&& f) {
+    const char* end = p + n;
+    p = json_skip_space(p, end);
+    if (p == end || *p != '[') return false;
+    p = json_skip_space(p + 1, end);
+    if (p < end && *p == ']') return true;
+    while (p < end) {
+        const char* val_end = json_skip_value(p, end);
+        if (!val_end || val_end == p) return false;
+        json_emit(p, val_end, f);
+        p = json_skip_space(val_end, end);
+        if (p < end && *p == ']') return true;
+        if (p == end || *p != ',') return false;
+        p = json_skip_space(p + 1, end);
+    }
+    return false;
+}
+
+// Unsigned decimal, stopping at the first non-digit.
+inline uint64_t json_uint(const char* p, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n && p[i] >= '0' && p[i] <= '9'; i++) v = v * 10 + (p[i] - '0');
+    return v;
+}
+
+inline bool json_is(const char* p, size_t n, const char* lit, size_t lit_len) {
+    if (n != lit_len) return false;
+    for (size_t i = 0; i < n; i++)
+        if (p[i] != lit[i]) return false;
+    return true;
+}
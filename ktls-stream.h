@@ -0,0 +1,272 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// TLS stream with kernel TLS offload (OpenSSL >= 3.0, SSL_OP_ENABLE_KTLS).
+//
+// net::new_tls_stream keeps the record layer in user space. This stream runs
+// the handshake with OpenSSL directly on the socket fd, waiting for the fd
+// through Photon when OpenSSL wants to read or write, and lets OpenSSL push
+// the session keys into the kernel. Once kTLS is on, SSL_write/SSL_read are
+// plain socket writes/reads and SSL_sendfile sends file pages without
+// bringing them to user space. Without kernel support it behaves like an
+// ordinary TLS stream, and sendfile encrypts straight from mmapped file
+// pages (write_mapped_file).
+#pragma once
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+#include <photon/net/socket.h>
+
+// Writes `count` bytes of the file from `offset` through `s`, from a
+// read-only mapping of the file in windows of `window` bytes, so the
+// stream's write is the only pass over the data (for TLS, the encryption
+// reads the page cache directly). The file must not shrink meanwhile.
+inline ssize_t write_mapped_file(photon::net::ISocketStream* s, int fd, off_t offset, size_t count,
+                                 size_t window = 4 << 20) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t done = 0;
+    while (done < count) {
+        off_t pos = offset + done;
+        off_t base = pos & ~(off_t)(page - 1);
+        size_t skip = pos - base;
+        size_t n = count - done < window ? count - done : window;
+        auto p = (char*)mmap(nullptr, skip + n, PROT_READ, MAP_SHARED, fd, base);
+        if (p == MAP_FAILED) {
+            if (done) return done;
+            LOG_ERRNO_RETURN(0, -1, "failed to map file for sending");
+        }
+        madvise(p, skip + n, MADV_WILLNEED);
+        ssize_t w = s->write(p + skip, n);
+        munmap(p, skip + n);
+        if (w > 0) done += w;
+        if (w != (ssize_t)n) return done ? (ssize_t)done : -1;
+    }
+    return done;
+}
+
+inline SSL_CTX* new_ktls_context(const char* cert_str = nullptr, const char* key_str = nullptr) {
+    SSL_CTX* ctx = SSL_CTX_new(cert_str ? TLS_server_method() : TLS_client_method());
+    if (!ctx) LOG_ERROR_RETURN(0, nullptr, "failed to create SSL context");
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // ciphers the kernel can offload
+    SSL_CTX_set_cipher_list(ctx, "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384");
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384");
+    if (cert_str && key_str) {
+        BIO* cbio = BIO_new_mem_buf(cert_str, -1);
+        X509* cert = PEM_read_bio_X509(cbio, nullptr, nullptr, nullptr);
+        BIO_free(cbio);
+        BIO* kbio = BIO_new_mem_buf(key_str, -1);
+        EVP_PKEY* key = PEM_read_bio_PrivateKey(kbio, nullptr, nullptr, nullptr);
+        BIO_free(kbio);
+        int ok = cert && key && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+                 SSL_CTX_use_PrivateKey(ctx, key) == 1;
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        if (!ok) {
+            SSL_CTX_free(ctx);
+            LOG_ERROR_RETURN(0, nullptr, "failed to load certificate or key");
+        }
+    }
+    return ctx;
+}
+
+class KtlsSocketStream : public photon::net::ISocketStream {
+public:
+    KtlsSocketStream(SSL_CTX* ctx, photon::net::ISocketStream* underlay, bool server, bool ownership)
+        : m_underlay(underlay), m_ownership(ownership), m_server(server) {
+        m_fd = underlay->get_underlay_fd();
+        // OpenSSL does its own I/O on the fd; it must not block the vCPU, so
+        // WANT_READ/WANT_WRITE come back and the coroutine waits instead.
+        int fl = fcntl(m_fd, F_GETFL);
+        if (fl >= 0 && !(fl & O_NONBLOCK)) fcntl(m_fd, F_SETFL, fl | O_NONBLOCK);
+        m_ssl = SSL_new(ctx);
+        if (m_ssl) SSL_set_fd(m_ssl, m_fd);
+    }
+
+    ~KtlsSocketStream() {
+        close();
+        if (m_ownership) delete m_underlay;
+    }
+
+    int handshake(photon::Timeout tmo = {}) {
+        if (!m_ssl) LOG_ERROR_RETURN(ENOMEM, -1, "failed to create SSL object");
+        int ret = ssl_call([&] {
+            return m_server ? SSL_accept(m_ssl) : SSL_connect(m_ssl);
+        }, tmo);
+        if (ret != 1) LOG_ERROR_RETURN(0, -1, "TLS handshake failed");
+        LOG_DEBUG("TLS handshake done, ktls send=`, recv=`", ktls_send(), ktls_recv());
+        return 0;
+    }
+
+    bool ktls_send() const { return m_ssl && BIO_get_ktls_send(SSL_get_wbio(m_ssl)); }
+    bool ktls_recv() const { return m_ssl && BIO_get_ktls_recv(SSL_get_rbio(m_ssl)); }
+
+    ssize_t recv(void* buf, size_t count, int /*flags*/ = 0) override {
+        return ssl_call([&] { return SSL_read(m_ssl, buf, (int)count); }, m_timeout);
+    }
+    ssize_t recv(const struct iovec* iov, int iovcnt, int flags = 0) override {
+        return iovcnt > 0 ? recv(iov[0].iov_base, iov[0].iov_len, flags) : 0;
+    }
+    ssize_t send(const void* buf, size_t count, int /*flags*/ = 0) override {
+        return ssl_call([&] { return SSL_write(m_ssl, buf, (int)count); }, m_timeout);
+    }
+    ssize_t send(const struct iovec* iov, int iovcnt, int /*flags*/ = 0) override {
+        return writev(iov, iovcnt);
+    }
+    ssize_t read(void* buf, size_t count) override {
+        size_t done = 0;
+        while (done < count) {
+            ssize_t n = recv((char*)buf + done, count - done);
+            if (n < 0) return done ? (ssize_t)done : -1;
+            if (n == 0) break;
+            done += n;
+        }
+        return done;
+    }
+    ssize_t readv(const struct iovec* iov, int iovcnt) override {
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t n = read(iov[i].iov_base, iov[i].iov_len);
+            if (n < 0) return total ? total : -1;
+            total += n;
+            if ((size_t)n < iov[i].iov_len) break;
+        }
+        return total;
+    }
+    ssize_t write(const void* buf, size_t count) override {
+        size_t done = 0;
+        while (done < count) {
+            ssize_t n = send((const char*)buf + done, count - done);
+            if (n <= 0) return done ? (ssize_t)done : -1;
+            done += n;
+        }
+        return done;
+    }
+    ssize_t writev(const struct iovec* iov, int iovcnt) override {
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t n = write(iov[i].iov_base, iov[i].iov_len);
+            if (n < 0) return total ? total : -1;
+            total += n;
+            if ((size_t)n < iov[i].iov_len) break;
+        }
+        return total;
+    }
+
+    // Zero-copy with kTLS; otherwise encrypted from the mapped file.
+    ssize_t sendfile(int in_fd, off_t offset, size_t count) override {
+        if (!ktls_send()) return write_mapped_file(this, in_fd, offset, count);
+        size_t done = 0;
+        while (done < count) {
+            // EAGAIN from the kernel comes back as SSL_ERROR_WANT_WRITE
+            size_t n_max = count - done < (1UL << 30) ? count - done : (1UL << 30);
+            ssize_t n = ssl_call([&] {
+                return (int)SSL_sendfile(m_ssl, in_fd, offset + done, n_max, 0);
+            }, m_timeout);
+            if (n <= 0) return done ? (ssize_t)done : -1;
+            done += n;
+        }
+        return done;
+    }
+
+    int close() override {
+        if (m_ssl) {
+            SSL_shutdown(m_ssl);
+            SSL_free(m_ssl);
+            m_ssl = nullptr;
+        }
+        return 0;
+    }
+    int shutdown(photon::net::ShutdownHow how) override {
+        if (m_ssl) SSL_shutdown(m_ssl);
+        return m_underlay->shutdown(how);
+    }
+
+    photon::Object* get_underlay_object(uint64_t recursion = 0) override {
+        return m_underlay->get_underlay_object(recursion);
+    }
+    int setsockopt(int level, int option_name, const void* option_value, socklen_t option_len) override {
+        return m_underlay->setsockopt(level, option_name, option_value, option_len);
+    }
+    int getsockopt(int level, int option_name, void* option_value, socklen_t* option_len) override {
+        return m_underlay->getsockopt(level, option_name, option_value, option_len);
+    }
+    uint64_t timeout() const override { return m_timeout; }
+    void timeout(uint64_t tm) override { m_timeout = tm; }
+    int getsockname(photon::net::EndPoint& addr) override { return m_underlay->getsockname(addr); }
+    int getpeername(photon::net::EndPoint& addr) override { return m_underlay->getpeername(addr); }
+    int getsockname(char* path, size_t count) override { return m_underlay->getsockname(path, count); }
+    int getpeername(char* path, size_t count) override { return m_underlay->getpeername(path, count); }
+
+protected:
+    // Retries an OpenSSL call, parking the coroutine on the fd whenever
+    // OpenSSL would block.
+    template <typename F>
+    int ssl_call(F&& f, photon::Timeout tmo) {
+        if (!m_ssl) {
+            errno = EBADF;
+            return -1;
+        }
+        while (true) {
+            ERR_clear_error();
+            int ret = f();
+            if (ret > 0) return ret;
+            int err = SSL_get_error(m_ssl, ret);
+            int wait;
+            if (err == SSL_ERROR_WANT_READ) {
+                wait = photon::wait_for_fd_readable(m_fd, tmo);
+            } else if (err == SSL_ERROR_WANT_WRITE) {
+                wait = photon::wait_for_fd_writable(m_fd, tmo);
+            } else if (err == SSL_ERROR_ZERO_RETURN) {
+                return 0;
+            } else {
+                char buf[256];
+                ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+                LOG_ERROR("SSL error `: `", err, buf);
+                errno = EIO;
+                return -1;
+            }
+            if (wait < 0) return -1;
+        }
+    }
+
+    photon::net::ISocketStream* m_underlay;
+    bool m_ownership;
+    bool m_server;
+    int m_fd = -1;
+    SSL* m_ssl = nullptr;
+    uint64_t m_timeout = -1UL;
+};
+
+// Wraps a connected TCP stream and runs the handshake; nullptr on failure.
+inline KtlsSocketStream* new_ktls_stream(SSL_CTX* ctx, photon::net::ISocketStream* base,
+                                         bool server, bool ownership = true) {
+    if (!base) return nullptr;
+    auto s = new KtlsSocketStream(ctx, base, server, ownership);
+    if (s->handshake(s->timeout()) < 0) {
+        delete s;
+        return nullptr;
+    }
+    return s;
+}
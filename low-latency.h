@@ -0,0 +1,91 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Per-vCPU low-latency profile.
+//
+// A vCPU is an OS thread, so the profile is thread_local: feed shards call
+// set_vcpu_low_latency() once at startup and spin, housekeeping vCPUs keep
+// the default profile and sleep in the kernel as usual. The profile is
+// consumed by the io_uring rings we own (see iouring-recv-ring.h) and by the
+// socket clients that create feed connections.
+#pragma once
+
+#include <sys/socket.h>
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+#include <photon/net/socket.h>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+struct LowLatencyProfile {
+    // IORING_SETUP_SQPOLL: a kernel thread polls the submission queue, so
+    // submissions need no syscall. `sqpoll_cpu` >= 0 pins that thread.
+    bool sqpoll = false;
+    int sqpoll_cpu = -1;
+    uint32_t sqpoll_idle_ms = 1000;
+    // Spin on the completion queue for up to this long after the last
+    // completion before going to sleep on the eventfd. 0 disables spinning.
+    uint64_t spin_budget_us = 0;
+    // SO_BUSY_POLL (us) for sockets created on this vCPU. 0 leaves it unset.
+    int busy_poll_us = 0;
+
+    bool spinning() const { return spin_budget_us > 0; }
+};
+
+inline LowLatencyProfile& vcpu_low_latency_profile() {
+    static thread_local LowLatencyProfile profile;
+    return profile;
+}
+
+// Select the profile of the current vCPU. Must be called before the vCPU's
+// rings are created (i.e. before its first feed connection).
+inline void set_vcpu_low_latency(const LowLatencyProfile& profile) {
+    vcpu_low_latency_profile() = profile;
+    LOG_INFO("vCPU low-latency profile: sqpoll=` (cpu `), spin=`us, busy_poll=`us",
+             profile.sqpoll, profile.sqpoll_cpu, profile.spin_budget_us, profile.busy_poll_us);
+}
+
+inline const LowLatencyProfile& get_vcpu_low_latency() {
+    return vcpu_low_latency_profile();
+}
+
+// The feed profile: pinned SQ poller, 50us of CQ spinning, 50us busy poll.
+inline LowLatencyProfile feed_low_latency_profile(int sqpoll_cpu = -1) {
+    LowLatencyProfile p;
+    p.sqpoll = true;
+    p.sqpoll_cpu = sqpoll_cpu;
+    p.spin_budget_us = 50;
+    p.busy_poll_us = 50;
+    return p;
+}
+
+// Applies the busy-poll part of the current vCPU's profile to a socket.
+inline int apply_busy_poll(photon::net::ISocketBase* sock) {
+    auto& p = get_vcpu_low_latency();
+    if (p.busy_poll_us <= 0) return 0;
+    int usec = p.busy_poll_us;
+    if (sock->setsockopt(SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to set SO_BUSY_POLL (needs CAP_NET_ADMIN to raise)");
+    int prefer = 1;
+    // best effort, kernel >= 5.11
+    sock->setsockopt(SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+    return 0;
+}
@@ -20,22 +20,60 @@ limitations under the License.
 #include <photon/io/fd-events.h>
 #include <photon/net/security-context/tls-stream.h>
 #include <photon/common/alog.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <memory>
 
 #include "cert-key.cpp"
+#include "file-serve.h"
+#include "sharded-tls-server.h"
 
 using namespace photon;
 
+static volatile sig_atomic_t stop_flag = 0;
+
+// main_tls [shards [handshake_vcpus [hash|cpu|migrate]]]
+// Without arguments: a single-vCPU server on Photon's TLS stream.
+// With SNAPSHOT_DIR set, clients GET the files in it over HTTP/1.1
+// (file-serve.h) instead of streaming data in.
+static int run_sharded(int argc, char** argv, ShardedTlsServer::Handler handler) {
+    ShardedTlsServerOptions opts;
+    opts.shards = atoi(argv[1]);
+    if (argc > 2) opts.handshake_vcpus = atoi(argv[2]);
+    if (argc > 3) {
+        if (strcmp(argv[3], "cpu") == 0) {
+            opts.steering = AcceptSteering::CpuLocal;
+            opts.pin_cpus = true;
+        } else if (strcmp(argv[3], "migrate") == 0) {
+            opts.steering = AcceptSteering::Migrate;
+        }
+    }
+    if (opts.shards <= 0) LOG_ERROR_RETURN(EINVAL, -1, "invalid shard count `", argv[1]);
+
+    auto ctx = new_ktls_context(cert_str, key_str);
+    if (!ctx) return -1;
+    DEFER(SSL_CTX_free(ctx));
+    ShardedTlsServer server(ctx, opts);
+    if (server.start(handler) < 0) return -1;
+    signal(SIGINT, [](int) { stop_flag = 1; });
+    signal(SIGTERM, [](int) { stop_flag = 1; });
+    while (!stop_flag) photon::thread_usleep(200 * 1000);
+    server.stop();
+    for (int i = 0; i < server.shards(); i++) {
+        auto& st = server.stats(i);
+        LOG_INFO("shard `: accepted `, handshake failed `, avg handshake ` us", i,
+                 st.accepted.load(), st.handshake_failed.load(),
+                 st.accepted ? st.handshake_us / st.accepted : 0);
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     if (photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE))
         return -1;
     DEFER(photon::fini());
 
-    auto ctx = net::new_tls_context(cert_str, key_str, passphrase_str);
-    if (!ctx) return -1;
-    DEFER(delete ctx);
-    auto server = net::new_tls_server(ctx, net::new_tcp_socket_server(), true);
-    DEFER(delete server);
-
     auto logHandle = [&](net::ISocketStream* arg) {
         auto sock = (net::ISocketStream*) arg;
         char buff[4096];
@@ -51,7 +89,21 @@ int main(int argc, char** argv) {
                  recv_cnt / ((photon::now - launchtime) / 1e6));
         return 0;
     };
-    server->set_handler(logHandle);
+    ShardedTlsServer::Handler handler = logHandle;
+    std::unique_ptr<SnapshotFileServer> files;
+    if (const char* dir = getenv("SNAPSHOT_DIR")) {
+        files.reset(new SnapshotFileServer(dir, true));
+        if (!files->ok()) return -1;
+        handler = [&](net::ISocketStream* s) { return files->handle(s); };
+    }
+    if (argc > 1) return run_sharded(argc, argv, handler);
+
+    auto ctx = net::new_tls_context(cert_str, key_str, passphrase_str);
+    if (!ctx) return -1;
+    DEFER(delete ctx);
+    auto server = net::new_tls_server(ctx, net::new_tcp_socket_server(), true);
+    DEFER(delete server);
+    server->set_handler(handler);
     server->bind_v4localhost();
     LOG_INFO("bound to ", server->getsockname());
     server->listen(1024);
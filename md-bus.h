@@ -0,0 +1,291 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Shared-memory market data bus.
+//
+// One writer process publishes fixed-layout events into a POSIX shared
+// memory ring of 256-byte slots; any number of reader processes map the same
+// ring read-only and poll it without syscalls. Every event gets a sequence
+// number (1, 2, ...) and lands in slot `seq & (capacity - 1)`. The slot's
+// sequence word doubles as a seqlock: the writer zeroes it, copies the
+// event, then stores the new sequence, so a reader can tell a complete event
+// from one that is being overwritten under it.
+//
+// The writer never waits for readers. A reader that falls more than
+// `capacity` events behind has been overrun: poll() reports it, counts the
+// lost events and resumes at the newest event.
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string.h>
+
+#include <photon/common/alog.h>
+
+const uint64_t MD_BUS_MAGIC = 0x3153554244444dULL;    // "MDDBUS1"
+const uint32_t MD_BUS_VERSION = 2;
+const size_t MD_SLOT_SIZE = 256;
+const size_t MD_SLOT_PAYLOAD = MD_SLOT_SIZE - 8;
+const int MD_BOOK_LEVELS = 12;
+// Prices and quantities are fixed point with 8 decimals.
+const int64_t MD_PRICE_SCALE = 100000000;
+
+enum MdEventType : uint16_t {
+    MD_TRADE = 1,
+    MD_BOOK_UPDATE = 2,
+    MD_END = 0xFFFF,        // end of stream, e.g. the writer shut down
+};
+
+struct MdEventHeader {
+    uint16_t type;
+    uint16_t size;          // of the whole event
+    uint32_t symbol_id;     // SymbolId of the writer (symbol-table.h)
+    uint64_t exchange_ts_ns;
+    uint64_t publish_ts_ns; // md_now_ns() when written to the bus
+};
+
+struct MdTrade {
+    MdEventHeader hdr;
+    int64_t price;
+    int64_t qty;
+    uint64_t trade_id;
+    uint8_t buyer_is_maker;
+    uint8_t pad[7];
+};
+
+struct MdBookLevel {
+    int64_t price;
+    int64_t qty;            // 0 removes the level
+};
+
+// One exchange update may take several events (up to MD_BOOK_LEVELS levels
+// of one side each); they all carry its update ids, the final one `last`.
+struct MdBookUpdate {
+    MdEventHeader hdr;
+    uint8_t side;           // 0 bid, 1 ask
+    uint8_t count;
+    uint8_t last;
+    uint8_t pad[5];
+    uint64_t first_update_id;
+    uint64_t last_update_id;
+    MdBookLevel levels[MD_BOOK_LEVELS];
+};
+
+union MdEvent {
+    MdEventHeader hdr;
+    MdTrade trade;
+    MdBookUpdate book;
+    char raw[MD_SLOT_PAYLOAD];
+};
+
+static_assert(sizeof(MdEvent) <= MD_SLOT_PAYLOAD, "event does not fit a slot");
+
+// CLOCK_MONOTONIC is shared by all processes on the host, so publish_ts_ns
+// can be compared against a reader's md_now_ns().
+inline uint64_t md_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct MdBusHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    alignas(64) std::atomic<uint64_t> write_seq;    // last published sequence
+};
+
+struct alignas(64) MdSlot {
+    std::atomic<uint64_t> seq;      // 0 while being written
+    char payload[MD_SLOT_PAYLOAD];
+};
+
+static_assert(sizeof(MdSlot) == MD_SLOT_SIZE, "unexpected slot size");
+
+inline size_t md_bus_size(uint64_t capacity) {
+    return sizeof(MdBusHeader) + capacity * sizeof(MdSlot);
+}
+
+class MdBusWriter {
+public:
+    ~MdBusWriter() { close(); }
+
+    // Creates (or recreates) the bus `name`, e.g. "/md-bus". `capacity` is
+    // the number of events kept and must be a power of 2.
+    int open(const char* name, uint64_t capacity = 65536) {
+        if (capacity == 0 || (capacity & (capacity - 1)))
+            LOG_ERROR_RETURN(EINVAL, -1, "bus capacity ` is not a power of 2", capacity);
+        int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+        if (fd < 0) LOG_ERRNO_RETURN(0, -1, "failed to open shm `", name);
+        m_size = md_bus_size(capacity);
+        if (ftruncate(fd, m_size) < 0) {
+            ::close(fd);
+            LOG_ERRNO_RETURN(0, -1, "failed to size shm `", name);
+        }
+        void* p = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) LOG_ERRNO_RETURN(0, -1, "failed to map shm `", name);
+        m_hdr = (MdBusHeader*)p;
+        m_slots = (MdSlot*)(m_hdr + 1);
+        m_mask = capacity - 1;
+        // invalidate first, so readers of a previous incarnation notice
+        __atomic_store_n(&m_hdr->magic, 0, __ATOMIC_RELEASE);
+        for (uint64_t i = 0; i < capacity; i++) m_slots[i].seq.store(0, std::memory_order_relaxed);
+        m_hdr->version = MD_BUS_VERSION;
+        m_hdr->slot_size = MD_SLOT_SIZE;
+        m_hdr->capacity = capacity;
+        m_hdr->write_seq.store(0, std::memory_order_relaxed);
+        m_seq = 0;
+        __atomic_store_n(&m_hdr->magic, MD_BUS_MAGIC, __ATOMIC_RELEASE);
+        LOG_INFO("market data bus ` ready: ` slots, ` bytes", name, capacity, m_size);
+        return 0;
+    }
+
+    void close() {
+        if (m_hdr) munmap(m_hdr, m_size);
+        m_hdr = nullptr;
+    }
+
+    // Copies the event into the next slot and returns its sequence number.
+    // Stamps publish_ts_ns.
+    uint64_t publish(MdEvent& ev) {
+        ev.hdr.publish_ts_ns = md_now_ns();
+        uint64_t seq = ++m_seq;
+        auto& slot = m_slots[seq & m_mask];
+        slot.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(slot.payload, &ev, ev.hdr.size);
+        slot.seq.store(seq, std::memory_order_release);
+        m_hdr->write_seq.store(seq, std::memory_order_release);
+        return seq;
+    }
+
+    template <typename T>
+    uint64_t publish(T& ev) {
+        static_assert(sizeof(T) <= sizeof(MdEvent), "not a bus event");
+        ev.hdr.size = sizeof(T);
+        return publish(reinterpret_cast<MdEvent&>(ev));
+    }
+
+    uint64_t sequence() const { return m_seq; }
+
+private:
+    MdBusHeader* m_hdr = nullptr;
+    MdSlot* m_slots = nullptr;
+    size_t m_size = 0;
+    uint64_t m_mask = 0;
+    uint64_t m_seq = 0;
+};
+
+class MdBusReader {
+public:
+    ~MdBusReader() { close(); }
+
+    // Maps an existing bus read-only. New readers start at the next event;
+    // with `from_oldest`, at the oldest event still in the ring.
+    int open(const char* name, bool from_oldest = false) {
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) LOG_ERRNO_RETURN(0, -1, "failed to open shm `", name);
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(MdBusHeader)) {
+            ::close(fd);
+            LOG_ERROR_RETURN(EINVAL, -1, "shm ` is not a market data bus", name);
+        }
+        m_size = st.st_size;
+        void* p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) LOG_ERRNO_RETURN(0, -1, "failed to map shm `", name);
+        m_hdr = (const MdBusHeader*)p;
+        if (__atomic_load_n(&m_hdr->magic, __ATOMIC_ACQUIRE) != MD_BUS_MAGIC ||
+                m_hdr->version != MD_BUS_VERSION || m_hdr->slot_size != MD_SLOT_SIZE ||
+                md_bus_size(m_hdr->capacity) > m_size) {
+            close();
+            LOG_ERROR_RETURN(EINVAL, -1, "shm ` is not a market data bus (v`)", name, MD_BUS_VERSION);
+        }
+        m_slots = (const MdSlot*)(m_hdr + 1);
+        m_capacity = m_hdr->capacity;
+        uint64_t w = m_hdr->write_seq.load(std::memory_order_acquire);
+        m_next = from_oldest && w >= m_capacity ? w - m_capacity + 1 : from_oldest ? 1 : w + 1;
+        return 0;
+    }
+
+    void close() {
+        if (m_hdr) munmap((void*)m_hdr, m_size);
+        m_hdr = nullptr;
+    }
+
+    // Returns 1 and fills `ev` if the next event is available, 0 if the
+    // reader is caught up, -1 if it was overrun (see lost()); polling again
+    // continues from the newest published event.
+    int poll(MdEvent* ev) {
+        auto& slot = m_slots[m_next & (m_capacity - 1)];
+        uint64_t s1 = slot.seq.load(std::memory_order_acquire);
+        if (s1 == m_next) {
+            memcpy(ev, slot.payload, sizeof(MdEvent));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == m_next) {
+                m_next++;
+                return 1;
+            }
+        } else if (s1 < m_next &&
+                   m_hdr->write_seq.load(std::memory_order_acquire) < m_next + m_capacity) {
+            // not published yet, or being written (seq 0) right now: the
+            // writer may publish it between the two loads, which is no loss
+            return 0;
+        }
+        // the slot holds (or is being overwritten with) a later lap
+        uint64_t w = m_hdr->write_seq.load(std::memory_order_acquire);
+        m_lost += w - m_next;
+        m_overruns++;
+        m_next = w;
+        return -1;
+    }
+
+    // Sequence number of the next event to be read.
+    uint64_t next_sequence() const { return m_next; }
+    uint64_t lost() const { return m_lost; }
+    uint64_t overruns() const { return m_overruns; }
+
+private:
+    const MdBusHeader* m_hdr = nullptr;
+    const MdSlot* m_slots = nullptr;
+    size_t m_size = 0;
+    uint64_t m_capacity = 0;
+    uint64_t m_next = 1;
+    uint64_t m_lost = 0;
+    uint64_t m_overruns = 0;
+};
+
+// Parses a decimal string ("27123.45") into MD_PRICE_SCALE fixed point.
+inline int64_t md_parse_fixed(const char* s, size_t n) {
+    int64_t ip = 0, fp = 0, scale = MD_PRICE_SCALE;
+    bool neg = n && *s == '-';
+    size_t i = neg;
+    for (; i < n && s[i] >= '0' && s[i] <= '9'; i++) ip = ip * 10 + (s[i] - '0');
+    if (i < n && s[i] == '.') {
+        for (i++; i < n && s[i] >= '0' && s[i] <= '9' && scale > 1; i++) {
+            scale /= 10;
+            fp += (s[i] - '0') * scale;
+        }
+    }
+    int64_t v = ip * MD_PRICE_SCALE + fp;
+    return neg ? -v : v;
+}
@@ -0,0 +1,189 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Publish-to-read latency of the shared-memory market data bus.
+//
+// The parent process publishes --count trades at --rate events/s (0: as fast
+// as possible); --readers forked processes spin on the bus and record
+// md_now_ns() - publish_ts_ns for every event. Each reader prints one JSON
+// line with its latency percentiles and overrun counts.
+//
+//   md_bus_bench --readers=4 --count=10000000 --rate=1000000 --capacity=65536
+
+#include <getopt.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <vector>
+
+#include <photon/common/alog.h>
+
+#include "md-bus.h"
+
+struct Options {
+    int readers = 2;
+    uint64_t count = 1000000;
+    uint64_t rate = 1000000;
+    uint64_t capacity = 65536;
+    const char* name = "/md-bus-bench";
+    bool pin = false;
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"readers", required_argument, 0, 'r'},
+        {"count", required_argument, 0, 'n'},
+        {"rate", required_argument, 0, 'R'},
+        {"capacity", required_argument, 0, 'c'},
+        {"name", required_argument, 0, 'N'},
+        {"pin", no_argument, 0, 'p'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "r:n:R:c:N:p", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'r': opts.readers = std::max(1, atoi(optarg)); break;
+            case 'n': opts.count = strtoull(optarg, nullptr, 10); break;
+            case 'R': opts.rate = strtoull(optarg, nullptr, 10); break;
+            case 'c': opts.capacity = strtoull(optarg, nullptr, 10); break;
+            case 'N': opts.name = optarg; break;
+            case 'p': opts.pin = true; break;
+            default:
+                fprintf(stderr, "usage: %s [--readers=N] [--count=N] [--rate=events_per_sec] "
+                        "[--capacity=slots] [--name=/shm-name] [--pin]\n", argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void pin_to(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// 10ns buckets up to 100us, then one overflow bucket.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : m_buckets(10001) {}
+    void add(uint64_t ns) {
+        m_buckets[std::min<uint64_t>(ns / 10, 10000)]++;
+        m_max = std::max(m_max, ns);
+        m_count++;
+    }
+    uint64_t percentile(double p) const {
+        uint64_t want = (uint64_t)(m_count * p), seen = 0;
+        for (size_t i = 0; i < m_buckets.size(); i++) {
+            seen += m_buckets[i];
+            if (seen > want) return i * 10;
+        }
+        return m_max;
+    }
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+
+private:
+    std::vector<uint64_t> m_buckets;
+    uint64_t m_count = 0, m_max = 0;
+};
+
+static int run_reader(int id, int ready_fd) {
+    if (opts.pin) pin_to(id + 1);
+    MdBusReader reader;
+    if (reader.open(opts.name) < 0) return 1;
+    char c = 1;
+    if (write(ready_fd, &c, 1) != 1) return 1;
+    close(ready_fd);
+
+    LatencyHistogram hist;
+    MdEvent ev;
+    uint64_t last_trade_id = 0, gaps = 0;
+    while (true) {
+        int ret = reader.poll(&ev);
+        if (ret == 0) continue;
+        if (ret < 0) continue;      // counted by the reader
+        if (ev.hdr.type == MD_END) break;
+        hist.add(md_now_ns() - ev.hdr.publish_ts_ns);
+        if (last_trade_id && ev.trade.trade_id != last_trade_id + 1) gaps++;
+        last_trade_id = ev.trade.trade_id;
+    }
+    printf("{\"reader\":%d,\"events\":%lu,\"lost\":%lu,\"overruns\":%lu,\"gaps\":%lu,"
+           "\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+           id, hist.count(), reader.lost(), reader.overruns(), gaps, hist.percentile(0.5),
+           hist.percentile(0.99), hist.percentile(0.999), hist.max());
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    set_log_output_level(ALOG_INFO);
+
+    MdBusWriter writer;
+    if (writer.open(opts.name, opts.capacity) < 0) return -1;
+
+    int fds[2];
+    if (pipe(fds) < 0) LOG_ERRNO_RETURN(0, -1, "pipe failed");
+    std::vector<pid_t> children;
+    for (int i = 0; i < opts.readers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) LOG_ERRNO_RETURN(0, -1, "fork failed");
+        if (pid == 0) {
+            close(fds[0]);
+            _exit(run_reader(i, fds[1]));
+        }
+        children.push_back(pid);
+    }
+    close(fds[1]);
+    for (int i = 0; i < opts.readers; i++) {
+        char c;
+        if (read(fds[0], &c, 1) != 1) LOG_ERROR_RETURN(0, -1, "reader failed to start");
+    }
+    close(fds[0]);
+    if (opts.pin) pin_to(0);
+
+    MdTrade trade = {};
+    trade.hdr.type = MD_TRADE;
+    trade.price = 27000 * MD_PRICE_SCALE;
+    trade.qty = MD_PRICE_SCALE / 1000;
+    uint64_t interval = opts.rate ? 1000000000ULL / opts.rate : 0;
+    uint64_t t0 = md_now_ns();
+    for (uint64_t i = 1; i <= opts.count; i++) {
+        if (interval) {
+            while (md_now_ns() - t0 < i * interval) {}
+        }
+        trade.trade_id = i;
+        trade.hdr.exchange_ts_ns = t0 + i * interval;
+        writer.publish(trade);
+    }
+    double seconds = (md_now_ns() - t0) / 1e9;
+    MdEvent end = {};
+    end.hdr.type = MD_END;
+    end.hdr.size = sizeof(MdEventHeader);
+    writer.publish(end);
+    LOG_INFO("published ` events in ` s (` events/s)", opts.count, seconds,
+             (uint64_t)(opts.count / seconds));
+
+    for (auto pid : children) waitpid(pid, nullptr, 0);
+    shm_unlink(opts.name);
+    return 0;
+}
@@ -0,0 +1,444 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Counters, gauges and histograms for watching a running process, served in
+// the Prometheus text format by MetricsServer.
+//
+// Counters and histograms are sharded per vCPU (OS thread). Registering a
+// metric reserves slots in a fixed slot table; every thread that updates
+// metrics owns a private copy of that table (its shard), so an update is a
+// relaxed load and store on memory no other thread writes: no lock prefix,
+// no shared cache line. A scrape sums the slot across all shards with
+// relaxed loads. Shards of exited threads are kept, and reused by the next
+// thread, so nothing counted is lost. Gauges are single values that belong
+// to one owner (a connection's backlog, a buffer's high-water mark).
+//
+// Metrics are never freed; get the handles once (per connection, say) and
+// keep them. Registering the same name and labels again returns the same
+// metric, e.g. after a reconnect.
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/net/socket.h>
+#include <photon/thread/thread.h>
+
+const size_t METRICS_MAX_SLOTS = 8192;      // 64KB per shard
+const int METRICS_HISTOGRAM_BUCKETS = 32;
+
+class MetricsRegistry;
+
+// The calling thread's shard, attached on first use.
+inline std::atomic<uint64_t>* metrics_shard();
+
+class MetricCounter {
+public:
+    void add(uint64_t n = 1) {
+        auto& s = metrics_shard()[m_slot];
+        s.store(s.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+private:
+    friend class MetricsRegistry;
+    uint32_t m_slot = 0;
+};
+
+class MetricGauge {
+public:
+    void set(int64_t v) { m_value.store(v, std::memory_order_relaxed); }
+    void add(int64_t v) { m_value.fetch_add(v, std::memory_order_relaxed); }
+    // Keeps the largest value seen: a high-water mark.
+    void set_max(int64_t v) {
+        int64_t cur = m_value.load(std::memory_order_relaxed);
+        while (v > cur && !m_value.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+    }
+    int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_value{0};
+};
+
+// Log2 buckets: a value v lands in [2^i, 2^(i+1)), 0 and 1 in the first.
+class MetricHistogram {
+public:
+    void observe(uint64_t v) {
+        auto shard = metrics_shard() + m_slot;
+        int b = v ? 63 - __builtin_clzll(v) : 0;
+        if (b >= METRICS_HISTOGRAM_BUCKETS) b = METRICS_HISTOGRAM_BUCKETS - 1;
+        bump(shard[b], 1);
+        bump(shard[METRICS_HISTOGRAM_BUCKETS], v);
+        bump(shard[METRICS_HISTOGRAM_BUCKETS + 1], 1);
+    }
+
+private:
+    friend class MetricsRegistry;
+    static const size_t SLOTS = METRICS_HISTOGRAM_BUCKETS + 2;     // buckets, sum, count
+
+    static void bump(std::atomic<uint64_t>& s, uint64_t n) {
+        s.store(s.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    uint32_t m_slot = 0;
+};
+
+// `key="value"`, escaped, for the labels argument of the registry.
+inline std::string metric_labels(const char* key, const std::string& value) {
+    std::string s = key;
+    s += "=\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') s += '\\';
+        if (c == '\n') {
+            s += "\\n";
+            continue;
+        }
+        s += c;
+    }
+    s += '"';
+    return s;
+}
+
+class MetricsRegistry {
+public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    // `labels` is a comma-separated list of key="value" (see
+    // metric_labels()), or empty.
+    MetricCounter* counter(const std::string& name, const char* help, const std::string& labels = "") {
+        return &get(name, help, COUNTER, labels, 1)->counter;
+    }
+    MetricGauge* gauge(const std::string& name, const char* help, const std::string& labels = "") {
+        return &get(name, help, GAUGE, labels, 0)->gauge;
+    }
+    MetricHistogram* histogram(const std::string& name, const char* help, const std::string& labels = "") {
+        return &get(name, help, HISTOGRAM, labels, MetricHistogram::SLOTS)->histogram;
+    }
+
+    // Sum of a counter over all shards.
+    uint64_t value(const MetricCounter* c) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return sum(c->m_slot);
+    }
+
+    // Count and sum of a histogram over all shards.
+    void totals(const MetricHistogram* h, uint64_t* count, uint64_t* total) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        *count = sum(h->m_slot + METRICS_HISTOGRAM_BUCKETS + 1);
+        *total = sum(h->m_slot + METRICS_HISTOGRAM_BUCKETS);
+    }
+
+    // Every metric in the Prometheus text exposition format. The lock only
+    // keeps registrations and new shards out; updates go on meanwhile.
+    std::string render() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::string out;
+        char buf[64];
+        for (auto& f : m_families) {
+            out += "# HELP " + f.name + " " + f.help + "\n";
+            out += "# TYPE " + f.name + " " + type_name(f.type) + "\n";
+            for (auto m : f.metrics) {
+                std::string braces = m->labels.empty() ? "" : "{" + m->labels + "}";
+                if (f.type == COUNTER) {
+                    snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long)sum(m->counter.m_slot));
+                    out += f.name + braces + buf;
+                } else if (f.type == GAUGE) {
+                    snprintf(buf, sizeof(buf), " %lld\n", (long long)m->gauge.value());
+                    out += f.name + braces + buf;
+                } else {
+                    render_histogram(out, f.name, m);
+                }
+            }
+        }
+        return out;
+    }
+
+    std::atomic<uint64_t>* attach_thread() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free_shards.empty()) {
+            auto s = m_free_shards.back();
+            m_free_shards.pop_back();
+            return s;
+        }
+        // own cache lines, and pages touched now rather than on first update
+        void* p = nullptr;
+        size_t bytes = METRICS_MAX_SLOTS * sizeof(std::atomic<uint64_t>);
+        if (posix_memalign(&p, 64, bytes) != 0) abort();
+        memset(p, 0, bytes);
+        auto s = (std::atomic<uint64_t>*)p;
+        m_shards.push_back(s);
+        return s;
+    }
+
+    void detach_thread(std::atomic<uint64_t>* shard) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free_shards.push_back(shard);
+    }
+
+private:
+    enum Type { COUNTER, GAUGE, HISTOGRAM };
+
+    struct Metric {
+        std::string labels;
+        MetricCounter counter;
+        MetricGauge gauge;
+        MetricHistogram histogram;
+    };
+
+    struct Family {
+        std::string name;
+        std::string help;
+        Type type;
+        std::vector<Metric*> metrics;
+    };
+
+    MetricsRegistry() = default;
+    ~MetricsRegistry() {
+        for (auto s : m_shards) free(s);
+    }
+
+    static const char* type_name(Type t) {
+        return t == COUNTER ? "counter" : t == GAUGE ? "gauge" : "histogram";
+    }
+
+    Metric* get(const std::string& name, const char* help, Type type, const std::string& labels,
+                size_t slots) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Family* fam = nullptr;
+        for (auto& f : m_families) {
+            if (f.name == name) {
+                fam = &f;
+                break;
+            }
+        }
+        if (fam && fam->type != type) {
+            // a programming error; hand out a metric that updates the dump
+            // area, which is never scraped
+            LOG_ERROR("metric ` registered with two types", name.c_str());
+            m_orphans.emplace_back(new Metric);
+            return m_orphans.back().get();
+        }
+        if (!fam) {
+            m_families.push_back({name, help, type, {}});
+            fam = &m_families.back();
+        }
+        for (auto m : fam->metrics)
+            if (m->labels == labels) return m;
+        m_metrics.emplace_back(new Metric);
+        auto m = m_metrics.back().get();
+        m->labels = labels;
+        if (slots) {
+            if (m_next_slot + slots > METRICS_MAX_SLOTS) {
+                // counts into the dump area, like an orphan
+                LOG_ERROR("metric slots exhausted, ` is not counted", name.c_str());
+                m_orphans.push_back(std::move(m_metrics.back()));
+                m_metrics.pop_back();
+                return m;
+            }
+            m->counter.m_slot = m->histogram.m_slot = m_next_slot;
+            m_next_slot += slots;
+        }
+        fam->metrics.push_back(m);
+        return m;
+    }
+
+    uint64_t sum(size_t slot) const {
+        uint64_t v = 0;
+        for (auto s : m_shards) v += s[slot].load(std::memory_order_relaxed);
+        return v;
+    }
+
+    void render_histogram(std::string& out, const std::string& name, const Metric* m) {
+        std::string lab = m->labels.empty() ? "" : m->labels + ",";
+        char buf[96];
+        uint32_t base = m->histogram.m_slot;
+        uint64_t counts[METRICS_HISTOGRAM_BUCKETS];
+        int last = -1;
+        for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+            counts[i] = sum(base + i);
+            if (counts[i]) last = i;
+        }
+        uint64_t cum = 0;
+        for (int i = 0; i <= last; i++) {
+            cum += counts[i];
+            // integer values: bucket i holds [2^i, 2^(i+1) - 1]
+            snprintf(buf, sizeof(buf), "le=\"%llu\"} %llu\n", (2ULL << i) - 1, (unsigned long long)cum);
+            out += name + "_bucket{" + lab + buf;
+        }
+        uint64_t count = sum(base + METRICS_HISTOGRAM_BUCKETS + 1);
+        snprintf(buf, sizeof(buf), "le=\"+Inf\"} %llu\n", (unsigned long long)count);
+        out += name + "_bucket{" + lab + buf;
+        std::string braces = m->labels.empty() ? "" : "{" + m->labels + "}";
+        snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long)sum(base + METRICS_HISTOGRAM_BUCKETS));
+        out += name + "_sum" + braces + buf;
+        snprintf(buf, sizeof(buf), " %llu\n", (unsigned long long)count);
+        out += name + "_count" + braces + buf;
+    }
+
+    std::mutex m_mutex;
+    std::vector<Family> m_families;     // scrape order is registration order
+    std::vector<std::unique_ptr<Metric>> m_metrics;
+    std::vector<std::unique_ptr<Metric>> m_orphans;
+    std::vector<std::atomic<uint64_t>*> m_shards;
+    std::vector<std::atomic<uint64_t>*> m_free_shards;
+    // Slots below this are the dump area: orphans and metrics registered
+    // after the table filled up all update it, a histogram writing SLOTS
+    // of them from slot 0, so it must be as wide as the widest metric.
+    size_t m_next_slot = MetricHistogram::SLOTS;
+};
+
+inline MetricsRegistry& metrics() { return MetricsRegistry::instance(); }
+
+inline std::atomic<uint64_t>* metrics_shard() {
+    // plain pointer for the fast path; the holder only hands the shard
+    // back when the thread exits
+    static thread_local std::atomic<uint64_t>* shard = nullptr;
+    if (__builtin_expect(shard != nullptr, 1)) return shard;
+    struct Holder {
+        std::atomic<uint64_t>* shard;
+        ~Holder() { metrics().detach_thread(shard); }
+    };
+    static thread_local Holder holder{metrics().attach_thread()};
+    shard = holder.shard;
+    return shard;
+}
+
+// What every WebSocket feed connection reports, labelled by connection.
+struct WsConnectionMetrics {
+    explicit WsConnectionMetrics(const std::string& conn) {
+        auto& r = metrics();
+        std::string l = metric_labels("conn", conn);
+        messages = r.counter("ws_messages_total", "Messages received", l);
+        bytes = r.counter("ws_received_bytes_total", "Bytes received from the socket", l);
+        recvs = r.counter("ws_recv_calls_total", "Reads from the socket", l);
+        static const char* ops[16] = {"continuation", "text", "binary", nullptr, nullptr, nullptr, nullptr,
+                                      nullptr, "close", "ping", "pong"};
+        for (int i = 0; i < 16; i++)
+            frames[i] = r.counter("ws_frames_total", "Frames received by opcode",
+                                  l + "," + metric_labels("opcode", ops[i] ? ops[i] : "other"));
+        connects = r.counter("ws_connects_total", "Connections established", l);
+        disconnects = r.counter("ws_disconnects_total", "Connections lost or dropped", l);
+        recv_buffer_hwm = r.gauge("ws_recv_buffer_high_water_bytes", "Largest unparsed receive backlog", l);
+        recv_buffer_capacity = r.gauge("ws_recv_buffer_capacity_bytes", "Current receive buffer size", l);
+        outbound_queued = r.gauge("ws_outbound_queued", "Messages waiting for the rate limiter", l);
+        handshake_us = r.histogram("ws_handshake_us", "Connect to handshake response, microseconds", l);
+    }
+
+    MetricCounter* messages;
+    MetricCounter* bytes;
+    MetricCounter* recvs;
+    MetricCounter* frames[16];
+    MetricCounter* connects;
+    MetricCounter* disconnects;
+    MetricGauge* recv_buffer_hwm;
+    MetricGauge* recv_buffer_capacity;
+    MetricGauge* outbound_queued;
+    MetricHistogram* handshake_us;
+};
+
+// GET /metrics over plain HTTP/1.1, from a vCPU of its own so that a scrape
+// never waits for (or delays) a busy event loop.
+class MetricsServer {
+public:
+    ~MetricsServer() { stop(); }
+
+    // Listens on 127.0.0.1:`port`, or on every interface if `local_only`
+    // is false. Returns once listening, or -1.
+    int start(uint16_t port, bool local_only = true) {
+        std::promise<int> started;
+        auto result = started.get_future();
+        m_stopping = false;
+        m_thread = std::thread([this, port, local_only, &started] {
+            if (photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE)) {
+                LOG_ERROR("metrics server failed to init photon");
+                started.set_value(-1);
+                return;
+            }
+            DEFER(photon::fini());
+            serve(port, local_only, &started);
+        });
+        if (result.get() < 0) {
+            m_thread.join();
+            return -1;
+        }
+        return 0;
+    }
+
+    void stop() {
+        m_stopping = true;
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+private:
+    void serve(uint16_t port, bool local_only, std::promise<int>* started) {
+        auto server = photon::net::new_tcp_socket_server();
+        if (!server) {
+            started->set_value(-1);
+            LOG_ERRNO_RETURN(0, , "failed to create metrics server");
+        }
+        DEFER(delete server);
+        server->setsockopt<int>(SOL_SOCKET, SO_REUSEADDR, 1);
+        int ret = local_only ? server->bind_v4localhost(port) : server->bind_v4any(port);
+        if (ret < 0 || server->listen() < 0) {
+            started->set_value(-1);
+            LOG_ERRNO_RETURN(0, , "metrics server failed to listen on port `", port);
+        }
+        server->set_handler({this, &MetricsServer::handle});
+        server->start_loop(false);
+        LOG_INFO("serving metrics on `/metrics", server->getsockname());
+        started->set_value(0);
+        while (!m_stopping) photon::thread_usleep(100 * 1000);
+        server->terminate();
+    }
+
+    int handle(photon::net::ISocketStream* stream) {
+        char req[4096];
+        size_t n = 0;
+        while (n < sizeof(req) - 1) {
+            ssize_t r = stream->recv(req + n, sizeof(req) - 1 - n);
+            if (r <= 0) return -1;
+            n += r;
+            req[n] = '\0';
+            if (strstr(req, "\r\n\r\n")) break;
+        }
+        std::string body, status = "200 OK";
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0) {
+            body = metrics().render();
+        } else {
+            status = "404 Not Found";
+            body = "try /metrics\n";
+        }
+        std::string resp = "HTTP/1.1 " + status +
+                           "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        return stream->write(resp.data(), resp.size()) == (ssize_t)resp.size() ? 0 : -1;
+    }
+
+    std::thread m_thread;
+    std::atomic<bool> m_stopping{false};
+};
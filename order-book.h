@@ -0,0 +1,146 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Price-level order book of one symbol, kept from a REST depth snapshot
+// plus the diff stream (DepthStream in ws-pipeline.h, MdBookUpdate on the
+// bus).
+//
+// Every diff covers the update ids [first_update_id, last_update_id]; the
+// snapshot is as of its lastUpdateId. A diff that ends at or before the
+// book's update id is already in it and is skipped. Otherwise it must
+// start at or before the next id, or updates were lost in between and the
+// book has to be fetched again (apply() returns -1). The events one diff is
+// split into share its ids and are applied as one.
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+
+#include "json-scan.h"
+#include "md-bus.h"
+
+class OrderBook {
+public:
+    using Bids = std::map<int64_t, int64_t, std::greater<int64_t>>;
+    using Asks = std::map<int64_t, int64_t>;
+
+    // Replaces the book with a depth snapshot:
+    //   {"lastUpdateId":1027024,"bids":[["4.00000000","431.00000000"]],"asks":[...]}
+    // False if the body is not one.
+    bool load_snapshot(const char* p, size_t n) {
+        clear();
+        bool have_id = false, ok_levels = true;
+        bool ok = json_for_each_member(p, n, [&](const char* k, size_t kl, const char* v, size_t vl) {
+            if (json_is(k, kl, "lastUpdateId", 12)) {
+                m_update_id = json_uint(v, vl);
+                have_id = true;
+            } else if (json_is(k, kl, "bids", 4)) {
+                ok_levels &= load_side(v, vl, m_bids);
+            } else if (json_is(k, kl, "asks", 4)) {
+                ok_levels &= load_side(v, vl, m_asks);
+            }
+        });
+        if (!ok || !have_id || !ok_levels) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    // 1 if applied, 0 if already in the book, -1 if updates are missing
+    // before it. The events of a diff are applied as they come, so -1 for
+    // the first event leaves the book as it was, but -1 after some of them
+    // (another diff came before the last one) leaves part of a diff in it.
+    // Either way the book has to be loaded again (BookSynchronizer fetches
+    // it); until then it keeps returning -1.
+    int apply(const MdBookUpdate& u) {
+        if (m_partial) {
+            // the rest of a diff that is being applied
+            if (u.last_update_id != m_partial) return -1;
+        } else {
+            if (u.last_update_id <= m_update_id) return 0;
+            if (u.first_update_id > m_update_id + 1) return -1;
+        }
+        for (int i = 0; i < u.count; i++) set_level(u.side, u.levels[i].price, u.levels[i].qty);
+        if (u.last) {
+            m_update_id = u.last_update_id;
+            m_partial = 0;
+        } else {
+            m_partial = u.last_update_id;
+        }
+        return 1;
+    }
+
+    // For loading a saved book: clear(), the levels, then the update id.
+    void set_level(int side, int64_t price, int64_t qty) {
+        if (side == 0) {
+            set(m_bids, price, qty);
+        } else {
+            set(m_asks, price, qty);
+        }
+    }
+    void set_update_id(uint64_t id) { m_update_id = id; }
+
+    void clear() {
+        m_bids.clear();
+        m_asks.clear();
+        m_update_id = 0;
+        m_partial = 0;
+    }
+
+    // Update id the book is as of.
+    uint64_t update_id() const { return m_update_id; }
+    const Bids& bids() const { return m_bids; }
+    const Asks& asks() const { return m_asks; }
+    // 0 when the side is empty.
+    int64_t best_bid() const { return m_bids.empty() ? 0 : m_bids.begin()->first; }
+    int64_t best_ask() const { return m_asks.empty() ? 0 : m_asks.begin()->first; }
+
+private:
+    template <typename Side>
+    static bool load_side(const char* p, size_t n, Side& side) {
+        bool ok = true;
+        bool complete = json_for_each_element(p, n, [&](const char* lv, size_t ll) {
+            int64_t f[2];
+            int i = 0;
+            json_for_each_element(lv, ll, [&](const char* x, size_t xl) {
+                if (i < 2) f[i] = md_parse_fixed(x, xl);
+                i++;
+            });
+            if (i != 2) {
+                ok = false;
+                return;
+            }
+            set(side, f[0], f[1]);
+        });
+        return complete && ok;
+    }
+
+    template <typename Side>
+    static void set(Side& side, int64_t price, int64_t qty) {
+        if (qty) {
+            side[price] = qty;
+        } else {
+            side.erase(price);
+        }
+    }
+
+    Bids m_bids;
+    Asks m_asks;
+    uint64_t m_update_id = 0;
+    uint64_t m_partial = 0;     // last_update_id of a diff applied in part
+};
@@ -0,0 +1,612 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Order entry over the exchange's WebSocket API.
+//
+// Every (symbol, side, time in force) combination gets an OrderTemplate: the
+// complete WebSocket frame of an `order.place` request, built once. Fields
+// that change per order have fixed-width slots (client order id, timestamp,
+// signature) or are padded with JSON whitespace (price, quantity), so an
+// order is sent by patching those bytes in place and signing with an HMAC
+// key whose ipad/opad blocks and constant query prefix are already hashed.
+//
+// OrderGateway owns a dedicated vCPU and a warm connection. Strategy threads
+// submit() fixed-size OrderRequests into a bounded lock-free queue; the
+// gateway vCPU spins on the queue for a while after each order, then sleeps
+// on an eventfd that producers only write to when it is asleep. Nothing is
+// allocated and no coroutine is created per order. Responses are matched to
+// orders by id (ws-correlation.h) for acknowledgement latency and timeouts.
+#pragma once
+
+#include <netdb.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+#include <photon/thread/thread11.h>
+#include <photon/net/socket.h>
+#include <photon/net/security-context/tls-stream.h>
+
+#include "hmac-sha256.h"
+#include "rate-limiter.h"
+#include "registered-io.h"
+#include "socket-profile.h"
+#include "timer-wheel.h"
+#include "topology.h"
+#include "ws-correlation.h"
+#include "ws-frame.h"
+
+// Prices and quantities are fixed point with 8 decimals.
+const int64_t ORDER_FIXED_SCALE = 100000000;
+// Width of the client order id and request id slots.
+const int ORDER_ID_DIGITS = 16;
+
+inline uint64_t order_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct OrderRequest {
+    uint32_t template_id;
+    int64_t price;              // ORDER_FIXED_SCALE fixed point
+    int64_t qty;
+    uint64_t client_order_id;   // < 10^16
+    uint64_t decided_ns;        // order_now_ns() at the decision, 0 if unknown
+};
+
+struct OrderTemplateSpec {
+    std::string symbol;         // "BTCUSDT"
+    std::string side;           // "BUY" / "SELL"
+    std::string time_in_force = "GTC";
+    int price_decimals = 2;
+    int qty_decimals = 5;
+};
+
+// A limit order frame with patchable slots.
+class OrderTemplate {
+public:
+    int build(const std::string& api_key, const HmacSha256Key& secret, const OrderTemplateSpec& spec) {
+        if (spec.price_decimals > 8 || spec.qty_decimals > 8)
+            LOG_ERROR_RETURN(EINVAL, -1, "at most 8 decimals");
+        m_price_decimals = spec.price_decimals;
+        m_qty_decimals = spec.qty_decimals;
+        std::string id(ORDER_ID_DIGITS, '0'), ts(13, '0'), sig(64, '0');
+        std::string price_slot = "0\"" + std::string(VALUE_WIDTH, ' ');
+        std::string qty_slot = price_slot;
+
+        // parameters in the order they are signed (sorted by name)
+        std::string json = "{\"id\":\"";
+        m_id_off = json.size();
+        json += id + "\",\"method\":\"order.place\",\"params\":{\"apiKey\":\"" + api_key +
+                "\",\"newClientOrderId\":\"";
+        m_cid_off = json.size();
+        json += id + "\",\"price\":\"";
+        m_price_off = json.size();
+        json += price_slot + ",\"quantity\":\"";
+        m_qty_off = json.size();
+        json += qty_slot + ",\"side\":\"" + spec.side + "\",\"signature\":\"";
+        m_sig_off = json.size();
+        json += sig + "\",\"symbol\":\"" + spec.symbol + "\",\"timeInForce\":\"" +
+                spec.time_in_force + "\",\"timestamp\":";
+        m_ts_off = json.size();
+        json += ts + ",\"type\":\"LIMIT\"}}";
+
+        // the server XORs the payload with the mask; an all-zero mask lets
+        // the frame be sent as patched
+        static const uint8_t zero_mask[4] = {0, 0, 0, 0};
+        char hdr[WS_MAX_HEADER];
+        size_t hl = ws_encode_header(hdr, WS_TEXT, json.size(), true, zero_mask);
+        m_frame.assign(hdr, hl);
+        m_frame += json;
+        m_id_off += hl;
+        m_cid_off += hl;
+        m_price_off += hl;
+        m_qty_off += hl;
+        m_sig_off += hl;
+        m_ts_off += hl;
+
+        std::string prefix = "apiKey=" + api_key + "&newClientOrderId=";
+        m_key = secret.prefixed(prefix.data(), prefix.size());
+        m_sig_mid = "&side=" + spec.side + "&symbol=" + spec.symbol +
+                    "&timeInForce=" + spec.time_in_force + "&timestamp=";
+        return 0;
+    }
+
+    // Patches the order into the frame and signs it. `ts_ms` is wall-clock
+    // time in milliseconds.
+    void fill(const OrderRequest& req, uint64_t ts_ms) {
+        char* f = &m_frame[0];
+        format_digits(req.client_order_id, f + m_cid_off, ORDER_ID_DIGITS);
+        memcpy(f + m_id_off, f + m_cid_off, ORDER_ID_DIGITS);
+        format_digits(ts_ms, f + m_ts_off, 13);
+        size_t plen = put_value(f + m_price_off, req.price, m_price_decimals);
+        size_t qlen = put_value(f + m_qty_off, req.qty, m_qty_decimals);
+
+        auto s = m_key.begin();
+        s.update(f + m_cid_off, ORDER_ID_DIGITS);
+        s.update("&price=", 7);
+        s.update(f + m_price_off, plen);
+        s.update("&quantity=", 10);
+        s.update(f + m_qty_off, qlen);
+        s.update(m_sig_mid.data(), m_sig_mid.size());
+        s.update(f + m_ts_off, 13);
+        s.update("&type=LIMIT", 11);
+        s.final_hex(f + m_sig_off);
+    }
+
+    const char* frame() const { return m_frame.data(); }
+    size_t size() const { return m_frame.size(); }
+
+private:
+    static const size_t VALUE_WIDTH = 24;   // digits + '.' of price or qty
+
+    static void format_digits(uint64_t v, char* out, int width) {
+        for (int i = width - 1; i >= 0; i--) {
+            out[i] = '0' + v % 10;
+            v /= 10;
+        }
+    }
+
+    // Writes `v` with `decimals` decimals, the closing quote and padding.
+    // Returns the length of the number.
+    static size_t put_value(char* out, int64_t v, int decimals) {
+        static const int64_t pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000,
+                                        10000000, 100000000};
+        char tmp[VALUE_WIDTH];
+        size_t n = 0;
+        uint64_t u = v < 0 ? 0 : v;
+        uint64_t frac = (u % ORDER_FIXED_SCALE) / pow10[8 - decimals];
+        uint64_t ip = u / ORDER_FIXED_SCALE;
+        for (int i = 0; i < decimals; i++, frac /= 10) tmp[n++] = '0' + frac % 10;
+        if (decimals) tmp[n++] = '.';
+        do {
+            tmp[n++] = '0' + ip % 10;
+            ip /= 10;
+        } while (ip && n < VALUE_WIDTH);
+        for (size_t i = 0; i < n; i++) out[i] = tmp[n - 1 - i];
+        out[n] = '"';
+        memset(out + n + 1, ' ', VALUE_WIDTH - n);
+        return n;
+    }
+
+    std::string m_frame;
+    size_t m_id_off, m_cid_off, m_price_off, m_qty_off, m_sig_off, m_ts_off;
+    int m_price_decimals, m_qty_decimals;
+    HmacSha256Key m_key;
+    std::string m_sig_mid;
+};
+
+// Bounded multi-producer single-consumer queue of OrderRequests.
+class OrderQueue {
+public:
+    explicit OrderQueue(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n *= 2;
+        m_slots = std::vector<Slot>(n);
+        m_mask = n - 1;
+        for (size_t i = 0; i < n; i++) m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(const OrderRequest& req) {
+        uint64_t pos = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = m_slots[pos & m_mask];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+            int64_t dif = (int64_t)(seq - pos);
+            if (dif == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.req = req;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(OrderRequest* req) {
+        auto& slot = m_slots[m_head & m_mask];
+        if (slot.seq.load(std::memory_order_acquire) != m_head + 1) return false;
+        *req = slot.req;
+        slot.seq.store(m_head + m_mask + 1, std::memory_order_release);
+        m_head++;
+        return true;
+    }
+
+    bool empty() const {
+        return m_slots[m_head & m_mask].seq.load(std::memory_order_acquire) != m_head + 1;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        OrderRequest req;
+    };
+    std::vector<Slot> m_slots;
+    uint64_t m_mask;
+    alignas(64) std::atomic<uint64_t> m_tail{0};
+    alignas(64) uint64_t m_head = 0;
+};
+
+struct OrderGatewayOptions {
+    std::string host = "ws-api.binance.com";
+    uint16_t port = 443;
+    std::string path = "/ws-api/v3";
+    int cpu = -1;                       // pin the gateway vCPU
+    size_t queue_capacity = 1024;       // rounded up to a power of 2
+    uint64_t spin_us = 200;             // spin on the queue after an order
+    uint64_t warm_interval_us = 1000;   // re-run the signing path when idle
+    uint64_t ping_interval_s = 30;
+    size_t max_outstanding = 4096;      // orders awaiting their response
+    uint64_t ack_timeout_us = 5000000;
+    uint64_t drain_timeout_us = 2000000;    // stop() waits this long for responses
+    // Binance places 10 orders/s per account; orders over the limit are
+    // rejected by submit's consumer, never sent late
+    OutboundLimits limits = order_gateway_limits();
+    TokenBucket* account = nullptr;     // shared by every gateway of the account
+
+    static OutboundLimits order_gateway_limits() {
+        OutboundLimits l;
+        l.rate = 10;
+        l.burst = 10;
+        return l;
+    }
+};
+
+class OrderGateway {
+public:
+    // Called on the gateway vCPU for every text message from the exchange.
+    using ResponseHandler = std::function<void(const char*, size_t)>;
+
+    OrderGateway(const std::string& api_key, const std::string& secret,
+                 const OrderGatewayOptions& opts = {})
+        : m_api_key(api_key), m_secret(secret.data(), secret.size()), m_opts(opts),
+          m_queue(opts.queue_capacity), m_requests(opts.max_outstanding, &m_timers) {
+        m_place = m_requests.method("order.place");
+        // open until the gateway is destroyed: producers may still be in
+        // submit() when stop() returns
+        m_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~OrderGateway() {
+        stop();
+        if (m_evfd >= 0) close(m_evfd);
+    }
+
+    // Returns the template id for OrderRequest. Before start() only.
+    int add_template(const OrderTemplateSpec& spec) {
+        m_templates.emplace_back();
+        if (m_templates.back().build(m_api_key, m_secret, spec) < 0) {
+            m_templates.pop_back();
+            return -1;
+        }
+        return (int)m_templates.size() - 1;
+    }
+
+    // Starts the gateway vCPU and waits until its connection is up.
+    int start(ResponseHandler handler) {
+        if (m_templates.empty()) LOG_ERROR_RETURN(EINVAL, -1, "no order templates");
+        m_handler = std::move(handler);
+        if (m_evfd < 0) LOG_ERRNO_RETURN(0, -1, "failed to create eventfd");
+        m_thread = std::thread(&OrderGateway::gateway_main, this);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [&] { return m_state != STARTING; });
+        if (m_state == FAILED) {
+            lock.unlock();
+            stop();
+            LOG_ERROR_RETURN(0, -1, "order gateway failed to start");
+        }
+        return 0;
+    }
+
+    // Sends the orders submitted so far, waits up to drain_timeout_us for the
+    // responses still due, closes the connection and joins the gateway vCPU.
+    // Thread-safe.
+    void stop() {
+        m_stopping = true;
+        wake();
+        if (m_thread.joinable()) m_thread.join();
+    }
+
+    // Thread-safe and wait-free. Returns false if the queue is full.
+    bool submit(const OrderRequest& req) {
+        if (!m_queue.push(req)) {
+            m_rejected++;
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleeping.load(std::memory_order_relaxed)) wake();
+        return true;
+    }
+
+    struct Stats {
+        std::atomic<uint64_t> sent{0};
+        std::atomic<uint64_t> dropped{0};       // submitted while disconnected
+        std::atomic<uint64_t> rate_limited{0};
+        std::atomic<uint64_t> wire_ns_total{0}; // decision to write() returning
+        std::atomic<uint64_t> wire_ns_max{0};
+    };
+    const Stats& stats() const { return m_stats; }
+    uint64_t rejected() const { return m_rejected; }
+
+private:
+    enum State { STARTING, RUNNING, FAILED };
+
+    void set_state(State st) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state = st;
+        m_cond.notify_all();
+    }
+
+    void wake() {
+        if (m_evfd >= 0) eventfd_write(m_evfd, 1);
+    }
+
+    void gateway_main() {
+        // the rings and signing state on the node of that CPU
+        place_vcpu(m_opts.cpu);
+        if (photon::init(photon::INIT_EVENT_IOURING, photon::INIT_IO_NONE)) {
+            LOG_ERROR("order gateway failed to init photon");
+            set_state(FAILED);
+            return;
+        }
+        DEFER(photon::fini());
+        DEFER(release_vcpu_buffer_pool());
+        auto ctx = photon::net::new_tls_context(nullptr, nullptr, nullptr);
+        if (!ctx) {
+            set_state(FAILED);
+            return;
+        }
+        DEFER(delete ctx);
+        auto cli = photon::net::new_tls_client(ctx, new_profiled_client(new_registered_tcp_client(), order_socket_profile()),
+                                               true);
+        DEFER(delete cli);
+
+        bool first = true;
+        while (!m_stopping) {
+            auto conn = connect(cli);
+            if (!conn) {
+                if (first) {
+                    set_state(FAILED);
+                    return;
+                }
+                photon::thread_sleep(1);
+                continue;
+            }
+            if (first) set_state(RUNNING);
+            first = false;
+            run_session(conn);
+            delete conn;
+            if (!m_stopping) LOG_WARN("order connection lost, reconnecting");
+        }
+        m_requests.log_stats(m_opts.host.c_str());
+    }
+
+    photon::net::ISocketStream* connect(photon::net::ISocketClient* cli) {
+        struct addrinfo hints = {};
+        struct addrinfo* res = nullptr;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(m_opts.host.c_str(), nullptr, &hints, &res) != 0 || !res)
+            LOG_ERROR_RETURN(0, nullptr, "failed to resolve `", m_opts.host.c_str());
+        photon::net::EndPoint ep(photon::net::IPAddr(((struct sockaddr_in*)res->ai_addr)->sin_addr),
+                                 m_opts.port);
+        freeaddrinfo(res);
+        auto conn = cli->connect(ep);
+        if (!conn) LOG_ERRNO_RETURN(0, nullptr, "failed to connect to `", m_opts.host.c_str());
+        m_rx_len = 0;
+        m_rx.resize(64 * 1024);
+        if (ws_client_handshake(conn, m_opts.host.c_str(), m_opts.path.c_str(),
+                                m_rx.data(), m_rx.size(), &m_rx_len) < 0) {
+            delete conn;
+            return nullptr;
+        }
+        LOG_INFO("order gateway connected to `", m_opts.host.c_str());
+        return conn;
+    }
+
+    void run_session(photon::net::ISocketStream* conn) {
+        m_broken = false;
+        OutboundLimiter limiter(m_opts.limits, [&](const char* frame, size_t n) {
+            photon::scoped_lock lock(m_send_lock);
+            if (conn->write(frame, n) != (ssize_t)n) {
+                m_broken = true;
+                LOG_ERRNO_RETURN(0, -1, "failed to send to `", m_opts.host.c_str());
+            }
+            return 0;
+        }, m_opts.account, &m_timers);
+        m_limiter = &limiter;
+        DEFER(m_limiter = nullptr);
+        auto reader = photon::thread_create11(&OrderGateway::read_loop, this, conn);
+        auto jh = photon::thread_enable_join(reader);
+        // keep-alive pings, idle warming and ack timeouts share one wheel,
+        // advanced whenever the loop wakes up
+        WheelTimer ping([&] { send_control(WS_PING, nullptr, 0); });
+        ping.start_periodic(m_opts.ping_interval_s * 1000000, &m_timers);
+        WheelTimer warming([&] { warm(); });
+        if (m_opts.warm_interval_us) warming.start_periodic(m_opts.warm_interval_us, &m_timers);
+        OrderRequest req;
+        while (!m_stopping && !m_broken) {
+            uint64_t spin_until = 0;
+            while (m_queue.pop(&req)) {
+                if (send_order(req) < 0) break;
+                spin_until = order_now_ns() + m_opts.spin_us * 1000;
+            }
+            // orders tend to come in bursts: spin before going to sleep
+            while (!m_broken && m_queue.empty() && order_now_ns() < spin_until) {}
+            if (!m_queue.empty()) continue;
+
+            m_sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_queue.empty() && !m_stopping) {
+                if (photon::wait_for_fd_readable(m_evfd, m_timers.next_timeout_us()) == 0) {
+                    eventfd_t v;
+                    eventfd_read(m_evfd, &v);
+                }
+            }
+            m_sleeping.store(false, std::memory_order_relaxed);
+            m_timers.advance(photon::now);
+        }
+        if (m_stopping && !m_broken) drain();
+        conn->shutdown(photon::net::ShutdownHow::ReadWrite);
+        photon::thread_join(jh);
+        m_requests.fail_all(ECONNRESET);
+        // nothing submitted while disconnected is sent later
+        while (m_queue.pop(&req)) m_stats.dropped++;
+    }
+
+    // On stop(): what is queued goes out, the responses get until the
+    // deadline, then the connection is closed with a close frame and the
+    // exchange's echo.
+    void drain() {
+        uint64_t deadline = photon::update_now() + m_opts.drain_timeout_us;
+        OrderRequest req;
+        while (!m_broken && m_queue.pop(&req)) send_order(req);
+        while (!m_broken && m_requests.outstanding() && photon::now < deadline) {
+            photon::thread_usleep(std::min<uint64_t>(m_timers.next_timeout_us(), 1000));
+            m_timers.advance(photon::update_now());
+        }
+        if (m_requests.outstanding())
+            LOG_WARN("` orders unanswered at shutdown", m_requests.outstanding());
+        const char code[2] = {(char)(WS_CLOSE_GOING_AWAY >> 8), (char)WS_CLOSE_GOING_AWAY};
+        if (m_broken || send_control(WS_CLOSE, code, 2) < 0) return;
+        while (!m_broken && photon::update_now() < deadline) photon::thread_usleep(1000);
+    }
+
+    int send_order(const OrderRequest& req) {
+        if (req.template_id >= m_templates.size()) {
+            LOG_ERROR("unknown order template `", req.template_id);
+            m_stats.dropped++;
+            return 0;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        auto& t = m_templates[req.template_id];
+        t.fill(req, ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000);
+        // the response carries the client order id as its request id
+        bool tracked = m_requests.expect(req.client_order_id, m_place, m_opts.ack_timeout_us) == 0;
+        if (m_limiter->send(OUT_ORDER, t.frame(), t.size()) < 0) {
+            if (tracked) m_requests.cancel(req.client_order_id);
+            if (m_broken) {
+                m_stats.dropped++;
+                return -1;
+            }
+            m_stats.rate_limited++;
+            return 0;
+        }
+        m_stats.sent++;
+        if (req.decided_ns) {
+            uint64_t d = order_now_ns() - req.decided_ns;
+            m_stats.wire_ns_total += d;
+            if (d > m_stats.wire_ns_max) m_stats.wire_ns_max = d;
+        }
+        return 0;
+    }
+
+    // Keeps the templates and the signing code in cache while idle. Works
+    // on a copy: a send may be parked in write() with template 0's frame.
+    void warm() {
+        OrderRequest req = {0, ORDER_FIXED_SCALE, ORDER_FIXED_SCALE, 0, 0};
+        m_warm = m_templates[0];
+        m_warm.fill(req, 0);
+    }
+
+    int send_control(uint8_t opcode, const char* payload, size_t n) {
+        static const uint8_t zero_mask[4] = {0, 0, 0, 0};
+        char frame[WS_MAX_HEADER + 125];
+        n = n > 125 ? 125 : n;
+        size_t hl = ws_encode_header(frame, opcode, n, true, zero_mask);
+        if (n) memcpy(frame + hl, payload, n);
+        return m_limiter ? m_limiter->send(OUT_CONTROL, frame, hl + n) : -1;
+    }
+
+    void read_loop(photon::net::ISocketStream* conn) {
+        while (!m_broken) {
+            size_t off = 0;
+            while (off < m_rx_len) {
+                WsFrameHeader h;
+                int hl = ws_parse_header(m_rx.data() + off, m_rx_len - off, &h);
+                if (hl < 0 || h.payload_len > m_rx.size() - WS_MAX_HEADER) {
+                    LOG_ERROR("bad frame from `", m_opts.host.c_str());
+                    goto broken;
+                }
+                if (hl == 0 || m_rx_len - off < hl + h.payload_len) break;
+                const char* payload = m_rx.data() + off + hl;
+                off += hl + h.payload_len;
+                if (h.opcode == WS_TEXT || h.opcode == WS_BINARY) {
+                    m_requests.on_message(payload, h.payload_len);
+                    if (m_handler) m_handler(payload, h.payload_len);
+                } else if (h.opcode == WS_PING) {
+                    send_control(WS_PONG, payload, h.payload_len);
+                } else if (h.opcode == WS_CLOSE) {
+                    LOG_WARN("` closed the order connection", m_opts.host.c_str());
+                    goto broken;
+                }
+            }
+            memmove(m_rx.data(), m_rx.data() + off, m_rx_len - off);
+            m_rx_len -= off;
+            ssize_t n = conn->recv(m_rx.data() + m_rx_len, m_rx.size() - m_rx_len);
+            if (n <= 0) goto broken;
+            m_rx_len += n;
+        }
+        return;
+    broken:
+        m_broken = true;
+        wake();
+    }
+
+    std::string m_api_key;
+    HmacSha256Key m_secret;
+    OrderGatewayOptions m_opts;
+    std::vector<OrderTemplate> m_templates;
+    OrderTemplate m_warm;       // scratch copy for warm()
+    OrderQueue m_queue;
+    TimerWheel m_timers;        // gateway vCPU only
+    WsCorrelator m_requests;
+    int m_place;
+    ResponseHandler m_handler;
+    Stats m_stats;
+    std::atomic<uint64_t> m_rejected{0};
+
+    std::thread m_thread;
+    int m_evfd = -1;
+    std::atomic<bool> m_sleeping{false};
+    std::atomic<bool> m_stopping{false};
+    bool m_broken = false;
+    photon::mutex m_send_lock;
+    OutboundLimiter* m_limiter = nullptr;   // of the current session
+    std::vector<char> m_rx;
+    size_t m_rx_len = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    State m_state = STARTING;
+};
@@ -3,20 +3,33 @@ import socketserver
 
 class SimpleHandler(BaseHTTPRequestHandler):
     protocol_version = "HTTP/1.1"
-    def do_GET(self):
-        self.send_response(200)
+
+    # keep-alive needs every response to be framed
+    def send_body(self, body):
         self.send_header('Content-type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
         self.end_headers()
-        self.wfile.write(b"Hello, GET request received")
+        self.wfile.write(body)
+
+    def do_GET(self):
+        self.send_response(200)
+        if self.path == "/chunked":
+            self.send_header('Content-type', 'text/plain')
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.end_headers()
+            for part in (b"Hello, ", b"chunked ", b"GET request received"):
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+            self.wfile.write(b"0\r\n\r\n")
+            return
+        self.send_body(b"Hello, GET request received")
 
     def do_POST(self):
         content_length = int(self.headers['Content-Length'])
         post_data = self.rfile.read(content_length)
         self.send_response(200)
-        self.send_header('Content-type', 'text/plain')
-        self.end_headers()
-        self.wfile.write(b"Hello, POST request received: " + post_data)
+        self.send_body(b"Hello, POST request received: " + post_data)
 
-with socketserver.TCPServer(("", 8080), SimpleHandler) as httpd:
+socketserver.TCPServer.allow_reuse_address = True
+with socketserver.ThreadingTCPServer(("", 8080), SimpleHandler) as httpd:
     print("Serving at port 8080")
-    httpd.serve_forever()
\ No newline at end of file
+    httpd.serve_forever()
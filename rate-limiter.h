@@ -0,0 +1,207 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Outbound message rate limiting, so that bursts never exceed the
+// exchange's per-connection and per-account limits.
+//
+// TokenBucket is the GCRA form of a token bucket: the whole state is one
+// atomic "theoretical arrival time", so a bucket shared by the connections
+// of an account on several vCPUs is taken with a single CAS and never
+// locks. OutboundLimiter sits in front of one connection's sends with
+// three classes: orders and cancels, then control frames (pings, pongs),
+// then subscriptions. Lower classes must leave a reserve of tokens for the
+// higher ones. A message that cannot go now is queued (and sent from a
+// timer when tokens are back) or rejected, per class; the calling
+// coroutine is never blocked.
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+
+#include <photon/common/alog.h>
+
+#include "timer-wheel.h"
+
+inline uint64_t rl_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class TokenBucket {
+public:
+    // `rate` tokens per second, at most `burst` at once.
+    TokenBucket(double rate, double burst)
+        : m_interval_ns((uint64_t)(1e9 / rate)), m_burst_ns((uint64_t)(burst * 1e9 / rate)) {}
+
+    // Takes `n` tokens if that leaves at least `reserve` in the bucket.
+    // Returns 0 on success, otherwise the ns until it would succeed.
+    uint64_t try_take(uint64_t now_ns, uint64_t n = 1, uint64_t reserve = 0) {
+        uint64_t cost = n * m_interval_ns;
+        uint64_t limit = m_burst_ns > reserve * m_interval_ns ? m_burst_ns - reserve * m_interval_ns : 0;
+        uint64_t tat = m_tat.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t new_tat = (tat > now_ns ? tat : now_ns) + cost;
+            if (new_tat - now_ns > limit) return new_tat - now_ns - limit;
+            if (m_tat.compare_exchange_weak(tat, new_tat, std::memory_order_relaxed)) return 0;
+        }
+    }
+
+    // Returns tokens taken by a send that did not happen.
+    void give_back(uint64_t n = 1) {
+        m_tat.fetch_sub(n * m_interval_ns, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> m_tat{0};
+    uint64_t m_interval_ns;
+    uint64_t m_burst_ns;
+};
+
+enum OutboundClass {
+    OUT_ORDER,          // orders and cancels
+    OUT_CONTROL,        // pings and pongs
+    OUT_SUBSCRIPTION,   // subscribe, unsubscribe and other requests
+    OUT_CLASSES,
+};
+
+struct OutboundLimits {
+    // Binance: 5 messages/s per stream connection, pings and pongs included
+    double rate = 5;
+    double burst = 5;
+    // tokens a class must leave for the classes above it
+    uint64_t reserve[OUT_CLASSES] = {0, 1, 2};
+    // queue when limited, or reject (stale orders are worse than none)
+    bool queue[OUT_CLASSES] = {false, true, true};
+    size_t queue_limit = 256;
+};
+
+class OutboundLimiter {
+public:
+    // Writes one complete frame; < 0 on failure.
+    using Sender = std::function<int(const char* frame, size_t n)>;
+
+    // `account` is an optional bucket for orders, shared with the other
+    // connections of the account on any vCPU. Queued messages are sent from
+    // a timer on `wheel`.
+    OutboundLimiter(const OutboundLimits& limits, Sender send, TokenBucket* account = nullptr,
+                    TimerWheel* wheel = nullptr)
+        : m_limits(limits), m_bucket(limits.rate, limits.burst), m_account(account),
+          m_send(std::move(send)), m_wheel(wheel) {
+        m_retry.set_callback([this] { drain(); });
+    }
+
+    // Sends now if the limits allow. Otherwise queues a copy (returns 0) or
+    // rejects: -1 with EBUSY, or ENOBUFS if the queue is full.
+    int send(OutboundClass cls, const char* frame, size_t n) {
+        // nothing overtakes what this class or a higher one has queued
+        if (!queued_upto(cls)) {
+            uint64_t wait = take(cls);
+            if (wait == 0) return do_send(cls, frame, n);
+            if (!m_limits.queue[cls]) {
+                m_stats.rejected[cls]++;
+                LOG_ERROR_RETURN(EBUSY, -1, "outbound rate limit reached, message rejected");
+            }
+            arm(wait);
+        }
+        if (m_queues[cls].size() >= m_limits.queue_limit) {
+            m_stats.rejected[cls]++;
+            LOG_ERROR_RETURN(ENOBUFS, -1, "outbound queue full, message rejected");
+        }
+        m_queues[cls].emplace_back(frame, n);
+        m_stats.queued[cls]++;
+        return 0;
+    }
+
+    size_t queued() const {
+        size_t n = 0;
+        for (auto& q : m_queues) n += q.size();
+        return n;
+    }
+
+    // Drops everything queued, e.g. when the connection is gone.
+    void clear() {
+        for (auto& q : m_queues) q.clear();
+        m_retry.cancel();
+    }
+
+    struct Stats {
+        uint64_t sent[OUT_CLASSES] = {};
+        uint64_t queued[OUT_CLASSES] = {};
+        uint64_t rejected[OUT_CLASSES] = {};
+    };
+    const Stats& stats() const { return m_stats; }
+
+private:
+    bool queued_upto(int cls) const {
+        for (int c = 0; c <= cls; c++)
+            if (!m_queues[c].empty()) return true;
+        return false;
+    }
+
+    // 0 if a token was taken from both buckets, else ns to wait.
+    uint64_t take(int cls) {
+        uint64_t now = rl_now_ns();
+        uint64_t wait = m_bucket.try_take(now, 1, m_limits.reserve[cls]);
+        if (wait || !m_account || cls != OUT_ORDER) return wait;
+        wait = m_account->try_take(now);
+        if (wait) m_bucket.give_back();
+        return wait;
+    }
+
+    int do_send(int cls, const char* frame, size_t n) {
+        if (m_send(frame, n) < 0) return -1;
+        m_stats.sent[cls]++;
+        return 0;
+    }
+
+    void arm(uint64_t wait_ns) {
+        if (!m_retry.pending()) m_retry.start(wait_ns / 1000 + 1, m_wheel);
+    }
+
+    void drain() {
+        for (int cls = 0; cls < OUT_CLASSES; cls++) {
+            auto& q = m_queues[cls];
+            while (!q.empty()) {
+                uint64_t wait = take(cls);
+                if (wait) {
+                    arm(wait);
+                    return;
+                }
+                std::string msg = std::move(q.front());
+                q.pop_front();
+                if (do_send(cls, msg.data(), msg.size()) < 0) {
+                    clear();
+                    return;
+                }
+            }
+        }
+    }
+
+    OutboundLimits m_limits;
+    TokenBucket m_bucket;
+    TokenBucket* m_account;
+    Sender m_send;
+    TimerWheel* m_wheel;
+    WheelTimer m_retry;
+    std::deque<std::string> m_queues[OUT_CLASSES];
+    Stats m_stats;
+};
@@ -0,0 +1,275 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Registered files and fixed buffers for long-lived sockets.
+//
+// A socket put into the ring's file table is referenced by index
+// (IOSQE_FIXED_FILE), so the kernel skips the fd lookup and refcounting on
+// every operation. Fixed buffers are registered once (IORING_REGISTER_BUFFERS)
+// and used with READ_FIXED / WRITE_FIXED, so their pages are not pinned again
+// per operation. Both are owned by the vCPU's UringRecvRing; feed and order
+// connections live for days, so the registration cost is paid once.
+#pragma once
+
+#include <sys/mman.h>
+#include <vector>
+
+#include "iouring-recv-ring.h"
+
+// One registered buffer. `len` is the number of valid bytes.
+struct FixedBuffer {
+    char* data;
+    uint32_t size;
+    uint32_t len;
+    uint16_t index;
+    FixedBuffer* next;
+};
+
+// Pool of fixed buffers registered with a ring. A ring has a single set of
+// registered buffers, so there is one pool per vCPU (get_vcpu_buffer_pool).
+class FixedBufferPool {
+public:
+    FixedBufferPool(UringRecvRing* ring, uint32_t count = 64, uint32_t size = 64 * 1024)
+        : m_ring(ring), m_count(count), m_size(size) {}
+
+    ~FixedBufferPool() {
+        if (m_mem) {
+            m_ring->unregister_buffers();
+            munmap(m_mem, (size_t)m_count * m_size);
+        }
+    }
+
+    int init() {
+        auto mem = mmap_local((size_t)m_count * m_size);
+        if (!mem)
+            LOG_ERRNO_RETURN(0, -1, "failed to map fixed buffers");
+        m_mem = (char*)mem;
+        std::vector<struct iovec> iov(m_count);
+        m_bufs.resize(m_count);
+        for (uint32_t i = 0; i < m_count; i++) {
+            iov[i].iov_base = m_mem + (size_t)i * m_size;
+            iov[i].iov_len = m_size;
+            m_bufs[i] = FixedBuffer{(char*)iov[i].iov_base, m_size, 0, (uint16_t)i, m_free};
+            m_free = &m_bufs[i];
+        }
+        if (m_ring->register_buffers(iov.data(), m_count) < 0) {
+            munmap(m_mem, (size_t)m_count * m_size);
+            m_mem = nullptr;
+            return -1;
+        }
+        return 0;
+    }
+
+    // nullptr when exhausted; callers fall back to their own memory.
+    FixedBuffer* get() {
+        auto b = m_free;
+        if (b) {
+            m_free = b->next;
+            b->len = 0;
+        }
+        return b;
+    }
+
+    void put(FixedBuffer* b) {
+        b->next = m_free;
+        m_free = b;
+    }
+
+    UringRecvRing* ring() { return m_ring; }
+
+private:
+    UringRecvRing* m_ring;
+    uint32_t m_count, m_size;
+    char* m_mem = nullptr;
+    std::vector<FixedBuffer> m_bufs;
+    FixedBuffer* m_free = nullptr;
+};
+
+// A socket fd placed in the ring's registered file table.
+class RegisteredSocket {
+public:
+    RegisteredSocket(UringRecvRing* ring, int fd) : m_ring(ring), m_fd(fd) {}
+
+    ~RegisteredSocket() {
+        if (m_index >= 0) m_ring->unregister_fd(m_index);
+    }
+
+    int init() {
+        m_index = m_ring->register_fd(m_fd);
+        return m_index < 0 ? -1 : 0;
+    }
+
+    int index() const { return m_index; }
+
+    ssize_t send(const void* buf, size_t count, photon::Timeout tmo = {}) {
+        int idx = m_index;
+        return m_ring->call([&](struct io_uring_sqe* sqe) {
+            io_uring_prep_send(sqe, idx, buf, count, MSG_NOSIGNAL);
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }, tmo);
+    }
+
+    ssize_t recv(void* buf, size_t count, photon::Timeout tmo = {}) {
+        int idx = m_index;
+        return m_ring->call([&](struct io_uring_sqe* sqe) {
+            io_uring_prep_recv(sqe, idx, buf, count, 0);
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }, tmo);
+    }
+
+    // WRITE_FIXED of `count` bytes of a pool buffer, starting at `offset`.
+    ssize_t send_fixed(const FixedBuffer* b, size_t offset, size_t count, photon::Timeout tmo = {}) {
+        int idx = m_index;
+        return m_ring->call([&](struct io_uring_sqe* sqe) {
+            io_uring_prep_write_fixed(sqe, idx, b->data + offset, count, 0, b->index);
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }, tmo);
+    }
+
+    // READ_FIXED into a pool buffer; sets b->len.
+    ssize_t recv_fixed(FixedBuffer* b, photon::Timeout tmo = {}) {
+        int idx = m_index;
+        ssize_t n = m_ring->call([&](struct io_uring_sqe* sqe) {
+            io_uring_prep_read_fixed(sqe, idx, b->data, b->size, 0, b->index);
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }, tmo);
+        b->len = n > 0 ? n : 0;
+        return n;
+    }
+
+    // Loops until everything is sent, like ISocketStream::write.
+    template <typename Send>
+    ssize_t send_all(size_t count, Send&& send_some) {
+        size_t done = 0;
+        while (done < count) {
+            ssize_t n = send_some(done);
+            if (n < 0) return done ? (ssize_t)done : -1;
+            if (n == 0) break;
+            done += n;
+        }
+        return done;
+    }
+
+    ssize_t write(const void* buf, size_t count, photon::Timeout tmo = {}) {
+        return send_all(count, [&](size_t done) {
+            return send((const char*)buf + done, count - done, tmo);
+        });
+    }
+
+    // Sends the valid bytes (b->len) of a pool buffer.
+    ssize_t write_fixed(const FixedBuffer* b, photon::Timeout tmo = {}) {
+        return send_all(b->len, [&](size_t done) {
+            return send_fixed(b, done, b->len - done, tmo);
+        });
+    }
+
+private:
+    UringRecvRing* m_ring;
+    int m_fd;
+    int m_index = -1;
+};
+
+// Multishot stream whose socket is also in the registered file table: the
+// receive side is armed against the fixed file, sends go through the ring.
+class RegisteredSocketStream : public MultishotSocketStream {
+public:
+    RegisteredSocketStream(UringRecvRing* ring, photon::net::ISocketStream* underlay, bool ownership)
+        : MultishotSocketStream(ring, underlay, ownership),
+          m_reg(ring, underlay->get_underlay_fd()) {}
+
+    int init() {
+        if (m_reg.init() < 0) return -1;
+        channel()->use_fixed_file(m_reg.index());
+        return 0;
+    }
+
+    RegisteredSocket* registered() { return &m_reg; }
+
+    ssize_t send(const void* buf, size_t count, int /*flags*/ = 0) override {
+        return m_reg.send(buf, count, m_timeout);
+    }
+    ssize_t send(const struct iovec* iov, int iovcnt, int /*flags*/ = 0) override {
+        return writev(iov, iovcnt);
+    }
+    ssize_t write(const void* buf, size_t count) override {
+        return m_reg.write(buf, count, m_timeout);
+    }
+    ssize_t writev(const struct iovec* iov, int iovcnt) override {
+        ssize_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            ssize_t n = m_reg.write(iov[i].iov_base, iov[i].iov_len, m_timeout);
+            if (n < 0) return total ? total : -1;
+            total += n;
+            if ((size_t)n < iov[i].iov_len) break;
+        }
+        return total;
+    }
+
+private:
+    RegisteredSocket m_reg;
+};
+
+class RegisteredSocketClient : public MultishotSocketClient {
+public:
+    using MultishotSocketClient::MultishotSocketClient;
+
+protected:
+    MultishotSocketStream* new_stream(photon::net::ISocketStream* stream) override {
+        auto rs = new RegisteredSocketStream(m_ring, stream, true);
+        if (rs->init() < 0) {
+            LOG_WARN("file table unavailable, using plain multishot stream");
+            rs->release_underlay();
+            delete rs;
+            return new MultishotSocketStream(m_ring, stream, true);
+        }
+        return rs;
+    }
+};
+
+inline std::unique_ptr<FixedBufferPool>& vcpu_buffer_pool_slot() {
+    static thread_local std::unique_ptr<FixedBufferPool> pool;
+    return pool;
+}
+
+// The fixed buffer pool of the current vCPU, created on first use.
+inline FixedBufferPool* get_vcpu_buffer_pool() {
+    auto& pool = vcpu_buffer_pool_slot();
+    if (!pool) {
+        auto ring = get_vcpu_recv_ring();
+        if (!ring) return nullptr;
+        std::unique_ptr<FixedBufferPool> p(new FixedBufferPool(ring));
+        if (p->init() < 0) return nullptr;
+        pool = std::move(p);
+    }
+    return pool.get();
+}
+
+// Frees the current vCPU's buffer pool and then its ring
+// (release_vcpu_recv_ring()), which the pool's buffers are registered
+// with. Call it before photon::fini() on every vCPU that used either.
+inline void release_vcpu_buffer_pool() {
+    vcpu_buffer_pool_slot().reset();
+    release_vcpu_recv_ring();
+}
+
+// new_multishot_tcp_client() for long-lived feed and order sockets: each
+// connection is also put into the vCPU's registered file table.
+inline photon::net::ISocketClient* new_registered_tcp_client(UringRecvRing* ring = nullptr) {
+    auto base = photon::net::new_iouring_tcp_client();
+    if (!ring) ring = get_vcpu_recv_ring();
+    if (!base || !ring) return base;
+    return new RegisteredSocketClient(ring, base, true);
+}
@@ -5,12 +5,18 @@
 #include <photon/fs/localfs.h>
 #include <photon/common/alog.h>
 #include <iostream>
+#include <memory>
+#include <stdlib.h>
+
+#include "file-serve.h"
+
 int main() {
     int ret = photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
     if (ret != 0) {
         return -1; 
     }
     DEFER(photon::fini());
+    DEFER(release_vcpu_recv_ring());
     photon_std::thread server_thread([]{
         auto server = photon::net::new_tcp_socket_server(); 
         if (server == nullptr) {
@@ -27,7 +33,19 @@ int main() {
             }
             return 0;
         }; 
-        server-> set_handler(handler); 
+        // With SNAPSHOT_DIR set, clients GET the files in it over HTTP/1.1;
+        // bodies are spliced from the page cache to the socket
+        std::unique_ptr<SnapshotFileServer> files;
+        auto file_handler = [&](photon::net::ISocketStream* stream) -> int {
+            return files->handle(stream);
+        };
+        if (const char* dir = getenv("SNAPSHOT_DIR")) {
+            files.reset(new SnapshotFileServer(dir, false));
+            if (!files->ok()) return -1;
+            server->set_handler(file_handler);
+        } else {
+            server-> set_handler(handler); 
+        }
         server->bind_v4localhost(9527); 
         server->listen();
         LOG_INFO("Server is listening for port ' ...", 9527); 
@@ -0,0 +1,276 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// TLS server sharded over N vCPUs.
+//
+// Each shard is an OS thread running its own Photon vCPU with its own
+// SO_REUSEPORT listener; all shards share one SSL_CTX. How connections are
+// spread is chosen by AcceptSteering:
+//   Hash      the kernel's 4-tuple hash over the reuseport group
+//   CpuLocal  a reuseport CBPF program picks the shard of the CPU that took
+//             the SYN (pair with pin_cpus so shard i runs on CPU i)
+//   Migrate   shard 0 accepts everything and hands each connection to the
+//             shard with the fewest active connections
+// With handshake_vcpus > 0, the TLS handshake runs on a separate WorkPool and
+// the connection comes back to its shard afterwards, so RSA/ECDHE work does
+// not stall established streams.
+#pragma once
+
+#include <linux/filter.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/thread/thread11.h>
+#include <photon/thread/workerpool.h>
+#include <photon/net/socket.h>
+
+#include "iouring-recv-ring.h"
+#include "ktls-stream.h"
+#include "topology.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+enum class AcceptSteering { Hash, CpuLocal, Migrate };
+
+struct ShardedTlsServerOptions {
+    int shards = 1;
+    uint64_t engine = photon::INIT_EVENT_IOURING;
+    AcceptSteering steering = AcceptSteering::Hash;
+    int handshake_vcpus = 0;        // 0: handshake on the shard itself
+    bool pin_cpus = false;          // pin shard i to CPU i
+    bool localhost = true;
+    uint16_t port = 0;              // 0: pick one, see port()
+    int backlog = 1024;
+    uint64_t drain_timeout_us = 5000000;    // stop() waits this long, then shuts sockets down
+};
+
+class ShardedTlsServer {
+public:
+    using Handler = std::function<int(photon::net::ISocketStream*)>;
+
+    struct ShardStats {
+        std::atomic<uint64_t> accepted{0};
+        std::atomic<uint64_t> active{0};
+        std::atomic<uint64_t> handshake_us{0};  // total
+        std::atomic<uint64_t> handshake_failed{0};
+    };
+
+    ShardedTlsServer(SSL_CTX* ctx, const ShardedTlsServerOptions& opts)
+        : m_ctx(ctx), m_opts(opts), m_shards(opts.shards) {
+        for (auto& s : m_shards) s.reset(new Shard);
+    }
+
+    ~ShardedTlsServer() { stop(); }
+
+    // Must be called from a Photon vCPU when handshake_vcpus > 0, since the
+    // handshake pool is created from the calling vCPU.
+    int start(Handler handler) {
+        m_handler = std::move(handler);
+        if (m_opts.handshake_vcpus > 0) {
+            m_hs_pool.reset(new photon::WorkPool(m_opts.handshake_vcpus, m_opts.engine,
+                                                 photon::INIT_IO_NONE, -1));
+        }
+        // shards join the reuseport group one by one, so that group index
+        // == shard index, which the CpuLocal program relies on
+        for (int i = 0; i < m_opts.shards; i++) {
+            m_shards[i]->th = std::thread(&ShardedTlsServer::shard_main, this, i);
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [&] { return m_shards[i]->state != Shard::STARTING; });
+            if (m_shards[i]->state == Shard::FAILED) {
+                lock.unlock();
+                stop();
+                LOG_ERROR_RETURN(0, -1, "shard ` failed to start", i);
+            }
+        }
+        LOG_INFO("TLS server listening on port ` with ` shards", m_port.load(), m_opts.shards);
+        return 0;
+    }
+
+    void stop() {
+        m_stopping = true;
+        for (auto& s : m_shards) {
+            if (s->th.joinable()) s->th.join();
+        }
+        m_hs_pool.reset();
+    }
+
+    uint16_t port() const { return m_port; }
+    int shards() const { return m_opts.shards; }
+    const ShardStats& stats(int shard) const { return m_shards[shard]->stats; }
+
+private:
+    struct Shard {
+        enum State { STARTING, RUNNING, FAILED };
+        std::thread th;
+        State state = STARTING;
+        photon::vcpu_base* vcpu = nullptr;
+        ShardStats stats;
+        // sockets of the shard's connections, touched on its vCPU only
+        std::unordered_set<photon::net::ISocketStream*> conns;
+    };
+
+    void set_state(int i, Shard::State st) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_shards[i]->state = st;
+        m_cond.notify_all();
+    }
+
+    void shard_main(int index) {
+        if (m_opts.pin_cpus) place_vcpu(index);
+        if (photon::init(m_opts.engine, photon::INIT_IO_NONE)) {
+            LOG_ERROR("shard ` failed to init photon", index);
+            set_state(index, Shard::FAILED);
+            return;
+        }
+        DEFER(photon::fini());
+        // send_file() from handlers may have set up the shard's ring
+        DEFER(release_vcpu_recv_ring());
+        m_shards[index]->vcpu = photon::get_vcpu();
+        if (serve(index) < 0) set_state(index, Shard::FAILED);
+    }
+
+    int serve(int index) {
+        auto server = m_opts.engine == photon::INIT_EVENT_EPOLL ?
+                      photon::net::new_tcp_socket_server() : photon::net::new_iouring_tcp_server();
+        if (!server) LOG_ERRNO_RETURN(0, -1, "failed to create tcp server");
+        DEFER(delete server);
+
+        bool listening = index == 0 || m_opts.steering != AcceptSteering::Migrate;
+        if (listening) {
+            server->setsockopt<int>(SOL_SOCKET, SO_REUSEPORT, 1);
+            uint16_t port = index == 0 ? m_opts.port : m_port.load();
+            int ret = m_opts.localhost ? server->bind_v4localhost(port) : server->bind_v4any(port);
+            if (ret < 0) LOG_ERRNO_RETURN(0, -1, "shard ` failed to bind port `", index, port);
+            if (index == 0) m_port = server->getsockname().port;
+            if (m_opts.steering == AcceptSteering::CpuLocal && index == m_opts.shards - 1 &&
+                    attach_cpu_steering(server) < 0)
+                return -1;
+            if (server->listen(m_opts.backlog) < 0)
+                LOG_ERRNO_RETURN(0, -1, "shard ` failed to listen", index);
+        }
+        set_state(index, Shard::RUNNING);
+
+        photon::thread* acceptor = nullptr;
+        photon::join_handle* jh = nullptr;
+        if (listening) {
+            acceptor = photon::thread_create11(&ShardedTlsServer::accept_loop, this, server, index);
+            jh = photon::thread_enable_join(acceptor);
+        }
+        while (!m_stopping) photon::thread_usleep(100 * 1000);
+        if (acceptor) {
+            photon::thread_interrupt(acceptor);
+            photon::thread_join(jh);
+        }
+        // let in-flight connections notice the shutdown; those still open
+        // after drain_timeout_us have their sockets shut down under them
+        auto& shard = *m_shards[index];
+        photon::Timeout drain(m_opts.drain_timeout_us);
+        bool forced = false;
+        while (shard.stats.active > 0) {
+            if (drain.timeout() == 0) {
+                if (!forced) LOG_WARN("shard `: ` connections still open, shutting them down", index,
+                                      shard.stats.active.load());
+                forced = true;
+                for (auto s : shard.conns) s->shutdown(photon::net::ShutdownHow::ReadWrite);
+            }
+            photon::thread_usleep(10 * 1000);
+        }
+        return 0;
+    }
+
+    // Returns socket index = CPU % shards for every incoming connection.
+    int attach_cpu_steering(photon::net::ISocketServer* server) {
+        struct sock_filter code[] = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+            {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)m_opts.shards},
+            {BPF_RET | BPF_A, 0, 0, 0},
+        };
+        struct sock_fprog prog = {(unsigned short)(sizeof(code) / sizeof(code[0])), code};
+        if (server->setsockopt(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to attach reuseport CPU steering program");
+        return 0;
+    }
+
+    int least_loaded_shard() {
+        int best = 0;
+        for (int i = 1; i < m_opts.shards; i++) {
+            if (m_shards[i]->stats.active < m_shards[best]->stats.active) best = i;
+        }
+        return best;
+    }
+
+    void accept_loop(photon::net::ISocketServer* server, int index) {
+        while (!m_stopping) {
+            auto stream = server->accept();
+            if (!stream) {
+                if (m_stopping) break;
+                // e.g. EMFILE: back off instead of spinning on the backlog
+                LOG_ERROR("accept failed on shard `", index, ERRNO());
+                photon::thread_usleep(1000);
+                continue;
+            }
+            int target = index;
+            if (m_opts.steering == AcceptSteering::Migrate) target = least_loaded_shard();
+            auto& st = m_shards[target]->stats;
+            st.accepted++;
+            st.active++;
+            auto th = photon::thread_create11(&ShardedTlsServer::serve_conn, this, stream, target);
+            if (target != index) photon::thread_migrate(th, m_shards[target]->vcpu);
+        }
+    }
+
+    void serve_conn(photon::net::ISocketStream* stream, int shard) {
+        auto& sh = *m_shards[shard];
+        auto& st = sh.stats;
+        DEFER(st.active--);
+        // created and freed on the shard, so the drain in serve() can shut
+        // the socket down even while the handshake runs elsewhere
+        auto tls = new KtlsSocketStream(m_ctx, stream, true, true);
+        DEFER(delete tls);
+        sh.conns.insert(stream);
+        DEFER(sh.conns.erase(stream));
+        auto t0 = photon::now;
+        if (m_hs_pool) m_hs_pool->thread_migrate(photon::CURRENT, -1UL);
+        int ret = tls->handshake(tls->timeout());
+        if (m_hs_pool) photon::thread_migrate(photon::CURRENT, sh.vcpu);
+        if (ret < 0) {
+            st.handshake_failed++;
+            return;
+        }
+        st.handshake_us += photon::now - t0;
+        m_handler(tls);
+    }
+
+    SSL_CTX* m_ctx;
+    ShardedTlsServerOptions m_opts;
+    Handler m_handler;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::unique_ptr<photon::WorkPool> m_hs_pool;
+    std::atomic<uint16_t> m_port{0};
+    std::atomic<bool> m_stopping{false};
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+};
@@ -0,0 +1,189 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Process shutdown in an order that loses nothing.
+//
+// SIGINT, SIGTERM or request() mark the process as shutting down. Code
+// that used to loop on a stop flag checks shutdown_requested(); coroutines
+// block in wait() and wake up when shutdown is requested. A loop that
+// blocks its vCPU in epoll_wait() adds fd() to its set instead: an eventfd
+// that becomes readable and stays readable.
+//
+// main() then calls drain(), which runs the registered steps stage by stage:
+//
+//   SHUTDOWN_STOP_INPUT   listeners and new work are turned away
+//   SHUTDOWN_SESSIONS     in-flight requests are answered, queued sends go
+//                         out and WebSockets close with a close frame
+//   SHUTDOWN_FLUSH        captures, checkpoints and files are written out
+//   SHUTDOWN_VCPUS        worker vCPUs are joined
+//
+// The steps of one stage run side by side as coroutines of the vCPU that
+// calls drain(), all under one deadline that each step is handed as a
+// Timeout. A step must give up when it expires: whatever was not drained
+// by then is dropped. Steps that belong to another vCPU hand the work over
+// themselves (OrderGateway::stop() and binlog_stop() are thread-safe).
+// A second signal exits at once, for when a drain hangs.
+#pragma once
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+#include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
+
+enum ShutdownStage {
+    SHUTDOWN_STOP_INPUT,
+    SHUTDOWN_SESSIONS,
+    SHUTDOWN_FLUSH,
+    SHUTDOWN_VCPUS,
+    SHUTDOWN_STAGES,
+};
+
+class ShutdownCoordinator {
+public:
+    // < 0 if the step failed.
+    using Step = std::function<int(photon::Timeout)>;
+
+    static ShutdownCoordinator& instance() {
+        static ShutdownCoordinator coordinator;
+        return coordinator;
+    }
+
+    // SIGINT and SIGTERM request shutdown.
+    void install_signals() {
+        struct sigaction sa = {};
+        sa.sa_handler = &ShutdownCoordinator::on_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+    }
+
+    // Thread-safe.
+    void request(const char* why = "requested") {
+        if (!mark()) return;
+        LOG_INFO("shutdown `", why);
+    }
+
+    bool requested() const { return m_requested.load(std::memory_order_acquire); }
+
+    // Readable once shutdown is requested.
+    int fd() const { return m_evfd; }
+
+    // Blocks the calling coroutine until shutdown is requested: 0, or -1 on
+    // timeout.
+    int wait(photon::Timeout tmo = {}) {
+        while (!requested()) {
+            int r = photon::wait_for_fd_readable(m_evfd, tmo);
+            if (r < 0 && !requested()) return -1;
+        }
+        return 0;
+    }
+
+    // Registers a step. Thread-safe. Steps are never unregistered, so
+    // whatever a step refers to must outlive drain().
+    void add(ShutdownStage stage, const char* name, Step step) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_steps.push_back({stage, name, std::move(step)});
+    }
+
+    // Runs the steps within `deadline_us` from now. Returns how many failed
+    // or finished late.
+    int drain(uint64_t deadline_us) {
+        mark();
+        photon::Timeout tmo(deadline_us);
+        uint64_t t0 = photon::now;
+        int bad = 0;
+        for (int stage = 0; stage < SHUTDOWN_STAGES; stage++) {
+            std::vector<Entry> steps;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (auto& s : m_steps) {
+                    if (s.stage == stage) steps.push_back(s);
+                }
+            }
+            std::vector<photon::join_handle*> running;
+            for (auto& s : steps) {
+                auto th = photon::thread_create11([&s, &tmo, &bad] {
+                    uint64_t start = photon::now;
+                    int r = s.step(tmo);
+                    bool late = tmo.timeout() == 0;
+                    if (r < 0 || late) bad++;
+                    LOG_INFO("shutdown: ` ` in ` ms", s.name, r < 0 ? "failed" : late ? "ran out of time" : "done",
+                             (photon::now - start) / 1000);
+                });
+                running.push_back(photon::thread_enable_join(th));
+            }
+            for (auto jh : running) photon::thread_join(jh);
+        }
+        LOG_INFO("shutdown: drained in ` ms, ` steps failed or late", (photon::now - t0) / 1000, bad);
+        return bad;
+    }
+
+private:
+    struct Entry {
+        int stage;
+        const char* name;
+        Step step;
+    };
+
+    ShutdownCoordinator() { m_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); }
+
+    // Async-signal-safe. False if shutdown was requested before.
+    bool mark() {
+        if (m_requested.exchange(true, std::memory_order_acq_rel)) return false;
+        eventfd_write(m_evfd, 1);
+        return true;
+    }
+
+    static void on_signal(int) {
+        if (!instance().mark()) _exit(1);
+    }
+
+    std::atomic<bool> m_requested{false};
+    int m_evfd = -1;
+    std::mutex m_mutex;
+    std::vector<Entry> m_steps;
+};
+
+inline ShutdownCoordinator& shutdown_coordinator() { return ShutdownCoordinator::instance(); }
+
+inline bool shutdown_requested() { return ShutdownCoordinator::instance().requested(); }
+
+// Joins the coroutine `th` (`jh` is from thread_enable_join()), and
+// interrupts it if it is still running when `tmo` expires, so that a step
+// waiting for a session gives up in time. -1 if it had to be interrupted.
+inline int shutdown_join(photon::thread* th, photon::join_handle* jh, photon::Timeout tmo) {
+    bool joined = false, fired = false;
+    auto timer = photon::thread_create11([&] {
+        if (photon::thread_usleep(tmo.timeout()) < 0 || joined) return;
+        fired = true;
+        photon::thread_interrupt(th, ETIMEDOUT);
+    });
+    auto timer_jh = photon::thread_enable_join(timer);
+    photon::thread_join(jh);
+    joined = true;
+    if (!fired) photon::thread_interrupt(timer);
+    photon::thread_join(timer_jh);
+    return fired ? -1 : 0;
+}
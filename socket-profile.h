@@ -0,0 +1,287 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// TCP options by kind of connection, declared once and applied to every
+// socket of a client or server.
+//
+//   feed    market data in, pongs and subscriptions out: no Nagle, quick
+//           ACKs, a receive buffer deep enough to ride out bursts
+//   order   small request/response frames both ways: no Nagle, quick ACKs,
+//           high priority and the EF DSCP mark
+//   bulk    snapshots and file transfers: large buffers, Nagle left on,
+//           marked for throughput
+//
+// new_profiled_client() and new_profiled_server() wrap any socket client or
+// server (new_iouring_tcp_client(), new_registered_tcp_client(),
+// new_tcp_socket_server(), ...; a TLS client or server goes on top). The
+// options are set on the client or listener first, so the buffer sizes are
+// in place before the SYN and the window scale is negotiated for them, and
+// again on each connected or accepted socket. Each socket is then read back
+// with getsockopt(): the kernel silently caps buffer sizes at
+// net.core.rmem_max / wmem_max (SO_RCVBUFFORCE is tried next, which needs
+// CAP_NET_ADMIN), and priorities above 6 need CAP_NET_ADMIN too. What did
+// not take is logged and counted, and the connection goes ahead anyway.
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <atomic>
+
+#include <photon/common/alog.h>
+#include <photon/net/socket.h>
+
+struct SocketProfile {
+    const char* name = "default";
+    int nodelay = -1;           // TCP_NODELAY; -1 leaves an option as it is
+    int quickack = -1;          // TCP_QUICKACK, set again on each socket
+    int rcvbuf = 0;             // SO_RCVBUF bytes; 0 leaves it as it is
+    int sndbuf = 0;             // SO_SNDBUF bytes
+    int priority = -1;          // SO_PRIORITY, 0-6 without CAP_NET_ADMIN
+    int tos = -1;               // IP_TOS, DSCP << 2
+};
+
+inline SocketProfile feed_socket_profile() {
+    SocketProfile p;
+    p.name = "feed";
+    p.nodelay = 1;
+    p.quickack = 1;
+    p.rcvbuf = 4 << 20;
+    p.priority = 6;
+    p.tos = IPTOS_LOWDELAY;
+    return p;
+}
+
+inline SocketProfile order_socket_profile() {
+    SocketProfile p;
+    p.name = "order";
+    p.nodelay = 1;
+    p.quickack = 1;
+    p.rcvbuf = 1 << 20;
+    p.sndbuf = 1 << 20;
+    p.priority = 6;
+    p.tos = 46 << 2;            // DSCP EF
+    return p;
+}
+
+inline SocketProfile bulk_socket_profile() {
+    SocketProfile p;
+    p.name = "bulk";
+    p.rcvbuf = 8 << 20;
+    p.sndbuf = 8 << 20;
+    p.priority = 0;
+    p.tos = IPTOS_THROUGHPUT;
+    return p;
+}
+
+// Sockets seen and options that did not take, over all profiles.
+struct SocketProfileStats {
+    std::atomic<uint64_t> sockets{0};
+    std::atomic<uint64_t> mismatches{0};
+};
+
+inline SocketProfileStats& socket_profile_stats() {
+    static SocketProfileStats stats;
+    return stats;
+}
+
+// Sets the options of `p` on a socket, or on a client or listener for the
+// sockets it creates. Returns how many could not be set.
+inline int set_socket_profile(photon::net::ISocketBase* sock, const SocketProfile& p) {
+    int failed = 0;
+    auto set = [&](int level, int opt, int v, const char* what) {
+        if (sock->setsockopt(level, opt, &v, sizeof(v)) == 0) return;
+        LOG_DEBUG("` profile: failed to set ` to `", p.name, what, v);
+        failed++;
+    };
+    if (p.nodelay >= 0) set(IPPROTO_TCP, TCP_NODELAY, p.nodelay, "TCP_NODELAY");
+    if (p.quickack >= 0) set(IPPROTO_TCP, TCP_QUICKACK, p.quickack, "TCP_QUICKACK");
+    if (p.rcvbuf > 0) set(SOL_SOCKET, SO_RCVBUF, p.rcvbuf, "SO_RCVBUF");
+    if (p.sndbuf > 0) set(SOL_SOCKET, SO_SNDBUF, p.sndbuf, "SO_SNDBUF");
+    // IP_TOS resets the priority to one derived from it, so it goes first
+    if (p.tos >= 0) set(IPPROTO_IP, IP_TOS, p.tos, "IP_TOS");
+    if (p.priority >= 0) set(SOL_SOCKET, SO_PRIORITY, p.priority, "SO_PRIORITY");
+    return failed;
+}
+
+// Reads the options of `p` back from a connected socket, forcing buffer
+// sizes the kernel capped if it may. Returns how many differ.
+inline int check_socket_profile(photon::net::ISocketBase* sock, const SocketProfile& p) {
+    int bad = 0;
+    auto get = [&](int level, int opt) {
+        int v = -1;
+        socklen_t len = sizeof(v);
+        if (sock->getsockopt(level, opt, &v, &len) < 0) return -1;
+        return v;
+    };
+    auto expect = [&](bool ok, const char* what, int want, int got) {
+        if (ok) return;
+        LOG_WARN("` profile: ` is ` instead of `", p.name, what, got, want);
+        bad++;
+    };
+    // the kernel reports twice the size asked for (the other half is its
+    // bookkeeping), capped at twice the sysctl limit
+    auto buffer = [&](int opt, int force, int want, const char* what) {
+        if (get(SOL_SOCKET, opt) >= 2LL * want) return;
+        sock->setsockopt(SOL_SOCKET, force, &want, sizeof(want));
+        int got = get(SOL_SOCKET, opt);
+        expect(got >= 2LL * want, what, want, got / 2);
+    };
+    if (p.nodelay >= 0) {
+        int got = get(IPPROTO_TCP, TCP_NODELAY);
+        expect(!got == !p.nodelay, "TCP_NODELAY", p.nodelay, got);
+    }
+    // TCP_QUICKACK is not sticky: the kernel turns it off and on by itself,
+    // so there is nothing to read back
+    if (p.rcvbuf > 0) buffer(SO_RCVBUF, SO_RCVBUFFORCE, p.rcvbuf, "SO_RCVBUF");
+    if (p.sndbuf > 0) buffer(SO_SNDBUF, SO_SNDBUFFORCE, p.sndbuf, "SO_SNDBUF");
+    if (p.priority >= 0) {
+        int got = get(SOL_SOCKET, SO_PRIORITY);
+        expect(got == p.priority, "SO_PRIORITY", p.priority, got);
+    }
+    if (p.tos >= 0) {
+        // the ECN bits belong to TCP
+        int got = get(IPPROTO_IP, IP_TOS);
+        expect((got & ~3) == (p.tos & ~3), "IP_TOS", p.tos, got);
+    }
+    auto& st = socket_profile_stats();
+    st.sockets.fetch_add(1, std::memory_order_relaxed);
+    st.mismatches.fetch_add(bad, std::memory_order_relaxed);
+    return bad;
+}
+
+// Both of the above on a new socket.
+inline int apply_socket_profile(photon::net::ISocketStream* sock, const SocketProfile& p) {
+    set_socket_profile(sock, p);
+    return check_socket_profile(sock, p);
+}
+
+class ProfiledSocketClient : public photon::net::ISocketClient {
+public:
+    ProfiledSocketClient(photon::net::ISocketClient* base, const SocketProfile& profile, bool ownership)
+        : m_base(base), m_profile(profile), m_ownership(ownership) {
+        set_socket_profile(m_base, m_profile);
+    }
+
+    virtual ~ProfiledSocketClient() {
+        if (m_ownership) delete m_base;
+    }
+
+    photon::net::ISocketStream* connect(const photon::net::EndPoint& remote,
+                                        const photon::net::EndPoint* local = nullptr) override {
+        return profiled(m_base->connect(remote, local));
+    }
+    photon::net::ISocketStream* connect(const char* path, size_t count = 0) override {
+        return m_base->connect(path, count);
+    }
+
+    photon::Object* get_underlay_object(uint64_t recursion = 0) override {
+        return m_base->get_underlay_object(recursion);
+    }
+    int setsockopt(int level, int option_name, const void* option_value, socklen_t option_len) override {
+        return m_base->setsockopt(level, option_name, option_value, option_len);
+    }
+    int getsockopt(int level, int option_name, void* option_value, socklen_t* option_len) override {
+        return m_base->getsockopt(level, option_name, option_value, option_len);
+    }
+    uint64_t timeout() const override { return m_base->timeout(); }
+    void timeout(uint64_t tm) override { m_base->timeout(tm); }
+
+private:
+    photon::net::ISocketStream* profiled(photon::net::ISocketStream* s) {
+        if (s) apply_socket_profile(s, m_profile);
+        return s;
+    }
+
+    photon::net::ISocketClient* m_base;
+    SocketProfile m_profile;
+    bool m_ownership;
+};
+
+class ProfiledSocketServer : public photon::net::ISocketServer {
+public:
+    ProfiledSocketServer(photon::net::ISocketServer* base, const SocketProfile& profile, bool ownership)
+        : m_base(base), m_profile(profile), m_ownership(ownership) {
+        // for the buffer sizes the SYN-ACK advertises
+        set_socket_profile(m_base, m_profile);
+    }
+
+    virtual ~ProfiledSocketServer() {
+        if (m_ownership) delete m_base;
+    }
+
+    int bind(const photon::net::EndPoint& ep) override { return m_base->bind(ep); }
+    int bind(const char* path, size_t count) override { return m_base->bind(path, count); }
+    int listen(int backlog = 1024) override { return m_base->listen(backlog); }
+    photon::net::ISocketStream* accept(photon::net::EndPoint* remote = nullptr) override {
+        auto s = m_base->accept(remote);
+        if (s) profiled(s);
+        return s;
+    }
+    photon::net::ISocketServer* set_handler(Handler handler) override {
+        m_handler = handler;
+        m_base->set_handler({this, &ProfiledSocketServer::on_accept});
+        return this;
+    }
+    int start_loop(bool block = false) override { return m_base->start_loop(block); }
+    void terminate() override { m_base->terminate(); }
+
+    int getsockname(photon::net::EndPoint& addr) override { return m_base->getsockname(addr); }
+    int getpeername(photon::net::EndPoint& addr) override { return m_base->getpeername(addr); }
+    int getsockname(char* path, size_t count) override { return m_base->getsockname(path, count); }
+    int getpeername(char* path, size_t count) override { return m_base->getpeername(path, count); }
+
+    photon::Object* get_underlay_object(uint64_t recursion = 0) override {
+        return m_base->get_underlay_object(recursion);
+    }
+    int setsockopt(int level, int option_name, const void* option_value, socklen_t option_len) override {
+        return m_base->setsockopt(level, option_name, option_value, option_len);
+    }
+    int getsockopt(int level, int option_name, void* option_value, socklen_t* option_len) override {
+        return m_base->getsockopt(level, option_name, option_value, option_len);
+    }
+    uint64_t timeout() const override { return m_base->timeout(); }
+    void timeout(uint64_t tm) override { m_base->timeout(tm); }
+
+private:
+    // SO_PRIORITY and TCP_QUICKACK are not inherited from the listener
+    void profiled(photon::net::ISocketStream* s) { apply_socket_profile(s, m_profile); }
+
+    int on_accept(photon::net::ISocketStream* s) {
+        profiled(s);
+        return m_handler(s);
+    }
+
+    photon::net::ISocketServer* m_base;
+    SocketProfile m_profile;
+    bool m_ownership;
+    Handler m_handler;
+};
+
+// `base` with `profile` applied to every socket it connects.
+inline photon::net::ISocketClient* new_profiled_client(photon::net::ISocketClient* base,
+                                                       const SocketProfile& profile, bool ownership = true) {
+    if (!base) return nullptr;
+    return new ProfiledSocketClient(base, profile, ownership);
+}
+
+// `base` with `profile` applied to its listener and every socket it accepts.
+inline photon::net::ISocketServer* new_profiled_server(photon::net::ISocketServer* base,
+                                                       const SocketProfile& profile, bool ownership = true) {
+    if (!base) return nullptr;
+    return new ProfiledSocketServer(base, profile, ownership);
+}
@@ -0,0 +1,404 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Message processing spread over worker vCPUs, in order per symbol.
+//
+// Connection I/O stays on its own vCPU; what is done with a message
+// (parsing, book updates, strategy callbacks) is posted to a Strand, one
+// per symbol. A strand runs its messages one at a time and in the order
+// posted, on whichever worker holds it, so the handler of a strand never
+// runs concurrently with itself and needs no locks for per-symbol state.
+//
+// The unit of scheduling is the strand, not the message. A strand with
+// messages is in exactly one worker's run queue; the worker runs up to
+// strand_batch of them and puts it at the back of its queue if more are
+// left. A worker whose queue is empty steals the oldest strand from
+// another worker's queue, and the strand then belongs to the thief until
+// it is stolen again. So a worker busy with a hot symbol no longer holds
+// up the quiet ones that happened to start on it, and cores that would
+// sit idle under a fixed symbol-to-vCPU assignment pick them up. With
+// `steal` off the assignment is fixed, round-robin by strand creation.
+//
+// Workers spin for spin_us after running out of work, then sleep on an
+// eventfd that producers only write to when it is asleep (as the order
+// gateway does). A handler runs on the worker's vCPU and may use Photon,
+// but whatever it blocks on blocks every strand queued behind it.
+#pragma once
+
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+
+#include "topology.h"
+
+// Bounded multi-producer multi-consumer queue.
+template <typename T>
+class MpmcQueue {
+public:
+    explicit MpmcQueue(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n *= 2;
+        m_slots = std::vector<Slot>(n);
+        m_mask = n - 1;
+        for (size_t i = 0; i < n; i++) m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool push(T v) {
+        uint64_t pos = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = m_slots[pos & m_mask];
+            int64_t dif = (int64_t)(slot.seq.load(std::memory_order_acquire) - pos);
+            if (dif == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.v = std::move(v);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T* v) {
+        uint64_t pos = m_head.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = m_slots[pos & m_mask];
+            int64_t dif = (int64_t)(slot.seq.load(std::memory_order_acquire) - (pos + 1));
+            if (dif == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    *v = std::move(slot.v);
+                    slot.seq.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const {
+        uint64_t pos = m_head.load(std::memory_order_acquire);
+        return m_slots[pos & m_mask].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    size_t size() const {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        uint64_t tail = m_tail.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq;
+        T v;
+    };
+    std::vector<Slot> m_slots;
+    uint64_t m_mask;
+    // on cache lines of their own; padded, as new ignores alignas in C++14
+    char m_pad0[64];
+    std::atomic<uint64_t> m_tail{0};
+    char m_pad1[64];
+    std::atomic<uint64_t> m_head{0};
+};
+
+struct StealingExecutorOptions {
+    int workers = 2;
+    uint64_t engine = photon::INIT_EVENT_IOURING;
+    std::vector<int> cpus;          // worker i placed on cpus[i] (CpuTopology::pick)
+    bool steal = true;              // false: strands stay where they started
+    size_t max_strands = 4096;      // per worker; the executor takes max_strands * workers
+    size_t strand_batch = 32;       // messages per turn before the next strand
+    uint64_t spin_us = 50;          // look for work this long before sleeping
+};
+
+class StealingExecutor;
+
+// What the executor schedules; see Strand.
+class ExecutorStrand {
+public:
+    virtual ~ExecutorStrand() = default;
+
+protected:
+    friend class StealingExecutor;
+
+    // Runs up to `max` queued messages; returns how many ran.
+    virtual size_t run(size_t max) = 0;
+    virtual bool empty() const = 0;
+
+    // After a post(): true if the strand has to be put in a run queue.
+    bool mark_scheduled() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return !m_scheduled.exchange(true, std::memory_order_acq_rel);
+    }
+
+    // After run(): true if the strand stays scheduled, with messages that
+    // were posted while it ran or raced with the check.
+    bool still_scheduled() {
+        if (!empty()) return true;
+        m_scheduled.store(false, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return !empty() && mark_scheduled();
+    }
+
+    std::atomic<bool> m_scheduled{false};
+    std::atomic<int> m_home{-1};    // worker whose queue it goes to
+};
+
+class StealingExecutor {
+public:
+    // Per worker, updated by the worker only.
+    struct WorkerStats {
+        std::atomic<uint64_t> messages{0};
+        std::atomic<uint64_t> turns{0};         // strand runs
+        std::atomic<uint64_t> steals{0};        // strands taken from others
+        std::atomic<uint64_t> sleeps{0};
+        std::atomic<uint64_t> busy_ns{0};       // running strands
+    };
+
+    explicit StealingExecutor(const StealingExecutorOptions& opts = {}) : m_opts(opts) {
+        if (m_opts.workers < 1) m_opts.workers = 1;
+        // stealing moves strands between workers, so any one run queue may
+        // end up with all of them; a full queue would make schedule() spin
+        size_t capacity = m_opts.max_strands * (m_opts.steal ? m_opts.workers : 1);
+        for (int i = 0; i < m_opts.workers; i++) m_workers.emplace_back(new Worker(capacity));
+    }
+
+    ~StealingExecutor() { stop(); }
+
+    // Starts the worker vCPUs.
+    int start() {
+        for (int i = 0; i < m_opts.workers; i++) {
+            auto& w = *m_workers[i];
+            w.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (w.evfd < 0) {
+                stop();
+                LOG_ERRNO_RETURN(0, -1, "failed to create eventfd");
+            }
+            w.th = std::thread(&StealingExecutor::worker_main, this, i);
+        }
+        LOG_INFO("executor started with ` workers, stealing `", m_opts.workers, m_opts.steal ? "on" : "off");
+        return 0;
+    }
+
+    // Runs what is queued, then joins the workers. Nothing may be posted
+    // once stop() is called.
+    void stop() {
+        m_stopping = true;
+        for (auto& w : m_workers) wake(*w);
+        for (auto& w : m_workers) {
+            if (w->th.joinable()) w->th.join();
+            if (w->evfd >= 0) close(w->evfd);
+            w->evfd = -1;
+        }
+    }
+
+    int workers() const { return m_opts.workers; }
+    const WorkerStats& stats(int worker) const { return m_workers[worker]->stats; }
+
+    // Strands in run queues, not counting the ones running.
+    size_t queued() const {
+        size_t n = 0;
+        for (auto& w : m_workers) n += w->queue.size();
+        return n;
+    }
+
+    // Called by Strand. Thread-safe.
+    void attach(ExecutorStrand* s) {
+        uint64_t n = m_strands.fetch_add(1, std::memory_order_relaxed);
+        if (n >= m_opts.max_strands * m_opts.workers)
+            LOG_ERROR("` strands exceed the run queues of ` workers", n + 1, m_opts.workers);
+        s->m_home.store(n % m_opts.workers, std::memory_order_relaxed);
+    }
+
+    void detach(ExecutorStrand*) { m_strands.fetch_sub(1, std::memory_order_relaxed); }
+
+    void schedule(ExecutorStrand* s) {
+        auto& w = *m_workers[s->m_home.load(std::memory_order_relaxed)];
+        while (!w.queue.push(s)) sched_yield();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (w.sleeping.load(std::memory_order_relaxed)) {
+            wake(w);
+        } else if (m_opts.steal && m_sleepers.load(std::memory_order_relaxed)) {
+            // its worker is busy: one that is not can take it
+            for (auto& o : m_workers) {
+                if (o->sleeping.load(std::memory_order_relaxed)) {
+                    wake(*o);
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    struct Worker {
+        explicit Worker(size_t capacity) : queue(capacity) {}
+        MpmcQueue<ExecutorStrand*> queue;
+        std::thread th;
+        int evfd = -1;
+        std::atomic<bool> sleeping{false};
+        WorkerStats stats;
+    };
+
+    static uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    void wake(Worker& w) {
+        if (w.evfd >= 0) eventfd_write(w.evfd, 1);
+    }
+
+    void worker_main(int index) {
+        if (index < (int)m_opts.cpus.size()) place_vcpu(m_opts.cpus[index]);
+        if (photon::init(m_opts.engine, photon::INIT_IO_NONE)) {
+            LOG_ERROR("executor worker ` failed to init photon", index);
+            return;
+        }
+        DEFER(photon::fini());
+        auto& w = *m_workers[index];
+        while (true) {
+            uint64_t spin_until = 0;
+            while (run_one(index)) spin_until = now_ns() + m_opts.spin_us * 1000;
+            while (now_ns() < spin_until) {
+                if (run_one(index)) spin_until = now_ns() + m_opts.spin_us * 1000;
+            }
+            if (m_stopping && !has_work(index)) break;
+
+            w.sleeping.store(true, std::memory_order_relaxed);
+            m_sleepers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!has_work(index) && !m_stopping) {
+                w.stats.sleeps.fetch_add(1, std::memory_order_relaxed);
+                if (photon::wait_for_fd_readable(w.evfd) == 0) {
+                    eventfd_t v;
+                    eventfd_read(w.evfd, &v);
+                }
+            }
+            m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+            w.sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    bool has_work(int index) const {
+        if (!m_workers[index]->queue.empty()) return true;
+        if (!m_opts.steal) return false;
+        for (auto& w : m_workers) {
+            if (!w->queue.empty()) return true;
+        }
+        return false;
+    }
+
+    // Runs one turn of a strand from this worker's queue or, failing that,
+    // one taken from another worker.
+    bool run_one(int index) {
+        auto& w = *m_workers[index];
+        ExecutorStrand* s;
+        if (!w.queue.pop(&s)) {
+            if (!m_opts.steal || !(s = steal(index))) return false;
+            w.stats.steals.fetch_add(1, std::memory_order_relaxed);
+            s->m_home.store(index, std::memory_order_relaxed);
+        }
+        uint64_t t0 = now_ns();
+        size_t n = s->run(m_opts.strand_batch);
+        w.stats.busy_ns.fetch_add(now_ns() - t0, std::memory_order_relaxed);
+        w.stats.messages.fetch_add(n, std::memory_order_relaxed);
+        w.stats.turns.fetch_add(1, std::memory_order_relaxed);
+        if (s->still_scheduled()) {
+            // behind the others of this worker, and up for stealing
+            while (!w.queue.push(s)) sched_yield();
+        }
+        return true;
+    }
+
+    // The oldest strand of the first other worker that has one, starting
+    // past this one so thieves spread over their victims.
+    ExecutorStrand* steal(int index) {
+        ExecutorStrand* s;
+        for (int i = 1; i < m_opts.workers; i++) {
+            if (m_workers[(index + i) % m_opts.workers]->queue.pop(&s)) return s;
+        }
+        return nullptr;
+    }
+
+    StealingExecutorOptions m_opts;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<uint64_t> m_strands{0};
+    std::atomic<int> m_sleepers{0};
+    std::atomic<bool> m_stopping{false};
+};
+
+// Messages of type T, handled one at a time and in order on the workers of
+// `executor`. post() is thread-safe and never blocks; it fails when
+// `capacity` messages are waiting. The strand must outlive its messages.
+template <typename T>
+class Strand : public ExecutorStrand {
+public:
+    using Handler = std::function<void(T&)>;
+
+    Strand(StealingExecutor* executor, Handler handler, size_t capacity = 1024)
+        : m_executor(executor), m_handler(std::move(handler)), m_queue(capacity) {
+        m_executor->attach(this);
+    }
+
+    ~Strand() { m_executor->detach(this); }
+
+    bool post(T msg) {
+        if (!m_queue.push(std::move(msg))) {
+            m_rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (mark_scheduled()) m_executor->schedule(this);
+        return true;
+    }
+
+    size_t queued() const { return m_queue.size(); }
+    uint64_t rejected() const { return m_rejected.load(std::memory_order_relaxed); }
+
+protected:
+    size_t run(size_t max) override {
+        size_t n = 0;
+        T msg;
+        while (n < max && m_queue.pop(&msg)) {
+            m_handler(msg);
+            n++;
+        }
+        return n;
+    }
+
+    bool empty() const override { return m_queue.empty(); }
+
+private:
+    StealingExecutor* m_executor;
+    Handler m_handler;
+    MpmcQueue<T> m_queue;
+    std::atomic<uint64_t> m_rejected{0};
+};
@@ -0,0 +1,256 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Skewed per-symbol load on a StealingExecutor, with and without stealing.
+//
+// One producer thread, standing in for the connection vCPU, posts --count
+// messages at --rate messages/s to one strand per symbol; --hot-share of
+// them go to the --hot symbols, the rest are spread over the others. Each
+// message costs --work-ns of CPU on a worker, and the strand checks that its
+// messages arrive in order. Strands start on worker symbol % --workers, so
+// hot symbols 0 and 4 with 4 workers share one worker under static
+// assignment. Each mode prints one JSON line with the post-to-handled
+// latency of hot and cold symbols, ordering errors and per-worker load.
+// --pin places the workers on cores chosen by CpuTopology::pick().
+//
+//   strand_bench --workers=4 --symbols=32 --hot=0,4 --hot-share=0.8 --rate=400000 --work-ns=2000 --mode=both --pin
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+
+#include "stealing-executor.h"
+
+struct Options {
+    int workers = 4;
+    int symbols = 32;
+    std::vector<int> hot = {0, 4};
+    double hot_share = 0.8;
+    uint64_t count = 2000000;
+    uint64_t rate = 400000;         // messages/s, 0: as fast as possible
+    uint64_t work_ns = 2000;
+    size_t capacity = 65536;        // per strand
+    const char* mode = "both";      // static, steal or both
+    bool pin = false;
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"workers", required_argument, 0, 'w'},
+        {"symbols", required_argument, 0, 's'},
+        {"hot", required_argument, 0, 'H'},
+        {"hot-share", required_argument, 0, 'S'},
+        {"count", required_argument, 0, 'n'},
+        {"rate", required_argument, 0, 'R'},
+        {"work-ns", required_argument, 0, 'W'},
+        {"capacity", required_argument, 0, 'c'},
+        {"mode", required_argument, 0, 'm'},
+        {"pin", no_argument, 0, 'p'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:s:H:S:n:R:W:c:m:p", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'w': opts.workers = std::max(1, atoi(optarg)); break;
+            case 's': opts.symbols = std::max(1, atoi(optarg)); break;
+            case 'H':
+                opts.hot.clear();
+                for (char* p = optarg; *p;) {
+                    opts.hot.push_back(strtol(p, &p, 10));
+                    if (*p == ',') p++;
+                    else if (*p) return -1;
+                }
+                break;
+            case 'S': opts.hot_share = atof(optarg); break;
+            case 'n': opts.count = strtoull(optarg, nullptr, 10); break;
+            case 'R': opts.rate = strtoull(optarg, nullptr, 10); break;
+            case 'W': opts.work_ns = strtoull(optarg, nullptr, 10); break;
+            case 'c': opts.capacity = strtoull(optarg, nullptr, 10); break;
+            case 'm': opts.mode = optarg; break;
+            case 'p': opts.pin = true; break;
+            default:
+                fprintf(stderr, "usage: %s [--workers=N] [--symbols=N] [--hot=a,b,...] [--hot-share=0..1] "
+                        "[--count=N] [--rate=msgs_per_sec] [--work-ns=N] [--capacity=msgs] "
+                        "[--mode=static|steal|both] [--pin]\n", argv[0]);
+                return -1;
+        }
+    }
+    for (int s : opts.hot) {
+        if (s < 0 || s >= opts.symbols) {
+            fprintf(stderr, "hot symbol %d is not below --symbols\n", s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 1us buckets up to 100ms, then one overflow bucket.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : m_buckets(100001) {}
+    void add(uint64_t ns) {
+        m_buckets[std::min<uint64_t>(ns / 1000, 100000)]++;
+        m_max = std::max(m_max, ns);
+        m_count++;
+    }
+    void merge(const LatencyHistogram& o) {
+        for (size_t i = 0; i < m_buckets.size(); i++) m_buckets[i] += o.m_buckets[i];
+        m_max = std::max(m_max, o.m_max);
+        m_count += o.m_count;
+    }
+    uint64_t percentile(double p) const {
+        uint64_t want = (uint64_t)(m_count * p), seen = 0;
+        for (size_t i = 0; i < m_buckets.size(); i++) {
+            seen += m_buckets[i];
+            if (seen > want) return i * 1000;
+        }
+        return m_max;
+    }
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+
+private:
+    std::vector<uint64_t> m_buckets;
+    uint64_t m_count = 0, m_max = 0;
+};
+
+struct Message {
+    uint64_t seq;
+    uint64_t posted_ns;
+};
+
+// Per-symbol state, touched only by the strand's handler.
+struct SymbolState {
+    uint64_t next_seq = 0;
+    uint64_t out_of_order = 0;
+    LatencyHistogram latency;
+
+    void on_message(Message& m) {
+        if (m.seq != next_seq) out_of_order++;
+        next_seq = m.seq + 1;
+        uint64_t until = now_ns() + opts.work_ns;
+        while (now_ns() < until) {}
+        latency.add(now_ns() - m.posted_ns);
+    }
+};
+
+static void print_histogram(const char* name, const LatencyHistogram& h) {
+    printf("\"%s\":{\"messages\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,\"max_us\":%lu}", name,
+           h.count(), h.percentile(0.5) / 1000, h.percentile(0.99) / 1000, h.percentile(0.999) / 1000,
+           h.max() / 1000);
+}
+
+static int run(bool steal) {
+    StealingExecutorOptions eo;
+    eo.workers = opts.workers;
+    eo.steal = steal;
+    if (opts.pin) eo.cpus = CpuTopology::instance().pick(opts.workers);
+    StealingExecutor executor(eo);
+
+    std::vector<SymbolState> states(opts.symbols);
+    std::vector<std::unique_ptr<Strand<Message>>> strands;
+    for (int i = 0; i < opts.symbols; i++) {
+        auto state = &states[i];
+        strands.emplace_back(new Strand<Message>(&executor, [state](Message& m) { state->on_message(m); },
+                                                 opts.capacity));
+    }
+    std::vector<bool> is_hot(opts.symbols);
+    std::vector<int> cold;
+    for (int s : opts.hot) is_hot[s] = true;
+    for (int i = 0; i < opts.symbols; i++) {
+        if (!is_hot[i]) cold.push_back(i);
+    }
+    if (executor.start() < 0) return -1;
+
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> share(0, 1);
+    std::vector<uint64_t> seq(opts.symbols);
+    uint64_t rejected = 0;
+    uint64_t interval = opts.rate ? 1000000000ULL / opts.rate : 0;
+    uint64_t t0 = now_ns();
+    for (uint64_t i = 0; i < opts.count; i++) {
+        if (interval) {
+            while (now_ns() - t0 < i * interval) {}
+        }
+        int s;
+        if (cold.empty() || (!opts.hot.empty() && share(rng) < opts.hot_share)) {
+            s = opts.hot[rng() % opts.hot.size()];
+        } else {
+            s = cold[rng() % cold.size()];
+        }
+        Message m = {seq[s], now_ns()};
+        if (strands[s]->post(m)) {
+            seq[s]++;
+        } else {
+            rejected++;
+        }
+    }
+    executor.stop();
+    double seconds = (now_ns() - t0) / 1e9;
+
+    LatencyHistogram hot, other;
+    uint64_t out_of_order = 0;
+    for (int i = 0; i < opts.symbols; i++) {
+        (is_hot[i] ? hot : other).merge(states[i].latency);
+        out_of_order += states[i].out_of_order;
+    }
+    printf("{\"mode\":\"%s\",\"workers\":%d,\"symbols\":%d,\"seconds\":%.3f,\"messages_per_s\":%lu,"
+           "\"rejected\":%lu,\"out_of_order\":%lu,",
+           steal ? "steal" : "static", opts.workers, opts.symbols, seconds,
+           (uint64_t)((hot.count() + other.count()) / seconds), rejected, out_of_order);
+    print_histogram("hot", hot);
+    printf(",");
+    print_histogram("cold", other);
+    printf(",\"per_worker\":[");
+    for (int i = 0; i < executor.workers(); i++) {
+        auto& st = executor.stats(i);
+        printf("%s{\"messages\":%lu,\"turns\":%lu,\"steals\":%lu,\"sleeps\":%lu,\"busy\":%.2f}", i ? "," : "",
+               st.messages.load(), st.turns.load(), st.steals.load(), st.sleeps.load(),
+               st.busy_ns.load() / 1e9 / seconds);
+    }
+    printf("]}\n");
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    set_log_output_level(ALOG_WARN);
+    bool both = strcmp(opts.mode, "both") == 0;
+    if (both || strcmp(opts.mode, "static") == 0) {
+        if (run(false) < 0) return -1;
+    }
+    if (both || strcmp(opts.mode, "steal") == 0) {
+        if (run(true) < 0) return -1;
+    }
+    return 0;
+}
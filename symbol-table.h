@@ -0,0 +1,293 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Exchange symbols and stream names interned into dense 32-bit ids.
+//
+// Names are interned once, at subscribe time, and from then on everything
+// downstream (bus events, books, per-symbol state) is indexed by SymbolId.
+// Ids are handed out 0, 1, 2, ... in intern order. Case is folded for
+// ASCII letters, so "btcusdt" (stream names) and "BTCUSDT" (the "s" field
+// of events) are the same symbol; name() returns the first spelling.
+//
+// find() maps a name straight out of a received message to its id without
+// allocating: the name is loaded into a zero-padded 32-byte key and folded
+// to upper case a word at a time, then looked up in a perfect hash (hash
+// and displace: one bucket read for the displacement, one slot read, a
+// 4-word compare). Names interned since the last build are compared one
+// by one until enough of them pile up for a rebuild (intern a list at once
+// to get a single build). A new hash is published with one pointer store,
+// so find() and name() never lock and may run on any thread while another
+// thread interns.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+
+using SymbolId = uint32_t;
+const SymbolId SYMBOL_NONE = UINT32_MAX;
+const size_t SYMBOL_MAX_LEN = 32;
+const size_t SYMBOL_MAX_COUNT = 65536;
+
+// A name as 4 words, zero-padded, ASCII letters upper-cased.
+struct SymbolKey {
+    uint64_t w[4];
+
+    SymbolKey() : w{} {}
+    // `n` <= SYMBOL_MAX_LEN. Reads no byte outside [p, p + n).
+    SymbolKey(const char* p, size_t n) {
+        for (size_t i = 0; i < 4; i++) {
+            size_t off = i * 8;
+            if (off + 8 <= n) {
+                memcpy(&w[i], p + off, 8);
+            } else {
+                w[i] = off < n ? load_tail(p + off, n - off) : 0;
+            }
+            w[i] = fold(w[i]);
+        }
+    }
+
+    bool operator==(const SymbolKey& o) const {
+        return ((w[0] ^ o.w[0]) | (w[1] ^ o.w[1]) | (w[2] ^ o.w[2]) | (w[3] ^ o.w[3])) == 0;
+    }
+
+    // The four products are independent, so they overlap in the pipeline.
+    uint64_t hash(uint64_t seed) const {
+        uint64_t a = (w[0] ^ seed) * 0x9E3779B97F4A7C15ULL;
+        uint64_t b = (w[1] ^ (seed >> 17)) * 0xC2B2AE3D27D4EB4FULL;
+        uint64_t c = w[2] * 0x165667B19E3779F9ULL;
+        uint64_t d = w[3] * 0xD6E8FEB86659FD93ULL;
+        uint64_t h = (a ^ (b << 23 | b >> 41)) + (c ^ (d << 41 | d >> 23));
+        h ^= h >> 32;
+        h *= 0x9FB21C651E98DF25ULL;
+        return h ^ (h >> 29);
+    }
+
+    // 1 to 7 bytes, little-endian, from overlapping loads.
+    static uint64_t load_tail(const char* p, size_t k) {
+        if (k >= 4) {
+            uint32_t lo, hi;
+            memcpy(&lo, p, 4);
+            memcpy(&hi, p + k - 4, 4);
+            return lo | (uint64_t)hi << ((k - 4) * 8);
+        }
+        return (uint64_t)(uint8_t)p[0] | (uint64_t)(uint8_t)p[k / 2] << (k / 2 * 8) |
+               (uint64_t)(uint8_t)p[k - 1] << ((k - 1) * 8);
+    }
+
+    // Clears 0x20 in every byte that is 'a'..'z'.
+    static uint64_t fold(uint64_t x) {
+        const uint64_t ones = 0x0101010101010101ULL;
+        uint64_t low7 = x & (0x7F * ones);
+        uint64_t ge_a = low7 + (0x80 - 'a') * ones;
+        uint64_t gt_z = low7 + (0x80 - 'z' - 1) * ones;
+        uint64_t lower = ge_a & ~gt_z & ~x & (0x80 * ones);
+        return x & ~(lower >> 2);
+    }
+};
+
+class SymbolTable {
+public:
+    SymbolTable() { rebuild(0); }
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    // The id of `name`, adding it if new. SYMBOL_NONE if the name is
+    // empty, longer than SYMBOL_MAX_LEN or the table is full.
+    SymbolId intern(const char* name, size_t n) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        SymbolId id = add(name, n);
+        size_t count = size(), indexed = m_index.load(std::memory_order_relaxed)->count;
+        if (count - indexed >= 8 + indexed / 8) rebuild(count);
+        return id;
+    }
+    SymbolId intern(const std::string& name) { return intern(name.data(), name.size()); }
+
+    // Interns all of `names` with a single rebuild; ids in the same order.
+    std::vector<SymbolId> intern(const std::vector<std::string>& names) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<SymbolId> ids;
+        for (auto& name : names) ids.push_back(add(name.data(), name.size()));
+        if (size() > m_index.load(std::memory_order_relaxed)->count) rebuild(size());
+        return ids;
+    }
+
+    // The id of `name`, SYMBOL_NONE if it was never interned.
+    SymbolId find(const char* name, size_t n) const {
+        if (n > SYMBOL_MAX_LEN) return SYMBOL_NONE;
+        SymbolKey k(name, n);
+        auto index = m_index.load(std::memory_order_acquire);
+        SymbolId id = index->find(k);
+        if (id != SYMBOL_NONE) return id;
+        for (SymbolId i = index->count, count = size(); i < count; i++)
+            if (entry(i).key == k) return i;
+        return SYMBOL_NONE;
+    }
+
+    // The name as first interned, and in lower case (stream names).
+    const char* name(SymbolId id) const { return id < size() ? entry(id).name : "?"; }
+    const char* lower(SymbolId id) const { return id < size() ? entry(id).lower : "?"; }
+
+    size_t size() const { return m_count.load(std::memory_order_acquire); }
+
+private:
+    static const size_t CHUNK = 1024;
+
+    struct Entry {
+        SymbolKey key;
+        char name[SYMBOL_MAX_LEN + 1];
+        char lower[SYMBOL_MAX_LEN + 1];
+    };
+
+    struct Slot {
+        SymbolKey key;
+        SymbolId id = SYMBOL_NONE;
+    };
+
+    // Hash and displace: the top bits of the hash pick a bucket, the
+    // bucket's displacement d turns the hash into a slot no other key of
+    // the table uses.
+    struct Index {
+        size_t count = 0;       // ids below this are in the hash
+        uint64_t seed;
+        int bucket_shift;
+        uint64_t slot_mask;
+        std::vector<uint32_t> disp;
+        std::vector<Slot> slots;
+
+        static uint64_t slot_of(uint64_t h, uint32_t d, uint64_t mask) {
+            return ((uint32_t)h + (uint64_t)d * ((h >> 32) | 1)) & mask;
+        }
+
+        SymbolId find(const SymbolKey& k) const {
+            uint64_t h = k.hash(seed);
+            const Slot& s = slots[slot_of(h, disp[h >> bucket_shift], slot_mask)];
+            return s.key == k ? s.id : SYMBOL_NONE;
+        }
+    };
+
+    const Entry& entry(SymbolId id) const { return m_chunks[id / CHUNK][id % CHUNK]; }
+
+    SymbolId add(const char* name, size_t n) {
+        if (n == 0 || n > SYMBOL_MAX_LEN)
+            LOG_ERROR_RETURN(EINVAL, SYMBOL_NONE, "cannot intern symbol of ` bytes", n);
+        SymbolId id = find(name, n);
+        if (id != SYMBOL_NONE) return id;
+        id = size();
+        if (id == SYMBOL_MAX_COUNT) LOG_ERROR_RETURN(ENOSPC, SYMBOL_NONE, "symbol table is full");
+        auto& chunk = m_chunks[id / CHUNK];
+        if (!chunk) chunk.reset(new Entry[CHUNK]);
+        Entry& e = chunk[id % CHUNK];
+        e.key = SymbolKey(name, n);
+        memcpy(e.name, name, n);
+        e.name[n] = '\0';
+        for (size_t i = 0; i < n; i++) e.lower[i] = tolower((unsigned char)name[i]);
+        e.lower[n] = '\0';
+        m_count.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    // Builds an index over the first `n` entries and publishes it. Slots
+    // are at most half full and buckets hold 4 keys on average, so a
+    // displacement is found within a few tries; a new seed is drawn if a
+    // bucket runs out of them. Rebuilds grow geometrically, so keeping the
+    // retired indexes costs a constant factor of the last one.
+    void rebuild(size_t n) {
+        size_t slots = 2, buckets = 2;
+        while (slots < 2 * n) slots *= 2;
+        while (buckets * 4 < n) buckets *= 2;
+        int bucket_bits = __builtin_ctzll(buckets);
+        std::unique_ptr<Index> index(new Index);
+        index->count = n;
+        for (uint64_t seed = m_seed;; seed = seed * 6364136223846793005ULL + 1442695040888963407ULL) {
+            index->seed = seed;
+            index->bucket_shift = 64 - bucket_bits;
+            index->slot_mask = slots - 1;
+            index->disp.assign(buckets, 0);
+            index->slots.assign(slots, Slot());
+            if (place(index.get(), n, buckets)) {
+                m_seed = seed;
+                break;
+            }
+        }
+        // readers may still hold the old index; it lives as long as the table
+        m_retired.emplace_back(std::move(index));
+        m_index.store(m_retired.back().get(), std::memory_order_release);
+    }
+
+    bool place(Index* index, size_t n, size_t buckets) {
+        std::vector<std::vector<std::pair<uint64_t, SymbolId>>> by_bucket(buckets);
+        for (SymbolId id = 0; id < n; id++) {
+            uint64_t h = entry(id).key.hash(index->seed);
+            by_bucket[h >> index->bucket_shift].emplace_back(h, id);
+        }
+        std::vector<size_t> order(buckets);
+        for (size_t i = 0; i < buckets; i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return by_bucket[a].size() > by_bucket[b].size();
+        });
+        std::vector<uint64_t> taken;
+        for (size_t b : order) {
+            auto& keys = by_bucket[b];
+            if (keys.empty()) break;
+            uint32_t d = 0;
+            for (;; d++) {
+                if (d == MAX_DISPLACEMENT) return false;
+                taken.clear();
+                bool ok = true;
+                for (auto& k : keys) {
+                    uint64_t s = Index::slot_of(k.first, d, index->slot_mask);
+                    if (index->slots[s].id != SYMBOL_NONE ||
+                            std::find(taken.begin(), taken.end(), s) != taken.end()) {
+                        ok = false;
+                        break;
+                    }
+                    taken.push_back(s);
+                }
+                if (ok) break;
+            }
+            index->disp[b] = d;
+            for (auto& k : keys) {
+                Slot& s = index->slots[Index::slot_of(k.first, d, index->slot_mask)];
+                s.key = entry(k.second).key;
+                s.id = k.second;
+            }
+        }
+        return true;
+    }
+
+    static const uint32_t MAX_DISPLACEMENT = 1 << 16;
+
+    std::mutex m_mutex;
+    std::unique_ptr<Entry[]> m_chunks[SYMBOL_MAX_COUNT / CHUNK];
+    std::atomic<uint32_t> m_count{0};
+    std::atomic<const Index*> m_index{nullptr};
+    std::vector<std::unique_ptr<Index>> m_retired;
+    uint64_t m_seed = 0x243F6A8885A308D3ULL;
+};
+
+// The process-wide table.
+inline SymbolTable& symbol_table() {
+    static SymbolTable table;
+    return table;
+}
@@ -0,0 +1,247 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Hierarchical timer wheel for the many cheap timers of a vCPU: pings,
+// stale-feed checks, request expiries, reconnect backoff.
+//
+// Four levels of 256 slots; level L holds timers due in [256^L, 256^(L+1))
+// ticks and is cascaded into the level below whenever the tick counter
+// crosses one of its slot boundaries. Timers are intrusive (WheelTimer), so
+// starting, restarting and cancelling are O(1) list operations with no
+// allocation. All timers of a wheel fire from one place: either the owner
+// calls advance() from its own loop, or start() runs a single driver
+// coroutine that sleeps until the next slot with timers in it. Nothing
+// here is thread-safe; a wheel and its timers belong to one vCPU.
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+
+#include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
+
+class TimerWheel;
+
+class WheelTimer {
+public:
+    using Callback = std::function<void()>;
+
+    WheelTimer() = default;
+    explicit WheelTimer(Callback cb) : m_cb(std::move(cb)) {}
+    WheelTimer(const WheelTimer&) = delete;
+    WheelTimer& operator=(const WheelTimer&) = delete;
+    ~WheelTimer() { cancel(); }
+
+    void set_callback(Callback cb) { m_cb = std::move(cb); }
+
+    // (Re)arms the timer to fire once after `delay_us`, on `wheel` or this
+    // vCPU's timer_wheel().
+    void start(uint64_t delay_us, TimerWheel* wheel = nullptr);
+    // Fires every `interval_us` until cancelled.
+    void start_periodic(uint64_t interval_us, TimerWheel* wheel = nullptr);
+    void cancel();
+    bool pending() const { return m_wheel != nullptr; }
+
+private:
+    friend class TimerWheel;
+    WheelTimer* m_next = nullptr;
+    WheelTimer* m_prev = nullptr;
+    WheelTimer** m_slot = nullptr;      // list head of the slot holding it
+    TimerWheel* m_wheel = nullptr;      // set while pending
+    uint64_t m_expire_tick = 0;
+    uint64_t m_interval_us = 0;
+    Callback m_cb;
+};
+
+class TimerWheel {
+public:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 8;
+    static const uint64_t SLOTS = 1 << SLOT_BITS;
+
+    explicit TimerWheel(uint64_t tick_us = 1000) : m_tick_us(tick_us) {
+        m_current = photon::now / m_tick_us;
+    }
+
+    // Timers still pending are detached. The driver must have been stopped
+    // (before photon::fini()).
+    ~TimerWheel() {
+        for (auto& level : m_slots) {
+            for (auto& head : level) {
+                for (auto t = head; t; t = t->m_next) t->m_wheel = nullptr;
+                head = nullptr;
+            }
+        }
+    }
+
+    void schedule(WheelTimer* t, uint64_t delay_us) {
+        if (t->m_wheel) t->m_wheel->unlink(t);
+        uint64_t now = photon::now;
+        // an idle wheel may not have been advanced for a while
+        if (m_pending == 0 && now / m_tick_us > m_current) m_current = now / m_tick_us;
+        uint64_t base = now > m_current * m_tick_us ? now : m_current * m_tick_us;
+        uint64_t tick = (base + delay_us + m_tick_us - 1) / m_tick_us;
+        t->m_expire_tick = tick > m_current ? tick : m_current + 1;
+        t->m_wheel = this;
+        place(t);
+        m_pending++;
+        if (m_driver_sleeping && t->m_expire_tick < m_wake_tick)
+            photon::thread_interrupt(m_driver);
+    }
+
+    void cancel(WheelTimer* t) {
+        if (t->m_wheel == this) unlink(t);
+    }
+
+    // Fires every timer due at or before `now_us`. Returns the number fired.
+    size_t advance(uint64_t now_us = photon::now) {
+        uint64_t target = now_us / m_tick_us;
+        size_t fired = 0;
+        while (m_current < target) {
+            if (m_pending == 0) {
+                m_current = target;
+                break;
+            }
+            m_current++;
+            for (int level = 1; level < LEVELS; level++) {
+                if (m_current & ((1ULL << (SLOT_BITS * level)) - 1)) break;
+                cascade(level, (m_current >> (SLOT_BITS * level)) & (SLOTS - 1));
+            }
+            // pop one at a time: callbacks may start or cancel other timers
+            auto& head = m_slots[0][m_current & (SLOTS - 1)];
+            while (auto t = head) {
+                unlink(t);
+                if (t->m_interval_us) schedule(t, t->m_interval_us);
+                fired++;
+                if (t->m_cb) t->m_cb();
+            }
+        }
+        return fired;
+    }
+
+    // Microseconds until advance() may have something to do, capped at the
+    // next level-0 revolution; -1 when no timer is pending.
+    uint64_t next_timeout_us() const {
+        if (m_pending == 0) return -1UL;
+        uint64_t to_boundary = SLOTS - (m_current & (SLOTS - 1));
+        uint64_t i = 1;
+        for (; i < to_boundary; i++) {
+            if (m_slots[0][(m_current + i) & (SLOTS - 1)]) break;
+        }
+        uint64_t due = (m_current + i) * m_tick_us;
+        return due > photon::now ? due - photon::now : 0;
+    }
+
+    size_t pending() const { return m_pending; }
+    uint64_t tick_us() const { return m_tick_us; }
+
+    // Runs advance() from one coroutine on the current vCPU, sleeping until
+    // the next due slot. Idempotent.
+    void start() {
+        if (m_driver) return;
+        m_running = true;
+        m_driver = photon::thread_create11(&TimerWheel::drive, this);
+        m_driver_jh = photon::thread_enable_join(m_driver);
+    }
+
+    void stop() {
+        if (!m_driver) return;
+        m_running = false;
+        photon::thread_interrupt(m_driver);
+        photon::thread_join(m_driver_jh);
+        m_driver = nullptr;
+    }
+
+private:
+    void place(WheelTimer* t) {
+        uint64_t delta = t->m_expire_tick - m_current;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) level++;
+        uint64_t e = t->m_expire_tick;
+        // further than the wheel reaches: park in the farthest slot, it is
+        // placed again when that slot cascades
+        uint64_t span = 1ULL << (SLOT_BITS * LEVELS);
+        if (delta >= span) e = m_current + span - 1;
+        auto& head = m_slots[level][(e >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        t->m_prev = nullptr;
+        t->m_next = head;
+        if (head) head->m_prev = t;
+        head = t;
+        t->m_slot = &head;
+    }
+
+    void unlink(WheelTimer* t) {
+        if (t->m_prev) t->m_prev->m_next = t->m_next;
+        else *t->m_slot = t->m_next;
+        if (t->m_next) t->m_next->m_prev = t->m_prev;
+        t->m_wheel = nullptr;
+        m_pending--;
+    }
+
+    void cascade(int level, uint64_t slot) {
+        auto t = m_slots[level][slot];
+        m_slots[level][slot] = nullptr;
+        while (t) {
+            auto next = t->m_next;
+            place(t);
+            t = next;
+        }
+    }
+
+    void drive() {
+        while (m_running) {
+            advance(photon::now);
+            uint64_t tmo = next_timeout_us();
+            m_wake_tick = tmo == -1UL ? -1UL : (photon::now + tmo) / m_tick_us;
+            m_driver_sleeping = true;
+            photon::thread_usleep(tmo);
+            m_driver_sleeping = false;
+        }
+    }
+
+    WheelTimer* m_slots[LEVELS][SLOTS] = {};
+    uint64_t m_tick_us;
+    uint64_t m_current;
+    size_t m_pending = 0;
+
+    photon::thread* m_driver = nullptr;
+    photon::join_handle* m_driver_jh = nullptr;
+    bool m_running = false;
+    bool m_driver_sleeping = false;
+    uint64_t m_wake_tick = 0;
+};
+
+// The wheel of the current vCPU (OS thread). Call start() on it to have
+// its timers fire by themselves.
+inline TimerWheel& timer_wheel() {
+    thread_local TimerWheel wheel;
+    return wheel;
+}
+
+inline void WheelTimer::start(uint64_t delay_us, TimerWheel* wheel) {
+    m_interval_us = 0;
+    (wheel ? wheel : &timer_wheel())->schedule(this, delay_us);
+}
+
+inline void WheelTimer::start_periodic(uint64_t interval_us, TimerWheel* wheel) {
+    (wheel ? wheel : &timer_wheel())->schedule(this, interval_us);
+    m_interval_us = interval_us;
+}
+
+inline void WheelTimer::cancel() {
+    if (m_wheel) m_wheel->cancel(this);
+    m_interval_us = 0;
+}
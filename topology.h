@@ -0,0 +1,367 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// CPU and NUMA placement of vCPUs, their memory and the NIC's interrupts.
+//
+// CpuTopology reads the online CPUs from sysfs with their core, package and
+// NUMA node, and pick() chooses CPUs for vCPUs: one hardware thread per
+// physical core on the wanted node, leaving out the core of CPU 0, where
+// the kernel's housekeeping and unassigned interrupts land.
+//
+// place_vcpu(cpu) is called first thing in a vCPU's thread, before
+// photon::init(): it pins the thread and makes the CPU's node the thread's
+// preferred memory node. The io_uring rings photon::init() creates, and
+// everything the vCPU allocates and touches later (binary log ring, metric
+// shard, ...), then come from the local node. mmap_local() maps and
+// populates memory on the calling vCPU's node explicitly, for buffers
+// registered with the ring.
+//
+// Packets are first handled in softirq on the CPU their NIC queue's
+// interrupt is routed to. nic_irq_advice() proposes an smp_affinity_list
+// for each queue interrupt of an interface: the CPUs of the NIC's node that
+// are not running feed vCPUs, so the interrupts stay on the node the data is
+// used on without taking cycles from the spinning vCPUs. check_feed_socket()
+// reads SO_INCOMING_CPU of a connected feed socket and warns when its
+// packets are handled on another node than the vCPU reading them.
+//
+// Nothing is changed outside the process: interrupt affinity is only
+// reported, for whoever sets up the host.
+#pragma once
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/net/socket.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// "0-3,8,10-11" to {0, 1, 2, 3, 8, 10, 11}.
+inline std::vector<int> parse_cpu_list(const char* s) {
+    std::vector<int> cpus;
+    while (*s) {
+        char* end;
+        long a = strtol(s, &end, 10);
+        if (end == s) break;
+        long b = a;
+        s = end;
+        if (*s == '-') {
+            b = strtol(s + 1, &end, 10);
+            s = end;
+        }
+        for (long i = a; i <= b; i++) cpus.push_back(i);
+        while (*s == ',' || *s == '\n' || *s == ' ') s++;
+    }
+    return cpus;
+}
+
+inline std::string format_cpu_list(std::vector<int> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::string s;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+        if (!s.empty()) s += ',';
+        s += std::to_string(cpus[i]);
+        if (j > i) s += '-' + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return s;
+}
+
+// First line of a small sysfs or procfs file, "" if there is none.
+inline std::string read_sys_line(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f) return "";
+    char buf[4096];
+    std::string s = fgets(buf, sizeof(buf), f) ? buf : "";
+    fclose(f);
+    while (!s.empty() && (s.back() == '\n' || s.back() == ' ')) s.pop_back();
+    return s;
+}
+
+inline int read_sys_int(const std::string& path, int dflt = -1) {
+    std::string s = read_sys_line(path);
+    return s.empty() ? dflt : atoi(s.c_str());
+}
+
+struct CpuInfo {
+    int cpu;
+    int core;           // core_id, unique within the package
+    int package;
+    int node;           // 0 without NUMA
+};
+
+class CpuTopology {
+public:
+    // Parsed from /sys once.
+    static const CpuTopology& instance() {
+        static CpuTopology topology = [] {
+            CpuTopology t;
+            t.load();
+            return t;
+        }();
+        return topology;
+    }
+
+    // `root` is for reading a copy of sysfs. Returns the number of CPUs.
+    int load(const std::string& root = "/sys") {
+        m_cpus.clear();
+        m_nodes = 1;
+        std::string cpu_dir = root + "/devices/system/cpu";
+        auto online = parse_cpu_list(read_sys_line(cpu_dir + "/online").c_str());
+        if (online.empty()) LOG_ERROR_RETURN(0, -1, "no online CPUs in `", cpu_dir.c_str());
+        std::vector<int> node_of(online.back() + 1, 0);
+        std::string node_dir = root + "/devices/system/node";
+        for (int node : parse_cpu_list(read_sys_line(node_dir + "/online").c_str())) {
+            auto list = read_sys_line(node_dir + "/node" + std::to_string(node) + "/cpulist");
+            for (int cpu : parse_cpu_list(list.c_str())) {
+                if (cpu < (int)node_of.size()) node_of[cpu] = node;
+            }
+            m_nodes = std::max(m_nodes, node + 1);
+        }
+        for (int cpu : online) {
+            std::string topo = cpu_dir + "/cpu" + std::to_string(cpu) + "/topology";
+            CpuInfo c;
+            c.cpu = cpu;
+            c.core = read_sys_int(topo + "/core_id", cpu);
+            c.package = read_sys_int(topo + "/physical_package_id", 0);
+            c.node = node_of[cpu];
+            m_cpus.push_back(c);
+        }
+        return m_cpus.size();
+    }
+
+    const std::vector<CpuInfo>& cpus() const { return m_cpus; }
+    int nodes() const { return m_nodes; }
+
+    // -1 if `cpu` is not online.
+    int node_of(int cpu) const {
+        auto c = find(cpu);
+        return c ? c->node : -1;
+    }
+
+    std::vector<int> cpus_of_node(int node) const {
+        std::vector<int> cpus;
+        for (auto& c : m_cpus) {
+            if (c.node == node) cpus.push_back(c.cpu);
+        }
+        return cpus;
+    }
+
+    // The other hardware threads of `cpu`'s core.
+    std::vector<int> siblings(int cpu) const {
+        std::vector<int> cpus;
+        auto c = find(cpu);
+        if (!c) return cpus;
+        for (auto& o : m_cpus) {
+            if (o.cpu != cpu && o.package == c->package && o.core == c->core) cpus.push_back(o.cpu);
+        }
+        return cpus;
+    }
+
+    // `n` CPUs for vCPUs on `node` (-1: any), one per physical core and
+    // none on CPU 0's core; hardware threads of used cores, and that core,
+    // only when there are not enough. Fewer than `n` if the node is short.
+    std::vector<int> pick(int n, int node = -1) const {
+        std::vector<int> picked;
+        auto housekeeping = find(0);
+        for (int pass = 0; pass < 3 && (int)picked.size() < n; pass++) {
+            for (auto& c : m_cpus) {
+                if ((int)picked.size() == n) break;
+                if (node >= 0 && c.node != node) continue;
+                if (std::find(picked.begin(), picked.end(), c.cpu) != picked.end()) continue;
+                bool on_housekeeping = housekeeping && c.package == housekeeping->package &&
+                                       c.core == housekeeping->core;
+                if (on_housekeeping && pass < 2) continue;
+                bool core_used = false;
+                for (int p : picked) {
+                    auto o = find(p);
+                    core_used |= o->package == c.package && o->core == c.core;
+                }
+                if (core_used && pass < 1) continue;
+                picked.push_back(c.cpu);
+            }
+        }
+        return picked;
+    }
+
+private:
+    const CpuInfo* find(int cpu) const {
+        for (auto& c : m_cpus) {
+            if (c.cpu == cpu) return &c;
+        }
+        return nullptr;
+    }
+
+    std::vector<CpuInfo> m_cpus;
+    int m_nodes = 1;
+};
+
+// The node of the calling thread's vCPU, -1 until place_vcpu().
+inline int& vcpu_numa_node() {
+    static thread_local int node = -1;
+    return node;
+}
+
+// Pins the calling thread to `cpu` and prefers the CPU's node for its
+// memory. Call before photon::init() in the vCPU's thread. A cpu < 0
+// leaves the thread where it is.
+inline int place_vcpu(int cpu) {
+    if (cpu < 0) return 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        errno = ret;
+        LOG_ERRNO_RETURN(0, -1, "failed to pin vCPU to CPU `", cpu);
+    }
+    int node = CpuTopology::instance().node_of(cpu);
+    if (node < 0) node = 0;
+    if (CpuTopology::instance().nodes() > 1) {
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) < 0)
+            LOG_WARN("failed to prefer memory of node ` for CPU `, errno=`", node, cpu, errno);
+    }
+    vcpu_numa_node() = node;
+    LOG_INFO("vCPU placed on CPU ` (node `)", cpu, node);
+    return 0;
+}
+
+// Anonymous memory on the calling vCPU's node, with every page faulted in
+// now. Bound to the node if the vCPU was placed and the host has more than
+// one; free with munmap(). nullptr on failure.
+inline void* mmap_local(size_t bytes) {
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (p == MAP_FAILED) return nullptr;
+    int node = vcpu_numa_node();
+    if (node >= 0 && CpuTopology::instance().nodes() > 1) {
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_mbind, p, bytes, MPOL_BIND, &mask, sizeof(mask) * 8, 0) < 0)
+            LOG_WARN("failed to bind ` bytes to node `, errno=`", bytes, node, errno);
+    }
+    // not MAP_POPULATE, which would fault the pages in before the binding
+    if (madvise(p, bytes, MADV_POPULATE_WRITE) < 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < bytes; off += page) ((volatile char*)p)[off] = 0;
+    }
+    return p;
+}
+
+struct IrqAdvice {
+    int irq;
+    std::string name;           // from /proc/interrupts, e.g. eth0-TxRx-3
+    std::string current;        // smp_affinity_list now
+    std::string recommended;
+};
+
+// The node of interface `ifname`'s device, 0 if unknown.
+inline int nic_numa_node(const char* ifname, const std::string& sys_root = "/sys") {
+    int node = read_sys_int(sys_root + "/class/net/" + ifname + "/device/numa_node", 0);
+    return node < 0 ? 0 : node;
+}
+
+// An smp_affinity_list for each queue interrupt of `ifname`: the CPUs of the
+// NIC's node that run no feed vCPU (`feed_cpus`) and are not siblings of
+// one. Empty if the device has no MSI interrupts (e.g. virtio without
+// multiqueue).
+inline std::vector<IrqAdvice> nic_irq_advice(const char* ifname, const std::vector<int>& feed_cpus,
+                                             const CpuTopology& topo = CpuTopology::instance(),
+                                             const std::string& sys_root = "/sys",
+                                             const std::string& proc_root = "/proc") {
+    std::vector<IrqAdvice> advice;
+    int node = nic_numa_node(ifname, sys_root);
+    std::vector<int> busy = feed_cpus;
+    for (int cpu : feed_cpus) {
+        auto s = topo.siblings(cpu);
+        busy.insert(busy.end(), s.begin(), s.end());
+        if (topo.node_of(cpu) != node)
+            LOG_WARN("feed vCPU on CPU ` is on node `, ` is on node `", cpu, topo.node_of(cpu), ifname, node);
+    }
+    std::vector<int> spare;
+    for (int cpu : topo.cpus_of_node(node)) {
+        if (std::find(busy.begin(), busy.end(), cpu) == busy.end()) spare.push_back(cpu);
+    }
+    // all of them rather than nothing, on a node the feed vCPUs fill up
+    if (spare.empty()) spare = topo.cpus_of_node(node);
+    std::string recommended = format_cpu_list(spare);
+
+    std::string dir = sys_root + "/class/net/" + ifname + "/device/msi_irqs";
+    DIR* d = opendir(dir.c_str());
+    if (!d) return advice;
+    while (auto e = readdir(d)) {
+        if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+        IrqAdvice a;
+        a.irq = atoi(e->d_name);
+        a.current = read_sys_line(proc_root + "/irq/" + e->d_name + "/smp_affinity_list");
+        a.recommended = recommended;
+        advice.push_back(a);
+    }
+    closedir(d);
+    std::sort(advice.begin(), advice.end(), [](const IrqAdvice& a, const IrqAdvice& b) { return a.irq < b.irq; });
+
+    // names are the last column of /proc/interrupts
+    FILE* f = fopen((proc_root + "/interrupts").c_str(), "r");
+    if (f) {
+        char line[4096];
+        while (fgets(line, sizeof(line), f)) {
+            int irq = atoi(line);
+            for (auto& a : advice) {
+                if (a.irq != irq) continue;
+                std::string s = line;
+                while (!s.empty() && (s.back() == '\n' || s.back() == ' ')) s.pop_back();
+                a.name = s.substr(s.find_last_of(' ') + 1);
+            }
+        }
+        fclose(f);
+    }
+    return advice;
+}
+
+// Logs how the packets of a connected feed socket reach the calling vCPU.
+// Returns the CPU that handled its last packets in softirq, -1 if unknown.
+inline int check_feed_socket(photon::net::ISocketBase* sock) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (sock->getsockopt(SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0) return -1;
+    auto& topo = CpuTopology::instance();
+    int node = vcpu_numa_node();
+    if (node >= 0 && topo.node_of(cpu) != node) {
+        LOG_WARN("feed packets are handled on CPU ` (node `), the vCPU runs on node `: move the NIC's "
+                 "interrupts, see nic_irq_advice()", cpu, topo.node_of(cpu), node);
+    } else {
+        LOG_DEBUG("feed packets are handled on CPU `", cpu);
+    }
+    return cpu;
+}
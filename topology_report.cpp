@@ -0,0 +1,99 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Placement plan for a feed host: the CPU and NUMA topology, the CPUs
+// --vcpus feed vCPUs would be placed on (on --node, by default the node of
+// --iface's NIC) and the interrupt affinity recommended for the NIC's
+// queues. Prints one JSON object; each interrupt comes with the command
+// that applies its recommendation. Nothing is changed.
+//
+//   topology_report --iface=eth0 --vcpus=4
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+
+#include "topology.h"
+
+struct Options {
+    const char* iface = "eth0";
+    int vcpus = 2;
+    int node = -1;                  // -1: the NIC's node
+    std::string sys_root = "/sys";  // a copy of /sys and /proc, for testing
+    std::string proc_root = "/proc";
+};
+
+static Options opts;
+
+static int parse_options(int argc, char** argv) {
+    static struct option long_opts[] = {
+        {"iface", required_argument, 0, 'i'},
+        {"vcpus", required_argument, 0, 'n'},
+        {"node", required_argument, 0, 'N'},
+        {"sys-root", required_argument, 0, 's'},
+        {"proc-root", required_argument, 0, 'p'},
+        {0, 0, 0, 0},
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "i:n:N:s:p:", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'i': opts.iface = optarg; break;
+            case 'n': opts.vcpus = atoi(optarg); break;
+            case 'N': opts.node = atoi(optarg); break;
+            case 's': opts.sys_root = optarg; break;
+            case 'p': opts.proc_root = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [--iface=name] [--vcpus=N] [--node=N] "
+                        "[--sys-root=path] [--proc-root=path]\n", argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (parse_options(argc, argv) < 0) return -1;
+    set_log_output_level(ALOG_WARN);
+
+    CpuTopology topo;
+    if (topo.load(opts.sys_root) < 0) return -1;
+    int nic_node = nic_numa_node(opts.iface, opts.sys_root);
+    int node = opts.node >= 0 ? opts.node : nic_node;
+    auto vcpus = topo.pick(opts.vcpus, node);
+    if ((int)vcpus.size() < opts.vcpus)
+        LOG_WARN("node ` has CPUs for ` of ` vCPUs", node, vcpus.size(), opts.vcpus);
+    auto irqs = nic_irq_advice(opts.iface, vcpus, topo, opts.sys_root, opts.proc_root);
+
+    printf("{\"cpus\":%zu,\"nodes\":[", topo.cpus().size());
+    for (int n = 0; n < topo.nodes(); n++) {
+        printf("%s{\"node\":%d,\"cpus\":\"%s\"}", n ? "," : "", n, format_cpu_list(topo.cpus_of_node(n)).c_str());
+    }
+    printf("],\"iface\":\"%s\",\"nic_node\":%d,\"vcpu_node\":%d,\"vcpu_cpus\":[", opts.iface, nic_node, node);
+    for (size_t i = 0; i < vcpus.size(); i++) printf("%s%d", i ? "," : "", vcpus[i]);
+    printf("],\"irqs\":[");
+    for (size_t i = 0; i < irqs.size(); i++) {
+        auto& a = irqs[i];
+        printf("%s{\"irq\":%d,\"name\":\"%s\",\"current\":\"%s\",\"recommended\":\"%s\","
+               "\"command\":\"echo %s > /proc/irq/%d/smp_affinity_list\"}", i ? "," : "", a.irq,
+               a.name.c_str(), a.current.c_str(), a.recommended.c_str(), a.recommended.c_str(), a.irq);
+    }
+    printf("]}\n");
+    return 0;
+}
@@ -0,0 +1,305 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Matches WebSocket API responses to the requests that caused them.
+//
+// One WsCorrelator per connection, used from the connection's vCPU only.
+// Outstanding requests live in a fixed pool of entries; an open-addressed
+// table (linear probing, backward-shift deletion) maps the request id to its
+// entry and each entry carries a WheelTimer for its deadline, so adding,
+// resolving and expiring a request are O(1) and nothing is allocated after
+// construction. A request is completed either by a callback or by waking the
+// coroutine blocked in call(). Round-trip latency, errors and timeouts are
+// kept per method.
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <photon/common/alog.h>
+#include <photon/thread/thread.h>
+
+#include "timer-wheel.h"
+
+// The id of a response: WebSocket API responses start with "id" (a number
+// or a digit string), stream API responses ({"result":null,"id":1}) end
+// with it. Market data events have no top-level id.
+inline bool ws_response_id(const char* p, size_t n, uint64_t* id) {
+    const char* v = nullptr;
+    if (n > 6 && memcmp(p, "{\"id\":", 6) == 0) {
+        v = p + 6;
+    } else if (n > 8 && p[n - 1] == '}') {
+        size_t from = n > 32 ? n - 32 : 0;
+        for (size_t i = n - 6; i-- > from;) {
+            if (memcmp(p + i, ",\"id\":", 6) == 0) {
+                v = p + i + 6;
+                break;
+            }
+        }
+    }
+    if (!v) return false;
+    const char* end = p + n;
+    if (v < end && *v == '"') v++;
+    if (v == end || *v < '0' || *v > '9') return false;
+    uint64_t x = 0;
+    for (; v < end && *v >= '0' && *v <= '9'; v++) x = x * 10 + (*v - '0');
+    *id = x;
+    return true;
+}
+
+struct WsMethodStats {
+    std::string name;
+    uint64_t count = 0;         // responses received
+    uint64_t errors = 0;        // responses carrying "error"
+    uint64_t timeouts = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+    uint64_t buckets[32] = {};  // [2^i, 2^(i+1)) us
+
+    void add(uint64_t us) {
+        count++;
+        total_us += us;
+        if (us > max_us) max_us = us;
+        int b = us ? 63 - __builtin_clzll(us) : 0;
+        buckets[b < 31 ? b : 31]++;
+    }
+    // Upper bound of the bucket holding the p-th response.
+    uint64_t percentile(double p) const {
+        uint64_t want = (uint64_t)(count * p), seen = 0;
+        for (int i = 0; i < 32; i++) {
+            seen += buckets[i];
+            if (seen > want) return 2ULL << i;
+        }
+        return max_us;
+    }
+};
+
+class WsCorrelator {
+public:
+    // `err` is 0, EPROTO for an error response, ETIMEDOUT, or the error
+    // passed to fail_all(). `payload` is null unless a response arrived.
+    using Callback = std::function<void(int err, const char* payload, size_t n)>;
+
+    // Room for `max_outstanding` requests. Deadlines are timers on `wheel`,
+    // by default the current vCPU's timer_wheel(), which must be running or
+    // advanced by the owner.
+    explicit WsCorrelator(size_t max_outstanding = 1024, TimerWheel* wheel = nullptr)
+        : m_entries(max_outstanding), m_wheel(wheel ? wheel : &timer_wheel()) {
+        size_t n = 16;
+        while (n < max_outstanding * 2) n *= 2;
+        m_index.assign(n, NIL);
+        m_index_mask = n - 1;
+        for (uint32_t i = 0; i < m_entries.size(); i++) {
+            m_entries[i].next = i + 1;
+            m_entries[i].timer.set_callback([this, i] { timeout(i); });
+        }
+        if (!m_entries.empty()) m_entries.back().next = NIL;
+        m_free = m_entries.empty() ? (uint32_t)NIL : 0;
+    }
+
+    ~WsCorrelator() { fail_all(ECANCELED); }
+
+    int method(const std::string& name) {
+        for (size_t i = 0; i < m_methods.size(); i++)
+            if (m_methods[i].name == name) return i;
+        m_methods.emplace_back();
+        m_methods.back().name = name;
+        return m_methods.size() - 1;
+    }
+
+    // Ids for requests of this connection; any unique id may be used instead.
+    uint64_t next_id() { return ++m_last_id; }
+
+    // Registers a request about to be sent. `cb` may be empty when only the
+    // latency is of interest.
+    int expect(uint64_t id, int method, uint64_t timeout_us, Callback cb = nullptr) {
+        return add(id, method, timeout_us, std::move(cb), nullptr);
+    }
+
+    // Registers `id`, runs `send()` and blocks until the response arrives or
+    // the request times out. The response is copied to `*resp`.
+    template <typename Send>
+    int call(uint64_t id, int method, uint64_t timeout_us, Send&& send, std::string* resp = nullptr) {
+        Waiter w;
+        w.resp = resp;
+        if (add(id, method, timeout_us, nullptr, &w) < 0) return -1;
+        if (send() < 0) {
+            cancel(id);
+            return -1;
+        }
+        w.sem.wait(1);
+        if (w.err) {
+            errno = w.err;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Drops a request without completing it.
+    void cancel(uint64_t id) {
+        uint32_t e = find(id);
+        if (e != NIL) release(e);
+    }
+
+    // Resolves the request a message answers. Returns false if the message
+    // is not a response to an outstanding request.
+    bool on_message(const char* p, size_t n) {
+        uint64_t id;
+        if (!ws_response_id(p, n, &id)) return false;
+        uint32_t e = find(id);
+        if (e == NIL) return false;
+        auto& st = m_methods[m_entries[e].method];
+        st.add(photon::now - m_entries[e].sent_us);
+        bool error = memmem(p, n, "\"error\"", 7) != nullptr;
+        if (error) st.errors++;
+        complete(e, error ? EPROTO : 0, p, n);
+        return true;
+    }
+
+    // Completes every outstanding request with `err`, e.g. when the
+    // connection is lost.
+    void fail_all(int err) {
+        for (uint32_t i = 0; i < m_entries.size(); i++)
+            if (m_entries[i].in_use) complete(i, err, nullptr, 0);
+    }
+
+    size_t outstanding() const { return m_outstanding; }
+    const std::vector<WsMethodStats>& stats() const { return m_methods; }
+
+    void log_stats(const char* conn) const {
+        for (auto& st : m_methods) {
+            if (!st.count && !st.timeouts) continue;
+            LOG_INFO("` `: ` responses, ` errors, ` timeouts, avg ` us, p50 <` us, p99 <` us, max ` us",
+                     conn, st.name.c_str(), st.count, st.errors, st.timeouts,
+                     st.count ? st.total_us / st.count : 0, st.percentile(0.5),
+                     st.percentile(0.99), st.max_us);
+        }
+    }
+
+private:
+    enum : uint32_t { NIL = UINT32_MAX };
+
+    struct Waiter {
+        photon::semaphore sem;
+        int err = 0;
+        std::string* resp = nullptr;
+    };
+
+    struct Entry {
+        uint64_t id;
+        uint64_t sent_us;
+        uint32_t method;
+        uint32_t next;          // free list
+        bool in_use = false;
+        WheelTimer timer;
+        Callback cb;
+        Waiter* waiter;
+    };
+
+    size_t home(uint64_t id) const {
+        return (id * 0x9E3779B97F4A7C15ULL >> 32) & m_index_mask;
+    }
+
+    uint32_t find(uint64_t id) const {
+        for (size_t i = home(id);; i = (i + 1) & m_index_mask) {
+            uint32_t e = m_index[i];
+            if (e == NIL || m_entries[e].id == id) return e;
+        }
+    }
+
+    int add(uint64_t id, int method, uint64_t timeout_us, Callback cb, Waiter* w) {
+        if (m_free == NIL) LOG_ERROR_RETURN(ENOBUFS, -1, "too many outstanding requests");
+        if (method < 0 || (size_t)method >= m_methods.size())
+            LOG_ERROR_RETURN(EINVAL, -1, "unknown method `", method);
+        size_t i = home(id);
+        for (; m_index[i] != NIL; i = (i + 1) & m_index_mask) {
+            if (m_entries[m_index[i]].id == id)
+                LOG_ERROR_RETURN(EEXIST, -1, "request id ` is already outstanding", id);
+        }
+        uint32_t e = m_free;
+        auto& ent = m_entries[e];
+        m_free = ent.next;
+        m_index[i] = e;
+        ent.id = id;
+        ent.sent_us = photon::now;
+        ent.method = method;
+        ent.in_use = true;
+        ent.cb = std::move(cb);
+        ent.waiter = w;
+        ent.timer.start(timeout_us, m_wheel);
+        m_outstanding++;
+        return 0;
+    }
+
+    void complete(uint32_t e, int err, const char* p, size_t n) {
+        auto cb = std::move(m_entries[e].cb);
+        auto w = m_entries[e].waiter;
+        release(e);
+        if (w) {
+            w->err = err;
+            if (w->resp) {
+                if (p) w->resp->assign(p, n);
+                else w->resp->clear();
+            }
+            w->sem.signal(1);
+        } else if (cb) {
+            cb(err, p, n);
+        }
+    }
+
+    void release(uint32_t e) {
+        auto& ent = m_entries[e];
+        ent.timer.cancel();
+
+        // remove from the index, shifting back the rest of the cluster
+        size_t i = home(ent.id);
+        while (m_index[i] != e) i = (i + 1) & m_index_mask;
+        for (size_t j = (i + 1) & m_index_mask; m_index[j] != NIL; j = (j + 1) & m_index_mask) {
+            size_t h = home(m_entries[m_index[j]].id);
+            // move j into the hole at i unless its home lies in (i, j]
+            if (((j - h) & m_index_mask) >= ((j - i) & m_index_mask)) {
+                m_index[i] = m_index[j];
+                i = j;
+            }
+        }
+        m_index[i] = NIL;
+
+        ent.in_use = false;
+        ent.cb = nullptr;
+        ent.waiter = nullptr;
+        ent.next = m_free;
+        m_free = e;
+        m_outstanding--;
+    }
+
+    void timeout(uint32_t e) {
+        m_methods[m_entries[e].method].timeouts++;
+        complete(e, ETIMEDOUT, nullptr, 0);
+    }
+
+    std::vector<Entry> m_entries;
+    std::vector<uint32_t> m_index;
+    size_t m_index_mask;
+    TimerWheel* m_wheel;
+    uint32_t m_free;
+    size_t m_outstanding = 0;
+    uint64_t m_last_id = 0;
+    std::vector<WsMethodStats> m_methods;
+};
@@ -0,0 +1,237 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// WebSocket (RFC 6455) frame headers and both sides of the opening
+// handshake. Only the framing is here: no buffering, no fragment reassembly.
+#pragma once
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+
+#include <photon/common/alog.h>
+#include <photon/net/socket.h>
+
+enum WsOpcode : uint8_t {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA,
+};
+
+struct WsFrameHeader {
+    bool fin;
+    uint8_t opcode;
+    bool masked;
+    uint8_t mask[4];
+    uint64_t payload_len;
+    size_t header_len;
+};
+
+// Max header size: 2 + 8 bytes of extended length + 4 bytes of mask.
+const size_t WS_MAX_HEADER = 14;
+
+// Returns the header length, 0 if more bytes are needed, -1 if malformed.
+inline int ws_parse_header(const char* p, size_t n, WsFrameHeader* h) {
+    if (n < 2) return 0;
+    auto b0 = (uint8_t)p[0], b1 = (uint8_t)p[1];
+    if (b0 & 0x70) return -1;       // RSV bits, no extensions negotiated
+    h->fin = b0 & 0x80;
+    h->opcode = b0 & 0x0F;
+    h->masked = b1 & 0x80;
+    uint64_t len = b1 & 0x7F;
+    size_t hl = 2;
+    if (len == 126) {
+        if (n < 4) return 0;
+        len = ((uint64_t)(uint8_t)p[2] << 8) | (uint8_t)p[3];
+        hl = 4;
+    } else if (len == 127) {
+        if (n < 10) return 0;
+        len = 0;
+        for (int i = 2; i < 10; i++) len = (len << 8) | (uint8_t)p[i];
+        hl = 10;
+    }
+    if (h->masked) {
+        if (n < hl + 4) return 0;
+        memcpy(h->mask, p + hl, 4);
+        hl += 4;
+    }
+    h->payload_len = len;
+    h->header_len = hl;
+    return (int)hl;
+}
+
+// Writes a frame header and returns its length. Server frames are unmasked;
+// client frames must carry a `mask` and the payload must be masked with it
+// (see ws_apply_mask).
+inline size_t ws_encode_header(char* out, uint8_t opcode, uint64_t len, bool fin = true,
+                               const uint8_t* mask = nullptr) {
+    size_t n = 0;
+    uint8_t m = mask ? 0x80 : 0;
+    out[n++] = (char)((fin ? 0x80 : 0) | opcode);
+    if (len <= 125) {
+        out[n++] = (char)(m | len);
+    } else if (len <= 65535) {
+        out[n++] = (char)(m | 126);
+        out[n++] = (char)(len >> 8);
+        out[n++] = (char)len;
+    } else {
+        out[n++] = (char)(m | 127);
+        for (int i = 7; i >= 0; i--) out[n++] = (char)(len >> (i * 8));
+    }
+    if (mask) {
+        memcpy(out + n, mask, 4);
+        n += 4;
+    }
+    return n;
+}
+
+// XORs `n` payload bytes starting at payload offset `offset`.
+inline void ws_apply_mask(char* p, size_t n, const uint8_t mask[4], size_t offset = 0) {
+    for (size_t i = 0; i < n; i++) p[i] ^= mask[(offset + i) & 3];
+}
+
+// Close status codes (RFC 6455, 7.4.1).
+enum WsCloseCode : uint16_t {
+    WS_CLOSE_NORMAL = 1000,
+    WS_CLOSE_GOING_AWAY = 1001,
+};
+
+// Writes a whole close frame carrying `code` and returns its length, at
+// most WS_MAX_HEADER + 2. Masked with `mask` if given.
+inline size_t ws_encode_close(char* out, uint16_t code, const uint8_t* mask = nullptr) {
+    size_t n = ws_encode_header(out, WS_CLOSE, 2, true, mask);
+    out[n] = (char)(code >> 8);
+    out[n + 1] = (char)code;
+    if (mask) ws_apply_mask(out + n, 2, mask);
+    return n + 2;
+}
+
+// Sec-WebSocket-Accept for a client's Sec-WebSocket-Key.
+inline std::string ws_accept_key(const char* key, size_t len) {
+    static const char GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    std::string s(key, len);
+    s += GUID;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char*)s.data(), s.size(), digest);
+    char b64[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+    int n = EVP_EncodeBlock((unsigned char*)b64, digest, SHA_DIGEST_LENGTH);
+    return std::string(b64, n);
+}
+
+// A fresh Sec-WebSocket-Key: 16 random bytes, base64. Empty if OpenSSL
+// has no randomness to give.
+inline std::string ws_new_key() {
+    unsigned char nonce[16];
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1) return {};
+    char b64[4 * ((sizeof(nonce) + 2) / 3) + 1];
+    int n = EVP_EncodeBlock((unsigned char*)b64, nonce, sizeof(nonce));
+    return std::string(b64, n);
+}
+
+// A fresh masking key for a client frame. All zeros if OpenSSL has no
+// randomness to give, which servers still accept.
+inline void ws_new_mask(uint8_t mask[4]) {
+    if (RAND_bytes(mask, 4) != 1) memset(mask, 0, 4);
+}
+
+// Value of header `name` (with the colon) in the header block [msg, end),
+// trimmed; nullptr if absent.
+inline const char* ws_find_header(const char* msg, const char* end, const char* name, size_t* len) {
+    size_t nl = strlen(name);
+    for (const char* line = strstr(msg, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+        const char* h = line + 2;
+        if (strncasecmp(h, name, nl) == 0) {
+            const char* v = h + nl;
+            while (*v == ' ') v++;
+            *len = strcspn(v, " \r\n");
+            return v;
+        }
+    }
+    return nullptr;
+}
+
+// Reads the client's upgrade request and answers 101. Returns 0 on success.
+inline int ws_server_handshake(photon::net::ISocketStream* s) {
+    char req[4096];
+    size_t n = 0;
+    const char* end = nullptr;
+    while (!end) {
+        if (n == sizeof(req) - 1) LOG_ERROR_RETURN(EMSGSIZE, -1, "websocket upgrade request too large");
+        ssize_t r = s->recv(req + n, sizeof(req) - 1 - n);
+        if (r <= 0) LOG_ERRNO_RETURN(0, -1, "failed to read websocket upgrade request");
+        n += r;
+        req[n] = '\0';
+        end = strstr(req, "\r\n\r\n");
+    }
+    size_t key_len = 0;
+    const char* key = ws_find_header(req, end, "Sec-WebSocket-Key:", &key_len);
+    if (!key || key_len == 0) LOG_ERROR_RETURN(EPROTO, -1, "websocket upgrade without Sec-WebSocket-Key");
+    std::string resp = "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: " + ws_accept_key(key, key_len) + "\r\n\r\n";
+    if (s->write(resp.data(), resp.size()) != (ssize_t)resp.size())
+        LOG_ERRNO_RETURN(0, -1, "failed to send websocket upgrade response");
+    return 0;
+}
+
+// Sends the upgrade request for `path` with a fresh key and waits for a 101
+// whose Sec-WebSocket-Accept matches it. Bytes received after the response
+// headers (early frames) are copied to `rest` (up to `rest_cap`) and their
+// count stored in `*rest_len`.
+inline int ws_client_handshake(photon::net::ISocketStream* s, const char* host, const char* path,
+                               char* rest = nullptr, size_t rest_cap = 0, size_t* rest_len = nullptr) {
+    std::string key = ws_new_key();
+    if (key.empty()) LOG_ERROR_RETURN(EIO, -1, "failed to generate a websocket key");
+    std::string req = std::string("GET ") + path + " HTTP/1.1\r\n"
+                      "Host: " + host + "\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Key: " + key + "\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n";
+    if (s->write(req.data(), req.size()) != (ssize_t)req.size())
+        LOG_ERRNO_RETURN(0, -1, "failed to send websocket upgrade to `", host);
+    char resp[4096];
+    size_t n = 0;
+    const char* end = nullptr;
+    while (!end) {
+        if (n == sizeof(resp) - 1) LOG_ERROR_RETURN(EMSGSIZE, -1, "websocket upgrade response too large");
+        ssize_t r = s->recv(resp + n, sizeof(resp) - 1 - n);
+        if (r <= 0) LOG_ERRNO_RETURN(0, -1, "failed to read websocket upgrade response from `", host);
+        n += r;
+        resp[n] = '\0';
+        end = strstr(resp, "\r\n\r\n");
+    }
+    if (strncmp(resp, "HTTP/1.1 101", 12) != 0)
+        LOG_ERROR_RETURN(EPROTO, -1, "` refused websocket upgrade: `", host, resp);
+    size_t accept_len = 0;
+    const char* accept = ws_find_header(resp, end, "Sec-WebSocket-Accept:", &accept_len);
+    if (!accept || ws_accept_key(key.data(), key.size()) != std::string(accept, accept_len))
+        LOG_ERROR_RETURN(EPROTO, -1, "` answered the websocket upgrade with a wrong Sec-WebSocket-Accept", host);
+    size_t hl = end + 4 - resp;
+    size_t extra = n - hl;
+    if (extra > rest_cap) LOG_ERROR_RETURN(ENOBUFS, -1, "no room for early websocket frames");
+    if (extra) memcpy(rest, resp + hl, extra);
+    if (rest_len) *rest_len = extra;
+    return 0;
+}
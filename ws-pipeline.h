@@ -0,0 +1,291 @@
+/*
+Copyright 2022 The Photon Authors
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Frame-to-event pipeline of a feed connection, put together at compile
+// time from three parts:
+//
+//   Stream    what the connection is subscribed to: the opcode its messages
+//             come in, the bus event they become and a parse() that turns
+//             one message into events (TradeStream, AggTradeStream,
+//             DepthStream below)
+//   Handler   where the results go, by plain member calls:
+//               void on_message(const char* p, size_t n)  every message
+//               void on_event(Stream::Event& ev)          every event
+//               void on_other(const char* p, size_t n)    not an event,
+//                                                         e.g. a response
+//               int  send_pong(const char* p, size_t n)   (PongOnPing)
+//               void on_close()                           the stream ended
+//   Control   what ping, pong and close frames do (PongOnPing, IgnorePings)
+//
+// WsPipeline<Stream, Handler, Control> is the on_frame callback of
+// ws_recv_frames(). An unfragmented, unmasked frame of the stream's opcode
+// goes straight through parse into the handler, which the compiler can
+// inline as one function per stream type; fragments, control frames and
+// protocol errors take an out-of-line path. There is no virtual call and
+// no std::function anywhere on the way.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include <photon/common/alog.h>
+
+#include "json-scan.h"
+#include "md-bus.h"
+#include "symbol-table.h"
+#include "ws-frame.h"
+
+// Fields shared by trade and aggTrade messages; `S` says which of the two:
+// S::is_type() checks "e", S::ID_KEY is the key of the trade id.
+//   {"e":"trade","E":1672515782136,"s":"BNBBTC","t":12345,"p":"0.001",
+//    "q":"100","T":1672515782136,"m":true,"M":true}
+template <typename S>
+struct TradeFields {
+    using Event = MdTrade;
+    enum { OPCODE = WS_TEXT };
+
+    // One pass over the members. hdr.symbol_id is `sym` unless "s" names
+    // another interned symbol.
+    template <typename Emit>
+    static bool parse(const char* p, size_t n, SymbolId sym, Emit&& emit) {
+        MdTrade t = {};
+        t.hdr.type = MD_TRADE;
+        t.hdr.symbol_id = sym;
+        bool typed = false, priced = false, sized = false;
+        bool ok = json_for_each_member(p, n, [&](const char* k, size_t kl, const char* v, size_t vl) {
+            if (kl != 1) return;
+            switch (k[0]) {
+            case 'e':
+                typed = S::is_type(v, vl);
+                break;
+            case 's': {
+                SymbolId id = symbol_table().find(v, vl);
+                if (id != SYMBOL_NONE) t.hdr.symbol_id = id;
+                break;
+            }
+            case 'p':
+                t.price = md_parse_fixed(v, vl);
+                priced = true;
+                break;
+            case 'q':
+                t.qty = md_parse_fixed(v, vl);
+                sized = true;
+                break;
+            case 'T':
+                t.hdr.exchange_ts_ns = json_uint(v, vl) * 1000000;
+                break;
+            case 'm':
+                t.buyer_is_maker = vl == 4 && v[0] == 't';
+                break;
+            default:
+                if (k[0] == S::ID_KEY) t.trade_id = json_uint(v, vl);
+                break;
+            }
+        });
+        if (!ok || !typed || !priced || !sized) return false;
+        emit(t);
+        return true;
+    }
+};
+
+// <symbol>@trade
+struct TradeStream : TradeFields<TradeStream> {
+    enum { ID_KEY = 't' };
+    static bool is_type(const char* v, size_t n) { return json_is(v, n, "trade", 5); }
+};
+
+// <symbol>@aggTrade: trade_id is the aggregate trade id
+struct AggTradeStream : TradeFields<AggTradeStream> {
+    enum { ID_KEY = 'a' };
+    static bool is_type(const char* v, size_t n) { return json_is(v, n, "aggTrade", 8); }
+};
+
+// <symbol>@depth, diffs of the book:
+//   {"e":"depthUpdate","E":123456789,"s":"BNBBTC","U":157,"u":160,
+//    "b":[["0.0024","10"]],"a":[["0.0026","100"]]}
+// Each side goes out in events of up to MD_BOOK_LEVELS levels, bids first;
+// all events of a message carry its update ids and the last one has `last`
+// set. A message that changes nothing still gives one (empty) event, so
+// that a book sees every update id.
+struct DepthStream {
+    using Event = MdBookUpdate;
+    enum { OPCODE = WS_TEXT };
+
+    template <typename Emit>
+    static bool parse(const char* p, size_t n, SymbolId sym, Emit&& emit) {
+        MdBookUpdate u = {};
+        u.hdr.type = MD_BOOK_UPDATE;
+        u.hdr.symbol_id = sym;
+        bool typed = false;
+        const char* sides[2] = {};
+        size_t side_len[2] = {};
+        bool ok = json_for_each_member(p, n, [&](const char* k, size_t kl, const char* v, size_t vl) {
+            if (kl != 1) return;
+            switch (k[0]) {
+            case 'e':
+                typed = json_is(v, vl, "depthUpdate", 11);
+                break;
+            case 's': {
+                SymbolId id = symbol_table().find(v, vl);
+                if (id != SYMBOL_NONE) u.hdr.symbol_id = id;
+                break;
+            }
+            case 'E':
+                u.hdr.exchange_ts_ns = json_uint(v, vl) * 1000000;
+                break;
+            case 'U':
+                u.first_update_id = json_uint(v, vl);
+                break;
+            case 'u':
+                u.last_update_id = json_uint(v, vl);
+                break;
+            case 'b':
+                sides[0] = v;
+                side_len[0] = vl;
+                break;
+            case 'a':
+                sides[1] = v;
+                side_len[1] = vl;
+                break;
+            }
+        });
+        if (!ok || !typed || !u.last_update_id) return false;
+
+        // events are emitted one behind, so the final one can be marked
+        bool pending = false;
+        for (int side = 0; side < 2; side++) {
+            if (!sides[side]) continue;
+            ok = json_for_each_element(sides[side], side_len[side], [&](const char* lv, size_t ll) {
+                // ["price","qty"]
+                int64_t f[2];
+                int i = 0;
+                json_for_each_element(lv, ll, [&](const char* x, size_t xl) {
+                    if (i < 2) f[i] = md_parse_fixed(x, xl);
+                    i++;
+                });
+                if (i != 2) return;
+                if (pending && (u.side != side || u.count == MD_BOOK_LEVELS)) {
+                    emit(u);
+                    u.count = 0;
+                }
+                u.side = side;
+                u.levels[u.count].price = f[0];
+                u.levels[u.count].qty = f[1];
+                u.count++;
+                pending = true;
+            });
+            if (!ok) return false;
+        }
+        u.last = 1;
+        emit(u);
+        return true;
+    }
+};
+
+// Pings are answered with a pong of the same payload through
+// handler.send_pong(); a close frame ends the stream.
+struct PongOnPing {
+    template <typename Handler>
+    static bool on_control(Handler& h, uint8_t opcode, const char* p, size_t n) {
+        if (opcode == WS_PING && h.send_pong(p, n) < 0) LOG_ERROR("failed to send pong");
+        return opcode != WS_CLOSE;
+    }
+};
+
+// For handlers that keep the connection alive some other way: only a close
+// frame does anything.
+struct IgnorePings {
+    template <typename Handler>
+    static bool on_control(Handler&, uint8_t opcode, const char*, size_t) {
+        return opcode != WS_CLOSE;
+    }
+};
+
+template <typename Stream, typename Handler, typename Control = PongOnPing>
+class WsPipeline {
+public:
+    using Event = typename Stream::Event;
+
+    // `symbol` is the default symbol of events, for messages that do not
+    // name one.
+    WsPipeline(Handler& handler, SymbolId symbol) : m_handler(handler), m_symbol(symbol) {}
+
+    // on_frame for ws_recv_frames(): false once the stream has ended.
+    bool operator()(const WsFrameHeader& h, const char* payload) {
+        if (__builtin_expect(h.fin && h.opcode == Stream::OPCODE && !h.masked && !m_fragmented, 1)) {
+            message(payload, h.payload_len);
+            return true;
+        }
+        return other_frame(h, payload);
+    }
+
+    // A message from elsewhere (e.g. read during the handshake).
+    void message(const char* p, size_t n) {
+        m_handler.on_message(p, n);
+        if (!Stream::parse(p, n, m_symbol, [this](Event& ev) { m_handler.on_event(ev); }))
+            m_handler.on_other(p, n);
+    }
+
+    // Drops a partly received message, for a new connection.
+    void reset() {
+        m_fragmented = false;
+        m_partial.clear();
+    }
+
+private:
+    __attribute__((noinline)) bool other_frame(const WsFrameHeader& h, const char* p) {
+        size_t n = h.payload_len;
+        if (h.masked) return close("masked frame from server");
+        if (h.opcode & 0x8) {
+            if (!h.fin || n > 125) return close("malformed control frame");
+            if (Control::on_control(m_handler, h.opcode, p, n)) return true;
+            LOG_INFO("received close frame");
+            m_handler.on_close();
+            return false;
+        }
+        if (h.opcode == WS_CONTINUATION) {
+            if (!m_fragmented) return close("continuation without a message");
+        } else if (h.opcode == WS_TEXT || h.opcode == WS_BINARY) {
+            if (m_fragmented) return close("new message inside a fragmented one");
+            m_fragmented = true;
+            m_opcode = h.opcode;
+            m_partial.clear();
+        } else {
+            LOG_WARN("unknown opcode `", h.opcode);
+            return true;
+        }
+        if (m_fragmented) m_partial.append(p, n);
+        if (h.fin) {
+            m_fragmented = false;
+            // messages of another type (binary on a text stream) are dropped
+            if (m_opcode == Stream::OPCODE) message(m_partial.data(), m_partial.size());
+            m_partial.clear();
+        }
+        return true;
+    }
+
+    bool close(const char* why) {
+        LOG_ERROR("websocket protocol error: `", why);
+        m_handler.on_close();
+        return false;
+    }
+
+    Handler& m_handler;
+    SymbolId m_symbol;
+    bool m_fragmented = false;
+    uint8_t m_opcode = 0;
+    std::string m_partial;
+};